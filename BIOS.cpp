@@ -0,0 +1,329 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "BIOS.h"
+#include "DOSFile.h"
+
+#include <cstring>
+
+#define MK_FP(SEG, OFF) (((SEG) << 4) + (OFF))
+
+namespace {
+
+enum {
+    BDA_EQUIPMENT    = 0x10,
+    BDA_MEMORY_SIZE  = 0x13,
+    BDA_KBD_FLAGS    = 0x17,
+    BDA_KBD_HEAD     = 0x1A,
+    BDA_KBD_TAIL     = 0x1C,
+    BDA_KBD_BUFFER   = 0x1E,
+    BDA_TICKS        = 0x6C,
+    BDA_MIDNIGHT     = 0x70,
+    BDA_KBD_START    = 0x80,
+    BDA_KBD_END      = 0x82,
+
+    ROM_HOT_HANDLERS = 0x0800,
+    ROM_INT21        = 0x0800,
+    ROM_INT16        = 0x0851,
+    ROM_INT1A        = 0x08AB
+};
+
+// Hot-path handlers, assembled for F000:0800. Jumps to 0108h, 00B0h and
+// 00D0h enter the trap stubs of INT 21h, 16h and 1Ah with the interrupt
+// frame untouched.
+uint8_t const HotHandlers[] = {
+    // int21:
+    0x80, 0xFC, 0x02,               // 0800  cmp  ah,2h
+    0x74, 0x12,                     // 0803  je   817h
+    0x80, 0xFC, 0x06,               // 0805  cmp  ah,6h
+    0x74, 0x08,                     // 0808  je   812h
+    0x80, 0xFC, 0x0B,               // 080A  cmp  ah,0Bh
+    0x74, 0x2C,                     // 080D  je   83Bh
+    0xE9, 0xF6, 0xF8,               // 080F  jmp  108h
+    // conio21:
+    0x80, 0xFA, 0xFF,               // 0812  cmp  dl,0FFh
+    0x74, 0x21,                     // 0815  je   838h
+    // putc21:
+    0x1E,                           // 0817  push ds
+    0x53,                           // 0818  push bx
+    0xBB, 0x50, 0x00,               // 0819  mov  bx,50h
+    0x8E, 0xDB,                     // 081C  mov  ds,bx
+    0x8B, 0x1E, 0x00, 0x00,         // 081E  mov  bx,word ds:0h
+    0x81, 0xFB, 0x00, 0x08,         // 0822  cmp  bx,800h
+    0x73, 0x0E,                     // 0826  jae  836h
+    0x88, 0x97, 0x00, 0x01,         // 0828  mov  byte [bx+100h],dl
+    0x43,                           // 082C  inc  bx
+    0x89, 0x1E, 0x00, 0x00,         // 082D  mov  word ds:0h,bx
+    0x88, 0xD0,                     // 0831  mov  al,dl
+    0x5B,                           // 0833  pop  bx
+    0x1F,                           // 0834  pop  ds
+    0xCF,                           // 0835  iret
+    // full21:
+    0x5B,                           // 0836  pop  bx
+    0x1F,                           // 0837  pop  ds
+    // trap21b:
+    0xE9, 0xCD, 0xF8,               // 0838  jmp  108h
+    // status21:
+    0x1E,                           // 083B  push ds
+    0x53,                           // 083C  push bx
+    0xBB, 0x40, 0x00,               // 083D  mov  bx,40h
+    0x8E, 0xDB,                     // 0840  mov  ds,bx
+    0x8B, 0x1E, 0x1A, 0x00,         // 0842  mov  bx,word ds:1Ah
+    0x3B, 0x1E, 0x1C, 0x00,         // 0846  cmp  bx,word ds:1Ch
+    0x5B,                           // 084A  pop  bx
+    0x1F,                           // 084B  pop  ds
+    0x74, 0xEA,                     // 084C  je   838h
+    0xB0, 0xFF,                     // 084E  mov  al,0FFh
+    0xCF,                           // 0850  iret
+    // int16:
+    0x80, 0xFC, 0x00,               // 0851  cmp  ah,0h
+    0x74, 0x12,                     // 0854  je   868h
+    0x80, 0xFC, 0x10,               // 0856  cmp  ah,10h
+    0x74, 0x0D,                     // 0859  je   868h
+    0x80, 0xFC, 0x01,               // 085B  cmp  ah,1h
+    0x74, 0x2E,                     // 085E  je   88Eh
+    0x80, 0xFC, 0x11,               // 0860  cmp  ah,11h
+    0x74, 0x29,                     // 0863  je   88Eh
+    // trap16:
+    0xE9, 0x48, 0xF8,               // 0865  jmp  0B0h
+    // read16:
+    0x1E,                           // 0868  push ds
+    0x53,                           // 0869  push bx
+    0xBB, 0x40, 0x00,               // 086A  mov  bx,40h
+    0x8E, 0xDB,                     // 086D  mov  ds,bx
+    0x8B, 0x1E, 0x1A, 0x00,         // 086F  mov  bx,word ds:1Ah
+    0x3B, 0x1E, 0x1C, 0x00,         // 0873  cmp  bx,word ds:1Ch
+    0x74, 0x2E,                     // 0877  je   8A7h
+    0x8B, 0x07,                     // 0879  mov  ax,word [bx]
+    0x43,                           // 087B  inc  bx
+    0x43,                           // 087C  inc  bx
+    0x3B, 0x1E, 0x82, 0x00,         // 087D  cmp  bx,word ds:82h
+    0x72, 0x04,                     // 0881  jb   887h
+    0x8B, 0x1E, 0x80, 0x00,         // 0883  mov  bx,word ds:80h
+    // nowrap16:
+    0x89, 0x1E, 0x1A, 0x00,         // 0887  mov  word ds:1Ah,bx
+    0x5B,                           // 088B  pop  bx
+    0x1F,                           // 088C  pop  ds
+    0xCF,                           // 088D  iret
+    // peek16:
+    0x1E,                           // 088E  push ds
+    0x53,                           // 088F  push bx
+    0xBB, 0x40, 0x00,               // 0890  mov  bx,40h
+    0x8E, 0xDB,                     // 0893  mov  ds,bx
+    0x8B, 0x1E, 0x1A, 0x00,         // 0895  mov  bx,word ds:1Ah
+    0x3B, 0x1E, 0x1C, 0x00,         // 0899  cmp  bx,word ds:1Ch
+    0x74, 0x08,                     // 089D  je   8A7h
+    0x8B, 0x07,                     // 089F  mov  ax,word [bx]
+    0x5B,                           // 08A1  pop  bx
+    0x1F,                           // 08A2  pop  ds
+    0xFB,                           // 08A3  sti
+    0xCA, 0x02, 0x00,               // 08A4  retf 2h
+    // empty16:
+    0x5B,                           // 08A7  pop  bx
+    0x1F,                           // 08A8  pop  ds
+    0xEB, 0xBA,                     // 08A9  jmp  865h
+    // int1a:
+    0x80, 0xFC, 0x00,               // 08AB  cmp  ah,0h
+    0x75, 0x1A,                     // 08AE  jne  8CAh
+    0x1E,                           // 08B0  push ds
+    0x53,                           // 08B1  push bx
+    0xBB, 0x40, 0x00,               // 08B2  mov  bx,40h
+    0x8E, 0xDB,                     // 08B5  mov  ds,bx
+    0x8B, 0x16, 0x6C, 0x00,         // 08B7  mov  dx,word ds:6Ch
+    0x8B, 0x0E, 0x6E, 0x00,         // 08BB  mov  cx,word ds:6Eh
+    0xA0, 0x70, 0x00,               // 08BF  mov  al,ds:70h
+    0xC6, 0x06, 0x70, 0x00, 0x00,   // 08C2  mov  byte ds:70h,0h
+    0x5B,                           // 08C7  pop  bx
+    0x1F,                           // 08C8  pop  ds
+    0xCF,                           // 08C9  iret
+    // trap1a:
+    0xE9, 0x03, 0xF8,               // 08CA  jmp  0D0h
+};
+
+// VMCALL; IRET; padding
+uint8_t const TrapStub[BIOS::TRAP_STRIDE] = {
+    0x0F, 0x01, 0xC1, 0xCF, 0x90, 0x90, 0x90, 0x90
+};
+
+}
+
+BIOS::BIOS(GuestMemory &Memory, VirtualClock &Clock) :
+    _mem   (Memory),
+    _clock (Clock),
+    _memory(Memory.base()),
+    _day   (-1)
+{
+}
+
+void BIOS::
+install()
+{
+    char *ROM = &_memory[MK_FP(ROM_SEGMENT, 0)];
+
+    for (int i = 0; i < 256; i++) {
+        std::memcpy(&ROM[i * TRAP_STRIDE], TrapStub, TRAP_STRIDE);
+        setVector(i, ROM_SEGMENT, i * TRAP_STRIDE);
+    }
+    std::memcpy(&ROM[ROM_HOT_HANDLERS], HotHandlers, sizeof(HotHandlers));
+
+    setVector(0x21, ROM_SEGMENT, ROM_INT21);
+    setVector(0x16, ROM_SEGMENT, ROM_INT16);
+    routeClock();
+
+    std::memset(&_memory[MK_FP(BDA_SEGMENT, 0)], 0, 0x100);
+    writeBDA16(BDA_EQUIPMENT, 0x0020);      // 80x25 color
+    writeBDA16(BDA_MEMORY_SIZE, 640);
+    writeBDA16(BDA_KBD_HEAD, BDA_KBD_BUFFER);
+    writeBDA16(BDA_KBD_TAIL, BDA_KBD_BUFFER);
+    writeBDA16(BDA_KBD_START, BDA_KBD_BUFFER);
+    writeBDA16(BDA_KBD_END, BDA_KBD_BUFFER + 32);
+
+    std::memset(&_memory[MK_FP(SHARED_SEGMENT, 0)], 0, 2);
+
+    updateTimeOfDay();
+}
+
+void BIOS::
+routeClock()
+{
+    uint32_t Trap = (static_cast <uint32_t> (ROM_SEGMENT) << 16) |
+        (0x1A * TRAP_STRIDE);
+    uint32_t ROM  = (static_cast <uint32_t> (ROM_SEGMENT) << 16) | ROM_INT1A;
+    uint32_t V    = vector(0x1A);
+    if (V != Trap && V != ROM)
+        return;
+
+    if (_clock.mode() == VirtualClock::MODE_VIRTUAL)
+        setVector(0x1A, ROM_SEGMENT, 0x1A * TRAP_STRIDE);
+    else
+        setVector(0x1A, ROM_SEGMENT, ROM_INT1A);
+}
+
+bool BIOS::
+trapVector(uint16_t CS, uint16_t IP, uint8_t &IntNo) const
+{
+    if (CS != ROM_SEGMENT || IP >= 256 * TRAP_STRIDE || IP % TRAP_STRIDE != 0)
+        return false;
+
+    IntNo = IP / TRAP_STRIDE;
+    return true;
+}
+
+uint32_t BIOS::
+vector(uint8_t IntNo) const
+{
+    uint32_t V;
+
+    std::memcpy(&V, &_memory[IntNo * 4], sizeof(V));
+    return V;
+}
+
+void BIOS::
+setVector(uint8_t IntNo, uint16_t Segment, uint16_t Offset)
+{
+    uint32_t V = (static_cast <uint32_t> (Segment) << 16) | Offset;
+
+    std::memcpy(&_memory[IntNo * 4], &V, sizeof(V));
+    _mem.dirty(IntNo * 4, sizeof(V));
+}
+
+void BIOS::
+drainConsole(DOSFile &Console)
+{
+    char    *Shared = &_memory[MK_FP(SHARED_SEGMENT, 0)];
+    uint16_t Count;
+
+    std::memcpy(&Count, Shared, sizeof(Count));
+    if (Count == 0)
+        return;
+
+    if (Count > CONSOLE_CAPACITY)
+        Count = CONSOLE_CAPACITY;
+    Console.write(&Shared[CONSOLE_DATA], Count);
+    std::memset(Shared, 0, sizeof(Count));
+    _mem.dirty(SHARED_SEGMENT, 0, sizeof(Count));
+}
+
+// the guest has no timer interrupt; the host refreshes the BDA tick count
+// from the clock on every VMEXIT, which includes the periodic host
+// interrupt exits, but only writes it when it changed
+void BIOS::
+updateTimeOfDay()
+{
+    int64_t Day = _clock.day();
+    if (Day > _day && _day >= 0) {
+        _memory[MK_FP(BDA_SEGMENT, BDA_MIDNIGHT)] = 1;
+        _mem.dirty(BDA_SEGMENT, BDA_MIDNIGHT, 1);
+    }
+    _day = Day;
+
+    uint32_t Ticks = _clock.ticks();
+    char    *Shown = &_memory[MK_FP(BDA_SEGMENT, BDA_TICKS)];
+    if (std::memcmp(Shown, &Ticks, sizeof(Ticks)) != 0) {
+        std::memcpy(Shown, &Ticks, sizeof(Ticks));
+        _mem.dirty(BDA_SEGMENT, BDA_TICKS, sizeof(Ticks));
+    }
+}
+
+bool BIOS::
+hasKey() const
+{
+    return readBDA16(BDA_KBD_HEAD) != readBDA16(BDA_KBD_TAIL);
+}
+
+uint16_t BIOS::
+peekKey() const
+{
+    return readBDA16(readBDA16(BDA_KBD_HEAD));
+}
+
+uint16_t BIOS::
+popKey()
+{
+    uint16_t Head = readBDA16(BDA_KBD_HEAD);
+    uint16_t Key  = readBDA16(Head);
+
+    Head += 2;
+    if (Head >= readBDA16(BDA_KBD_END))
+        Head = readBDA16(BDA_KBD_START);
+    writeBDA16(BDA_KBD_HEAD, Head);
+    return Key;
+}
+
+uint8_t BIOS::
+shiftFlags() const
+{
+    return _memory[MK_FP(BDA_SEGMENT, BDA_KBD_FLAGS)];
+}
+
+bool BIOS::
+pushKey(uint16_t Key)
+{
+    uint16_t Tail = readBDA16(BDA_KBD_TAIL);
+    uint16_t Next = Tail + 2;
+
+    if (Next >= readBDA16(BDA_KBD_END))
+        Next = readBDA16(BDA_KBD_START);
+    if (Next == readBDA16(BDA_KBD_HEAD))
+        return false;   // buffer full
+
+    writeBDA16(Tail, Key);
+    writeBDA16(BDA_KBD_TAIL, Next);
+    return true;
+}
+
+uint16_t BIOS::
+readBDA16(uint16_t Offset) const
+{
+    uint16_t V;
+
+    std::memcpy(&V, &_memory[MK_FP(BDA_SEGMENT, Offset)], sizeof(V));
+    return V;
+}
+
+void BIOS::
+writeBDA16(uint16_t Offset, uint16_t Value)
+{
+    std::memcpy(&_memory[MK_FP(BDA_SEGMENT, Offset)], &Value, sizeof(Value));
+    _mem.dirty(BDA_SEGMENT, Offset, sizeof(Value));
+}
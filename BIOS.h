@@ -0,0 +1,85 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __BIOS_h
+#define __BIOS_h
+
+#include <cstdint>
+
+#include "GuestMemory.h"
+#include "VirtualClock.h"
+
+class DOSFile;
+
+//
+// Guest-resident BIOS: interrupt vector table, BIOS Data Area and a small
+// real-mode ROM at F000:0000.
+//
+// Every vector points at an 8-byte trap stub "VMCALL; IRET" in the ROM, so
+// interrupts the guest does not serve itself reach DOSKernel::trap() with
+// the vector encoded in IP. INT 21h, 16h and 1Ah point at ROM handlers
+// that complete the hot, side-effect-free calls without leaving the guest
+// and jump to their trap stub for everything else:
+//
+//   INT 21h AH=02, AH=06 (output)  append to the console ring below
+//   INT 21h AH=0B                  BDA keyboard buffer not empty
+//   INT 16h AH=00/10, AH=01/11     BDA keyboard buffer, if not empty
+//   INT 1Ah AH=00                  BDA tick count, unless the clock is
+//                                  virtual and has to see the polls
+//
+// The console ring lives in the shared area at 0050:0000 (count word,
+// data at 0050:0100) and is drained by the host on every trap, so output
+// ordering with host-side console writes is preserved.
+//
+class BIOS {
+public:
+    enum {
+        ROM_SEGMENT      = 0xF000,
+        BDA_SEGMENT      = 0x0040,
+        SHARED_SEGMENT   = 0x0050,
+
+        TRAP_STRIDE      = 8,
+        TRAP_LENGTH      = 3,       // VMCALL
+
+        CONSOLE_DATA     = 0x0100,  // offset in SHARED_SEGMENT
+        CONSOLE_CAPACITY = 0x0800
+    };
+
+private:
+    GuestMemory  &_mem;
+    VirtualClock &_clock;
+    char         *_memory;
+    int64_t       _day;             // of the last update, -1 before it
+
+public:
+    BIOS(GuestMemory &Memory, VirtualClock &Clock);
+
+public:
+    void install();
+
+    // INT 1Ah to the ROM handler or to its trap stub, as the clock mode
+    // asks, unless the guest has hooked it
+    void routeClock();
+
+    // map a VMCALL at CS:IP back to the interrupt vector of its trap stub
+    bool trapVector(uint16_t CS, uint16_t IP, uint8_t &IntNo) const;
+
+    uint32_t vector(uint8_t IntNo) const;
+    void setVector(uint8_t IntNo, uint16_t Segment, uint16_t Offset);
+
+public:
+    void drainConsole(DOSFile &Console);
+    void updateTimeOfDay();
+
+    bool hasKey() const;
+    uint16_t peekKey() const;
+    uint16_t popKey();
+    bool pushKey(uint16_t Key);
+    uint8_t shiftFlags() const;
+
+private:
+    uint16_t readBDA16(uint16_t Offset) const;
+    void writeBDA16(uint16_t Offset, uint16_t Value);
+};
+
+#endif  // !__BIOS_h
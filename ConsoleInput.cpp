@@ -0,0 +1,489 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "ConsoleInput.h"
+#include "VirtualClock.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <poll.h>
+#include <strings.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace {
+
+int64_t const NANOS_PER_MILLI = 1000000;
+
+// scan codes of a US keyboard, as the BIOS reports them
+uint8_t const LetterScans[26] = {
+    0x1E, 0x30, 0x2E, 0x20, 0x12, 0x21, 0x22, 0x23, 0x17, 0x24, 0x25, 0x26,
+    0x32, 0x31, 0x18, 0x19, 0x10, 0x13, 0x1F, 0x14, 0x16, 0x2F, 0x11, 0x2D,
+    0x15, 0x2C
+};
+
+// ' ' to '@'
+uint8_t const SymbolScans[33] = {
+    0x39, 0x02, 0x28, 0x04, 0x05, 0x06, 0x08, 0x28, 0x0A, 0x0B, 0x09, 0x0D,
+    0x33, 0x0C, 0x34, 0x35, 0x0B, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+    0x09, 0x0A, 0x27, 0x27, 0x33, 0x0D, 0x34, 0x35, 0x03
+};
+
+// '[' to '`', and '{' to DEL
+uint8_t const BracketScans[6] = { 0x1A, 0x2B, 0x1B, 0x07, 0x0C, 0x29 };
+uint8_t const BraceScans[5]   = { 0x1A, 0x2B, 0x1B, 0x29, 0x0E };
+
+struct NamedKey {
+    char const *Name;
+    uint16_t    Key;
+};
+
+NamedKey const NamedKeys[] = {
+    { "Enter", 0x1C0D }, { "Esc",   0x011B }, { "Tab",   0x0F09 },
+    { "Bksp",  0x0E08 }, { "Up",    0x4800 }, { "Down",  0x5000 },
+    { "Left",  0x4B00 }, { "Right", 0x4D00 }, { "Home",  0x4700 },
+    { "End",   0x4F00 }, { "PgUp",  0x4900 }, { "PgDn",  0x5100 },
+    { "Ins",   0x5200 }, { "Del",   0x5300 }, { "F1",    0x3B00 },
+    { "F2",    0x3C00 }, { "F3",    0x3D00 }, { "F4",    0x3E00 },
+    { "F5",    0x3F00 }, { "F6",    0x4000 }, { "F7",    0x4100 },
+    { "F8",    0x4200 }, { "F9",    0x4300 }, { "F10",   0x4400 },
+    { "F11",   0x8500 }, { "F12",   0x8600 },
+};
+
+uint16_t
+KeyFor(uint8_t C)
+{
+    uint8_t Scan = 0;
+
+    if (C >= 'a' && C <= 'z')
+        Scan = LetterScans[C - 'a'];
+    else if (C >= 'A' && C <= 'Z')
+        Scan = LetterScans[C - 'A'];
+    else if (C >= ' ' && C <= '@')
+        Scan = SymbolScans[C - ' '];
+    else if (C >= '[' && C <= '`')
+        Scan = BracketScans[C - '['];
+    else if (C >= '{' && C <= 0x7F)
+        Scan = BraceScans[C - '{'];
+    else if (C >= 0x01 && C <= 0x1A)
+        Scan = LetterScans[C - 0x01];       // ^A-^Z
+    else if (C == 0x00)
+        Scan = 0x03;                        // ^@
+
+    switch (C) {
+        case 0x08: Scan = 0x0E; break;
+        case 0x09: Scan = 0x0F; break;
+        case 0x0A:
+        case 0x0D: Scan = 0x1C; break;
+        case 0x1B: Scan = 0x01; break;
+        case 0x1C: Scan = 0x2B; break;
+        case 0x1D: Scan = 0x1B; break;
+        case 0x1E: Scan = 0x07; break;
+        case 0x1F: Scan = 0x0C; break;
+    }
+    return (Scan << 8) | C;
+}
+
+// ESC [ n ~
+uint16_t
+TildeKey(int N)
+{
+    if (N >= 11 && N <= 15)
+        return (0x3B + N - 11) << 8;        // F1-F5
+    if (N >= 17 && N <= 21)
+        return (0x40 + N - 17) << 8;        // F6-F10
+
+    switch (N) {
+        case 1:
+        case 7:  return 0x4700;
+        case 2:  return 0x5200;
+        case 3:  return 0x5300;
+        case 4:
+        case 8:  return 0x4F00;
+        case 5:  return 0x4900;
+        case 6:  return 0x5100;
+        case 23: return 0x8500;
+        case 24: return 0x8600;
+    }
+    return 0;
+}
+
+// ESC [ X and ESC O X
+uint16_t
+CursorKey(uint8_t C)
+{
+    switch (C) {
+        case 'A': return 0x4800;
+        case 'B': return 0x5000;
+        case 'C': return 0x4D00;
+        case 'D': return 0x4B00;
+        case 'H': return 0x4700;
+        case 'F': return 0x4F00;
+        case 'P': return 0x3B00;
+        case 'Q': return 0x3C00;
+        case 'R': return 0x3D00;
+        case 'S': return 0x3E00;
+    }
+    return 0;
+}
+
+// the terminal as it was before setRaw(), put back however hvdos ends
+int            RawFD = -1;
+struct termios SavedTermios;
+
+void
+RestoreTerminal()
+{
+    if (RawFD >= 0)
+        tcsetattr(RawFD, TCSANOW, &SavedTermios);
+}
+
+void
+RestoreAndRaise(int Signal)
+{
+    RestoreTerminal();
+    std::signal(Signal, SIG_DFL);
+    std::raise(Signal);
+}
+
+}
+
+ConsoleInput::ConsoleInput(int FD, VirtualClock &Clock) :
+    _fd        (FD),
+    _clock     (Clock),
+    _terminal  (false),
+    _eof       (false),
+    _afterCR   (false),
+    _next      (0),
+    _scriptNext(0),
+    _due       (-1)
+{
+}
+
+ConsoleInput::~ConsoleInput()
+{
+    if (_terminal) {
+        RestoreTerminal();
+        RawFD = -1;
+    }
+}
+
+// ^C still interrupts hvdos, while ^Z is a key rather than a suspend that
+// would leave the shell with a raw terminal
+bool ConsoleInput::
+setRaw()
+{
+    struct termios T;
+    if (!isatty(_fd) || tcgetattr(_fd, &T) != 0)
+        return false;
+
+    SavedTermios = T;
+    T.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+    T.c_iflag &= ~(ICRNL | INLCR | IXON);
+    T.c_cc[VMIN]  = 1;
+    T.c_cc[VTIME] = 0;
+    T.c_cc[VSUSP] = _POSIX_VDISABLE;
+    if (tcsetattr(_fd, TCSANOW, &T) != 0)
+        return false;
+
+    static bool Registered = false;
+    if (!Registered) {
+        std::atexit(RestoreTerminal);
+        for (int Signal : { SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGABRT })
+            std::signal(Signal, RestoreAndRaise);
+        Registered = true;
+    }
+    RawFD     = _fd;
+    _terminal = true;
+    return true;
+}
+
+bool ConsoleInput::
+setScript(char const *Text)
+{
+    std::vector <ScriptKey> Script;
+    int64_t                 Delay = 0;
+
+    for (char const *P = Text; *P != '\0'; P++) {
+        uint16_t Key;
+
+        if (*P == '\r')
+            continue;
+        if (*P == '\n') {
+            Key = KEY_ENTER;
+        } else if (*P != '{') {
+            Key = KeyFor(static_cast <uint8_t> (*P));
+        } else if (P[1] == '{') {
+            Key = KeyFor('{');
+            P++;
+        } else {
+            char const *End = std::strchr(P, '}');
+            if (End == nullptr) {
+                errno = EINVAL;
+                return false;
+            }
+            std::string Name(P + 1, End);
+            P = End;
+
+            unsigned Millis;
+            char     Extra;
+            if (std::sscanf(Name.c_str(), "wait %u%c", &Millis, &Extra) == 1) {
+                Delay += Millis * NANOS_PER_MILLI;
+                continue;
+            }
+
+            Key = 0;
+            if (Name.size() == 2 && Name[0] == '^' &&
+                    std::isalpha(static_cast <uint8_t> (Name[1]))) {
+                Key = KeyFor(std::toupper(Name[1]) - '@');
+            }
+            for (NamedKey const &K : NamedKeys) {
+                if (strcasecmp(Name.c_str(), K.Name) == 0)
+                    Key = K.Key;
+            }
+            if (Key == 0) {
+                errno = EINVAL;
+                return false;
+            }
+        }
+
+        Script.push_back({ Key, Delay });
+        Delay = 0;
+    }
+
+    _script.swap(Script);
+    _scriptNext = 0;
+    _due        = -1;
+    return true;
+}
+
+bool ConsoleInput::
+loadScript(char const *Path)
+{
+    FILE *F = std::fopen(Path, "r");
+    if (F == nullptr)
+        return false;
+
+    std::string Text;
+    char        Buffer[READ_SIZE];
+    size_t      Count;
+    while ((Count = std::fread(Buffer, 1, sizeof(Buffer), F)) > 0)
+        Text.append(Buffer, Count);
+    bool Failed = std::ferror(F);
+    std::fclose(F);
+    if (Failed) {
+        errno = EIO;
+        return false;
+    }
+    return setScript(Text.c_str());
+}
+
+void ConsoleInput::
+reset()
+{
+    _bytes.clear();
+    _next       = 0;
+    _eof        = false;
+    _afterCR    = false;
+    _scriptNext = 0;
+    _due        = -1;
+}
+
+bool ConsoleInput::
+ready()
+{
+    uint16_t Key;
+    size_t   Length;
+
+    if (_scriptNext < _script.size())
+        return until() == 0;
+    return peekHost(Key, Length) || _eof;
+}
+
+bool ConsoleInput::
+eof()
+{
+    uint16_t Key;
+    size_t   Length;
+
+    return _scriptNext == _script.size() && !peekHost(Key, Length) && _eof;
+}
+
+uint16_t ConsoleInput::
+get()
+{
+    uint16_t Key;
+    size_t   Length;
+
+    if (_scriptNext < _script.size()) {
+        Key  = _script[_scriptNext++].Key;
+        _due = -1;
+        if (_scriptNext < _script.size())
+            _due = _clock.now() + _script[_scriptNext].Delay;
+        return Key;
+    }
+
+    if (!peekHost(Key, Length))
+        return KEY_EOF;
+    _afterCR  = Length == 1 && _bytes[_next] == '\r';
+    _next    += Length;
+    return Key;
+}
+
+// the first key's wait starts when the guest first asks for input
+int64_t ConsoleInput::
+until()
+{
+    if (_scriptNext == _script.size())
+        return -1;
+
+    int64_t Now = _clock.now();
+    if (_due < 0)
+        _due = Now + _script[_scriptNext].Delay;
+    return std::max <int64_t> (_due - Now, 0);
+}
+
+bool ConsoleInput::
+wait(int64_t Nanos)
+{
+    if (_scriptNext == _script.size() && !ready())
+        fill(Nanos < 0 ? -1 : static_cast <int> ((Nanos + 999999) / 1000000));
+    return ready();
+}
+
+void ConsoleInput::
+discard()
+{
+    if (!interactive())
+        return;
+
+    while (fill(0))
+        ;
+    _bytes.clear();
+    _next    = 0;
+    _afterCR = false;
+}
+
+ssize_t ConsoleInput::
+read(void *Buffer, size_t Length)
+{
+    if (_next == _bytes.size() && !fill(-1))
+        return 0;
+
+    size_t Count = std::min(Length, _bytes.size() - _next);
+    std::memcpy(Buffer, &_bytes[_next], Count);
+    _next    += Count;
+    _afterCR  = false;
+    return Count;
+}
+
+// whatever FD has within TimeoutMillis (-1 forever); false if nothing
+bool ConsoleInput::
+fill(int TimeoutMillis)
+{
+    if (_eof)
+        return false;
+    if (_next == _bytes.size()) {
+        _bytes.clear();
+        _next = 0;
+    }
+
+    struct pollfd PFD = { _fd, POLLIN, 0 };
+    int           Result;
+    while ((Result = ::poll(&PFD, 1, TimeoutMillis)) < 0 && errno == EINTR)
+        ;
+    if (Result <= 0)
+        return false;
+
+    size_t  Size = _bytes.size();
+    ssize_t Count;
+    _bytes.resize(Size + READ_SIZE);
+    while ((Count = ::read(_fd, &_bytes[Size], READ_SIZE)) < 0 &&
+            errno == EINTR)
+        ;
+    _bytes.resize(Size + std::max <ssize_t> (Count, 0));
+    if (Count <= 0) {
+        _eof = true;
+        return false;
+    }
+    return true;
+}
+
+// the key at _next and how many bytes it takes: 0 if they may yet become
+// a longer escape sequence, and Key 0 for bytes that make no key
+size_t ConsoleInput::
+decode(uint16_t &Key)
+{
+    uint8_t const *P = &_bytes[_next];
+    size_t         N = _bytes.size() - _next;
+
+    Key = 0;
+    if (P[0] == '\n' && _afterCR)
+        return 1;
+    if (P[0] == '\n' || P[0] == '\r') {
+        Key = KEY_ENTER;
+        return 1;
+    }
+    if (!_terminal || P[0] != 0x1B) {
+        // a terminal's Backspace sends DEL
+        Key = (_terminal && P[0] == 0x7F) ? 0x0E08 : KeyFor(P[0]);
+        return 1;
+    }
+
+    // ESC [ parameters final, ESC O final, or Esc by itself
+    if (N < 2)
+        return 0;
+    if (P[1] != '[' && P[1] != 'O') {
+        Key = KEY_ESC;
+        return 1;
+    }
+
+    size_t I      = 2;
+    int    Number = 0;
+    bool   First  = true;
+    while (I < N && P[1] == '[' &&
+            (std::isdigit(P[I]) || P[I] == ';')) {
+        if (P[I] == ';')
+            First = false;
+        else if (First)
+            Number = Number * 10 + (P[I] - '0');
+        I++;
+    }
+    if (I == N) {
+        if (N < 16)
+            return 0;
+        Key = KEY_ESC;
+        return 1;
+    }
+    Key = (P[I] == '~') ? TildeKey(Number) : CursorKey(P[I]);
+    return I + 1;
+}
+
+// the next key from FD without taking it, skipping bytes that make none
+bool ConsoleInput::
+peekHost(uint16_t &Key, size_t &Length)
+{
+    for (;;) {
+        if (_next == _bytes.size() && !fill(0))
+            return false;
+
+        Length = decode(Key);
+        if (Length == 0) {
+            if (fill(0))
+                continue;
+            Key    = KEY_ESC;
+            Length = 1;
+        }
+        if (Key != 0)
+            return true;
+        _next    += Length;
+        _afterCR  = false;
+    }
+}
@@ -0,0 +1,108 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __ConsoleInput_h
+#define __ConsoleInput_h
+
+#include <cstdint>
+#include <vector>
+#include <sys/types.h>
+
+class VirtualClock;
+
+//
+// Keystrokes for the console, as BIOS scan code and ASCII, from two
+// sources in turn:
+//
+//   script    keys given up front (hvdos -K/-k), each of which may wait a
+//             while of guest time after the one before; these come first
+//   host      standard input: a terminal, which setRaw() switches to one
+//             key at a time with escape sequences decoded, or a redirected
+//             file or pipe, whose bytes are the keys and whose line breaks
+//             are Enter
+//
+// Only wait() and read() block, so the kernel decides how the guest idles.
+// Once both sources are exhausted every key is ^Z.
+//
+// In a script, characters stand for themselves and a line break is Enter.
+// {Name} is a named key: Enter, Esc, Tab, Bksp, Up, Down, Left, Right,
+// Home, End, PgUp, PgDn, Ins, Del, F1-F12, or ^A-^Z; {{ is a '{'. {wait N}
+// has the next key wait N milliseconds after the one before was read.
+//
+class ConsoleInput {
+public:
+    enum {
+        KEY_ENTER = 0x1C0D,
+        KEY_ESC   = 0x011B,
+        KEY_EOF   = 0x2C1A,     // ^Z
+        READ_SIZE = 4096
+    };
+
+    struct ScriptKey {
+        uint16_t Key;
+        int64_t  Delay;         // after the key before, in ns
+    };
+
+private:
+    int                      _fd;
+    VirtualClock            &_clock;
+    bool                     _terminal;     // in raw mode
+    bool                     _eof;
+    bool                     _afterCR;      // an LF now is the same line break
+    std::vector <uint8_t>    _bytes;        // read from _fd, not yet used
+    size_t                   _next;
+    std::vector <ScriptKey>  _script;
+    size_t                   _scriptNext;
+    int64_t                  _due;          // clock time of the next, or -1
+
+public:
+    ConsoleInput(int FD, VirtualClock &Clock);
+    ~ConsoleInput();
+
+public:
+    // keys one at a time, unechoed, if FD is a terminal; restored at exit
+    bool setRaw();
+    bool terminal() const { return _terminal; }
+
+    // false with errno EINVAL on a syntax error
+    bool setScript(char const *Text);
+    bool loadScript(char const *Path);
+
+    // for a run starting over: the script from the top, and whatever was
+    // read from FD dropped
+    void reset();
+
+    // DOS edits and echoes lines itself when keys come from a script or a
+    // terminal, rather than passing bytes through
+    bool cooked() const
+        { return _terminal || _scriptNext < _script.size(); }
+
+    // keys come from someone typing, so typing ahead can be discarded
+    bool interactive() const
+        { return _terminal && _scriptNext == _script.size(); }
+
+public:
+    // a key can be had now; at the end of input there always is one
+    bool ready();
+    bool eof();
+    uint16_t get();
+
+    // guest time until the next script key, or -1 once keys come from FD
+    int64_t until();
+
+    // up to Nanos (forever if negative) for host input; true if ready()
+    bool wait(int64_t Nanos);
+
+    // typed ahead at the terminal
+    void discard();
+
+    // redirected input as bytes, blocking; 0 at end of input
+    ssize_t read(void *Buffer, size_t Length);
+
+private:
+    bool fill(int TimeoutMillis);
+    size_t decode(uint16_t &Key);
+    bool peekHost(uint16_t &Key, size_t &Length);
+};
+
+#endif  // !__ConsoleInput_h
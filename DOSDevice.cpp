@@ -0,0 +1,128 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "DOSDevice.h"
+#include "Stats.h"
+
+#include <cerrno>
+
+#include <unistd.h>
+
+namespace {
+
+ssize_t
+WriteAll(int FD, char const *Buffer, size_t Length)
+{
+    size_t Done = 0;
+
+    while (Done < Length) {
+        ssize_t Count = ::write(FD, Buffer + Done, Length - Done);
+        if (Count < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        Done += Count;
+    }
+    return Done;
+}
+
+}
+
+ConsoleDevice::ConsoleDevice(int InFD, int OutFD, VirtualClock &Clock,
+        TextScreen &Screen) :
+    DOSDevice    ("CON"),
+    _input       (InFD, Clock),
+    _screen      (Screen),
+    _out         (OutFD),
+    _pendingSince(0),
+    _capture     (nullptr)
+{
+    _buffer.reserve(FLUSH_SIZE);
+}
+
+ssize_t ConsoleDevice::
+read(void *Buffer, size_t Length)
+{
+    // a prompt must be visible before we block for its answer
+    flush();
+    return _input.read(Buffer, Length);
+}
+
+ssize_t ConsoleDevice::
+write(void const *Buffer, size_t Length)
+{
+    char const *B = static_cast <char const *> (Buffer);
+
+    if (_screen.output() != TextScreen::OUTPUT_STREAM) {
+        _screen.write(B, Length);
+        return Length;
+    }
+    return writeStream(B, Length);
+}
+
+ssize_t ConsoleDevice::
+writeStream(void const *Buffer, size_t Length)
+{
+    char const *B = static_cast <char const *> (Buffer);
+
+    if (_capture != nullptr)
+        _capture->append(B, Length);
+
+    // never grow past the reserved buffer; large writes go straight out
+    if (_buffer.size() + Length > FLUSH_SIZE)
+        flush();
+    if (Length >= FLUSH_SIZE)
+        return WriteAll(_out, B, Length);
+
+    if (_buffer.empty())
+        _pendingSince = Stats::now();
+
+    _buffer.insert(_buffer.end(), B, B + Length);
+
+    if (_buffer.size() >= FLUSH_SIZE)
+        flush();
+    return Length;
+}
+
+void ConsoleDevice::
+flush()
+{
+    _screen.flush();
+    if (_buffer.empty())
+        return;
+
+    WriteAll(_out, _buffer.data(), _buffer.size());
+    _buffer.clear();
+}
+
+void ConsoleDevice::
+tick(uint64_t Now)
+{
+    if (!_buffer.empty() && Now - _pendingSince >= FLUSH_NANOS)
+        flush();
+}
+
+bool ConsoleDevice::
+waitInput(int64_t Nanos)
+{
+    // what the guest is waiting for an answer to is on screen first
+    if (Nanos != 0)
+        flush();
+    return _input.wait(Nanos);
+}
+
+StreamDevice::StreamDevice(char const *Name, int OutFD,
+        ConsoleDevice *Console) :
+    DOSDevice(Name),
+    _out     (OutFD),
+    _console (Console)
+{
+}
+
+ssize_t StreamDevice::
+write(void const *Buffer, size_t Length)
+{
+    _console->flush();
+    return WriteAll(_out, static_cast <char const *> (Buffer), Length);
+}
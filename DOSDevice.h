@@ -0,0 +1,113 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __DOSDevice_h
+#define __DOSDevice_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "ConsoleInput.h"
+#include "DOSFile.h"
+#include "TextScreen.h"
+
+//
+// Character devices behind the standard handles and the reserved names
+// CON, NUL, AUX/COM1 and PRN/LPT1.
+//
+class DOSDevice : public DOSFile {
+private:
+    char const *_name;
+
+public:
+    explicit DOSDevice(char const *Name) : _name(Name) {}
+
+public:
+    char const *name() const { return _name; }
+
+    bool isDevice() const override { return true; }
+    off_t seek(off_t Offset, int Whence) override { return 0; }
+
+    // push buffered output to the host
+    virtual void flush() {}
+
+    // called on every VMEXIT with the current Stats::now()
+    virtual void tick(uint64_t Now) {}
+};
+
+// NUL: reads return end of file, writes are discarded
+class NullDevice : public DOSDevice {
+public:
+    NullDevice() : DOSDevice("NUL") {}
+
+public:
+    ssize_t read(void *Buffer, size_t Length) override { return 0; }
+    ssize_t write(void const *Buffer, size_t Length) override
+        { return Length; }
+};
+
+//
+// CON: all console output from INT 21h (AH=02/06/09/40) and from the ROM
+// console buffer is coalesced here and written with one syscall when the
+// buffer fills, when FLUSH_NANOS have passed since the first pending
+// byte, before any console input, and at exit. Unless the screen is only
+// kept, output goes to it instead. Input comes through a ConsoleInput;
+// reads are of its bytes, as redirected input has them.
+//
+class ConsoleDevice : public DOSDevice {
+public:
+    enum {
+        FLUSH_SIZE  = 64 * 1024,
+        FLUSH_NANOS = 20 * 1000 * 1000
+    };
+
+private:
+    ConsoleInput        _input;
+    TextScreen         &_screen;
+    int                 _out;
+    std::vector <char>  _buffer;
+    uint64_t            _pendingSince;
+    std::string        *_capture;
+
+public:
+    ConsoleDevice(int InFD, int OutFD, VirtualClock &Clock,
+            TextScreen &Screen);
+
+public:
+    ssize_t read(void *Buffer, size_t Length) override;
+    ssize_t write(void const *Buffer, size_t Length) override;
+
+    void flush() override;
+    void tick(uint64_t Now) override;
+
+    ConsoleInput &input() { return _input; }
+
+    // to standard output whatever the screen; what goes there is appended
+    // to Output as well, unless nullptr
+    ssize_t writeStream(void const *Buffer, size_t Length);
+    void capture(std::string *Output) { _capture = Output; }
+
+    // true once input can be read, or false after Nanos (forever if
+    // negative) without any
+    bool waitInput(int64_t Nanos);
+};
+
+//
+// Unbuffered output to a host descriptor (standard error, AUX, PRN). The
+// console is flushed first so that output stays in program order.
+//
+class StreamDevice : public DOSDevice {
+private:
+    int             _out;
+    ConsoleDevice  *_console;
+
+public:
+    StreamDevice(char const *Name, int OutFD, ConsoleDevice *Console);
+
+public:
+    ssize_t read(void *Buffer, size_t Length) override { return 0; }
+    ssize_t write(void const *Buffer, size_t Length) override;
+};
+
+#endif  // !__DOSDevice_h
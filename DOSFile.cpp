@@ -0,0 +1,300 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "DOSFile.h"
+#include "Stats.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csetjmp>
+#include <csignal>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// where a copy out of a mapping goes on if the file shrank under it
+thread_local sigjmp_buf *MapFault;
+struct sigaction         SavedBusError;
+
+void
+OnBusError(int Signal, siginfo_t *Info, void *Context)
+{
+    if (MapFault != nullptr)
+        siglongjmp(*MapFault, 1);
+
+    // not a mapped read: as if we had never been here
+    sigaction(Signal, &SavedBusError, nullptr);
+    raise(Signal);
+}
+
+// Length bytes out of a mapping, false if they are past the end of a file
+// truncated since it was mapped. SA_NODEFER, and no saved signal mask, so
+// that the copy costs no syscall
+bool
+MappedCopy(void *To, void const *From, size_t Length)
+{
+    static bool Registered = false;
+    if (!Registered) {
+        struct sigaction SA;
+        std::memset(&SA, 0, sizeof(SA));
+        SA.sa_sigaction = OnBusError;
+        SA.sa_flags     = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&SA.sa_mask);
+        sigaction(SIGBUS, &SA, &SavedBusError);
+        Registered = true;
+    }
+
+    sigjmp_buf Jump;
+    if (sigsetjmp(Jump, 0) != 0) {
+        MapFault = nullptr;
+        return false;
+    }
+    MapFault = &Jump;
+    std::memcpy(To, From, Length);
+    MapFault = nullptr;
+    return true;
+}
+
+}
+
+HostFile::HostFile(int FD, Counters *C) :
+    _fd      (FD),
+    _counters(C)
+{
+}
+
+HostFile::~HostFile()
+{
+    close();
+}
+
+ssize_t HostFile::
+read(void *Buffer, size_t Length)
+{
+    _counters->Syscalls++;
+    return ::read(_fd, Buffer, Length);
+}
+
+ssize_t HostFile::
+write(void const *Buffer, size_t Length)
+{
+    _counters->Syscalls++;
+    return ::write(_fd, Buffer, Length);
+}
+
+off_t HostFile::
+seek(off_t Offset, int Whence)
+{
+    _counters->Syscalls++;
+    return ::lseek(_fd, Offset, Whence);
+}
+
+int HostFile::
+close()
+{
+    if (_fd < 0)
+        return 0;
+
+    _counters->Syscalls++;
+    int Result = ::close(_fd);
+    _fd = -1;
+    return Result;
+}
+
+ReadOnlyFile::ReadOnlyFile(int FD, Counters *C) :
+    _fd          (FD),
+    _seekable    (false),
+    _map         (nullptr),
+    _size        (0),
+    _mtime       (0),
+    _position    (0),
+    _validated   (Stats::now()),
+    _bufferOffset(0),
+    _bufferLength(0),
+    _counters    (C)
+{
+    struct stat ST;
+
+    _counters->Syscalls++;
+    if (::fstat(_fd, &ST) == 0 && S_ISREG(ST.st_mode)) {
+        _seekable = true;
+        _size     = ST.st_size;
+        _mtime    = ST.st_mtime;
+    }
+
+    if (_seekable && _size > 0) {
+        _counters->Syscalls++;
+        void *Map = ::mmap(nullptr, _size, PROT_READ, MAP_SHARED, _fd, 0);
+        if (Map != MAP_FAILED) {
+            ::madvise(Map, _size, MADV_SEQUENTIAL);
+            _map = static_cast <char *> (Map);
+            _counters->Syscalls++;
+            _counters->Mapped++;
+        }
+    }
+
+    if (_map == nullptr)
+        _buffer.resize(BUFFER_SIZE);
+}
+
+ReadOnlyFile::~ReadOnlyFile()
+{
+    close();
+}
+
+ssize_t ReadOnlyFile::
+read(void *Buffer, size_t Length)
+{
+    char *B = static_cast <char *> (Buffer);
+
+    if (_seekable) {
+        uint64_t Now = Stats::now();
+        if (Now - _validated >= REVALIDATE_NANOS ||
+                _position + static_cast <off_t> (Length) > _size)
+            revalidate(Now);
+    }
+
+    if (_map != nullptr) {
+        size_t Count = 0;
+        if (_position < _size) {
+            Count = std::min(Length, static_cast <size_t> (_size - _position));
+            if (!MappedCopy(B, &_map[_position], Count)) {
+                // truncated since the last check: read what is left of it
+                // through the buffer
+                revalidate(Stats::now());
+                unmap();
+                Count = 0;
+            }
+        }
+        if (_map != nullptr) {
+            _position += Count;
+            return Count;
+        }
+    }
+
+    size_t Done = 0;
+    while (Done < Length) {
+        off_t End = _bufferOffset + static_cast <off_t> (_bufferLength);
+        if (_position >= _bufferOffset && _position < End) {
+            size_t Skip  = _position - _bufferOffset;
+            size_t Count = std::min(Length - Done, _bufferLength - Skip);
+            std::memcpy(B + Done, &_buffer[Skip], Count);
+            Done      += Count;
+            _position += Count;
+            continue;
+        }
+
+        // a pipe returns what it has; do not block for the rest
+        if (!_seekable && Done != 0)
+            break;
+
+        ssize_t Count = fill();
+        if (Count < 0)
+            return (Done != 0) ? Done : -1;
+        if (Count == 0)
+            break;
+    }
+
+    return Done;
+}
+
+ssize_t ReadOnlyFile::
+write(void const *Buffer, size_t Length)
+{
+    errno = EBADF;
+    return -1;
+}
+
+off_t ReadOnlyFile::
+seek(off_t Offset, int Whence)
+{
+    if (!_seekable) {
+        _counters->Syscalls++;
+        return ::lseek(_fd, Offset, Whence);
+    }
+
+    off_t Base;
+    switch (Whence) {
+        case SEEK_SET: Base = 0; break;
+        case SEEK_CUR: Base = _position; break;
+        case SEEK_END: revalidate(Stats::now()); Base = _size; break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    if (Base + Offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _position = Base + Offset;
+    return _position;
+}
+
+int ReadOnlyFile::
+close()
+{
+    if (_fd < 0)
+        return 0;
+
+    unmap();
+
+    _counters->Syscalls++;
+    int Result = ::close(_fd);
+    _fd = -1;
+    return Result;
+}
+
+void ReadOnlyFile::
+revalidate(uint64_t Now)
+{
+    struct stat ST;
+
+    _validated = Now;
+    _counters->Syscalls++;
+    if (::fstat(_fd, &ST) != 0)
+        return;
+    if (ST.st_size == _size && ST.st_mtime == _mtime)
+        return;
+
+    // changed behind our back: forget everything we cached
+    unmap();
+    _size         = ST.st_size;
+    _mtime        = ST.st_mtime;
+    _bufferLength = 0;
+}
+
+void ReadOnlyFile::
+unmap()
+{
+    if (_map == nullptr)
+        return;
+
+    _counters->Syscalls++;
+    ::munmap(_map, _size);
+    _map = nullptr;
+    _buffer.resize(BUFFER_SIZE);
+}
+
+ssize_t ReadOnlyFile::
+fill()
+{
+    ssize_t Count;
+
+    _counters->Refills++;
+    do {
+        _counters->Syscalls++;
+        Count = _seekable ?
+            ::pread(_fd, _buffer.data(), _buffer.size(), _position) :
+            ::read(_fd, _buffer.data(), _buffer.size());
+    } while (Count < 0 && errno == EINTR);
+
+    _bufferOffset = _position;
+    _bufferLength = (Count > 0) ? Count : 0;
+    return Count;
+}
@@ -0,0 +1,98 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __DOSFile_h
+#define __DOSFile_h
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <sys/types.h>
+
+//
+// An open DOS file or device, as referenced by a handle. Operations
+// follow the POSIX conventions: -1 with errno set on failure.
+//
+class DOSFile {
+public:
+    // what host files cost, for hvdos -s
+    struct Counters {
+        uint64_t Syscalls;      // made by open files, close included
+        uint64_t Refills;       // read-ahead buffer fills
+        uint64_t Mapped;        // files served from a mapping
+    };
+
+public:
+    virtual ~DOSFile() {}
+
+public:
+    virtual ssize_t read(void *Buffer, size_t Length) = 0;
+    virtual ssize_t write(void const *Buffer, size_t Length) = 0;
+    virtual off_t seek(off_t Offset, int Whence) = 0;
+    virtual int close() { return 0; }
+
+    virtual bool isDevice() const { return false; }
+};
+
+// a regular file on the host
+class HostFile : public DOSFile {
+private:
+    int         _fd;
+    Counters   *_counters;
+
+public:
+    HostFile(int FD, Counters *C);
+    ~HostFile();
+
+public:
+    ssize_t read(void *Buffer, size_t Length) override;
+    ssize_t write(void const *Buffer, size_t Length) override;
+    off_t seek(off_t Offset, int Whence) override;
+    int close() override;
+};
+
+//
+// A host file opened read-only. Reads are served from an mmap of the whole
+// file or, for files that cannot be mapped, from a read-ahead buffer; the
+// file position is kept here so LSEEK needs no syscall. The file is
+// re-checked with fstat() every REVALIDATE_NANOS and whenever a read hits
+// the end; if it changed, the mapping and buffer are dropped and reads go
+// through the buffer at the current position.
+//
+class ReadOnlyFile : public DOSFile {
+public:
+    enum {
+        BUFFER_SIZE      = 64 * 1024,
+        REVALIDATE_NANOS = 100 * 1000 * 1000
+    };
+
+private:
+    int                 _fd;
+    bool                _seekable;
+    char               *_map;
+    off_t               _size;
+    time_t              _mtime;
+    off_t               _position;
+    uint64_t            _validated;
+    std::vector <char>  _buffer;
+    off_t               _bufferOffset;
+    size_t              _bufferLength;
+    Counters           *_counters;
+
+public:
+    ReadOnlyFile(int FD, Counters *C);
+    ~ReadOnlyFile();
+
+public:
+    ssize_t read(void *Buffer, size_t Length) override;
+    ssize_t write(void const *Buffer, size_t Length) override;
+    off_t seek(off_t Offset, int Whence) override;
+    int close() override;
+
+private:
+    void revalidate(uint64_t Now);
+    void unmap();
+    ssize_t fill();
+};
+
+#endif  // !__DOSFile_h
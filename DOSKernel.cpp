@@ -2,9 +2,16 @@
 // Read LICENSE.txt for licensing information.
 
 #include "DOSKernel.h"
+#include "ProgramImage.h"
+#include "VMSnapshot.h"
 #include "interface.h"
 
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
 #include <cerrno>
+#include <cstring>
+#include <time.h>
 
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -19,25 +26,38 @@
 #define MK_FP(SEG, OFF) (((SEG) << 4) + (OFF))
 
 
-// TODO Make this list
-#define DOS_EBADF  EBADF
-#define DOS_ENFILE ENFILE
+#define DOS_EINVFUNC     1          // function number invalid
+#define DOS_ENOENT       2          // file not found
+#define DOS_ENOPATH      3          // path not found
+#define DOS_EMFILE       4          // too many open files
+#define DOS_ENFILE       4          // the same, for a full SFT
+#define DOS_EACCES       5          // access denied
+#define DOS_EBADF        6          // invalid handle
+#define DOS_EARENA       7          // memory control block destroyed
+#define DOS_ENOMEM       8          // insufficient memory
+#define DOS_EBLOCK       9          // memory block address invalid
+#define DOS_EENVIRON     10         // environment invalid
+#define DOS_EFORMAT      11         // format invalid
+#define DOS_ENODRIVE     15         // invalid drive
+#define DOS_ECURDIR      16         // attempt to remove current directory
+#define DOS_EXDEV        17         // not same device
+#define DOS_ENOSPC       39         // insufficient disk space
+
+#define FLAG_CARRY       0x0001
+#define FLAG_ZERO        0x0040
 
 namespace {
 
-enum  {
-    ATTR_ARCHIVE      = (1 << 5),
-    ATTR_DIRECTORY    = (1 << 4),
-    ATTR_VOLUME_LABEL = (1 << 3),
-    ATTR_SYSTEM       = (1 << 2),
-    ATTR_HIDDEN       = (1 << 1),
-    ATTR_READONLY     = (1 << 0)
-};
-
 #pragma pack(push, 1)
 
+// the DTA of FINDFIRST/FINDNEXT; the first 21 bytes belong to DOS, we
+// keep the search there so any number of searches can be in progress
 struct FindData {
-    uint8_t  Unknown[21];
+    uint8_t  Drive;
+    char     Template[11];
+    uint8_t  SearchAttributes;
+    uint32_t Snapshot;
+    uint32_t Index;
     uint8_t  Attributes;
     uint16_t FileTime;
     uint16_t FileDate;
@@ -47,6 +67,86 @@ struct FindData {
 
 #pragma pack(pop)
 
+static_assert(offsetof(FindData, Attributes) == 21, "DTA layout");
+
+// the DOS error for a failed MemoryArena call
+int
+ArenaError()
+{
+    switch (errno) {
+        case ENOMEM: return DOS_ENOMEM;
+        case EINVAL: return DOS_EBLOCK;
+        default:     return DOS_EARENA;
+    }
+}
+
+// the name DOS 4+ gives a program's MCB: its base name, uppercase
+void
+ProgramName(char const *Path, char (&Name)[9])
+{
+    char const *Base = Path;
+    for (char const *P = Path; *P != '\0'; P++) {
+        if (*P == '/' || *P == '\\' || *P == ':')
+            Base = P + 1;
+    }
+
+    std::memset(Name, 0, sizeof(Name));
+    for (int i = 0; i < 8 && Base[i] != '\0' && Base[i] != '.'; i++)
+        Name[i] = std::toupper(static_cast <unsigned char> (Base[i]));
+}
+
+// what a parent gets back when its child terminates
+hv_x86_reg_t const ParentRegisters[DOSKernel::PARENT_REGISTERS] = {
+    HV_X86_RIP, HV_X86_RFLAGS,
+    HV_X86_RAX, HV_X86_RCX, HV_X86_RDX, HV_X86_RBX,
+    HV_X86_RSI, HV_X86_RDI, HV_X86_RSP, HV_X86_RBP,
+    HV_X86_CS, HV_X86_SS, HV_X86_DS, HV_X86_ES, HV_X86_FS, HV_X86_GS
+};
+
+// an environment, its strings and the program name after them, is at
+// most this long
+size_t const EnvironmentLimit = 0x8000;
+
+int64_t const NanosPerSecond = 1000000000;
+
+// the date and time of a VirtualClock time, which is local already
+void
+Calendar(int64_t Local, struct tm &TM)
+{
+    time_t T = Local / NanosPerSecond;
+    gmtime_r(&T, &TM);
+}
+
+// and back, false if TM is no such date or time
+bool
+FromCalendar(struct tm &TM, int64_t &Local)
+{
+    struct tm Check = TM;
+    time_t    T     = timegm(&Check);
+    if (Check.tm_year != TM.tm_year || Check.tm_mon != TM.tm_mon ||
+            Check.tm_mday != TM.tm_mday || Check.tm_hour != TM.tm_hour ||
+            Check.tm_min != TM.tm_min || Check.tm_sec != TM.tm_sec)
+        return false;
+
+    Local = static_cast <int64_t> (T) * NanosPerSecond;
+    return true;
+}
+
+uint8_t
+ToBCD(int Value)
+{
+    return ((Value / 10) << 4) | (Value % 10);
+}
+
+// -1 for a byte that is no BCD
+int
+FromBCD(uint8_t Value)
+{
+    if ((Value >> 4) > 9 || (Value & 0x0F) > 9)
+        return -1;
+    return (Value >> 4) * 10 + (Value & 0x0F);
+}
+
 
 #pragma pack(push, 1)
 struct PSP {
@@ -77,365 +177,1276 @@ struct PSP {
 };
 #pragma pack(pop)
 
-// convert backslashes to slashes
-static inline void
-ConvertSlashes(std::string &S)
-{
-    std::transform(S.begin(), S.begin(), S.end(),
-            [](char C) { return (C == '\\') ? '/' : C; });
-}
+#pragma pack(push, 1)
 
-static inline uint8_t
-ModeToAttribute(uint16_t Mode)
-{
-    uint8_t Attribute = 0;
+// ES:BX of EXEC to load, and to execute unless AL=01h, which returns the
+// child's initial registers here
+struct ExecBlock {
+    uint16_t Environment;       // 0 for a copy of the parent's
+    uint32_t CommandTail;
+    uint32_t FCB1;
+    uint32_t FCB2;
+    uint32_t InitialStack;
+    uint32_t InitialEntry;
+};
 
-    if (Mode & S_IFDIR) {
-        Attribute |= ATTR_DIRECTORY;
-    }
-    if ((Mode & S_IRUSR) == 0) {
-        Attribute |= ATTR_READONLY;
-    }
+// ES:BX of EXEC AL=03h, to load an overlay
+struct OverlayBlock {
+    uint16_t LoadSegment;
+    uint16_t Relocation;
+};
 
-    return Attribute;
-}
+#pragma pack(pop)
 
 }
 
-DOSKernel::DOSKernel(char *memory, hv_vcpuid_t vcpu, int argc, char **argv) :
+DOSKernel::DOSKernel(char *memory, hv_vcpuid_t vcpu) :
     _memory    (memory),
+    _mem       (memory),
+    _arena     (_mem),
     _vcpu      (vcpu),
-    _dta       (0),
-    _exitStatus(0)
+    _regs      (vcpu),
+    _bios      (_mem, _clock),
+    _screen    (_mem, _clock, 1),
+    _console   (std::make_shared <ConsoleDevice> (0, 1, _clock, _screen)),
+    _sftFree   (0),
+    _psp       (PROGRAM_SEGMENT),
+    _dtaSegment(PROGRAM_SEGMENT),
+    _dtaOffset (0x80),
+    _exitStatus(0),
+    _returnCode(0),
+    _snapshotFunction(-1),
+    _extendedScan(0)
+{
+    // files the guest writes to memory get the guest's date and time
+    _fs.setClock([this] { return _clock.lastTick(); });
+
+    auto StdErr = std::make_shared <StreamDevice> ("", 2, _console.get());
+    auto AUX    = std::make_shared <StreamDevice> ("AUX", 2, _console.get());
+    auto PRN    = std::make_shared <StreamDevice> ("PRN", 2, _console.get());
+
+    _devices.push_back(_console);
+    _devices.push_back(std::make_shared <NullDevice> ());
+    _devices.push_back(AUX);
+    _devices.push_back(PRN);
+
+    for (int i = 0; i < SFT_SIZE; i++) {
+        _sft[i].RefCount = 0;
+        _sft[i].Mode     = 0;
+        _sft[i].NextFree = (i + 1 < SFT_SIZE) ? i + 1 : -1;
+    }
+
+    // SFT 0-3: CON, standard error, AUX, PRN; the kernel keeps these open
+    _standard[0] = _console;
+    _standard[1] = StdErr;
+    _standard[2] = AUX;
+    _standard[3] = PRN;
+    allocSFT(_console, 2);
+    allocSFT(StdErr, 1);
+    allocSFT(AUX, 2);
+    allocSFT(PRN, 1);
+
+    for (int i = 0; i < 256; i++) {
+        _vectors[i].Name = nullptr, _vectors[i].Hits = 0;
+        _dosFunctions[i].Name = nullptr, _dosFunctions[i].Hits = 0;
+    }
+    registerBuiltins();
+}
+
+void DOSKernel::
+boot(int argc, char **argv)
 {
-    _fdbits.resize(256);
+    // IVT, BDA and ROM stubs, and a blank screen
+    _bios.install();
+    _screen.setMode(0x03, true);
 
-    _fdtable[0] = 0, _fdbits[0] = true;
-    _fdtable[1] = 1, _fdbits[1] = true;
-    _fdtable[2] = 2, _fdbits[2] = true;
+    // all of memory goes to the program, named in its MCB as DOS 4+ does
+    char Name[9];
+    ProgramName(argv[1], Name);
+    _arena.format(PROGRAM_SEGMENT, Name);
 
     // Initialize PSP
-    makePSP(0, argc, argv);
+    makePSP(PROGRAM_SEGMENT, argc, argv);
 }
 
-DOSKernel::~DOSKernel()
+// The state is the PSP, the DTA, the exit status, the allocation strategy,
+// the programs waiting in EXEC, the clock, each drive's current directory and the
+// SFT; JFTs, vectors, the MCB chain and everything else the guest sees are
+// in its memory. Devices are saved by their place in _devices, SFT 0-3
+// by index as the constructor opens them again. A kernel can restore the
+// same state any number of times.
+bool DOSKernel::
+save(VMSnapshot &Snapshot) const
 {
+    for (int i = 4; i < SFT_SIZE; i++) {
+        if (_sft[i].RefCount != 0 && std::find(_devices.begin(),
+                    _devices.end(), _sft[i].File) == _devices.end()) {
+            errno = EBUSY;
+            return false;
+        }
+    }
+
+    Snapshot.put(_psp);
+    Snapshot.put(_dtaSegment);
+    Snapshot.put(_dtaOffset);
+    Snapshot.put(_exitStatus);
+    Snapshot.put(_arena.strategy());
+    Snapshot.put(_returnCode);
+    Snapshot.put(static_cast <uint16_t> (_parents.size()));
+    for (Parent const &P : _parents)
+        Snapshot.put(P);
+    _clock.save(Snapshot);
+
+    char Cwd[PATH_SIZE];
+    Snapshot.put(static_cast <uint8_t> (_fs.currentDrive()));
+    for (int Drive = 0; Drive < FileSystem::DRIVE_COUNT; Drive++) {
+        if (_fs.getcwd(Drive + 1, Cwd, sizeof(Cwd)) && Cwd[0] != '\0') {
+            Snapshot.put(static_cast <uint8_t> (Drive));
+            Snapshot.putString(Cwd);
+        }
+    }
+    Snapshot.put(static_cast <uint8_t> (FileSystem::DRIVE_COUNT));
+
+    for (int i = 0; i < SFT_SIZE; i++) {
+        if (_sft[i].RefCount == 0)
+            continue;
+
+        int8_t Device = -1;
+        if (i >= 4) {
+            Device = std::find(_devices.begin(), _devices.end(),
+                    _sft[i].File) - _devices.begin();
+        }
+        Snapshot.put(static_cast <uint8_t> (i));
+        Snapshot.put(_sft[i].RefCount);
+        Snapshot.put(_sft[i].Mode);
+        Snapshot.put(Device);
+    }
+    Snapshot.put(static_cast <uint8_t> (JFT_FREE));
+    return true;
 }
 
-int DOSKernel::
-dispatch(uint8_t IntNo)
+bool DOSKernel::
+restore(VMSnapshot &Snapshot)
 {
-    switch (IntNo) {
-        case 0x20: return int20();
-        case 0x21: return int21();
-        default:   break;
+    uint8_t  Strategy;
+    uint16_t Parents;
+    uint8_t  Drive;
+    bool     Result = Snapshot.get(_psp) && Snapshot.get(_dtaSegment) &&
+        Snapshot.get(_dtaOffset) && Snapshot.get(_exitStatus) &&
+        Snapshot.get(Strategy) && Snapshot.get(_returnCode) &&
+        Snapshot.get(Parents);
+    _parents.resize(Result ? Parents : 0);
+    for (Parent &P : _parents)
+        Result = Result && Snapshot.get(P);
+    Result = Result && _clock.restore(Snapshot) && Snapshot.get(Drive);
+    if (Result && !_fs.setCurrentDrive(Drive)) {
+        errno = ENODEV;
+        return false;
+    }
+
+    // the index of the chain the memory holds; if the guest broke it, its
+    // next call for memory is told so
+    _arena.setStrategy(Strategy);
+    _arena.rebuild();
+
+    // the machine may have been saved with the clock in the other mode
+    _bios.routeClock();
+
+    // the terminal shows some other screen than the one restored
+    _screen.invalidate();
+
+    // keys are for the run from here on, which starts reading afresh
+    _console->input().reset();
+    _extendedScan = 0;
+    _conLine.clear();
+
+    // every drive back to its root, then the ones that were not
+    std::string Cwd;
+    for (int i = 0; i < FileSystem::DRIVE_COUNT; i++)
+        _fs.chdir((std::string(1, 'A' + i) + ":\\").c_str());
+    while (Result && (Result = Snapshot.get(Drive)) &&
+            Drive < FileSystem::DRIVE_COUNT) {
+        Result = Snapshot.getString(Cwd);
+        if (Result && !_fs.chdir((std::string(1, 'A' + Drive) + ":\\" +
+                        Cwd).c_str()))
+            return false;
+    }
+
+    // files a previous run left open are closed
+    for (int i = 0; i < SFT_SIZE; i++) {
+        if (_sft[i].RefCount != 0)
+            _sft[i].File->close();
+        _sft[i].File.reset();
+        _sft[i].RefCount = 0;
+    }
+
+    uint8_t Index;
+    while (Result && (Result = Snapshot.get(Index)) && Index != JFT_FREE) {
+        SFTEntry &E = _sft[Index];
+        int8_t    Device;
+
+        Result = Snapshot.get(E.RefCount) && Snapshot.get(E.Mode) &&
+            Snapshot.get(Device);
+        if (Result && Index < 4)
+            E.File = _standard[Index];
+        else if (Result && Device >= 0 &&
+                static_cast <size_t> (Device) < _devices.size())
+            E.File = _devices[Device];
+        else
+            Result = false;
     }
-    return STATUS_UNHANDLED;
+    if (!Result) {
+        errno = EINVAL;
+        return false;
+    }
+
+    _sftFree = -1;
+    for (int i = SFT_SIZE - 1; i >= 0; i--) {
+        if (_sft[i].RefCount == 0) {
+            _sft[i].NextFree = _sftFree;
+            _sftFree         = i;
+        }
+    }
+    return true;
 }
 
-int DOSKernel::
-int20()
+bool DOSKernel::
+loadProgram(char const *Path)
 {
-    _exitStatus = 0;
-    return STATUS_STOP;
+    uint64_t            Start = Stats::now();
+    ProgramImage        Image;
+    ProgramImage::Entry Entry;
+
+    struct PSP PSP;
+    _mem.read(_psp, 0, &PSP, sizeof(PSP));
+    if (!Image.open(Path) || !Image.load(_mem, _psp, PSP.FirstFreeSegment,
+                Entry))
+        return false;
+
+    start(Entry.CodeSegment, Entry.CodeOffset, Entry.StackSegment,
+            Entry.StackOffset);
+
+    _stats.Load.Latency.add(Stats::now() - Start);
+    _stats.Load.Bytes += Image.imageSize();
+    return true;
 }
 
-int DOSKernel::
-int21()
+// registers of a program about to run with the current PSP
+void DOSKernel::
+start(uint16_t CodeSegment, uint16_t CodeOffset, uint16_t StackSegment,
+        uint16_t StackOffset)
 {
-#ifdef DEBUG
-    std::fprintf(stderr, "\n[%04x] INT 21/AH=%02Xh\n", pc, AH);
-#endif
-
-    switch (AH) {
-        case 0x02: return int21Func02();
-        case 0x08: return int21Func08();
-        case 0x09: return int21Func09();
-        case 0x0A: return int21Func0A();
-        case 0x0C: return int21Func0C();
-        case 0x0E: return int21Func0E();
-        case 0x19: return int21Func19();
-        case 0x1A: return int21Func1A();
-        case 0x25: return int21Func25();
-        case 0x26: return int21Func26();
-        case 0x30: return int21Func30();
-        case 0x33: return int21Func33();
-        case 0x35: return int21Func35();
-        case 0x3C: return int21Func3C();
-        case 0x3D: return int21Func3D();
-        case 0x3E: return int21Func3E();
-        case 0x3F: return int21Func3F();
-        case 0x40: return int21Func40();
-        case 0x41: return int21Func41();
-        case 0x42: return int21Func42();
-        case 0x43: return int21Func43();
-        case 0x4C: return int21Func4C();
-        case 0x4E: return int21Func4E();
-        case 0x4F: return int21Func4F();
-        case 0x57: return int21Func57();
-        default:   break;
-    }
-
-    std::fprintf(stderr, "Unknown interrupt 0x21/0x%02X at %s:%d\n",
-            AH, __FILE__, __LINE__);
-    return STATUS_UNSUPPORTED;
+    _regs.write(HV_X86_CS, CodeSegment);
+    _regs.write(HV_X86_RIP, CodeOffset);
+    _regs.write(HV_X86_SS, StackSegment);
+    _regs.write(HV_X86_RSP, StackOffset);
+    _regs.write(HV_X86_DS, _psp);
+    _regs.write(HV_X86_ES, _psp);
+    _regs.write(HV_X86_RFLAGS, 0x202);
 }
 
-// DOS 1+ - WRITE CHARACTER TO STANDARD OUTPUT
-int DOSKernel::
-int21Func02()
+DOSKernel::~DOSKernel()
 {
-    putchar(DL);
-    SET_AL(DL);
-    return STATUS_HANDLED;
 }
 
-// DOS 1+ - CHARACTER INPUT WITHOUT ECHO
-int DOSKernel::
-int21Func08()
+void DOSKernel::
+registerBuiltins()
 {
-    SET_AL(internalGetChar(0));
-    return STATUS_HANDLED;
+    static struct {
+        uint8_t      Func;
+        char const  *Name;
+        int (DOSKernel::*Handler)();
+    } const DOSFunctions[] = {
+        { 0x01, "READ CHARACTER FROM STANDARD INPUT",    &DOSKernel::int21Func01 },
+        { 0x02, "WRITE CHARACTER TO STANDARD OUTPUT",    &DOSKernel::int21Func02 },
+        { 0x06, "DIRECT CONSOLE OUTPUT/INPUT",           &DOSKernel::int21Func06 },
+        { 0x07, "DIRECT CHARACTER INPUT WITHOUT ECHO",   &DOSKernel::int21Func07 },
+        { 0x08, "CHARACTER INPUT WITHOUT ECHO",          &DOSKernel::int21Func08 },
+        { 0x09, "WRITE STRING TO STANDARD OUTPUT",       &DOSKernel::int21Func09 },
+        { 0x0A, "BUFFERED INPUT",                        &DOSKernel::int21Func0A },
+        { 0x0B, "GET STDIN STATUS",                      &DOSKernel::int21Func0B },
+        { 0x0C, "FLUSH BUFFER AND READ STANDARD INPUT",  &DOSKernel::int21Func0C },
+        { 0x0E, "SELECT DEFAULT DRIVE",                  &DOSKernel::int21Func0E },
+        { 0x19, "GET CURRENT DEFAULT DRIVE",             &DOSKernel::int21Func19 },
+        { 0x1A, "SET DISK TRANSFER AREA ADDRESS",        &DOSKernel::int21Func1A },
+        { 0x25, "SET INTERRUPT VECTOR",                  &DOSKernel::int21Func25 },
+        { 0x26, "CREATE NEW PROGRAM SEGMENT PREFIX",     &DOSKernel::int21Func26 },
+        { 0x2A, "GET SYSTEM DATE",                       &DOSKernel::int21Func2A },
+        { 0x2B, "SET SYSTEM DATE",                       &DOSKernel::int21Func2B },
+        { 0x2C, "GET SYSTEM TIME",                       &DOSKernel::int21Func2C },
+        { 0x2D, "SET SYSTEM TIME",                       &DOSKernel::int21Func2D },
+        { 0x30, "GET DOS VERSION",                       &DOSKernel::int21Func30 },
+        { 0x33, "EXTENDED BREAK CHECKING",               &DOSKernel::int21Func33 },
+        { 0x35, "GET INTERRUPT VECTOR",                  &DOSKernel::int21Func35 },
+        { 0x3B, "CHDIR",                                 &DOSKernel::int21Func3B },
+        { 0x3C, "CREAT",                                 &DOSKernel::int21Func3C },
+        { 0x3D, "OPEN",                                  &DOSKernel::int21Func3D },
+        { 0x3E, "CLOSE",                                 &DOSKernel::int21Func3E },
+        { 0x3F, "READ",                                  &DOSKernel::int21Func3F },
+        { 0x40, "WRITE",                                 &DOSKernel::int21Func40 },
+        { 0x41, "UNLINK",                                &DOSKernel::int21Func41 },
+        { 0x42, "LSEEK",                                 &DOSKernel::int21Func42 },
+        { 0x43, "GET/SET FILE ATTRIBUTES",               &DOSKernel::int21Func43 },
+        { 0x45, "DUP",                                   &DOSKernel::int21Func45 },
+        { 0x46, "DUP2",                                  &DOSKernel::int21Func46 },
+        { 0x47, "CWD",                                   &DOSKernel::int21Func47 },
+        { 0x48, "ALLOCATE MEMORY",                       &DOSKernel::int21Func48 },
+        { 0x49, "FREE MEMORY",                           &DOSKernel::int21Func49 },
+        { 0x4A, "RESIZE MEMORY BLOCK",                   &DOSKernel::int21Func4A },
+        { 0x4B, "EXEC",                                  &DOSKernel::int21Func4B },
+        { 0x4C, "EXIT",                                  &DOSKernel::int21Func4C },
+        { 0x4D, "GET RETURN CODE",                       &DOSKernel::int21Func4D },
+        { 0x4E, "FINDFIRST",                             &DOSKernel::int21Func4E },
+        { 0x4F, "FINDNEXT",                              &DOSKernel::int21Func4F },
+        { 0x57, "GET FILE'S LAST-WRITTEN DATE AND TIME", &DOSKernel::int21Func57 },
+        { 0x58, "GET/SET MEMORY ALLOCATION STRATEGY",    &DOSKernel::int21Func58 },
+        { 0x67, "SET HANDLE COUNT",                      &DOSKernel::int21Func67 },
+    };
+
+    registerInterrupt(0x10, "VIDEO", [this] { return int10(); });
+    registerInterrupt(0x15, "SYSTEM SERVICES", [this] { return int15(); });
+    registerInterrupt(0x16, "KEYBOARD", [this] { return int16(); });
+    registerInterrupt(0x1A, "TIME OF DAY", [this] { return int1A(); });
+    registerInterrupt(0x20, "TERMINATE PROGRAM", [this] { return int20(); });
+    registerInterrupt(0x21, "DOS FUNCTION DISPATCHER", [this] { return int21(); });
+
+    for (auto const &F : DOSFunctions) {
+        auto Handler = F.Handler;
+        registerDOSFunction(F.Func, F.Name,
+                [this, Handler] { return (this->*Handler)(); });
+    }
 }
 
-// DOS 1+ - WRITE STRING TO STANDARD OUTPUT
-int DOSKernel::
-int21Func09()
+void DOSKernel::
+registerInterrupt(uint8_t IntNo, char const *Name, ServiceHandler Handler)
 {
-    std::string S(readCString(MK_FP(DS, DX), '$'));
-    fwrite(S.data(), 1, S.size(), stdout);
+    _vectors[IntNo].Name    = Name;
+    _vectors[IntNo].Handler = std::move(Handler);
+}
 
-    SET_AL('$');
+void DOSKernel::
+registerDOSFunction(uint8_t Func, char const *Name, ServiceHandler Handler)
+{
+    _dosFunctions[Func].Name    = Name;
+    _dosFunctions[Func].Handler = std::move(Handler);
+}
 
-    return STATUS_HANDLED;
+void DOSKernel::
+reportUnhandled(FILE *F) const
+{
+    for (int i = 0; i < 256; i++) {
+        if (!_vectors[i].Handler && _vectors[i].Hits != 0) {
+            std::fprintf(F, "Unhandled interrupt 0x%02X: %llu calls\n", i,
+                    static_cast <unsigned long long> (_vectors[i].Hits));
+        }
+    }
+    for (int i = 0; i < 256; i++) {
+        if (!_dosFunctions[i].Handler && _dosFunctions[i].Hits != 0) {
+            std::fprintf(F, "Unhandled interrupt 0x21/0x%02X: %llu calls\n", i,
+                    static_cast <unsigned long long> (_dosFunctions[i].Hits));
+        }
+    }
 }
 
-// DOS 1+ - BUFFERED INPUT
 int DOSKernel::
-int21Func0A()
+dispatch(uint8_t IntNo)
 {
-    uint32_t abs = MK_FP(DS, DX);
-    char *addr = &_memory[abs];
-    getline(&addr, NULL, stdin);
+    Service &S = _vectors[IntNo];
 
-    return STATUS_HANDLED;
+    S.Hits++;
+    if (!S.Handler)
+        return STATUS_UNHANDLED;
+
+    // INT 21h calls are traced per function by int21()
+    return callService(S, _stats.Vectors[IntNo],
+            IntNo == 0x21 ? 0 : Trace::CATEGORY_INTERRUPT, IntNo);
 }
 
-// DOS 1+ - FLUSH BUFFER AND READ STANDARD INPUT
+// VMCALL from a BIOS trap stub: the guest executed INT n and the vector
+// was not completed by the ROM
 int DOSKernel::
-int21Func0C()
+trap()
 {
-    flushConsoleInput();
-
-    switch (AL) {
-        case 0x01:
-        case 0x06:
-        case 0x07:
-        case 0x08:
-        case 0x0a:
-            SET_AH(AL);
-            int21();
-            SET_AH(0x0c);
-            break;
+    // keep guest-buffered console output ahead of anything the host prints
+    _bios.drainConsole(*_console);
+
+    uint8_t IntNo;
+    if (!_bios.trapVector(_regs.read(HV_X86_CS), pc, IntNo)) {
+        std::fprintf(stderr, "VMCALL outside of the BIOS trap stubs at "
+                "%04x:%04x\n", static_cast <unsigned> (_regs.read(HV_X86_CS)),
+                pc);
+        return STATUS_UNSUPPORTED;
+    }
 
-        default:
-            break;
+    if (IntNo == 0x21 && AH == _snapshotFunction) {
+        _snapshotFunction = -1;
+        return STATUS_SNAPSHOT;
     }
 
-    return STATUS_HANDLED;
+    // the flag a service returns its result in: ZF for the keyboard status
+    // calls, CF for everything else; AH is gone once they have run
+    uint16_t Result = FLAG_CARRY;
+    if ((IntNo == 0x16 && (AH & 0xEF) == 0x01) ||
+            (IntNo == 0x21 && AH == 0x06))
+        Result = FLAG_ZERO;
+
+    _clock.service();
+    int Status = dispatch(IntNo);
+    if (Status == STATUS_HANDLED || Status == STATUS_UNHANDLED)
+        returnFromTrap(Result);
+    return Status;
 }
 
-// DOS 1+ - SELECT DEFAULT DRIVE
-int DOSKernel::
-int21Func0E()
+// Resume at the IRET of the trap stub. If the service set its result flag,
+// that flag is merged into the FLAGS image of the interrupt frame, since
+// that is what IRET restores; the rest of FLAGS is what the ROM's dispatch
+// compares left, and the caller gets its own back.
+void DOSKernel::
+returnFromTrap(uint16_t Result)
 {
-    SET_AL(DL + 'A');
-    return STATUS_HANDLED;
+    if (_regs.modified() & (1u << RegisterFile::SLOT_RFLAGS)) {
+        uint16_t Stack = _regs.read(HV_X86_SS);
+        uint16_t Frame = SP + 4;
+        uint16_t Saved;
+
+        _mem.read(Stack, Frame, &Saved, sizeof(Saved));
+        Saved = (Saved & ~Result) | (FLAGS & Result);
+        _mem.write(Stack, Frame, &Saved, sizeof(Saved));
+    }
+
+    _regs.write(HV_X86_RIP, pc + BIOS::TRAP_LENGTH);
 }
 
-// DOS 1+ - GET CURRENT DEFAULT DRIVE
-int DOSKernel::
-int21Func19()
+// return address of the INT instruction that led to the current trap
+void DOSKernel::
+callerAddress(uint16_t &CS, uint16_t &IP)
 {
-    SET_AL(0);
-    return STATUS_HANDLED;
+    uint16_t Frame[2];
+
+    _mem.read(_regs.read(HV_X86_SS), SP, Frame, sizeof(Frame));
+    IP = Frame[0];
+    CS = Frame[1];
 }
 
-// DOS 1+ - SET DISK TRANSFER AREA ADDRESS
-int DOSKernel::
-int21Func1A()
+// called by the run loop after every VMEXIT
+void DOSKernel::
+tick()
 {
-    _dta = DX;
-    return STATUS_HANDLED;
+    _bios.updateTimeOfDay();
+    tickDevices();
 }
 
+// tick() but for the time of day, which a replayed guest has from its log
 void DOSKernel::
-makePSP(uint16_t seg, int argc, char **argv)
+tickDevices()
 {
-    uint32_t abs = MK_FP(seg, 0);
-
-    struct PSP *PSP = (struct PSP *)(&_memory[abs]);
-
-    // CPMExit: INT 20h
-    PSP->CPMExit[0] = 0xcd;
-    PSP->CPMExit[1] = 0x20;
-
-    // DOS Far Call: INT 21h + RETF
-    PSP->DOSFarCall[0] = 0xcd;
-    PSP->DOSFarCall[1] = 0x21;
-    PSP->DOSFarCall[2] = 0xcb;
+    uint64_t Now = Stats::now();
 
-    // first FSB = empty file name
-    PSP->FCB1[0] = 0x01;
-    PSP->FCB1[1] = 0x20;
-
-    uint8_t c = 0;
-    int j = 0;
-    for (int i = 2; i < argc && c < 0x7E; i++) {
-        j = 0;
-        PSP->CommandLine[c++] = ' ';
-        while (argv[i][j] && c < 0x7E)
-            PSP->CommandLine[c++] = argv[i][j++];
-    }
-    PSP->CommandLine[c] = 0x0D;
-    PSP->CommandLineLength = c;
+    _screen.tick(Now);
+    for (auto const &D : _devices)
+        D->tick(Now);
 }
 
-// DOS 1+ - SET INTERRUPT VECTOR
-int DOSKernel::
-int21Func25()
+void DOSKernel::
+flushConsole()
 {
-#ifdef DEBUG
-    std::fprintf(stderr, "[%04x] SET INTERRUPT VECTOR: 0x%02x to 0x%04x:0x%04x\n", pc, AL, DS, DX);
-#endif
-    return STATUS_HANDLED;
+    _bios.drainConsole(*_console);
+    for (auto const &D : _devices)
+        D->flush();
 }
 
-// DOS 1+ - CREATE NEW PROGRAM SEGMENT PREFIX
+// The guest waits for an interrupt, and the only one it could get is the
+// timer's: it resumes at the next tick. With interrupts off it never would.
 int DOSKernel::
-int21Func26()
+halt()
 {
-    makePSP(DS, 0, 0);
+    if ((FLAGS & 0x0200) == 0) {
+        std::fprintf(stderr, "HLT with interrupts disabled at %04x:%04x\n",
+                static_cast <unsigned> (_regs.read(HV_X86_CS)), pc);
+        return STATUS_UNSUPPORTED;
+    }
+
+    _clock.waitTick();
+    _regs.write(HV_X86_RIP, pc + 1);
     return STATUS_HANDLED;
 }
 
-// DOS 2+ - GET DOS VERSION
-int DOSKernel::
-int21Func30()
+void DOSKernel::
+readTimeStampCounter()
 {
-    SET_AL(7);
-    SET_AH(0);
-    return STATUS_HANDLED;
+    uint64_t TSC = _clock.readTSC();
+
+    _regs.write(HV_X86_RAX, TSC & 0xFFFFFFFF);
+    _regs.write(HV_X86_RDX, TSC >> 32);
+    _regs.write(HV_X86_RIP, pc + 2);
 }
 
-// DOS 2+ - EXTENDED BREAK CHECKING
 int DOSKernel::
-int21Func33()
+callService(Service &S, Stats::Entry &E, uint32_t Category, uint8_t IntNo)
 {
-    static bool extended_break_checking = false;
-    switch (AL) {
-        case 0:
-            SET_DL(extended_break_checking);
-            break;
-        case 1:
-            extended_break_checking = DL;
-            break;
-        default:
-            std::fprintf(stderr, "Unknown subfunction 0x21/0x33/0x%02X at %s:%d\n",
-                         AL, __FILE__, __LINE__);
+    if (!_trace.enabled(Category)) {
+        uint64_t Start  = Stats::now();
+        int      Status = S.Handler();
+        E.Latency.add(Stats::now() - Start);
+        return Status;
     }
-    return STATUS_HANDLED;
-}
 
-// DOS 2+ - GET INTERRUPT VECTOR
-int DOSKernel::
-int21Func35()
-{
-#ifdef DEBUG
-    std::fprintf(stderr, "\nGET INTERRUPT VECTOR: 0x%02x\n", AL);
-#endif
-    SET_ES(0);
-    SET_BX(0);
-    return STATUS_HANDLED;
+    uint16_t EntryAX = AX, EntryBX = BX, EntryCX = CX;
+    uint16_t EntryCS, EntryIP;
+    callerAddress(EntryCS, EntryIP);
+
+    uint64_t Start  = Stats::now();
+    int      Status = S.Handler();
+    E.Latency.add(Stats::now() - Start);
+
+    Trace::Record &R = _trace.append(Category);
+    R.Vector      = IntNo;
+    R.Function    = EntryAX >> 8;
+    R.Subfunction = EntryAX & 0xFF;
+    R.Carry       = FLAGS & 1;
+    R.CS          = EntryCS;
+    R.IP          = EntryIP;
+    R.Handle      = EntryBX;
+    R.Count       = EntryCX;
+    R.Result      = AX;
+    return Status;
 }
 
-// DOS 2+ - CREAT - CREATE OR TRUNCATE FILE
+// SYSTEM SERVICES - only AH=86h; the rest fail as on a machine without
+// them
 int DOSKernel::
-int21Func3C()
+int15()
 {
-    std::string FN(readCString(MK_FP(DS, DX)));
-
-#if DEBUG
-    std::fprintf(stderr, "\ncreat: %s\n", FN.c_str());
-#endif
-
-    // TODO we ignore attributes
-    int HostFD = ::open(FN.c_str(), O_CREAT | O_TRUNC | O_RDWR | O_BINARY, 0777);
-    if (HostFD < 0) {
+    if (AH != 0x86) {
         SETC(1);
-        SET_AX(getDOSError());
-    } else {
-        int FD = allocFD(HostFD);
-        if (FD < 0) {
-            ::close(HostFD);
-            SETC(1);
-            SET_AX(DOS_ENFILE);
-        } else {
-            SETC(0);
-            SET_AX(FD);
-        }
+        SET_AH(0x86);
+        return STATUS_HANDLED;
     }
 
+    // WAIT, CX:DX microseconds
+    _clock.wait(((static_cast <int64_t> (CX) << 16) | DX) * 1000);
+    SETC(0);
     return STATUS_HANDLED;
 }
 
-// DOS 2+ - OPEN - OPEN EXISTING FILE
+// VIDEO - text mode only; without a screen to show, teletype output goes to
+// the console as well
 int DOSKernel::
-int21Func3D()
+int10()
 {
-    std::string FN(readCString(MK_FP(DS, DX)));
+    int      Row, Column;
+    uint16_t Cell;
 
-#if DEBUG
-    std::fprintf(stderr, "\nopen: %s\n", FN.c_str());
-#endif
+    switch (AH) {
+        case 0x00: // SET VIDEO MODE, bit 7 keeps the screen
+            _screen.setMode(AL & 0x7F, (AL & 0x80) == 0);
+            break;
 
-    // oflag is compatible!
-    int HostFD = ::open(FN.c_str(), (AL & 3) | O_BINARY);
-    if (HostFD < 0) {
-        SETC(1);
-        SET_AX(getDOSError());
-    } else {
-        int FD = allocFD(HostFD);
-        if (FD < 0) {
-            ::close(HostFD);
-            SETC(1);
-            SET_AX(DOS_ENFILE);
-        } else {
-            SETC(0);
-            SET_AX(FD);
-        }
-    }
+        case 0x01: // SET TEXT-MODE CURSOR SHAPE
+            _screen.setCursorShape(CX);
+            break;
 
-    return STATUS_HANDLED;
-}
+        case 0x02: // SET CURSOR POSITION
+            _screen.setCursor(BH, DH, DL);
+            break;
 
-// DOS 2+ - CLOSE - CLOSE FILE
-int DOSKernel::
-int21Func3E()
-{
-    int FD     = BX;
-    int HostFD = findFD(FD);
-    if (HostFD < 0) {
-        SETC(1);
-        SET_AX(DOS_EBADF);
-    } else {
-        deallocFD(FD);
-        if (::close(HostFD) < 0) {
-            SETC(1);
-            SET_AX(getDOSError());
-        } else {
-            SETC(0);
+        case 0x03: // GET CURSOR POSITION AND SIZE
+            _screen.cursor(BH, Row, Column);
+            SET_DX((Row << 8) | Column);
+            SET_CX(_screen.cursorShape());
+            break;
+
+        case 0x05: // SELECT ACTIVE DISPLAY PAGE
+            _screen.setPage(AL);
+            break;
+
+        case 0x06: // SCROLL UP WINDOW
+        case 0x07: // SCROLL DOWN WINDOW
+            _screen.scroll(_screen.page(), (AH == 0x06) ? AL : -AL, CH, CL,
+                    DH, DL, BH);
+            break;
+
+        case 0x08: // READ CHARACTER AND ATTRIBUTE AT CURSOR POSITION
+            _screen.cursor(BH, Row, Column);
+            SET_AX(_screen.cell(BH, Row, Column));
+            break;
+
+        case 0x09: // WRITE CHARACTER AND ATTRIBUTE AT CURSOR POSITION
+        case 0x0A: // WRITE CHARACTER ONLY AT CURSOR POSITION
+            _screen.cursor(BH, Row, Column);
+            for (int i = 0; i < CX && Row < _screen.rows(); i++) {
+                Cell = (AH == 0x09) ? (BL << 8) :
+                    (_screen.cell(BH, Row, Column) & 0xFF00);
+                _screen.setCell(BH, Row, Column, Cell | AL);
+                if (++Column >= TextScreen::COLUMNS) {
+                    Column = 0;
+                    Row++;
+                }
+            }
+            break;
+
+        case 0x0E: { // TELETYPE OUTPUT
+            char C = AL;
+            _screen.teletype(_screen.page(), C);
+            if (_screen.output() == TextScreen::OUTPUT_STREAM)
+                _console->write(&C, 1);
+            break;
         }
+
+        case 0x0F: // GET CURRENT VIDEO MODE
+            SET_AX((TextScreen::COLUMNS << 8) | _screen.mode());
+            SET_BH(_screen.page());
+            break;
+
+        case 0x10: // SET PALETTE REGISTERS; only blink or bright background
+            if (AL == 0x03)
+                _screen.setBlink(BL != 0);
+            break;
+
+        case 0x11: // CHARACTER GENERATOR
+            switch (AL) {
+                case 0x02:
+                case 0x12:
+                    _screen.setRows(50);
+                    break;
+
+                case 0x01:
+                case 0x04:
+                case 0x11:
+                case 0x14:
+                    _screen.setRows(25);
+                    break;
+
+                case 0x30: // GET FONT INFORMATION
+                    SET_CX(_screen.rows() == 50 ? 8 : 16);
+                    SET_DL(_screen.rows() - 1);
+                    break;
+            }
+            break;
+
+        case 0x12: // ALTERNATE FUNCTION SELECT
+            if (BL == 0x10) {
+                SET_BX(0x0003);     // colour, 256K
+                SET_CX(0x0009);
+            }
+            break;
+
+        case 0x13: { // WRITE STRING, ES:BP, attributes interleaved if AL bit 1
+            uint16_t Offset = _regs.read(HV_X86_RBP);
+            uint8_t  Page   = BH;
+            int      SavedRow, SavedColumn;
+            _screen.cursor(Page, SavedRow, SavedColumn);
+            _screen.setCursor(Page, DH, DL);
+            for (int i = 0; i < CX; i++) {
+                uint8_t C, Attribute = BL;
+                _mem.read(ES, Offset++, &C, 1);
+                if (AL & 0x02)
+                    _mem.read(ES, Offset++, &Attribute, 1);
+
+                _screen.cursor(Page, Row, Column);
+                if (C != 0x07 && C != 0x08 && C != 0x0A && C != 0x0D)
+                    _screen.setCell(Page, Row, Column, Attribute << 8);
+                _screen.teletype(Page, C);
+                if (_screen.output() == TextScreen::OUTPUT_STREAM)
+                    _console->write(&C, 1);
+            }
+            if ((AL & 0x01) == 0)
+                _screen.setCursor(Page, SavedRow, SavedColumn);
+            break;
+        }
+
+        case 0x1A: // GET DISPLAY COMBINATION CODE
+            if (AL == 0x00) {
+                SET_AL(0x1A);
+                SET_BX(0x0008);     // VGA, colour
+            }
+            break;
+
+        default:
+            break;
+    }
+    return STATUS_HANDLED;
+}
+
+// KEYBOARD - the ROM serves these while the BDA buffer holds keys
+int DOSKernel::
+int16()
+{
+    switch (AH) {
+        case 0x00: // GET KEYSTROKE
+        case 0x10:
+            SET_AX(readKey());
+            break;
+
+        case 0x01: // CHECK FOR KEYSTROKE
+        case 0x11:
+            if (!_bios.hasKey() && inputReady())
+                _bios.pushKey(readKey());
+            if (_bios.hasKey()) {
+                SET_AX(_bios.peekKey());
+                SETZ(0);
+            } else {
+                SETZ(1);
+            }
+            break;
+
+        case 0x02: // GET SHIFT FLAGS
+        case 0x12:
+            SET_AL(_bios.shiftFlags());
+            break;
+
+        default:
+            break;
+    }
+    return STATUS_HANDLED;
+}
+
+// TIME OF DAY - the ROM serves AH=00 while the clock is the host's. The
+// real-time clock is the same clock as the tick count.
+int DOSKernel::
+int1A()
+{
+    struct tm TM;
+    int64_t   Local;
+    int       Hour, Minute, Second, Century, Year, Month, Day;
+
+    switch (AH) {
+        case 0x00: { // GET SYSTEM TIME
+            uint32_t Ticks;
+
+            _clock.pollTicks();
+            _bios.updateTimeOfDay();
+            std::memcpy(&Ticks, &_memory[MK_FP(BIOS::BDA_SEGMENT, 0x6C)],
+                    sizeof(Ticks));
+            SET_CX(Ticks >> 16);
+            SET_DX(Ticks & 0xFFFF);
+            SET_AL(_memory[MK_FP(BIOS::BDA_SEGMENT, 0x70)]);
+            _memory[MK_FP(BIOS::BDA_SEGMENT, 0x70)] = 0;
+            _mem.dirty(BIOS::BDA_SEGMENT, 0x70, 1);
+            break;
+        }
+
+        case 0x01: // SET SYSTEM TIME
+            _clock.setTicks((static_cast <uint32_t> (CX) << 16) | DX);
+            _memory[MK_FP(BIOS::BDA_SEGMENT, 0x70)] = 0;
+            _mem.dirty(BIOS::BDA_SEGMENT, 0x70, 1);
+            _bios.updateTimeOfDay();
+            break;
+
+        case 0x02: // GET REAL-TIME CLOCK TIME
+            Calendar(_clock.now(), TM);
+            SET_CX((ToBCD(TM.tm_hour) << 8) | ToBCD(TM.tm_min));
+            SET_DX(ToBCD(TM.tm_sec) << 8);
+            SETC(0);
+            break;
+
+        case 0x03: // SET REAL-TIME CLOCK TIME
+            Calendar(_clock.now(), TM);
+            Hour   = FromBCD(CX >> 8);
+            Minute = FromBCD(CX & 0xFF);
+            Second = FromBCD(DX >> 8);
+            TM.tm_hour = Hour, TM.tm_min = Minute, TM.tm_sec = Second;
+            if (Hour < 0 || Minute < 0 || Second < 0 ||
+                    !FromCalendar(TM, Local)) {
+                SETC(1);
+                break;
+            }
+            _clock.set(Local);
+            _bios.updateTimeOfDay();
+            SETC(0);
+            break;
+
+        case 0x04: // GET REAL-TIME CLOCK DATE
+            Calendar(_clock.now(), TM);
+            SET_CX((ToBCD(19 + TM.tm_year / 100) << 8) |
+                    ToBCD(TM.tm_year % 100));
+            SET_DX((ToBCD(TM.tm_mon + 1) << 8) | ToBCD(TM.tm_mday));
+            SETC(0);
+            break;
+
+        case 0x05: // SET REAL-TIME CLOCK DATE
+            Calendar(_clock.now(), TM);
+            Century = FromBCD(CX >> 8);
+            Year    = FromBCD(CX & 0xFF);
+            Month   = FromBCD(DX >> 8);
+            Day     = FromBCD(DX & 0xFF);
+            TM.tm_year = Century * 100 + Year - 1900;
+            TM.tm_mon  = Month - 1;
+            TM.tm_mday = Day;
+            if (Century < 0 || Year < 0 || Month < 0 || Day < 0 ||
+                    !FromCalendar(TM, Local)) {
+                SETC(1);
+                break;
+            }
+            _clock.set(Local);
+            _bios.updateTimeOfDay();
+            SETC(0);
+            break;
+
+        default:
+            break;
+    }
+    return STATUS_HANDLED;
+}
+
+int DOSKernel::
+int20()
+{
+    return terminate(0);
+}
+
+int DOSKernel::
+int21()
+{
+#ifdef DEBUG
+    std::fprintf(stderr, "\n[%04x] INT 21/AH=%02Xh\n", pc, AH);
+#endif
+
+    uint8_t  Func = AH;
+    Service &S    = _dosFunctions[Func];
+
+    S.Hits++;
+    if (S.Handler) {
+        return callService(S, _stats.DOSFunctions[Func], Trace::CATEGORY_DOS,
+                0x21);
+    }
+
+    // unknown functions fail with "invalid function number" and are
+    // summarized by reportUnhandled() at exit
+    SETC(1);
+    SET_AX(0x01);
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - READ CHARACTER FROM STANDARD INPUT, WITH ECHO
+int DOSKernel::
+int21Func01()
+{
+    SET_AL(readChar(true));
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - WRITE CHARACTER TO STANDARD OUTPUT
+int DOSKernel::
+int21Func02()
+{
+    char C = DL;
+    _console->write(&C, 1);
+    SET_AL(DL);
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - DIRECT CONSOLE OUTPUT/INPUT
+int DOSKernel::
+int21Func06()
+{
+    if (DL != 0xFF) {
+        char C = DL;
+        _console->write(&C, 1);
+        SET_AL(DL);
+        return STATUS_HANDLED;
+    }
+
+    if (_extendedScan != 0 || inputReady()) {
+        SET_AL(readChar(false));
+        SETZ(0);
+    } else {
+        SET_AL(0);
+        SETZ(1);
+    }
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - DIRECT CHARACTER INPUT, WITHOUT ECHO
+int DOSKernel::
+int21Func07()
+{
+    SET_AL(readChar(false));
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - CHARACTER INPUT WITHOUT ECHO
+int DOSKernel::
+int21Func08()
+{
+    SET_AL(readChar(false));
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - WRITE STRING TO STANDARD OUTPUT
+int DOSKernel::
+int21Func09()
+{
+    // an unterminated string runs to the end of the segment
+    long Length = _mem.scan(DS, DX, '$', 0x10000);
+    if (Length < 0)
+        Length = 0x10000;
+
+    GuestMemory::Span S[GuestMemory::MAX_SPANS];
+    int N = _mem.spans(DS, DX, Length, S);
+    for (int i = 0; i < N; i++) {
+        _console->write(S[i].Data, S[i].Length);
+    }
+
+    SET_AL('$');
+
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - BUFFERED INPUT
+int DOSKernel::
+int21Func0A()
+{
+    // DS:DX holds its size with the CR, then the count without it, the
+    // line and the CR
+    uint8_t Size;
+    _mem.read(DS, DX, &Size, 1);
+    if (Size == 0)
+        return STATUS_HANDLED;
+
+    char    Line[256];
+    uint8_t Count = editLine(Line, Size - 1);
+    Line[Count] = '\r';
+    _mem.write(DS, DX + 1, &Count, 1);
+    _mem.write(DS, DX + 2, Line, Count + 1);
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - GET STDIN STATUS
+int DOSKernel::
+int21Func0B()
+{
+    SET_AL((_extendedScan != 0 || inputReady()) ? 0xFF : 0x00);
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - FLUSH BUFFER AND READ STANDARD INPUT
+int DOSKernel::
+int21Func0C()
+{
+    flushConsoleInput();
+
+    switch (AL) {
+        case 0x01:
+        case 0x06:
+        case 0x07:
+        case 0x08:
+        case 0x0a:
+            SET_AH(AL);
+            int21();
+            SET_AH(0x0c);
+            break;
+
+        default:
+            break;
+    }
+
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - SELECT DEFAULT DRIVE
+int DOSKernel::
+int21Func0E()
+{
+    _fs.setCurrentDrive(DL);
+    SET_AL(FileSystem::DRIVE_COUNT);
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - GET CURRENT DEFAULT DRIVE
+int DOSKernel::
+int21Func19()
+{
+    SET_AL(_fs.currentDrive());
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - SET DISK TRANSFER AREA ADDRESS
+int DOSKernel::
+int21Func1A()
+{
+    _dtaSegment = DS;
+    _dtaOffset  = DX;
+    return STATUS_HANDLED;
+}
+
+void DOSKernel::
+makePSP(uint16_t seg, int argc, char **argv)
+{
+    uint32_t abs = MK_FP(seg, 0);
+
+    struct PSP *PSP = (struct PSP *)(&_memory[abs]);
+    initPSP(seg, MemoryArena::END_SEGMENT, seg);
+
+    // stdin, stdout, stderr, stdaux, stdprn
+    static uint8_t const StandardHandles[] = { 0, 0, 1, 2, 3 };
+
+    for (size_t i = 0; i < sizeof(StandardHandles); i++) {
+        PSP->JobFileTable[i] = StandardHandles[i];
+        _sft[StandardHandles[i]].RefCount++;
+    }
+
+    // first FSB = empty file name
+    PSP->FCB1[0] = 0x01;
+    PSP->FCB1[1] = 0x20;
+
+    uint8_t c = 0;
+    int j = 0;
+    for (int i = 2; i < argc && c < 0x7E; i++) {
+        j = 0;
+        PSP->CommandLine[c++] = ' ';
+        while (argv[i][j] && c < 0x7E)
+            PSP->CommandLine[c++] = argv[i][j++];
+    }
+    PSP->CommandLine[c] = 0x0D;
+    PSP->CommandLineLength = c;
+}
+
+// a PSP with no files open and an empty command line, for a program
+// with memory up to End
+void DOSKernel::
+initPSP(uint16_t Segment, uint16_t End, uint16_t Parent)
+{
+    uint32_t    Linear = MK_FP(Segment, 0);
+    struct PSP *PSP    = (struct PSP *)(&_memory[Linear]);
+
+    std::memset(PSP, 0, sizeof(*PSP));
+    _mem.dirty(Linear, sizeof(*PSP));
+
+    PSP->FirstFreeSegment = End;
+    PSP->CallerPSPSegment = Parent;
+
+    std::memset(PSP->JobFileTable, JFT_FREE, sizeof(PSP->JobFileTable));
+    PSP->JobFileTableSize    = JFT_SIZE;
+    PSP->JobFileTablePointer = (static_cast <uint32_t> (Segment) << 16) |
+        offsetof(struct PSP, JobFileTable);
+
+    // CPMExit: INT 20h
+    PSP->CPMExit[0] = 0xcd;
+    PSP->CPMExit[1] = 0x20;
+
+    // DOS Far Call: INT 21h + RETF
+    PSP->DOSFarCall[0] = 0xcd;
+    PSP->DOSFarCall[1] = 0x21;
+    PSP->DOSFarCall[2] = 0xcb;
+
+    PSP->CommandLine[0] = 0x0D;
+}
+
+// DOS 1+ - SET INTERRUPT VECTOR
+int DOSKernel::
+int21Func25()
+{
+#ifdef DEBUG
+    std::fprintf(stderr, "[%04x] SET INTERRUPT VECTOR: 0x%02x to 0x%04x:0x%04x\n", pc, AL, DS, DX);
+#endif
+    _bios.setVector(AL, DS, DX);
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - CREATE NEW PROGRAM SEGMENT PREFIX: a copy of the current PSP
+// at DX:0000 with the INT 22h-24h vectors as they are now; the handles
+// are copied, not duplicated, so no SFT entry gains a reference
+int DOSKernel::
+int21Func26()
+{
+    struct PSP P;
+
+    _mem.read(_psp, 0, &P, sizeof(P));
+    P.OldTSRAddress               = _bios.vector(0x22);
+    P.OldBreakAddress             = _bios.vector(0x23);
+    P.CriticalErrorHandlerAddress = _bios.vector(0x24);
+    _mem.write(DX, 0, &P, sizeof(P));
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - GET SYSTEM DATE
+int DOSKernel::
+int21Func2A()
+{
+    struct tm TM;
+
+    Calendar(_clock.now(), TM);
+    SET_CX(TM.tm_year + 1900);
+    SET_DX(((TM.tm_mon + 1) << 8) | TM.tm_mday);
+    SET_AL(TM.tm_wday);
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - SET SYSTEM DATE; the time of day stays
+int DOSKernel::
+int21Func2B()
+{
+    struct tm TM;
+    int64_t   Local;
+
+    Calendar(_clock.now(), TM);
+    TM.tm_year = CX - 1900;
+    TM.tm_mon  = DH - 1;
+    TM.tm_mday = DL;
+    if (CX < 1980 || CX > 2099 || !FromCalendar(TM, Local)) {
+        SET_AL(0xFF);
+        return STATUS_HANDLED;
+    }
+
+    _clock.set(Local);
+    _bios.updateTimeOfDay();
+    SET_AL(0x00);
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - GET SYSTEM TIME, to the tick as DOS keeps it
+int DOSKernel::
+int21Func2C()
+{
+    struct tm TM;
+
+    _clock.pollTicks();
+    int64_t Local = _clock.lastTick();
+    Calendar(Local, TM);
+    SET_CX((TM.tm_hour << 8) | TM.tm_min);
+    SET_DX((TM.tm_sec << 8) | (Local % NanosPerSecond / 10000000));
+    return STATUS_HANDLED;
+}
+
+// DOS 1+ - SET SYSTEM TIME; the date stays
+int DOSKernel::
+int21Func2D()
+{
+    struct tm TM;
+    int64_t   Local;
+
+    Calendar(_clock.now(), TM);
+    TM.tm_hour = CH;
+    TM.tm_min  = CL;
+    TM.tm_sec  = DH;
+    if (DL > 99 || !FromCalendar(TM, Local)) {
+        SET_AL(0xFF);
+        return STATUS_HANDLED;
+    }
+
+    _clock.set(Local + DL * (NanosPerSecond / 100));
+    _bios.updateTimeOfDay();
+    SET_AL(0x00);
+    return STATUS_HANDLED;
+}
+
+// DOS 2+ - GET DOS VERSION
+int DOSKernel::
+int21Func30()
+{
+    SET_AL(7);
+    SET_AH(0);
+    return STATUS_HANDLED;
+}
+
+// DOS 2+ - EXTENDED BREAK CHECKING
+int DOSKernel::
+int21Func33()
+{
+    static bool extended_break_checking = false;
+    switch (AL) {
+        case 0:
+            SET_DL(extended_break_checking);
+            break;
+        case 1:
+            extended_break_checking = DL;
+            break;
+        default:
+            std::fprintf(stderr, "Unknown subfunction 0x21/0x33/0x%02X at %s:%d\n",
+                         AL, __FILE__, __LINE__);
+    }
+    return STATUS_HANDLED;
+}
+
+// DOS 2+ - GET INTERRUPT VECTOR
+int DOSKernel::
+int21Func35()
+{
+#ifdef DEBUG
+    std::fprintf(stderr, "\nGET INTERRUPT VECTOR: 0x%02x\n", AL);
+#endif
+    uint32_t Vector = _bios.vector(AL);
+    SET_ES(Vector >> 16);
+    SET_BX(Vector & 0xFFFF);
+    return STATUS_HANDLED;
+}
+
+// DOS 2+ - CHDIR - SET CURRENT DIRECTORY
+int DOSKernel::
+int21Func3B()
+{
+    char FN[PATH_SIZE];
+    if (!readFileName(FN))
+        return STATUS_HANDLED;
+
+    if (!_fs.chdir(FN)) {
+        SETC(1);
+        SET_AX(getDOSError());
+    } else {
+        SETC(0);
+    }
+
+    return STATUS_HANDLED;
+}
+
+// DOS 2+ - CREAT - CREATE OR TRUNCATE FILE
+int DOSKernel::
+int21Func3C()
+{
+    char FN[PATH_SIZE];
+    if (!readFileName(FN))
+        return STATUS_HANDLED;
+
+#if DEBUG
+    std::fprintf(stderr, "\ncreat: %s\n", FN);
+#endif
+
+    // TODO we ignore attributes
+    return openFile(FN, O_CREAT | O_TRUNC | O_RDWR | O_BINARY, 0777);
+}
+
+// DOS 2+ - OPEN - OPEN EXISTING FILE
+int DOSKernel::
+int21Func3D()
+{
+    char FN[PATH_SIZE];
+    if (!readFileName(FN))
+        return STATUS_HANDLED;
+
+#if DEBUG
+    std::fprintf(stderr, "\nopen: %s\n", FN);
+#endif
+
+    // oflag is compatible!
+    return openFile(FN, (AL & 3) | O_BINARY, 0, AL & SFT_NOINHERIT);
+}
+
+// DOS 2+ - CLOSE - CLOSE FILE
+int DOSKernel::
+int21Func3E()
+{
+    uint16_t  Size;
+    uint8_t  *JFT   = jobFileTable(Size);
+    int       Index = sftIndex(BX);
+    if (Index < 0) {
+        SETC(1);
+        SET_AX(DOS_EBADF);
+        return STATUS_HANDLED;
+    }
+
+    // a file written to may have changed size under a search snapshot
+    if (!_sft[Index].File->isDevice() &&
+            (_sft[Index].Mode & O_ACCMODE) != O_RDONLY)
+        _fs.touch();
+
+    JFT[BX] = JFT_FREE;
+    jobFileTableWritten(&JFT[BX], 1);
+    if (releaseSFT(Index) < 0) {
+        SETC(1);
+        SET_AX(getDOSError());
+    } else {
+        SETC(0);
     }
 
     return STATUS_HANDLED;
@@ -445,20 +1456,38 @@ int21Func3E()
 int DOSKernel::
 int21Func3F()
 {
-    int FD = findFD(BX);
-    if (FD < 0) {
+    DOSFile *File = findFD(BX);
+    if (File == nullptr) {
         SETC(1);
         SET_AX(DOS_EBADF);
         return STATUS_HANDLED;
     }
 
-    char Buffer[64 * 1024];
-    ssize_t ReadCount = ::read(FD, Buffer, CX);
+    // read straight into the guest buffer, one piece per wrap point
+    GuestMemory::Span S[GuestMemory::MAX_SPANS];
+    int     N = _mem.spans(DS, DX, CX, S);
+    ssize_t ReadCount = 0;
+
+    for (int i = 0; i < N; i++) {
+        _mem.dirty(S[i].Data - _memory, S[i].Length);
+        ssize_t Count = (File == _console.get()) ?
+            readConsole(S[i].Data, S[i].Length) :
+            File->read(S[i].Data, S[i].Length);
+        if (Count < 0) {
+            if (ReadCount == 0)
+                ReadCount = -1;
+            break;
+        }
+        ReadCount += Count;
+        if (static_cast <size_t> (Count) < S[i].Length)
+            break;
+    }
+
     if (ReadCount < 0) {
         SETC(1);
         SET_AX(getDOSError());
     } else {
-        writeMem(MK_FP(DS, DX), Buffer, ReadCount);
+        _stats.DOSFunctions[0x3F].Bytes += ReadCount;
         SETC(0);
         SET_AX(ReadCount);
     }
@@ -468,109 +1497,516 @@ int21Func3F()
 
 // DOS 2+ - WRITE - WRITE TO FILE OR DEVICE
 int DOSKernel::
-int21Func40()
+int21Func40()
+{
+    DOSFile *File = findFD(BX);
+    if (File == nullptr) {
+        SETC(1);
+        SET_AX(DOS_EBADF);
+        return STATUS_HANDLED;
+    }
+
+    GuestMemory::Span S[GuestMemory::MAX_SPANS];
+    int     N = _mem.spans(DS, DX, CX, S);
+    ssize_t WriteCount = 0;
+
+    for (int i = 0; i < N; i++) {
+        ssize_t Count = File->write(S[i].Data, S[i].Length);
+        if (Count < 0) {
+            if (WriteCount == 0)
+                WriteCount = -1;
+            break;
+        }
+        WriteCount += Count;
+        if (static_cast <size_t> (Count) < S[i].Length)
+            break;
+    }
+
+    if (WriteCount < 0) {
+        SETC(1);
+        SET_AX(getDOSError());
+    } else {
+        _stats.DOSFunctions[0x40].Bytes += WriteCount;
+        SETC(0);
+        SET_AX(WriteCount);
+    }
+
+    return STATUS_HANDLED;
+}
+
+// DOS 2+ - UNLINK - DELETE FILE
+int DOSKernel::
+int21Func41()
+{
+    char FN[PATH_SIZE];
+    if (!readFileName(FN))
+        return STATUS_HANDLED;
+
+    if (!_fs.unlink(FN)) {
+        SETC(1);
+        SET_AX(getDOSError());
+        return STATUS_HANDLED;
+    }
+
+    SETC(0);
+    return STATUS_HANDLED;
+}
+
+// DOS 2+ - LSEEK - SET CURRENT FILE POSITION
+int DOSKernel::
+int21Func42()
+{
+    DOSFile *File = findFD(BX);
+    if (File == nullptr) {
+        SETC(1);
+        SET_AX(DOS_EBADF);
+        return STATUS_HANDLED;
+    }
+
+    off_t NewOffset = File->seek(static_cast <int32_t> ((CX << 16) | DX), AL);
+
+#if 0
+    std::fprintf(stderr, "\n%" PRIx64 ": lseek(%d, 0x%x, %d) = %" PRId64 "\n",
+            pc.value(), BX, (CX << 16) | DX, AL,
+            static_cast <int64_t> (NewOffset));
+#endif
+
+    if (NewOffset < 0) {
+        SETC(1);
+        SET_AX(getDOSError());
+    } else {
+        SETC(0);
+        SET_DX(NewOffset >> 16);
+        SET_AX(NewOffset & 0xffff);
+    }
+    return STATUS_HANDLED;
+}
+
+// DOS 2+ - GET/SET FILE ATTRIBUTES
+int DOSKernel::
+int21Func43()
+{
+    char    FN[PATH_SIZE];
+    uint8_t Attributes;
+
+    switch (AL) {
+        case 0x00: // GET FILE ATTRIBUTES
+            if (!readFileName(FN))
+                return STATUS_HANDLED;
+
+            if (!_fs.attributes(FN, Attributes)) {
+                SETC(1);
+                SET_AX(getDOSError());
+                return STATUS_HANDLED;
+            }
+
+            SETC(0);
+            SET_CX(Attributes);
+            break;
+
+        case 0x01: // SET FILE ATTRIBUTES
+#if DEBUG
+            if (readFileName(FN)) {
+                std::fprintf(stderr, "\nUNIMPL SetFileAttributes: 0x%02X, "
+                        "%s\n", CX, FN);
+            }
+#endif
+            SETC(0);
+            break;
+
+        default:
+            std::fprintf(stderr, "Unknown GetSetFileAttributes "
+                    "subfunction: 0x%02X\n", AL);
+            return STATUS_UNSUPPORTED;
+    }
+
+    return STATUS_HANDLED;
+}
+
+// DOS 2+ - DUP - DUPLICATE FILE HANDLE
+int DOSKernel::
+int21Func45()
+{
+    int Index = sftIndex(BX);
+    if (Index < 0) {
+        SETC(1);
+        SET_AX(DOS_EBADF);
+        return STATUS_HANDLED;
+    }
+
+    _sft[Index].RefCount++;
+    int Handle = allocHandle(Index);
+    if (Handle < 0) {
+        releaseSFT(Index);
+        SETC(1);
+        SET_AX(DOS_EMFILE);
+    } else {
+        SETC(0);
+        SET_AX(Handle);
+    }
+
+    return STATUS_HANDLED;
+}
+
+// DOS 2+ - DUP2, FORCEDUP - FORCE DUPLICATE FILE HANDLE
+int DOSKernel::
+int21Func46()
+{
+    uint16_t  Size;
+    uint8_t  *JFT   = jobFileTable(Size);
+    int       Index = sftIndex(BX);
+    if (Index < 0 || CX >= Size) {
+        SETC(1);
+        SET_AX(DOS_EBADF);
+        return STATUS_HANDLED;
+    }
+
+    if (CX != BX) {
+        _sft[Index].RefCount++;
+        if (sftIndex(CX) >= 0)
+            releaseSFT(JFT[CX]);
+        JFT[CX] = Index;
+        jobFileTableWritten(&JFT[CX], 1);
+    }
+
+    SETC(0);
+    return STATUS_HANDLED;
+}
+
+// DOS 2+ - CWD - GET CURRENT DIRECTORY
+int DOSKernel::
+int21Func47()
+{
+    char Cwd[64];
+    if (!_fs.getcwd(DL, Cwd, sizeof(Cwd))) {
+        SETC(1);
+        SET_AX(getDOSError());
+        return STATUS_HANDLED;
+    }
+
+    _mem.write(DS, SI, Cwd, std::strlen(Cwd) + 1);
+    SETC(0);
+    SET_AX(0x0100);
+
+    return STATUS_HANDLED;
+}
+
+// DOS 2+ - ALLOCATE MEMORY
+int DOSKernel::
+int21Func48()
+{
+    uint16_t Segment, Largest;
+    if (!_arena.allocate(BX, _psp, Segment, Largest)) {
+        int Error = ArenaError();
+        if (Error == DOS_ENOMEM)
+            SET_BX(Largest);
+        SETC(1);
+        SET_AX(Error);
+        return STATUS_HANDLED;
+    }
+
+    SETC(0);
+    SET_AX(Segment);
+    return STATUS_HANDLED;
+}
+
+// DOS 2+ - FREE MEMORY
+int DOSKernel::
+int21Func49()
+{
+    if (!_arena.release(ES)) {
+        SETC(1);
+        SET_AX(ArenaError());
+        return STATUS_HANDLED;
+    }
+
+    SETC(0);
+    return STATUS_HANDLED;
+}
+
+// DOS 2+ - RESIZE MEMORY BLOCK
+int DOSKernel::
+int21Func4A()
+{
+    uint16_t Largest;
+    if (!_arena.resize(ES, BX, Largest)) {
+        int Error = ArenaError();
+        if (Error == DOS_ENOMEM)
+            SET_BX(Largest);
+        SETC(1);
+        SET_AX(Error);
+        return STATUS_HANDLED;
+    }
+
+    SETC(0);
+    return STATUS_HANDLED;
+}
+
+// DOS 2+ - EXEC - LOAD AND/OR EXECUTE PROGRAM
+int DOSKernel::
+int21Func4B()
 {
-    int FD = findFD(BX);
-    if (FD < 0) {
-        SETC(1);
-        SET_AX(DOS_EBADF);
+    char FN[PATH_SIZE];
+    if (!readFileName(FN))
         return STATUS_HANDLED;
-    }
 
-    std::string B(readString(MK_FP(DS, DX), CX));
+#if DEBUG
+    std::fprintf(stderr, "\nexec %02x: %s\n", AL, FN);
+#endif
 
-    ssize_t WriteCount = ::write(FD, B.data(), B.size());
-    if (WriteCount < 0) {
+    if (AL != 0x00 && AL != 0x01 && AL != 0x03) {
         SETC(1);
-        SET_AX(getDOSError());
-    } else {
-        SETC(0);
-        SET_AX(WriteCount);
+        SET_AX(DOS_EINVFUNC);
+        return STATUS_HANDLED;
     }
+    return exec(AL, FN);
+}
 
-    return STATUS_HANDLED;
+// A host file comes from the ProgramCache; anything else, on a RAM drive or
+// in an image, is read through the file system and not kept.
+std::shared_ptr <ProgramImage> DOSKernel::
+openProgram(char const *FileName)
+{
+    std::string HostPath;
+    if (_fs.hostFile(FileName, HostPath))
+        return _programs.open(HostPath);
+
+    std::shared_ptr <DOSFile> File = _fs.open(FileName, O_RDONLY | O_BINARY,
+            0);
+    if (!File)
+        return nullptr;
+
+    auto Image  = std::make_shared <ProgramImage> ();
+    bool Result = Image->read(*File);
+    int  Error  = errno;
+    File->close();
+    errno = Error;
+    return Result ? Image : nullptr;
 }
 
-// DOS 2+ - UNLINK - DELETE FILE
-int DOSKernel::
-int21Func41()
+// A copy of the environment at Source, or an empty one, with the full name
+// of the program after it as DOS 3+ passes it, in a new block of the
+// current PSP; false with errno E2BIG, ENOMEM or EFAULT.
+bool DOSKernel::
+makeEnvironment(uint16_t Source, char const *FileName, uint16_t &Segment)
 {
-    std::string FN(readCString(MK_FP(DS, DX)));
+    std::string Block;
+    std::string FullName;
+    if (!_fs.fullName(FileName, FullName))
+        return false;
+
+    for (uint16_t Offset = 0; Source != 0; ) {
+        long Length = _mem.scan(Source, Offset, '\0',
+                EnvironmentLimit - Offset);
+        if (Length < 0) {
+            errno = E2BIG;
+            return false;
+        }
+        if (Length == 0)
+            break;
 
-    // TODO
-#if DEBUG
-    std::fprintf(stderr, "\nUNIMPL del: %s\n", FN.c_str());
-#endif
+        size_t At = Block.size();
+        Block.resize(At + Length + 1);
+        _mem.read(Source, Offset, &Block[At], Length + 1);
+        Offset += Length + 1;
+    }
+    // an empty environment is two NULs too, for programs that look for them
+    if (Block.empty())
+        Block += '\0';
+    Block += '\0';
+    Block.append("\1\0", 2);
+    Block += FullName;
+    Block += '\0';
+    if (Block.size() > EnvironmentLimit) {
+        errno = E2BIG;
+        return false;
+    }
 
-    return STATUS_HANDLED;
+    uint16_t Largest;
+    if (!_arena.allocate((Block.size() + 15) / 16, _psp, Segment, Largest))
+        return false;
+    _mem.write(Segment, 0, Block.data(), Block.size());
+    return true;
 }
 
-// DOS 2+ - LSEEK - SET CURRENT FILE POSITION
+// Load a program as DOS does, its environment first, then the program in
+// the largest block there is or as much of it as the program asks for. The
+// parent, with the registers of its call, waits on _parents until the
+// child terminates.
 int DOSKernel::
-int21Func42()
+exec(uint8_t Mode, char const *FileName)
 {
-    int FD = findFD(BX);
-    if (FD < 0) {
+    uint64_t Start  = Stats::now();
+    uint16_t Params = ES;
+    uint16_t Offset = BX;
+
+    std::shared_ptr <ProgramImage> Image = openProgram(FileName);
+    if (!Image) {
         SETC(1);
-        SET_AX(DOS_EBADF);
+        SET_AX(getDOSError());
         return STATUS_HANDLED;
     }
 
-    off_t NewOffset = lseek(FD, (CX << 16) | DX, AL);
+    if (Mode == 0x03) {
+        OverlayBlock B;
+        _mem.read(Params, Offset, &B, sizeof(B));
+        if (!Image->loadOverlay(_mem, B.LoadSegment, B.Relocation)) {
+            SETC(1);
+            SET_AX(getDOSError());
+            return STATUS_HANDLED;
+        }
+
+        _stats.Load.Latency.add(Stats::now() - Start);
+        _stats.Load.Bytes += Image->imageSize();
+        SETC(0);
+        return STATUS_HANDLED;
+    }
 
-#if 0
-    std::fprintf(stderr, "\n%" PRIx64 ": lseek(%d, 0x%x, %d) = %" PRId64 "\n",
-            pc.value(), BX, (CX << 16) | DX, AL,
-            static_cast <int64_t> (NewOffset));
-#endif
+    ExecBlock B;
+    _mem.read(Params, Offset, &B, sizeof(B));
 
-    if (NewOffset < 0) {
+    struct PSP *Current = (struct PSP *)(&_memory[MK_FP(_psp, 0)]);
+    uint16_t    Environment;
+    if (!makeEnvironment((B.Environment != 0) ? B.Environment :
+                Current->EnvironmentSegment, FileName, Environment)) {
         SETC(1);
         SET_AX(getDOSError());
-    } else {
-        SETC(0);
-        SET_DX(NewOffset >> 16);
-        SET_AX(NewOffset & 0xffff);
+        return STATUS_HANDLED;
     }
-    return STATUS_HANDLED;
-}
 
-// DOS 2+ - GET/SET FILE ATTRIBUTES
-int DOSKernel::
-int21Func43()
-{
-    std::string FN;
-    struct stat ST;
+    uint16_t            Largest    = _arena.largest();
+    uint16_t            Paragraphs = std::min(static_cast <uint32_t>
+            (Largest), Image->maxParagraphs());
+    uint16_t            Child;
+    ProgramImage::Entry Entry;
+    if (Largest < Image->minParagraphs() ||
+            !_arena.allocate(Paragraphs, _psp, Child, Largest)) {
+        int Error = (Largest < Image->minParagraphs()) ? DOS_ENOMEM :
+            ArenaError();
+        _arena.release(Environment);
+        SETC(1);
+        SET_AX(Error);
+        return STATUS_HANDLED;
+    }
+    if (!Image->load(_mem, Child, Child + Paragraphs, Entry)) {
+        int Error = getDOSError();
+        _arena.release(Child);
+        _arena.release(Environment);
+        SETC(1);
+        SET_AX(Error);
+        return STATUS_HANDLED;
+    }
 
-    switch (AL) {
-        case 0x00: // GET FILE ATTRIBUTES
-            FN = readCString(MK_FP(DS, DX));
-            ConvertSlashes(FN);
+    char Name[9];
+    ProgramName(FileName, Name);
+    _arena.setOwner(Child, Child, Name);
+    _arena.setOwner(Environment, Child, nullptr);
+
+    initPSP(Child, Child + Paragraphs, _psp);
+    struct PSP *PSP = (struct PSP *)(&_memory[MK_FP(Child, 0)]);
+    PSP->EnvironmentSegment = Environment;
+
+    // where the parent resumes, as the INT 22h vector DOS keeps here
+    uint16_t ReturnCS, ReturnIP;
+    callerAddress(ReturnCS, ReturnIP);
+    PSP->OldTSRAddress = (static_cast <uint32_t> (ReturnCS) << 16) | ReturnIP;
+
+    // the parent's handles, but for files opened not to be inherited
+    uint16_t Size;
+    uint8_t *JFT = jobFileTable(Size);
+    for (uint16_t i = 0; i < Size && i < JFT_SIZE; i++) {
+        uint8_t Index = JFT[i];
+        if (Index < SFT_SIZE && _sft[Index].File &&
+                (_sft[Index].Mode & SFT_NOINHERIT) == 0) {
+            PSP->JobFileTable[i] = Index;
+            _sft[Index].RefCount++;
+        }
+    }
 
-            if (::stat(FN.c_str(), &ST) != 0) {
-                SETC(1);
-                SET_AX(getDOSError());
-                return STATUS_HANDLED;
-            }
+    _mem.read(B.CommandTail >> 16, B.CommandTail & 0xFFFF,
+            &PSP->CommandLineLength, 1 + sizeof(PSP->CommandLine));
+    _mem.read(B.FCB1 >> 16, B.FCB1 & 0xFFFF, PSP->FCB1, sizeof(PSP->FCB1));
+    _mem.read(B.FCB2 >> 16, B.FCB2 & 0xFFFF, PSP->FCB2, sizeof(PSP->FCB2));
+
+    // the parent's stack goes in its PSP, as DOS keeps it there
+    Parent P;
+    P.PSP        = _psp;
+    P.DTASegment = _dtaSegment;
+    P.DTAOffset  = _dtaOffset;
+    for (int i = 0; i < PARENT_REGISTERS; i++)
+        P.Registers[i] = _regs.read(ParentRegisters[i]);
+    Current->INT21SSSP = (static_cast <uint32_t> (_regs.read(HV_X86_SS)) <<
+            16) | SP;
+    _mem.dirty(_psp, offsetof(struct PSP, INT21SSSP),
+            sizeof(Current->INT21SSSP));
+    _parents.push_back(P);
+
+    _psp        = Child;
+    _dtaSegment = Child;
+    _dtaOffset  = 0x80;
+
+    _stats.Load.Latency.add(Stats::now() - Start);
+    _stats.Load.Bytes += Image->imageSize();
+
+    if (Mode == 0x01) {
+        // the caller starts the child, which finds AX on top of its stack
+        uint16_t AXValue = 0;
+        Entry.StackOffset -= sizeof(AXValue);
+        _mem.write(Entry.StackSegment, Entry.StackOffset, &AXValue,
+                sizeof(AXValue));
+
+        B.InitialStack = (static_cast <uint32_t> (Entry.StackSegment) << 16) |
+            Entry.StackOffset;
+        B.InitialEntry = (static_cast <uint32_t> (Entry.CodeSegment) << 16) |
+            Entry.CodeOffset;
+        _mem.write(Params, Offset, &B, sizeof(B));
+        SETC(0);
+        return STATUS_HANDLED;
+    }
 
-            SETC(0);
-            SET_CX(ModeToAttribute(ST.st_mode));
-            break;
+    start(Entry.CodeSegment, Entry.CodeOffset, Entry.StackSegment,
+            Entry.StackOffset);
+    SET_AX(0);
+    return STATUS_NORETURN;
+}
 
-        case 0x01: // SET FILE ATTRIBUTES
-#if DEBUG
-            std::fprintf(stderr, "\nUNIMPL SetFileAttributes: 0x%02X, %s\n",
-                    CX, readCString(MK_FP(DS, DX)).c_str());
-#endif
-            SETC(0);
-            break;
+// AH=4Ch and INT 20h: a child goes back to its parent in EXEC, after its
+// files are closed and its memory freed; the first program stops the run
+int DOSKernel::
+terminate(uint8_t Code)
+{
+    if (_parents.empty()) {
+        _exitStatus = Code;
+        return STATUS_STOP;
+    }
 
-        default:
-            std::fprintf(stderr, "Unknown GetSetFileAttributes "
-                    "subfunction: 0x%02X\n", AL);
-            return STATUS_UNSUPPORTED;
+    uint16_t Size;
+    uint8_t *JFT = jobFileTable(Size);
+    for (uint16_t i = 0; i < Size; i++) {
+        int Index = JFT[i];
+        JFT[i] = JFT_FREE;
+        jobFileTableWritten(&JFT[i], 1);
+        if (Index >= SFT_SIZE || !_sft[Index].File)
+            continue;
+
+        // a file written to may have changed size under a search snapshot
+        if (!_sft[Index].File->isDevice() &&
+                (_sft[Index].Mode & O_ACCMODE) != O_RDONLY)
+            _fs.touch();
+        releaseSFT(Index);
     }
+    _arena.releaseOwner(_psp);
+
+    Parent const &P = _parents.back();
+    _psp        = P.PSP;
+    _dtaSegment = P.DTASegment;
+    _dtaOffset  = P.DTAOffset;
+    for (int i = 0; i < PARENT_REGISTERS; i++)
+        _regs.write(ParentRegisters[i], P.Registers[i]);
+    _parents.pop_back();
 
+    _returnCode = Code;
+    SETC(0);
     return STATUS_HANDLED;
 }
 
@@ -578,87 +2014,73 @@ int21Func43()
 int DOSKernel::
 int21Func4C()
 {
-    _exitStatus = AL;
-    return STATUS_STOP;
+    return terminate(AL);
+}
+
+// DOS 2+ - GET RETURN CODE (ERRORLEVEL)
+int DOSKernel::
+int21Func4D()
+{
+    // termination type 0 in AH, normal; DOS hands the code out once
+    SET_AX(_returnCode);
+    _returnCode = 0;
+    SETC(0);
+    return STATUS_HANDLED;
 }
 
 // DOS 2+ - FINDFIRST - FIND FIRST MATCHING FILE
 int DOSKernel::
 int21Func4E()
 {
-    std::string FileSpec(readCString(MK_FP(DS, DX)));
-    ConvertSlashes(FileSpec);
+    char FileSpec[PATH_SIZE];
+    if (!readFileName(FileSpec))
+        return STATUS_HANDLED;
 
-    if (CX & ATTR_VOLUME_LABEL) {
+    if (CX & FileSystem::ATTR_VOLUME_LABEL) {
 #if DEBUG
         std::fprintf(stderr, "\nUNIMPL findfirst volume label: %s\n",
-                FileSpec.c_str());
+                FileSpec);
 #endif
         SETC(1);
         SET_AX(0x12); // no more files
         return STATUS_HANDLED;
     }
 
-    if (FileSpec.find_first_of("?*") != std::string::npos) {
-#if DEBUG
-        std::fprintf(stderr, "\nUNIMPL findfirst wildcards: %s\n",
-                FileSpec.c_str());
-#endif
-        SETC(1);
-        SET_AX(0x12); // no more files
-        return STATUS_HANDLED;
-    }
+    FindData FD;
+    std::memset(&FD, 0, sizeof(FD));
 
-    struct stat ST;
-    if (::stat(FileSpec.c_str(), &ST)) {
-        SETC(1);
-        SET_AX(getDOSError());
-        return STATUS_HANDLED;
+    // the last component is the pattern, the rest names the directory
+    char *Pattern = FileSpec;
+    for (char *P = FileSpec; *P != '\0'; P++) {
+        if (*P == '\\' || *P == '/' || *P == ':')
+            Pattern = P + 1;
     }
+    FileSystem::makeTemplate(Pattern, FD.Template);
+    *Pattern = '\0';
 
-    if ((ST.st_mode) == S_IFDIR && !(CX & ATTR_DIRECTORY)) {
-        // found a directory but program hasn't requested directories
+    uint32_t Snapshot = _fs.snapshot(FileSpec);
+    if (Snapshot == 0) {
         SETC(1);
-        SET_AX(0x12); // no more files
+        SET_AX(getDOSError());
         return STATUS_HANDLED;
     }
 
+    FD.Drive            = (FileSpec[0] != '\0' && FileSpec[1] == ':') ?
+        std::toupper(static_cast <uint8_t> (FileSpec[0])) - 'A' + 1 :
+        _fs.currentDrive() + 1;
+    FD.SearchAttributes = CX;
+    FD.Snapshot         = Snapshot;
+    FD.Index            = 0;
+    _mem.write(_dtaSegment, _dtaOffset, &FD, sizeof(FD));
 
-    FindData FD;
-
-    std::memset(&FD, 0, sizeof(FD));
-
-    FD.Attributes = ModeToAttribute(ST.st_mode);
-    FD.FileTime   = 0; // TODO
-    FD.FileDate   = 0; // TODO
-    FD.FileSize   = ST.st_size;
-
-    size_t FNPos = FileSpec.rfind('/');
-    if (FNPos != std::string::npos) {
-        FNPos++;
-    } else {
-        FNPos = 0;
-    }
-    std::strncpy(FD.FileName, &FileSpec[FNPos], sizeof(FD.FileName) - 1);
-
-    writeMem(MK_FP(DS, _dta), &FD, sizeof(FD));
-
-    SETC(0);
-    return STATUS_HANDLED;
+    return findNext();
 }
 
 // DOS 2+ - FINDNEXT - FIND NEXT MATCHING FILE
 int DOSKernel::
 int21Func4F()
 {
-    // TODO
-#if DEBUG
-    std::fprintf(stderr, "\nUNIMPL FindNext\n");
-#endif
-    SET_AX(0x12); // no more files
-    SETC(1);
-
-    return STATUS_HANDLED;
+    return findNext();
 }
 
 // DOS 2+ - GET FILE'S LAST-WRITTEN DATE AND TIME
@@ -674,98 +2096,513 @@ int21Func57()
     return STATUS_HANDLED;
 }
 
+// DOS 2.11+ - GET OR SET MEMORY ALLOCATION STRATEGY
+// DOS 5+ - GET OR SET UMB LINK STATE
 int DOSKernel::
-getDOSError() const
+int21Func58()
 {
-    // TODO translate
-    return errno;
+    switch (AL) {
+        case 0x00: // GET ALLOCATION STRATEGY
+            SET_AX(_arena.strategy());
+            SETC(0);
+            return STATUS_HANDLED;
+
+        case 0x01: // SET ALLOCATION STRATEGY
+            // the high-memory bits are accepted, there being no UMBs to
+            // prefer or avoid
+            if ((BL & 0x3F) <= MemoryArena::LAST_FIT && (BL & 0xC0) != 0xC0) {
+                _arena.setStrategy(BL);
+                SETC(0);
+                return STATUS_HANDLED;
+            }
+            break;
+
+        case 0x02: // GET UMB LINK STATE
+            SET_AL(0);
+            SETC(0);
+            return STATUS_HANDLED;
+
+        case 0x03: // SET UMB LINK STATE
+            if (BX == 0) {
+                SETC(0);
+                return STATUS_HANDLED;
+            }
+            break;
+    }
+
+    SETC(1);
+    SET_AX(DOS_EINVFUNC);
+    return STATUS_HANDLED;
 }
 
-void DOSKernel::
-flushConsoleInput()
+// DOS 3.3+ - SET HANDLE COUNT
+int DOSKernel::
+int21Func67()
 {
-    fflush(stdout);
+    struct PSP *PSP  = (struct PSP *)(&_memory[MK_FP(_psp, 0)]);
+    uint16_t    Size;
+    uint8_t    *JFT  = jobFileTable(Size);
+
+    // more handles than SFT entries could never be open at once
+    uint16_t Count = std::min <uint16_t> (BX, SFT_SIZE);
+
+    if (Count > Size) {
+        // a block of the program's own, as DOS allocates it; a table that
+        // an earlier call allocated is given back
+        uint16_t Paragraphs = (Count + 15) / 16;
+        uint16_t Segment, Largest;
+        if (!_arena.allocate(Paragraphs, _psp, Segment, Largest)) {
+            SETC(1);
+            SET_AX(ArenaError());
+            return STATUS_HANDLED;
+        }
+
+        uint8_t *Table = reinterpret_cast <uint8_t *>
+            (&_memory[MK_FP(Segment, 0)]);
+        std::memset(Table, JFT_FREE, Paragraphs * 16);
+        std::memcpy(Table, JFT, Size);
+        _mem.dirty(Segment, 0, Paragraphs * 16);
+        _mem.dirty(_psp, 0, sizeof(*PSP));
+
+        uint16_t Previous = PSP->JobFileTablePointer >> 16;
+        if (Previous != _psp)
+            _arena.release(Previous);
+
+        PSP->JobFileTableSize    = Count;
+        PSP->JobFileTablePointer = static_cast <uint32_t> (Segment) << 16;
+    }
+
+    SETC(0);
+    return STATUS_HANDLED;
 }
 
+// continue the search whose state FINDFIRST left in the DTA
 int DOSKernel::
-internalGetChar(bool Echo)
+findNext()
 {
-    return getchar();
+    typedef FileSystem::SearchEntry SearchEntry;
+
+    FindData FD;
+    _mem.read(_dtaSegment, _dtaOffset, &FD, sizeof(FD));
+
+    size_t             Count;
+    SearchEntry const *Entries = _fs.entries(FD.Snapshot, Count);
+    size_t             Index   = FD.Index;
+
+    // without wildcards, the entries are sorted by exactly what we look for
+    bool Exact = std::memchr(FD.Template, '?', sizeof(FD.Template)) == nullptr;
+    if (Exact && Index < Count) {
+        auto I = std::lower_bound(Entries + Index, Entries + Count,
+                FD.Template, [](SearchEntry const &E, char const *Template) {
+                    return std::memcmp(E.Template, Template, 11) < 0;
+                });
+        Index = I - Entries;
+    }
+
+    // normal files are always found, the others only when asked for
+    uint8_t Excluded = (FileSystem::ATTR_HIDDEN | FileSystem::ATTR_SYSTEM |
+            FileSystem::ATTR_DIRECTORY) & ~FD.SearchAttributes;
+
+    for (; Index < Count; Index++) {
+        SearchEntry const &E = Entries[Index];
+
+        if (!FileSystem::matches(FD.Template, E.Template)) {
+            if (Exact)
+                break;
+            continue;
+        }
+        if (E.Attributes & Excluded)
+            continue;
+
+        FD.Index      = Index + 1;
+        FD.Attributes = E.Attributes;
+        FD.FileTime   = E.Time;
+        FD.FileDate   = E.Date;
+        FD.FileSize   = E.Size;
+        std::memcpy(FD.FileName, E.Name, sizeof(FD.FileName));
+        _mem.write(_dtaSegment, _dtaOffset, &FD, sizeof(FD));
+
+        SETC(0);
+        return STATUS_HANDLED;
+    }
+
+    FD.Index = Count;
+    _mem.write(_dtaSegment, _dtaOffset, &FD, offsetof(FindData, Attributes));
+
+    SETC(1);
+    SET_AX(0x12); // no more files
+    return STATUS_HANDLED;
 }
 
 int DOSKernel::
-allocFD(int HostFD)
+getDOSError() const
 {
-    auto I = std::find(_fdbits.begin(), _fdbits.end(), false);
-    if (I == _fdbits.end())
-        return -1;
-
-    int FD = I - _fdbits.begin();
-    _fdbits[FD] = true;
-    _fdtable.insert(std::make_pair(FD, HostFD));
-    return FD;
+    switch (errno) {
+        case EINVAL:       return DOS_EINVFUNC;
+        case ENOENT:       return DOS_ENOENT;
+        case ENOTDIR:      return DOS_ENOPATH;
+        case EMFILE:       return DOS_EMFILE;
+        case ENFILE:       return DOS_ENFILE;
+        case EBADF:        return DOS_EBADF;
+        case ENOMEM:       return DOS_ENOMEM;
+        case EFAULT:       return DOS_EARENA;        // EXEC's MCBs
+        case E2BIG:        return DOS_EENVIRON;      // EXEC's environment
+        case ENOEXEC:      return DOS_EFORMAT;
+        case ENODEV:       return DOS_ENODRIVE;
+        case EBUSY:        return DOS_ECURDIR;
+        case EXDEV:        return DOS_EXDEV;
+        case ENOSPC:       return DOS_ENOSPC;
+        case ENAMETOOLONG: return DOS_ENOPATH;
+        default:           return DOS_EACCES;        // EACCES EISDIR EROFS EEXIST
+    }
 }
 
+// only what was typed ahead at a terminal; a script's keys and redirected
+// input are not typed ahead
 void DOSKernel::
-deallocFD(int FD)
+flushConsoleInput()
 {
-    if (FD < 3)
+    _console->flush();
+    if (!_console->input().interactive())
         return;
 
-    _fdbits[FD] = false;
-    _fdtable.erase(FD);
+    while (_bios.hasKey())
+        _bios.popKey();
+    _extendedScan = 0;
+    _console->input().discard();
 }
 
-int DOSKernel::
-findFD(int FD)
+// the next key as INT 16h has it, waiting for one as long as it takes;
+// keys peeked by INT 16h or AH=0B wait in the BDA buffer
+uint16_t DOSKernel::
+readKey()
 {
-    if (FD < 0)
-        return -1;
+    ConsoleInput &Input = _console->input();
+
+    while (!_bios.hasKey() && !Input.ready()) {
+        int64_t Until = Input.until();
+        if (Until >= 0)
+            _clock.wait(Until);
+        else
+            _console->waitInput(-1);
+    }
+    return _bios.hasKey() ? _bios.popKey() : Input.get();
+}
+
+// a character of DOS input: 00h for an extended key, whose scan code the
+// next call returns
+uint8_t DOSKernel::
+readChar(bool Echo)
+{
+    if (_extendedScan != 0) {
+        uint8_t Scan = _extendedScan;
+        _extendedScan = 0;
+        return Scan;
+    }
 
-    auto I = _fdtable.find(FD);
-    return (I != _fdtable.end()) ? I->second : -1;
+    uint16_t Key = readKey();
+    char     C   = Key & 0xFF;
+    if (C == 0)
+        _extendedScan = Key >> 8;
+    else if (Echo)
+        _console->write(&C, 1);
+    return C;
 }
 
+// DOS line input, echoed as it is typed: Backspace takes a character
+// back, Esc starts over, Enter or the end of input ends the line, and keys
+// beyond Max ring the bell
+size_t DOSKernel::
+editLine(char *Line, size_t Max)
+{
+    ConsoleInput &Input = _console->input();
+    size_t        Count = 0;
+
+    _extendedScan = 0;
+    while (_bios.hasKey() || !Input.eof()) {
+        char C = readKey() & 0xFF;
+
+        switch (C) {
+            case '\r':
+                _console->write("\r", 1);
+                return Count;
+
+            case '\b':
+                if (Count > 0) {
+                    Count--;
+                    _console->write("\b \b", 3);
+                }
+                break;
+
+            case 0x1B:
+                _console->write("\\\r\n", 3);
+                Count = 0;
+                break;
+
+            case 0x00:
+                break;      // no template editing with the function keys
+
+            default:
+                if (Count < Max) {
+                    Line[Count++] = C;
+                    _console->write(&C, 1);
+                } else {
+                    _console->write("\a", 1);
+                }
+                break;
+        }
+    }
+    return Count;
+}
 
-void DOSKernel::
-writeMem(uint16_t const &Address, void const *Bytes, size_t Length)
+// handle reads of CON: a line at a time, edited as DOS does and given out
+// with its CR LF over as many reads as take it, unless input is redirected
+ssize_t DOSKernel::
+readConsole(char *Buffer, size_t Length)
+{
+    ConsoleInput &Input = _console->input();
+
+    if (_conLine.empty() && !Input.cooked()) {
+        size_t Count = 0;
+        while (Count < Length && _bios.hasKey())
+            Buffer[Count++] = _bios.popKey() & 0xFF;
+        return Count > 0 ? Count : _console->read(Buffer, Length);
+    }
+
+    if (_conLine.empty()) {
+        if (!_bios.hasKey() && Input.eof())
+            return 0;
+
+        char Line[CON_LINE_SIZE];
+        size_t Count = editLine(Line, CON_LINE_SIZE - 2);
+        _console->write("\n", 1);
+        _conLine.assign(Line, Count);
+        _conLine += "\r\n";
+    }
+
+    size_t Count = std::min(Length, _conLine.size());
+    std::memcpy(Buffer, _conLine.data(), Count);
+    _conLine.erase(0, Count);
+    return Count;
+}
+
+// A guest that keeps asking for input there is none of is idle. Once one
+// place in it has asked POLL_THRESHOLD times within POLL_WINDOW_NANOS, each
+// further poll from there parks the vCPU thread on the console for up to a
+// tick, which a key ends at once.
+bool DOSKernel::
+inputReady()
 {
-    auto             D = Address;
-    uint8_t const   *B = reinterpret_cast <uint8_t const *> (Bytes);
+    ConsoleInput &Input = _console->input();
+    if (_bios.hasKey() || Input.ready()) {
+        _pollSites.clear();
+        return true;
+    }
 
-    while (Length-- != 0) {
-        writeMem8(D, *B);
-        D++, B++;
+    uint16_t CS, IP;
+    callerAddress(CS, IP);
+    if (_pollSites.size() >= 64)
+        _pollSites.clear();
+    PollSite &S   = _pollSites[(static_cast <uint32_t> (CS) << 16) | IP];
+    uint64_t  Now = Stats::now();
+    if (S.Count == 0 || Now - S.Since > POLL_WINDOW_NANOS) {
+        S.Since = Now;
+        S.Count = 0;
+    }
+    if (++S.Count < POLL_THRESHOLD)
+        return false;
+
+    // a script's next key comes at a time of the guest's clock
+    int64_t Until = Input.until();
+    bool    Ready;
+    if (Until >= 0) {
+        _clock.wait(std::min(Until, _clock.untilTick()));
+        Ready = Input.ready();
+    } else {
+        Ready = _console->waitInput(_clock.untilTick());
+        _clock.waited(Stats::now() - Now);
     }
+    _stats.Parked.Latency.add(Stats::now() - Now);
+
+    // still idle, so the next poll parks too
+    S.Since = Stats::now();
+    if (Ready)
+        _pollSites.clear();
+    return Ready;
 }
 
-std::string DOSKernel::
-readString(uint16_t const &Address, size_t Length)
+// CON, NUL, AUX, PRN and their aliases, with any directory or extension
+std::shared_ptr <DOSDevice> DOSKernel::
+findDevice(char const *FileName) const
 {
-    std::string     Result;
-    auto            S = Address;
+    static struct {
+        char const *Alias;
+        char const *Name;
+    } const Aliases[] = {
+        { "COM1", "AUX" },
+        { "LPT1", "PRN" },
+    };
+
+    char const *Start = FileName;
+    for (char const *P = FileName; *P != '\0'; P++) {
+        if (*P == '\\' || *P == '/' || *P == ':')
+            Start = P + 1;
+    }
 
-    while (Length-- != 0) {
-        Result += static_cast <char> (readMem8(S));
-        S++;
+    // device names are at most four characters
+    char Base[5];
+    size_t Length = 0;
+    for (; Start[Length] != '\0' && Start[Length] != '.'; Length++) {
+        if (Length == sizeof(Base) - 1)
+            return nullptr;
+        Base[Length] = std::toupper(static_cast <uint8_t> (Start[Length]));
     }
+    Base[Length] = '\0';
 
-    return Result;
+    char const *Name = Base;
+    for (auto const &A : Aliases) {
+        if (std::strcmp(Base, A.Alias) == 0)
+            Name = A.Name;
+    }
+    for (auto const &D : _devices) {
+        if (std::strcmp(Name, D->name()) == 0)
+            return D;
+    }
+    return nullptr;
 }
 
-std::string DOSKernel::
-readCString(uint16_t const &Address, char Terminator)
+// shared tail of CREAT and OPEN
+int DOSKernel::
+openFile(char const *FileName, int Flags, mode_t Mode, uint8_t NoInherit)
 {
-    std::string     Result;
-    auto            S = Address;
+    std::shared_ptr <DOSFile> File(findDevice(FileName));
 
-    for (;;) {
-        char C = readMem8(S);
-        if (C == Terminator)
-            break;
+    if (!File)
+        File = _fs.open(FileName, Flags, Mode);
+    if (!File) {
+        SETC(1);
+        SET_AX(getDOSError());
+        return STATUS_HANDLED;
+    }
+
+    int Index = allocSFT(File, (Flags & O_ACCMODE) | NoInherit);
+    if (Index < 0) {
+        File->close();
+        SETC(1);
+        SET_AX(DOS_ENFILE);
+        return STATUS_HANDLED;
+    }
 
-        Result += C, S++;
+    int Handle = allocHandle(Index);
+    if (Handle < 0) {
+        releaseSFT(Index);
+        SETC(1);
+        SET_AX(DOS_EMFILE);
+    } else {
+        SETC(0);
+        SET_AX(Handle);
     }
+    return STATUS_HANDLED;
+}
+
+// take a free SFT entry with one reference for the caller
+int DOSKernel::
+allocSFT(std::shared_ptr <DOSFile> const &File, uint8_t Mode)
+{
+    int Index = _sftFree;
+    if (Index < 0)
+        return -1;
+
+    SFTEntry &E = _sft[Index];
+    _sftFree   = E.NextFree;
+    E.File     = File;
+    E.RefCount = 1;
+    E.Mode     = Mode;
+    return Index;
+}
 
+// drop one reference; the last one closes the file
+int DOSKernel::
+releaseSFT(int Index)
+{
+    SFTEntry &E = _sft[Index];
+    if (--E.RefCount != 0)
+        return 0;
+
+    int Result = E.File->close();
+    E.File.reset();
+    E.NextFree = _sftFree;
+    _sftFree   = Index;
     return Result;
 }
+
+// The size and pointer are the guest's to set, so the table is cut short
+// at the end of memory, and at SFT_SIZE, past which no handle can refer to
+// an entry anyway. Callers that write it report the entries with
+// jobFileTableWritten().
+uint8_t *DOSKernel::
+jobFileTable(uint16_t &Size)
+{
+    struct PSP const *PSP = (struct PSP const *)(&_memory[MK_FP(_psp, 0)]);
+    uint32_t Pointer = PSP->JobFileTablePointer;
+    uint32_t Linear  = GuestMemory::linear(Pointer >> 16, Pointer & 0xFFFF);
+
+    Size = std::min <uint32_t> (PSP->JobFileTableSize,
+            std::min <uint32_t> (SFT_SIZE,
+                GuestMemory::ADDRESS_SPACE - Linear));
+    return reinterpret_cast <uint8_t *> (&_memory[Linear]);
+}
+
+void DOSKernel::
+jobFileTableWritten(uint8_t const *Entry, size_t Count)
+{
+    _mem.dirty(static_cast <uint32_t> (
+                reinterpret_cast <char const *> (Entry) - _memory), Count);
+}
+
+// lowest free handle of the current PSP, now referring to SFT entry Index;
+// the caller's reference on the entry moves to the handle
+int DOSKernel::
+allocHandle(int Index)
+{
+    uint16_t  Size;
+    uint8_t  *JFT  = jobFileTable(Size);
+    void     *Free = std::memchr(JFT, JFT_FREE, Size);
+    if (Free == nullptr)
+        return -1;
+
+    *static_cast <uint8_t *> (Free) = Index;
+    jobFileTableWritten(static_cast <uint8_t *> (Free), 1);
+    return static_cast <uint8_t *> (Free) - JFT;
+}
+
+int DOSKernel::
+sftIndex(int Handle)
+{
+    uint16_t  Size;
+    uint8_t  *JFT = jobFileTable(Size);
+    if (Handle < 0 || Handle >= Size || JFT[Handle] >= SFT_SIZE)
+        return -1;
+
+    int Index = JFT[Handle];
+    return _sft[Index].File ? Index : -1;
+}
+
+DOSFile *DOSKernel::
+findFD(int Handle)
+{
+    int Index = sftIndex(Handle);
+    return (Index < 0) ? nullptr : _sft[Index].File.get();
+}
+
+// ASCIZ file name at DS:DX; sets CF and AX if it does not fit
+bool DOSKernel::
+readFileName(char (&FileName)[PATH_SIZE])
+{
+    if (!_mem.readCString(DS, DX, FileName, sizeof(FileName))) {
+        SETC(1);
+        SET_AX(DOS_ENOPATH);
+        return false;
+    }
+    return true;
+}
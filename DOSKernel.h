@@ -4,11 +4,29 @@
 #ifndef __DOSKernel_h
 #define __DOSKernel_h
 
+#include <cstdio>
+#include <functional>
+#include <memory>
 #include <string>
-#include <map>
+#include <unordered_map>
 #include <vector>
 #include <Hypervisor/hv_vmx.h>
 
+#include "BIOS.h"
+#include "DOSDevice.h"
+#include "FileSystem.h"
+#include "GuestMemory.h"
+#include "MemoryArena.h"
+#include "ProgramCache.h"
+#include "RegisterFile.h"
+#include "Stats.h"
+#include "TextScreen.h"
+#include "Trace.h"
+#include "VirtualClock.h"
+
+class ProgramImage;
+class VMSnapshot;
+
 class DOSKernel {
 public:
     enum {
@@ -16,42 +34,199 @@ public:
         STATUS_STOP,
         STATUS_UNHANDLED,
         STATUS_UNSUPPORTED,
-        STATUS_NORETURN
+        STATUS_NORETURN,
+        STATUS_SNAPSHOT     // armSnapshot() call reached, not dispatched
+    };
+
+    enum {
+        PROGRAM_SEGMENT = 0x0100,   // PSP of the program; image at +100h
+        PATH_SIZE       = 128,      // longest ASCIZ file name we accept
+
+        SFT_SIZE        = 255,      // JFT entries are bytes, FFh is free
+        SFT_NOINHERIT   = 0x80,     // Mode bit: EXEC does not pass it on
+        JFT_FREE        = 0xFF,
+        JFT_SIZE        = 20,       // Job File Table inside the PSP
+
+        PARENT_REGISTERS = 16,
+
+        CON_LINE_SIZE   = 128       // a line of cooked CON input, CR LF too
+    };
+
+    typedef std::function <int ()> ServiceHandler;
+
+    // one slot of the interrupt vector table or of the INT 21h function
+    // table; a slot without a handler counts hits for reportUnhandled()
+    struct Service {
+        char const      *Name;
+        ServiceHandler   Handler;
+        uint64_t         Hits;
+    };
+
+    // System File Table entry; every handle in every JFT that refers to
+    // it holds a reference, free entries are chained through NextFree
+    struct SFTEntry {
+        std::shared_ptr <DOSFile>   File;
+        uint16_t                    RefCount;
+        uint8_t                     Mode;       // AL of OPEN
+        int                         NextFree;
+    };
+
+    // input polls that found nothing, from one place in the guest
+    enum {
+        POLL_THRESHOLD    = 32,         // within POLL_WINDOW_NANOS, to park
+        POLL_WINDOW_NANOS = 50000000
+    };
+
+    struct PollSite {
+        uint64_t    Since;
+        uint32_t    Count;
+    };
+
+    // a program waiting in EXEC for its child to terminate, and the
+    // registers of its INT 21h call, which resumes then
+    struct Parent {
+        uint16_t    PSP;
+        uint16_t    DTASegment;
+        uint16_t    DTAOffset;
+        uint32_t    Registers[PARENT_REGISTERS];
     };
 
 private:
     char                *_memory;
+    GuestMemory          _mem;
+    MemoryArena          _arena;
+    ProgramCache         _programs;
     hv_vcpuid_t          _vcpu;
-    std::map <int, int>  _fdtable;
-    std::vector <bool>   _fdbits;
-    uint16_t             _dta;
+    RegisterFile         _regs;
+    VirtualClock         _clock;
+    BIOS                 _bios;
+    TextScreen           _screen;
+    Stats                _stats;
+    Trace                _trace;
+    FileSystem           _fs;
+    std::shared_ptr <ConsoleDevice>             _console;
+    std::vector <std::shared_ptr <DOSDevice>>   _devices;
+    std::shared_ptr <DOSFile>                   _standard[4];   // SFT 0-3
+    SFTEntry             _sft[SFT_SIZE];
+    int                  _sftFree;
+    uint16_t             _psp;
+    uint16_t             _dtaSegment;
+    uint16_t             _dtaOffset;
     int                  _exitStatus;
+    uint16_t             _returnCode;           // of the last child, AH=4D
+    std::vector <Parent> _parents;              // innermost last
+    int                  _snapshotFunction;     // -1 when not armed
+    std::unordered_map <uint32_t, PollSite>     _pollSites;     // by CS:IP
+    uint8_t              _extendedScan;         // for the next AH=01/06/07/08
+    std::string          _conLine;              // rest of a line read from CON
+    Service              _vectors[256];
+    Service              _dosFunctions[256];
 
 public:
-    DOSKernel(char *memory, hv_vcpuid_t vcpu, int argc, char **argv);
+    DOSKernel(char *memory, hv_vcpuid_t vcpu);
     ~DOSKernel();
 
+public:
+    // a fresh machine: BIOS, the MCB chain with all of memory given to the
+    // program, and its PSP in guest memory
+    void boot(int argc, char **argv);
+
 public:
     int dispatch(uint8_t IntNo);
+    int trap();
+    void tick();
+    void tickDevices();
+    void flushConsole();
+
+    // HLT and RDTSC exits, which the guest resumes after
+    int halt();
+    void readTimeStampCounter();
+
+    // the program to run in the PSP built at startup, and its registers
+    bool loadProgram(char const *Path);
+
+    // AL of the program's EXIT, 0 after INT 20h
+    int exitStatus() const { return _exitStatus; }
+
+    GuestMemory &memory() { return _mem; }
+    RegisterFile &registers() { return _regs; }
+    RegisterFile const &registers() const { return _regs; }
+    BIOS &bios() { return _bios; }
+    VirtualClock &clock() { return _clock; }
+    VirtualClock const &clock() const { return _clock; }
+    ConsoleDevice &console() { return *_console; }
+    TextScreen &screen() { return _screen; }
+    FileSystem &fileSystem() { return _fs; }
+    FileSystem const &fileSystem() const { return _fs; }
+    ProgramCache const &programs() const { return _programs; }
+
+    Stats &stats() { return _stats; }
+    Trace &trace() { return _trace; }
+
+public:
+    // host-side state of a booted machine, whose guest memory and vCPU
+    // are saved alongside; false with errno EBUSY if a host file is open
+    bool save(VMSnapshot &Snapshot) const;
+
+    // instead of boot(), with the same drives mounted; false with errno set
+    bool restore(VMSnapshot &Snapshot);
+
+    // have trap() return STATUS_SNAPSHOT at the next INT 21h with AH =
+    // Function, before it runs; resuming the guest repeats the call
+    void armSnapshot(uint8_t Function) { _snapshotFunction = Function; }
+
+public:
+    void registerInterrupt(uint8_t IntNo, char const *Name,
+            ServiceHandler Handler);
+    void registerDOSFunction(uint8_t Func, char const *Name,
+            ServiceHandler Handler);
+
+    Service const &interrupt(uint8_t IntNo) const { return _vectors[IntNo]; }
+    Service const &dosFunction(uint8_t Func) const
+        { return _dosFunctions[Func]; }
+
+    void reportUnhandled(FILE *F) const;
 
 private:
+    void registerBuiltins();
+    int callService(Service &S, Stats::Entry &E, uint32_t Category,
+            uint8_t IntNo);
+    void returnFromTrap(uint16_t Result);
+    void callerAddress(uint16_t &CS, uint16_t &IP);
+    void start(uint16_t CodeSegment, uint16_t CodeOffset,
+            uint16_t StackSegment, uint16_t StackOffset);
+
+private:
+    int int10();
+    int int15();
+    int int16();
+    int int1A();
     int int20();
     int int21();
 
 private:
+    int int21Func01();
     int int21Func02();
+    int int21Func06();
+    int int21Func07();
     int int21Func08();
     int int21Func09();
     int int21Func0A();
+    int int21Func0B();
     int int21Func0C();
     int int21Func0E();
     int int21Func19();
     int int21Func1A();
     int int21Func25();
     int int21Func26();
+    int int21Func2A();
+    int int21Func2B();
+    int int21Func2C();
+    int int21Func2D();
     int int21Func30();
     int int21Func33();
     int int21Func35();
+    int int21Func3B();
     int int21Func3C();
     int int21Func3D();
     int int21Func3E();
@@ -60,32 +235,56 @@ private:
     int int21Func41();
     int int21Func42();
     int int21Func43();
+    int int21Func45();
+    int int21Func46();
+    int int21Func47();
+    int int21Func48();
+    int int21Func49();
+    int int21Func4A();
+    int int21Func4B();
     int int21Func4C();
+    int int21Func4D();
     int int21Func4E();
     int int21Func4F();
     int int21Func57();
+    int int21Func58();
+    int int21Func67();
 
 private:
+    int findNext();
     int getDOSError() const;
     void makePSP(uint16_t seg, int argc, char **argv);
+    void initPSP(uint16_t Segment, uint16_t End, uint16_t Parent);
 
+    std::shared_ptr <ProgramImage> openProgram(char const *FileName);
+    bool makeEnvironment(uint16_t Source, char const *FileName,
+            uint16_t &Segment);
+    int exec(uint8_t Mode, char const *FileName);
+    int terminate(uint8_t Code);
 private:
     void flushConsoleInput();
-    int internalGetChar(bool Echo);
+    uint16_t readKey();
+    uint8_t readChar(bool Echo);
+    size_t editLine(char *Line, size_t Max);
+    ssize_t readConsole(char *Buffer, size_t Length);
+    bool inputReady();
 
 private:
-    int allocFD(int HostFD);
-    void deallocFD(int FD);
+    std::shared_ptr <DOSDevice> findDevice(char const *FileName) const;
+    int openFile(char const *FileName, int Flags, mode_t Mode,
+            uint8_t NoInherit = 0);
 
-    int findFD(int FD);
+    int allocSFT(std::shared_ptr <DOSFile> const &File, uint8_t Mode);
+    int releaseSFT(int Index);
 
-private:
-    void writeMem(uint16_t const &Address, void const *Bytes,
-            size_t Length);
-    std::string readString(uint16_t const &Address, size_t Length);
-    std::string readCString(uint16_t const &Address,
-            char Terminator = '\0');
+    uint8_t *jobFileTable(uint16_t &Size);
+    void jobFileTableWritten(uint8_t const *Entry, size_t Count);
+    int allocHandle(int Index);
+    int sftIndex(int Handle);
+    DOSFile *findFD(int Handle);
 
+private:
+    bool readFileName(char (&FileName)[PATH_SIZE]);
 };
 
 #endif  // !__DOSKernel_h
@@ -0,0 +1,1132 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "FileSystem.h"
+#include "PackedImage.h"
+
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#else
+#include <sys/event.h>
+#endif
+
+namespace {
+
+inline void
+AppendComponent(std::string &Path, std::string const &Name)
+{
+    if (Path.empty() || Path[Path.size() - 1] != '/')
+        Path += '/';
+    Path += Name;
+}
+
+}
+
+FileSystem::FileSystem() :
+    _quota       (DEFAULT_QUOTA),
+    _counters    (),
+    _current     (DEFAULT_DRIVE),
+    _nextSnapshot(0)
+{
+#if defined(__linux__)
+    _notify = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+    _notify = ::kqueue();
+#endif
+
+    _root.Type = DT_DIR;
+    _root.Mode = S_IFDIR | 0755;
+
+    // C: is the directory hvdos was started in
+    mount(DEFAULT_DRIVE, ".");
+}
+
+FileSystem::~FileSystem()
+{
+    while (!_directories.empty())
+        invalidate(_directories.begin()->first);
+
+    if (_notify >= 0)
+        ::close(_notify);
+}
+
+bool FileSystem::
+mount(int Drive, char const *HostRoot)
+{
+    char Path[PATH_MAX];
+    struct stat ST;
+
+    if (Drive < 0 || Drive >= DRIVE_COUNT) {
+        errno = EINVAL;
+        return false;
+    }
+    if (::realpath(HostRoot, Path) == nullptr || ::stat(Path, &ST) != 0)
+        return false;
+    if (!S_ISDIR(ST.st_mode)) {
+        errno = ENOTDIR;
+        return false;
+    }
+
+    _drives[Drive].HostRoot = Path;
+    _drives[Drive].Memory.reset();
+    _drives[Drive].Image.reset();
+    _drives[Drive].Cwd.clear();
+    return true;
+}
+
+bool FileSystem::
+mountMemory(int Drive)
+{
+    if (Drive < 0 || Drive >= DRIVE_COUNT) {
+        errno = EINVAL;
+        return false;
+    }
+
+    _drives[Drive].HostRoot.clear();
+    _drives[Drive].Memory.reset(new MemoryDrive(&_quota, &_clock));
+    _drives[Drive].Image.reset();
+    _drives[Drive].Cwd.clear();
+    return true;
+}
+
+bool FileSystem::
+mountOverlay(int Drive, char const *HostRoot)
+{
+    if (!mount(Drive, HostRoot))
+        return false;
+
+    _drives[Drive].Memory.reset(new MemoryDrive(&_quota, &_clock));
+    return true;
+}
+
+bool FileSystem::
+mountImage(int Drive, char const *ImagePath)
+{
+    if (Drive < 0 || Drive >= DRIVE_COUNT) {
+        errno = EINVAL;
+        return false;
+    }
+
+    std::shared_ptr <PackedImage> Image(new PackedImage);
+    if (!Image->open(ImagePath))
+        return false;
+
+    _drives[Drive].HostRoot.clear();
+    _drives[Drive].Memory.reset();
+    _drives[Drive].Image = Image;
+    _drives[Drive].Cwd.clear();
+    return true;
+}
+
+// deleted names first, so that a file deleted and created again is written
+bool FileSystem::
+commit()
+{
+    bool        Result = true;
+    std::string HostPath;
+
+    for (int Drive = 0; Drive < DRIVE_COUNT; Drive++) {
+        MemoryDrive *Memory = _drives[Drive].Memory.get();
+        if (Memory == nullptr || _drives[Drive].HostRoot.empty())
+            continue;
+
+        for (auto const &W : Memory->whiteouts()) {
+            poll();
+            _path = W;
+            _last.clear();
+            if (lookup(Drive, HostPath) != nullptr &&
+                    ::unlink(HostPath.c_str()) != 0)
+                Result = false;
+        }
+
+        for (auto const &I : Memory->nodes()) {
+            poll();
+            _path = I.first;
+            _last = I.second.Name;
+            if (lookup(Drive, HostPath) == nullptr && errno != ENOENT) {
+                Result = false;
+                continue;
+            }
+
+            std::vector <char> const &Bytes = I.second.Data->Bytes;
+            int FD = ::open(HostPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                    0666);
+            if (FD < 0) {
+                Result = false;
+                continue;
+            }
+
+            size_t Done = 0;
+            while (Done < Bytes.size()) {
+                ssize_t Count = ::write(FD, &Bytes[Done], Bytes.size() - Done);
+                if (Count < 0 && errno == EINTR)
+                    continue;
+                if (Count <= 0) {
+                    Result = false;
+                    break;
+                }
+                Done += Count;
+            }
+            if (::close(FD) != 0)
+                Result = false;
+        }
+    }
+
+    return Result;
+}
+
+bool FileSystem::
+setCurrentDrive(int Drive)
+{
+    if (!mapped(Drive))
+        return false;
+
+    _current = Drive;
+    return true;
+}
+
+// AH=3C/3D: host files are opened read-only (ReadOnlyFile) or read-write
+// (HostFile); on an overlay, opening a host file for writing copies it up
+std::shared_ptr <DOSFile> FileSystem::
+open(char const *Name, int Flags, mode_t Mode)
+{
+    int         Drive;
+    std::string HostPath;
+    bool        Writable = (Flags & O_ACCMODE) != O_RDONLY;
+
+    poll();
+    if (!canonicalize(Name, Drive))
+        return nullptr;
+
+    struct Drive &D      = _drives[Drive];
+    MemoryDrive  *Memory = D.Memory.get();
+
+    if (D.Image) {
+        int Index = _path.empty() ? -1 : D.Image->find(_path);
+        if (Writable || (Flags & (O_CREAT | O_TRUNC)) != 0 ||
+                (Index >= 0 && D.Image->isDirectory(Index)) ||
+                _path.empty()) {
+            errno = EACCES;
+            return nullptr;
+        }
+        if (Index < 0) {
+            errno = ENOENT;
+            return nullptr;
+        }
+        return std::make_shared <PackedFile> (D.Image, Index);
+    }
+
+    if (Memory == nullptr) {
+        Entry *E = lookup(Drive, HostPath);
+        if (E == nullptr && (errno != ENOENT || (Flags & O_CREAT) == 0))
+            return nullptr;
+        if (E != nullptr && isDirectoryAt(HostPath, *E)) {
+            errno = EACCES;
+            return nullptr;
+        }
+        return openHost(HostPath, Flags, Mode);
+    }
+
+    if (_path.empty()) {
+        errno = EACCES;
+        return nullptr;
+    }
+
+    MemoryDrive::Node *N = Memory->find(_path);
+    if (N == nullptr) {
+        bool Lower = false;
+
+        if (!D.HostRoot.empty()) {
+            Entry *E = lookup(Drive, HostPath);
+            if (E == nullptr && errno != ENOENT)
+                return nullptr;
+            if (E != nullptr && !Memory->isWhiteout(_path)) {
+                if (isDirectoryAt(HostPath, *E)) {
+                    errno = EACCES;
+                    return nullptr;
+                }
+                Lower = true;
+            }
+        } else if (_path.find('\\') != std::string::npos) {
+            // a RAM drive has no subdirectories
+            errno = ENOTDIR;
+            return nullptr;
+        }
+
+        if (Lower && !Writable)
+            return openHost(HostPath, Flags, Mode);
+        if (!Lower && (Flags & O_CREAT) == 0) {
+            errno = ENOENT;
+            return nullptr;
+        }
+
+        std::string Path(_path);
+        N = Memory->create(Path, _last);
+        if (Lower && (Flags & O_TRUNC) == 0 && !copyUp(HostPath, *N->Data)) {
+            int Error = errno;
+            Memory->remove(Path);
+            errno = Error;
+            return nullptr;
+        }
+    } else if ((Flags & O_TRUNC) != 0) {
+        N->Data->resize(0);
+        N->Data->touch();
+    }
+
+    return std::make_shared <MemoryFile> (N->Data, Writable);
+}
+
+bool FileSystem::
+fullName(char const *Name, std::string &FullName)
+{
+    int Drive;
+    if (!canonicalize(Name, Drive))
+        return false;
+
+    FullName.assign(1, 'A' + Drive);
+    FullName += ":\\";
+    FullName += _path;
+    return true;
+}
+
+bool FileSystem::
+hostFile(char const *Name, std::string &HostPath)
+{
+    int Drive;
+
+    poll();
+    if (!canonicalize(Name, Drive))
+        return false;
+
+    struct Drive &D      = _drives[Drive];
+    MemoryDrive  *Memory = D.Memory.get();
+    if (D.HostRoot.empty() || _path.empty() || (Memory != nullptr &&
+                (Memory->find(_path) != nullptr ||
+                 Memory->isWhiteout(_path)))) {
+        errno = ENOENT;
+        return false;
+    }
+
+    Entry *E = lookup(Drive, HostPath);
+    if (E == nullptr)
+        return false;
+    if (isDirectoryAt(HostPath, *E)) {
+        errno = EISDIR;
+        return false;
+    }
+    return true;
+}
+
+// AH=41: on an overlay, a host file is hidden behind a whiteout
+bool FileSystem::
+unlink(char const *Name)
+{
+    int         Drive;
+    std::string HostPath;
+
+    poll();
+    if (!canonicalize(Name, Drive))
+        return false;
+
+    struct Drive &D      = _drives[Drive];
+    MemoryDrive  *Memory = D.Memory.get();
+    Entry        *E      = nullptr;
+
+    if (D.Image) {
+        errno = EACCES;
+        return false;
+    }
+
+    if (!D.HostRoot.empty()) {
+        E = lookup(Drive, HostPath);
+        if (E == nullptr && errno != ENOENT)
+            return false;
+        if (E != nullptr && Memory != nullptr && Memory->isWhiteout(_path))
+            E = nullptr;
+        if (E != nullptr && (E == &_root || isDirectoryAt(HostPath, *E))) {
+            errno = EACCES;
+            return false;
+        }
+    }
+
+    if (Memory == nullptr) {
+        if (E == nullptr) {
+            errno = ENOENT;
+            return false;
+        }
+        return ::unlink(HostPath.c_str()) == 0;
+    }
+
+    bool Removed = Memory->remove(_path);
+    if (E != nullptr) {
+        Memory->whiteout(_path);
+        Removed = true;
+    }
+    if (!Removed)
+        errno = ENOENT;
+    return Removed;
+}
+
+// AH=43 AL=0
+bool FileSystem::
+attributes(char const *Name, uint8_t &Attributes)
+{
+    int         Drive;
+    std::string HostPath;
+
+    poll();
+    if (!canonicalize(Name, Drive))
+        return false;
+
+    struct Drive &D      = _drives[Drive];
+    MemoryDrive  *Memory = D.Memory.get();
+
+    if (_path.empty()) {
+        Attributes = ATTR_DIRECTORY;
+        return true;
+    }
+
+    if (D.Image) {
+        int Index = D.Image->find(_path);
+        if (Index < 0) {
+            errno = ENOENT;
+            return false;
+        }
+        Attributes = D.Image->entry(Index).Attributes;
+        return true;
+    }
+
+    if (Memory != nullptr) {
+        if (MemoryDrive::Node *N = Memory->find(_path)) {
+            Attributes = N->Data->Attributes;
+            return true;
+        }
+        if (D.HostRoot.empty() || Memory->isWhiteout(_path)) {
+            errno = ENOENT;
+            return false;
+        }
+    }
+
+    Entry *E = lookup(Drive, HostPath);
+    if (E == nullptr)
+        return false;
+
+    mode_t Mode = modeAt(HostPath, *E);
+    if (Mode == 0)
+        return false;
+
+    Attributes = modeAttributes(Mode);
+    return true;
+}
+
+// AH=3B: the new directory is kept as a DOS path on its drive
+bool FileSystem::
+chdir(char const *Name)
+{
+    int         Drive;
+    std::string HostPath;
+
+    poll();
+    if (!canonicalize(Name, Drive))
+        return false;
+
+    if (!_path.empty() && _drives[Drive].Image) {
+        int Index = _drives[Drive].Image->find(_path);
+        if (Index < 0 || !_drives[Drive].Image->isDirectory(Index)) {
+            errno = (Index < 0) ? ENOENT : ENOTDIR;
+            return false;
+        }
+    } else if (!_path.empty()) {
+        if (_drives[Drive].HostRoot.empty()) {
+            errno = ENOENT;
+            return false;
+        }
+
+        Entry *E = lookup(Drive, HostPath);
+        if (E == nullptr)
+            return false;
+        if (!isDirectoryAt(HostPath, *E)) {
+            errno = ENOTDIR;
+            return false;
+        }
+    }
+
+    _drives[Drive].Cwd = _path;
+    return true;
+}
+
+// AH=47: Drive is 0 for the default drive, 1 for A: and so on
+bool FileSystem::
+getcwd(int Drive, char *Buffer, size_t Size) const
+{
+    Drive = (Drive == 0) ? _current : Drive - 1;
+    if (!mapped(Drive)) {
+        errno = ENODEV;
+        return false;
+    }
+
+    std::string const &Cwd = _drives[Drive].Cwd;
+    if (Cwd.size() >= Size) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    std::memcpy(Buffer, Cwd.c_str(), Cwd.size() + 1);
+    return true;
+}
+
+// a snapshot of an overlay directory is the upper layer's files over the
+// host's, less the whiteouts
+uint32_t FileSystem::
+snapshot(char const *Name)
+{
+    int         Drive;
+    std::string Key;
+    time_t      MTime = 0;
+
+    poll();
+    if (!canonicalize(Name, Drive))
+        return 0;
+
+    struct Drive &D      = _drives[Drive];
+    MemoryDrive  *Memory = D.Memory.get();
+    bool          IsRoot = _path.empty();
+    int           Index  = -1;
+
+    if (!D.HostRoot.empty()) {
+        Entry *E = lookup(Drive, Key);
+        if (E == nullptr || !isDirectoryAt(Key, *E)) {
+            errno = ENOTDIR;
+            return 0;
+        }
+
+        struct stat ST;
+        if (::stat(Key.c_str(), &ST) != 0)
+            return 0;
+        MTime = ST.st_mtime;
+    } else if (D.Image) {
+        Index = IsRoot ? -1 : D.Image->find(_path);
+        if (!IsRoot && (Index < 0 || !D.Image->isDirectory(Index))) {
+            errno = ENOTDIR;
+            return 0;
+        }
+        Key.assign(1, 'A' + Drive);
+        Key += ':';
+        Key += _path;
+    } else if (!IsRoot) {
+        errno = ENOTDIR;
+        return 0;
+    } else {
+        Key.assign(1, 'A' + Drive);
+        Key += ':';
+    }
+
+    uint64_t Generation = (Memory != nullptr) ? Memory->generation() : 0;
+    for (auto const &I : _snapshots) {
+        Snapshot const &S = I.second;
+        if (!S.Stale && S.MTime == MTime && S.Generation == Generation &&
+                S.Key == Key)
+            return I.first;
+    }
+
+    // the oldest snapshot goes, along with any search still using it
+    if (_snapshots.size() >= MAX_SNAPSHOTS)
+        _snapshots.erase(_snapshots.begin());
+
+    uint32_t Id = ++_nextSnapshot;
+    Snapshot &S = _snapshots[Id];
+    S.Key        = Key;
+    S.MTime      = MTime;
+    S.Generation = Generation;
+    S.Stale      = false;
+
+    // an image's listing is already sorted and needs no copy
+    if (D.Image) {
+        S.Image = D.Image;
+        S.List  = D.Image->list(Index, S.Count);
+        return Id;
+    }
+
+    if (Memory != nullptr)
+        memoryEntries(*Memory, _path, S.Entries);
+    if (!D.HostRoot.empty())
+        readSnapshot(S, IsRoot, Memory, _path);
+    sortEntries(S.Entries);
+    S.List  = S.Entries.data();
+    S.Count = S.Entries.size();
+    return Id;
+}
+
+FileSystem::SearchEntry const *FileSystem::
+entries(uint32_t Id, size_t &Count) const
+{
+    auto I = _snapshots.find(Id);
+    if (I == _snapshots.end()) {
+        Count = 0;
+        return nullptr;
+    }
+
+    Count = I->second.Count;
+    return I->second.List;
+}
+
+void FileSystem::
+touch()
+{
+    for (auto &I : _snapshots)
+        I.second.Stale = true;
+}
+
+uint8_t FileSystem::
+modeAttributes(mode_t Mode)
+{
+    uint8_t Attributes = 0;
+
+    if (S_ISDIR(Mode)) {
+        Attributes |= ATTR_DIRECTORY;
+    }
+    if ((Mode & S_IWUSR) == 0) {
+        Attributes |= ATTR_READONLY;
+    }
+
+    return Attributes;
+}
+
+// packed local time as in directory entries
+void FileSystem::
+dosTime(time_t Time, uint16_t &DOSTime, uint16_t &DOSDate)
+{
+    struct tm TM;
+
+    ::localtime_r(&Time, &TM);
+    DOSTime = (TM.tm_hour << 11) | (TM.tm_min << 5) | (TM.tm_sec / 2);
+    DOSDate = (std::max(TM.tm_year - 80, 0) << 9) | ((TM.tm_mon + 1) << 5) |
+        TM.tm_mday;
+}
+
+bool FileSystem::
+shortName(char const *HostName, char Template[11], char Name[13])
+{
+    static char const Invalid[] = " \"*+,/:;<=>?[\\]|";
+
+    char const *Dot = std::strchr(HostName, '.');
+    size_t BaseLength = Dot ? Dot - HostName : std::strlen(HostName);
+    size_t ExtLength  = Dot ? std::strlen(Dot + 1) : 0;
+
+    if (BaseLength == 0 || BaseLength > 8 || ExtLength > 3 ||
+            (Dot && std::strchr(Dot + 1, '.') != nullptr))
+        return false;
+
+    for (char const *P = HostName; *P != '\0'; P++) {
+        uint8_t C = *P;
+        if (C < 0x20 || (C != '.' && std::strchr(Invalid, C) != nullptr))
+            return false;
+    }
+
+    makeTemplate(HostName, Template);
+
+    size_t N = 0;
+    for (size_t i = 0; i < BaseLength; i++)
+        Name[N++] = std::toupper(static_cast <uint8_t> (HostName[i]));
+    if (ExtLength != 0) {
+        Name[N++] = '.';
+        for (size_t i = 0; i < ExtLength; i++)
+            Name[N++] = std::toupper(static_cast <uint8_t> (Dot[1 + i]));
+    }
+    Name[N] = '\0';
+    return true;
+}
+
+void FileSystem::
+makeTemplate(char const *Name, char Template[11])
+{
+    std::memset(Template, ' ', 11);
+
+    // "." and ".." are names of their own
+    if (std::strcmp(Name, ".") == 0 || std::strcmp(Name, "..") == 0) {
+        std::memcpy(Template, Name, std::strlen(Name));
+        return;
+    }
+
+    size_t i = 0;
+    for (; *Name != '\0' && *Name != '.'; Name++) {
+        if (*Name == '*') {
+            for (; i < 8; i++)
+                Template[i] = '?';
+        } else if (i < 8) {
+            Template[i++] = std::toupper(static_cast <uint8_t> (*Name));
+        }
+    }
+
+    if (*Name++ != '.')
+        return;
+
+    for (i = 8; *Name != '\0'; Name++) {
+        if (*Name == '*') {
+            for (; i < 11; i++)
+                Template[i] = '?';
+        } else if (i < 11) {
+            Template[i++] = std::toupper(static_cast <uint8_t> (*Name));
+        }
+    }
+}
+
+bool FileSystem::
+matches(char const *Pattern, char const *Template)
+{
+    for (int i = 0; i < 11; i++) {
+        if (Pattern[i] != '?' && Pattern[i] != Template[i])
+            return false;
+    }
+    return true;
+}
+
+bool FileSystem::
+mapped(int Drive) const
+{
+    return Drive >= 0 && Drive < DRIVE_COUNT &&
+        (!_drives[Drive].HostRoot.empty() || _drives[Drive].Memory ||
+         _drives[Drive].Image);
+}
+
+// drive and absolute, uppercase DOS path of Name into _path; the last
+// component as the program spelled it into _last
+bool FileSystem::
+canonicalize(char const *Name, int &Drive)
+{
+    Drive = _current;
+    if (Name[0] != '\0' && Name[1] == ':') {
+        Drive = std::toupper(static_cast <uint8_t> (Name[0])) - 'A';
+        Name += 2;
+    }
+    if (!mapped(Drive)) {
+        errno = ENODEV;
+        return false;
+    }
+
+    if (*Name == '\\' || *Name == '/')
+        _path.clear();
+    else
+        _path = _drives[Drive].Cwd;
+    _last.clear();
+
+    while (*Name != '\0') {
+        char const *End = Name;
+        while (*End != '\0' && *End != '\\' && *End != '/')
+            End++;
+
+        size_t Length = End - Name;
+        if (Length == 0 || (Length == 1 && Name[0] == '.')) {
+            // empty or current directory
+        } else if (Length == 2 && Name[0] == '.' && Name[1] == '.') {
+            size_t Slash = _path.rfind('\\');
+            _path.erase((Slash == std::string::npos) ? 0 : Slash);
+            _last.clear();
+        } else {
+            if (!_path.empty())
+                _path += '\\';
+            for (size_t i = 0; i < Length; i++)
+                _path += std::toupper(static_cast <uint8_t> (Name[i]));
+            _last.assign(Name, Length);
+        }
+
+        Name = (*End != '\0') ? End + 1 : End;
+    }
+
+    return true;
+}
+
+// index entry of _path on a drive's host directory, &_root for its root;
+// nullptr with errno ENOENT and the path a new file would get in HostPath
+// if only the last component is missing
+FileSystem::Entry *FileSystem::
+lookup(int Drive, std::string &HostPath)
+{
+    HostPath = _drives[Drive].HostRoot;
+
+    Entry  *E     = &_root;
+    size_t  Start = 0;
+    while (Start < _path.size()) {
+        size_t End = _path.find('\\', Start);
+        if (End == std::string::npos)
+            End = _path.size();
+        bool IsLast = (End == _path.size());
+
+        // HostPath is a directory, look the next component up in its index
+        _key.assign(_path, Start, End - Start);
+        Directory *D = directory(HostPath);
+        auto       I = (D != nullptr) ? D->Names.find(_key) :
+            std::unordered_map <std::string, Entry>::iterator();
+
+        if (D == nullptr || I == D->Names.end()) {
+            if (!IsLast) {
+                errno = ENOTDIR;
+                return nullptr;
+            }
+            AppendComponent(HostPath, _last.empty() ? _key : _last);
+            errno = ENOENT;
+            return nullptr;
+        }
+
+        E = &I->second;
+        if (!IsLast && !isDirectory(HostPath, *E)) {
+            errno = ENOTDIR;
+            return nullptr;
+        }
+        AppendComponent(HostPath, E->HostName);
+        Start = End + 1;
+    }
+
+    return E;
+}
+
+FileSystem::Directory *FileSystem::
+directory(std::string const &HostDir)
+{
+    auto I = _directories.find(HostDir);
+    if (I != _directories.end())
+        return &I->second;
+
+    DIR *DP = ::opendir(HostDir.c_str());
+    if (DP == nullptr)
+        return nullptr;
+
+    if (_directories.size() >= MAX_DIRECTORIES) {
+        while (!_directories.empty())
+            invalidate(_directories.begin()->first);
+    }
+
+    Directory &D = _directories[HostDir];
+    D.Watch = watch(HostDir);
+
+    while (struct dirent *DE = ::readdir(DP)) {
+        if (std::strcmp(DE->d_name, ".") == 0 ||
+                std::strcmp(DE->d_name, "..") == 0)
+            continue;
+
+        std::string Key(DE->d_name);
+        for (auto &C : Key)
+            C = std::toupper(static_cast <uint8_t> (C));
+
+        // of several spellings, the all-uppercase one wins
+        Entry E = { DE->d_name, DE->d_type, 0 };
+        auto  R = D.Names.emplace(Key, E);
+        if (!R.second && Key == DE->d_name)
+            R.first->second = E;
+    }
+    ::closedir(DP);
+
+    // an index nobody tells us about changes to can only be used once
+    if (D.Watch < 0) {
+        static Directory Unwatched;
+        Unwatched = std::move(D);
+        _directories.erase(HostDir);
+        return &Unwatched;
+    }
+
+    return &D;
+}
+
+std::shared_ptr <DOSFile> FileSystem::
+openHost(std::string const &HostPath, int Flags, mode_t Mode)
+{
+    int FD = ::open(HostPath.c_str(), Flags, Mode);
+    if (FD < 0)
+        return nullptr;
+
+    if ((Flags & O_ACCMODE) == O_RDONLY)
+        return std::make_shared <ReadOnlyFile> (FD, &_counters);
+    return std::make_shared <HostFile> (FD, &_counters);
+}
+
+// the contents of a host file into the upper layer, ENOSPC if they do not
+// fit the quota
+bool FileSystem::
+copyUp(std::string const &HostPath, MemoryDrive::File &Data)
+{
+    int FD = ::open(HostPath.c_str(), O_RDONLY);
+    if (FD < 0)
+        return false;
+
+    struct stat ST;
+    bool        Result = ::fstat(FD, &ST) == 0;
+    if (Result && !Data.resize(ST.st_size)) {
+        errno  = ENOSPC;
+        Result = false;
+    }
+
+    size_t Done = 0;
+    while (Result && Done < Data.Bytes.size()) {
+        ssize_t Count = ::pread(FD, &Data.Bytes[Done],
+                Data.Bytes.size() - Done, Done);
+        if (Count < 0 && errno == EINTR)
+            continue;
+        if (Count <= 0) {
+            // the file shrank under us
+            Result = (Count == 0) && Data.resize(Done);
+            break;
+        }
+        Done += Count;
+    }
+
+    if (Result) {
+        Data.Attributes = modeAttributes(ST.st_mode);
+        dosTime(ST.st_mtime, Data.Time, Data.Date);
+    }
+
+    ::close(FD);
+    return Result;
+}
+
+mode_t FileSystem::
+mode(std::string const &HostDir, Entry &E)
+{
+    if (E.Mode == 0) {
+        std::string Path(HostDir);
+        struct stat ST;
+
+        AppendComponent(Path, E.HostName);
+        if (::stat(Path.c_str(), &ST) == 0)
+            E.Mode = ST.st_mode;
+    }
+    return E.Mode;
+}
+
+bool FileSystem::
+isDirectory(std::string const &HostDir, Entry &E)
+{
+    if (E.Type == DT_DIR)
+        return true;
+    if (E.Type == DT_REG)
+        return false;
+
+    // symbolic links and file systems without d_type
+    return S_ISDIR(mode(HostDir, E));
+}
+
+// the same for an entry lookup() returned, by its own host path
+mode_t FileSystem::
+modeAt(std::string const &HostPath, Entry &E)
+{
+    if (&E == &_root)
+        return _root.Mode;
+    return mode(std::string(HostPath, 0, HostPath.rfind('/')), E);
+}
+
+bool FileSystem::
+isDirectoryAt(std::string const &HostPath, Entry &E)
+{
+    if (&E == &_root)
+        return true;
+    return isDirectory(std::string(HostPath, 0, HostPath.rfind('/')), E);
+}
+
+// every 8.3 name in S.Key not whited out in Upper, with one stat() each
+void FileSystem::
+readSnapshot(Snapshot &S, bool IsRoot, MemoryDrive const *Upper,
+        std::string const &Dir)
+{
+    std::string Path;
+
+    DIR *DP = ::opendir(S.Key.c_str());
+    if (DP == nullptr)
+        return;
+
+    while (struct dirent *DE = ::readdir(DP)) {
+        bool        IsDot = std::strcmp(DE->d_name, ".") == 0 ||
+                            std::strcmp(DE->d_name, "..") == 0;
+        SearchEntry E;
+        struct stat ST;
+
+        if (IsDot) {
+            // a root directory has no "." and ".." in DOS
+            if (IsRoot)
+                continue;
+            makeTemplate(DE->d_name, E.Template);
+            std::strcpy(E.Name, DE->d_name);
+        } else if (!shortName(DE->d_name, E.Template, E.Name)) {
+            continue;
+        }
+
+        if (Upper != nullptr && !IsDot) {
+            Path = Dir;
+            if (!Path.empty())
+                Path += '\\';
+            Path += E.Name;
+            if (Upper->isWhiteout(Path))
+                continue;
+        }
+
+        if (::fstatat(::dirfd(DP), DE->d_name, &ST, 0) != 0)
+            continue;
+
+        E.Attributes = modeAttributes(ST.st_mode);
+        E.Size       = S_ISDIR(ST.st_mode) ? 0 :
+            static_cast <uint32_t> (std::min <off_t> (ST.st_size, UINT32_MAX));
+        dosTime(ST.st_mtime, E.Time, E.Date);
+        S.Entries.push_back(E);
+    }
+    ::closedir(DP);
+}
+
+// the files of a MemoryDrive directory
+void FileSystem::
+memoryEntries(MemoryDrive const &Memory, std::string const &Dir,
+        SearchEntries &Entries)
+{
+    std::string Prefix(Dir);
+    if (!Prefix.empty())
+        Prefix += '\\';
+
+    MemoryDrive::Nodes const &Nodes = Memory.nodes();
+    for (auto I = Nodes.lower_bound(Prefix); I != Nodes.end() &&
+            I->first.compare(0, Prefix.size(), Prefix) == 0; ++I) {
+        char const *Name = I->first.c_str() + Prefix.size();
+        SearchEntry E;
+
+        if (std::strchr(Name, '\\') != nullptr ||
+                !shortName(Name, E.Template, E.Name))
+            continue;
+
+        MemoryDrive::File const &F = *I->second.Data;
+        E.Attributes = F.Attributes;
+        E.Time       = F.Time;
+        E.Date       = F.Date;
+        E.Size       = static_cast <uint32_t>
+            (std::min <size_t> (F.Bytes.size(), UINT32_MAX));
+        Entries.push_back(E);
+    }
+}
+
+// sorted by template; of entries with the same DOS name, the first one
+// added is kept
+void FileSystem::
+sortEntries(SearchEntries &Entries)
+{
+    std::stable_sort(Entries.begin(), Entries.end(),
+            [](SearchEntry const &A, SearchEntry const &B) {
+                return std::memcmp(A.Template, B.Template, 11) < 0;
+            });
+
+    // FOO.H and foo.h are the same DOS name
+    Entries.erase(std::unique(Entries.begin(), Entries.end(),
+                [](SearchEntry const &A, SearchEntry const &B) {
+                    return std::memcmp(A.Template, B.Template, 11) == 0;
+                }), Entries.end());
+    Entries.shrink_to_fit();
+}
+
+int FileSystem::
+watch(std::string const &HostDir)
+{
+    if (_notify < 0)
+        return -1;
+
+#if defined(__linux__)
+    int W = ::inotify_add_watch(_notify, HostDir.c_str(),
+            IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |
+            IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+#else
+    int W = ::open(HostDir.c_str(), O_EVTONLY);
+    if (W >= 0) {
+        struct kevent K;
+        EV_SET(&K, W, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+                NOTE_WRITE | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME |
+                NOTE_REVOKE, 0, nullptr);
+        if (::kevent(_notify, &K, 1, nullptr, 0, nullptr) < 0) {
+            ::close(W);
+            W = -1;
+        }
+    }
+#endif
+    if (W < 0)
+        return -1;
+
+    // the same directory under another name (symbolic links)
+    auto I = _watches.find(W);
+    if (I != _watches.end())
+        _directories.erase(I->second);
+
+    _watches[W] = HostDir;
+    return W;
+}
+
+// drop the index of every directory the host reported a change to
+void FileSystem::
+poll()
+{
+    if (_notify < 0 || _watches.empty())
+        return;
+
+#if defined(__linux__)
+    char Buffer[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t Length = ::read(_notify, Buffer, sizeof(Buffer));
+        if (Length <= 0)
+            break;
+
+        for (char *P = Buffer; P < Buffer + Length; ) {
+            struct inotify_event const *IE =
+                reinterpret_cast <struct inotify_event const *> (P);
+            auto I = _watches.find(IE->wd);
+            if (I != _watches.end())
+                invalidate(I->second);
+            P += sizeof(struct inotify_event) + IE->len;
+        }
+    }
+#else
+    struct kevent   Events[16];
+    struct timespec Zero = { 0, 0 };
+
+    for (;;) {
+        int Count = ::kevent(_notify, nullptr, 0, Events, 16, &Zero);
+        if (Count <= 0)
+            break;
+
+        for (int i = 0; i < Count; i++) {
+            auto I = _watches.find(static_cast <int> (Events[i].ident));
+            if (I != _watches.end())
+                invalidate(I->second);
+        }
+    }
+#endif
+}
+
+void FileSystem::
+invalidate(std::string const &HostDir)
+{
+    for (auto &S : _snapshots) {
+        if (S.second.Key == HostDir)
+            S.second.Stale = true;
+    }
+
+    auto I = _directories.find(HostDir);
+    if (I == _directories.end())
+        return;
+
+    int W = I->second.Watch;
+    if (W >= 0) {
+#if defined(__linux__)
+        ::inotify_rm_watch(_notify, W);
+#else
+        ::close(W);
+#endif
+        _watches.erase(W);
+    }
+    _directories.erase(I);
+}
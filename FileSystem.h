@@ -0,0 +1,214 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __FileSystem_h
+#define __FileSystem_h
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+
+#include "MemoryDrive.h"
+
+class PackedImage;
+
+//
+// Drive letters mapped to host directories, each with its own current
+// directory, and the resolver from DOS names to host paths.
+//
+// DOS names are case-insensitive. Every host directory the resolver walks
+// through is read once into an index from uppercase name to host name, so
+// FOO.H finds foo.h, and a probe for a name that does not exist needs no
+// syscall at all. File modes are stat()ed on first use and cached in the
+// index as well. A directory's index is dropped when the host reports a
+// change to it (inotify on Linux, kqueue elsewhere); notifications are
+// drained before every lookup.
+//
+// A drive can also be a RAM drive, or an overlay whose reads come from a
+// host directory and whose writes, creates and deletes stay in memory
+// (MemoryDrive) until commit() or exit. Memory drives share one quota.
+// A drive mounted from a PackedImage is read-only and never touches the
+// host file system after the image is mapped.
+//
+// FINDFIRST/FINDNEXT enumerate a snapshot of a directory: its 8.3 names,
+// sorted, with attributes, size and DOS date and time. A snapshot is
+// shared by every search of that directory until the directory changes;
+// searches refer to it by id, so one that is replaced stays readable
+// until MAX_SNAPSHOTS newer ones exist.
+//
+class FileSystem {
+public:
+    enum {
+        DRIVE_COUNT     = 26,
+        DEFAULT_DRIVE   = 2,        // C:
+        MAX_DIRECTORIES = 256,      // indexed directories before a flush
+        MAX_SNAPSHOTS   = 16,
+        DEFAULT_QUOTA   = 64 << 20  // bytes of all memory drives
+    };
+
+    enum {
+        ATTR_ARCHIVE      = (1 << 5),
+        ATTR_DIRECTORY    = (1 << 4),
+        ATTR_VOLUME_LABEL = (1 << 3),
+        ATTR_SYSTEM       = (1 << 2),
+        ATTR_HIDDEN       = (1 << 1),
+        ATTR_READONLY     = (1 << 0)
+    };
+
+    // one directory entry as FINDFIRST reports it, and as a PackedImage
+    // stores it
+#pragma pack(push, 1)
+    struct SearchEntry {
+        char            Template[11];   // "NAME    EXT", as in an FCB
+        char            Name[13];       // "NAME.EXT"
+        uint8_t         Attributes;
+        uint16_t        Time;
+        uint16_t        Date;
+        uint32_t        Size;
+    };
+#pragma pack(pop)
+
+    typedef std::vector <SearchEntry> SearchEntries;
+
+private:
+    struct Entry {
+        std::string     HostName;
+        uint8_t         Type;       // d_type from readdir()
+        mode_t          Mode;       // 0 until first stat()
+    };
+
+    struct Directory {
+        std::unordered_map <std::string, Entry>     Names;
+        int                                         Watch;
+    };
+
+    // HostRoot only: host directory; Memory only: RAM drive; both:
+    // overlay; Image: packed image
+    struct Drive {
+        std::string                     HostRoot;
+        std::unique_ptr <MemoryDrive>   Memory;
+        std::shared_ptr <PackedImage>   Image;
+        std::string                     Cwd;    // uppercase, '\\'-separated
+    };
+
+    struct Snapshot {
+        std::string     Key;        // host directory, or "X:" and the path
+        time_t          MTime;
+        uint64_t        Generation; // of the drive's MemoryDrive
+        bool            Stale;
+        SearchEntries   Entries;
+
+        // Entries, or a directory listing inside a PackedImage
+        std::shared_ptr <PackedImage>   Image;
+        SearchEntry const              *List;
+        size_t                          Count;
+    };
+
+private:
+    MemoryQuota                                     _quota;
+    MemoryDrive::Clock                              _clock;
+    DOSFile::Counters                               _counters;
+    Drive                                           _drives[DRIVE_COUNT];
+    int                                             _current;
+    std::unordered_map <std::string, Directory>     _directories;
+    std::unordered_map <int, std::string>           _watches;
+    int                                             _notify;
+    Entry                                           _root;
+    std::map <uint32_t, Snapshot>                   _snapshots;
+    uint32_t                                        _nextSnapshot;
+
+    // scratch strings, reused so that lookups do not allocate
+    std::string                                     _path;
+    std::string                                     _last;
+    std::string                                     _key;
+
+public:
+    FileSystem();
+    ~FileSystem();
+
+public:
+    bool mount(int Drive, char const *HostRoot);
+    bool mountMemory(int Drive);
+    bool mountOverlay(int Drive, char const *HostRoot);
+    bool mountImage(int Drive, char const *ImagePath);
+
+    void setQuota(size_t Bytes) { _quota.setLimit(Bytes); }
+    MemoryQuota const &quota() const { return _quota; }
+
+    // the dates of files written to RAM drives and overlays
+    void setClock(MemoryDrive::Clock const &Now) { _clock = Now; }
+
+    // what the host files opened so far have cost
+    DOSFile::Counters const &counters() const { return _counters; }
+
+    // write the upper layers of all overlays to the host
+    bool commit();
+
+    int currentDrive() const { return _current; }
+    bool setCurrentDrive(int Drive);
+
+    // nullptr or false with errno set on failure
+    std::shared_ptr <DOSFile> open(char const *Name, int Flags, mode_t Mode);
+    bool unlink(char const *Name);
+    bool attributes(char const *Name, uint8_t &Attributes);
+
+    // "X:\PATH\NAME.EXT" for Name; false with errno set
+    bool fullName(char const *Name, std::string &FullName);
+
+    // the host file that Name is, if it is one on a host directory or the
+    // lower layer of an overlay; false otherwise, with errno set
+    bool hostFile(char const *Name, std::string &HostPath);
+
+    bool chdir(char const *Name);
+    bool getcwd(int Drive, char *Buffer, size_t Size) const;
+
+public:
+    // id of a snapshot of the directory Name, 0 with errno set on failure
+    uint32_t snapshot(char const *Name);
+    SearchEntry const *entries(uint32_t Id, size_t &Count) const;
+
+    // files may have changed size: the next FINDFIRST takes new snapshots
+    void touch();
+
+    static uint8_t modeAttributes(mode_t Mode);
+    static void dosTime(time_t Time, uint16_t &DOSTime, uint16_t &DOSDate);
+
+    // template and display name of a host name that is a valid 8.3 name
+    static bool shortName(char const *HostName, char Template[11],
+            char Name[13]);
+
+    // FCB-style template of a file name or pattern, '*' expanded to '?'
+    static void makeTemplate(char const *Name, char Template[11]);
+    static bool matches(char const *Pattern, char const *Template);
+
+private:
+    bool mapped(int Drive) const;
+    bool canonicalize(char const *Name, int &Drive);
+    Entry *lookup(int Drive, std::string &HostPath);
+
+    std::shared_ptr <DOSFile> openHost(std::string const &HostPath,
+            int Flags, mode_t Mode);
+    bool copyUp(std::string const &HostPath, MemoryDrive::File &Data);
+
+    Directory *directory(std::string const &HostDir);
+    mode_t mode(std::string const &HostDir, Entry &E);
+    bool isDirectory(std::string const &HostDir, Entry &E);
+    mode_t modeAt(std::string const &HostPath, Entry &E);
+    bool isDirectoryAt(std::string const &HostPath, Entry &E);
+
+    void readSnapshot(Snapshot &S, bool IsRoot, MemoryDrive const *Upper,
+            std::string const &Dir);
+    void memoryEntries(MemoryDrive const &Memory, std::string const &Dir,
+            SearchEntries &Entries);
+    static void sortEntries(SearchEntries &Entries);
+
+    int watch(std::string const &HostDir);
+    void poll();
+    void invalidate(std::string const &HostDir);
+};
+
+#endif  // !__FileSystem_h
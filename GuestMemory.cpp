@@ -0,0 +1,125 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "GuestMemory.h"
+
+#include <algorithm>
+#include <cstring>
+
+int GuestMemory::
+spans(uint16_t Segment, uint16_t Offset, size_t Length,
+        Span Out[MAX_SPANS]) const
+{
+    int Count = 0;
+
+    if (Length > 0x10000)
+        Length = 0x10000;
+
+    while (Length != 0) {
+        uint32_t Linear = linear(Segment, Offset);
+
+        // stop at the end of the segment and at the end of the address space
+        size_t Chunk = 0x10000 - Offset;
+        if (Chunk > ADDRESS_SPACE - Linear)
+            Chunk = ADDRESS_SPACE - Linear;
+        if (Chunk > Length)
+            Chunk = Length;
+
+        // adjacent pieces (offset wrap at the 1 MB boundary) are merged
+        if (Count != 0 && Out[Count - 1].Data + Out[Count - 1].Length ==
+                &_base[Linear]) {
+            Out[Count - 1].Length += Chunk;
+        } else {
+            Out[Count].Data   = &_base[Linear];
+            Out[Count].Length = Chunk;
+            Count++;
+        }
+
+        Offset += Chunk;
+        Length -= Chunk;
+    }
+
+    return Count;
+}
+
+void GuestMemory::
+read(uint16_t Segment, uint16_t Offset, void *Bytes, size_t Length) const
+{
+    Span S[MAX_SPANS];
+    int  N = spans(Segment, Offset, Length, S);
+    char *B = static_cast <char *> (Bytes);
+
+    for (int i = 0; i < N; i++) {
+        std::memcpy(B, S[i].Data, S[i].Length);
+        B += S[i].Length;
+    }
+}
+
+void GuestMemory::
+write(uint16_t Segment, uint16_t Offset, void const *Bytes, size_t Length)
+{
+    Span S[MAX_SPANS];
+    int  N = spans(Segment, Offset, Length, S);
+    char const *B = static_cast <char const *> (Bytes);
+
+    for (int i = 0; i < N; i++) {
+        std::memcpy(S[i].Data, B, S[i].Length);
+        dirty(S[i].Data - _base, S[i].Length);
+        B += S[i].Length;
+    }
+}
+
+long GuestMemory::
+scan(uint16_t Segment, uint16_t Offset, char Terminator, size_t Limit) const
+{
+    Span S[MAX_SPANS];
+    int  N = spans(Segment, Offset, Limit, S);
+    long Length = 0;
+
+    for (int i = 0; i < N; i++) {
+        void const *T = std::memchr(S[i].Data, Terminator, S[i].Length);
+        if (T != nullptr)
+            return Length + (static_cast <char const *> (T) - S[i].Data);
+        Length += S[i].Length;
+    }
+
+    return -1;
+}
+
+bool GuestMemory::
+readCString(uint16_t Segment, uint16_t Offset, char *Buffer,
+        size_t Size) const
+{
+    long Length = scan(Segment, Offset, '\0', Size);
+    if (Length < 0)
+        return false;
+
+    read(Segment, Offset, Buffer, Length + 1);
+    return true;
+}
+
+void GuestMemory::
+markDirty(uint32_t Linear, size_t Length)
+{
+    if (Length == 0)
+        return;
+    if (Length > ADDRESS_SPACE)
+        Length = ADDRESS_SPACE;
+
+    if (_journal != nullptr) {
+        uint32_t Start = Linear % ADDRESS_SPACE;
+        uint32_t Head  = static_cast <uint32_t> (
+                std::min <size_t> (Length, ADDRESS_SPACE - Start));
+        _journal->push_back(Range { Start, Head });
+        if (Head < Length)
+            _journal->push_back(Range { 0,
+                    static_cast <uint32_t> (Length - Head) });
+    }
+    if (_dirty == nullptr)
+        return;
+
+    uint32_t First = Linear / PAGE_SIZE;
+    uint32_t Last  = First + (Linear % PAGE_SIZE + Length - 1) / PAGE_SIZE;
+    for (uint32_t Page = First; Page <= Last; Page++)
+        _dirty[(Page % PAGE_COUNT) / 64] |= 1ULL << (Page % 64);
+}
@@ -0,0 +1,93 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __GuestMemory_h
+#define __GuestMemory_h
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//
+// Real-mode view of guest memory. A Segment:Offset range is handed out as
+// contiguous host spans, split where the offset wraps at 64 KB and where
+// the linear address wraps at 1 MB (A20 disabled), so that host I/O can
+// go straight to and from guest memory without bounce buffers.
+//
+// While a ResetPoint tracks pages, or a RunLog records, host code that
+// writes guest memory other than through write() reports it with dirty().
+//
+class GuestMemory {
+public:
+    enum {
+        ADDRESS_SPACE = 1 << 20,
+        MAX_SPANS     = 3,
+        PAGE_SIZE     = 4096,
+        PAGE_COUNT    = ADDRESS_SPACE / PAGE_SIZE
+    };
+
+    struct Span {
+        char   *Data;
+        size_t  Length;
+    };
+
+    // Length bytes at Linear, within the address space
+    struct Range {
+        uint32_t Linear;
+        uint32_t Length;
+    };
+
+private:
+    char                 *_base;
+    uint64_t             *_dirty;   // PAGE_COUNT bits, or nullptr
+    std::vector <Range>  *_journal; // or nullptr
+
+public:
+    explicit GuestMemory(char *Base) :
+        _base(Base), _dirty(nullptr), _journal(nullptr) {}
+
+public:
+    char *base() const { return _base; }
+
+    static uint32_t linear(uint16_t Segment, uint16_t Offset)
+        { return ((static_cast <uint32_t> (Segment) << 4) + Offset) &
+            (ADDRESS_SPACE - 1); }
+
+    // fills Out with up to MAX_SPANS spans covering Length (at most 64 KB)
+    // bytes at Segment:Offset and returns their number
+    int spans(uint16_t Segment, uint16_t Offset, size_t Length,
+            Span Out[MAX_SPANS]) const;
+
+    void read(uint16_t Segment, uint16_t Offset, void *Bytes,
+            size_t Length) const;
+    void write(uint16_t Segment, uint16_t Offset, void const *Bytes,
+            size_t Length);
+
+    // number of bytes before Terminator, or -1 if it does not occur within
+    // Limit bytes
+    long scan(uint16_t Segment, uint16_t Offset, char Terminator,
+            size_t Limit) const;
+
+    // copy a NUL-terminated string into Buffer; false if it does not fit
+    bool readCString(uint16_t Segment, uint16_t Offset, char *Buffer,
+            size_t Size) const;
+
+public:
+    // record the pages host writes touch in Bitmap, or stop if nullptr
+    void track(uint64_t *Bitmap) { _dirty = Bitmap; }
+
+    // append every host write to Writes as well, or stop if nullptr
+    void journal(std::vector <Range> *Writes) { _journal = Writes; }
+
+    // Length bytes from Linear, wrapping at 1 MB, were written
+    void dirty(uint32_t Linear, size_t Length)
+        { if (_dirty != nullptr || _journal != nullptr)
+            markDirty(Linear, Length); }
+    void dirty(uint16_t Segment, uint16_t Offset, size_t Length)
+        { dirty(linear(Segment, Offset), Length); }
+
+private:
+    void markDirty(uint32_t Linear, size_t Length);
+};
+
+#endif  // !__GuestMemory_h
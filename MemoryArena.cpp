@@ -0,0 +1,389 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "MemoryArena.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+
+static_assert(sizeof(MemoryArena::MCB) == 16, "MCB layout");
+
+namespace {
+
+// MCB names are padded with NULs, not terminated: a full 8 bytes has none
+void
+SetName(MemoryArena::MCB &M, char const *Name)
+{
+    std::memset(M.Name, 0, sizeof(M.Name));
+    std::memcpy(M.Name, Name, std::min(std::strlen(Name), sizeof(M.Name)));
+}
+
+}
+
+MemoryArena::MemoryArena(GuestMemory &Memory) :
+    _mem     (Memory),
+    _largest (2 * TREE_LEAVES, 0),
+    _strategy(FIRST_FIT)
+{
+}
+
+void MemoryArena::
+format(uint16_t Owner, char const *Name)
+{
+    clear();
+
+    MCB M;
+    std::memset(&M, 0, sizeof(M));
+    M.Type  = 'Z';
+    M.Owner = Owner;
+    M.Size  = END_SEGMENT - FIRST_SEGMENT - 1;
+    SetName(M, Name);
+    _mem.write(FIRST_SEGMENT, 0, &M, sizeof(M));
+
+    _blocks[FIRST_SEGMENT] = M.Size;
+    if (Owner == OWNER_FREE)
+        addFree(FIRST_SEGMENT, M.Size);
+}
+
+bool MemoryArena::
+rebuild()
+{
+    clear();
+
+    uint16_t Segment  = FIRST_SEGMENT;
+    uint16_t Previous = 0;
+    bool     Merge    = false;
+    for (;;) {
+        MCB M;
+        _mem.read(Segment, 0, &M, sizeof(M));
+
+        uint32_t End = Segment + 1u + M.Size;
+        if ((M.Type != 'M' && M.Type != 'Z') || End > END_SEGMENT ||
+                (M.Type == 'Z') != (End == END_SEGMENT)) {
+            clear();
+            errno = EFAULT;
+            return false;
+        }
+
+        if (M.Owner == OWNER_FREE && Merge) {
+            uint16_t Size = End - Previous - 1;
+            removeFree(Previous, _blocks[Previous]);
+            _blocks[Previous] = Size;
+            addFree(Previous, Size);
+            writeMCB(Previous, OWNER_FREE, Size, false);
+        } else {
+            _blocks[Segment] = M.Size;
+            if (M.Owner == OWNER_FREE)
+                addFree(Segment, M.Size);
+            Previous = Segment;
+            Merge    = M.Owner == OWNER_FREE;
+        }
+
+        if (End == END_SEGMENT)
+            return true;
+        Segment = End;
+    }
+}
+
+bool MemoryArena::
+allocate(uint16_t Paragraphs, uint16_t Owner, uint16_t &Segment,
+        uint16_t &Largest)
+{
+    // an empty index is a chain that was broken when it was last walked
+    if (_blocks.empty() && !rebuild())
+        return false;
+
+    for (int Pass = 0; ; Pass++) {
+        uint16_t Free;
+        if (!findFit(Paragraphs, Free)) {
+            Largest = largest();
+            errno   = ENOMEM;
+            return false;
+        }
+
+        // the guest may have changed the chain since; look again in what
+        // it is now
+        Blocks::iterator I = _blocks.find(Free);
+        if (!consistent(I)) {
+            if (Pass > 0 || !rebuild()) {
+                errno = EFAULT;
+                return false;
+            }
+            continue;
+        }
+
+        uint16_t Size  = I->second;
+        uint16_t Block = Free;
+        removeFree(Free, Size);
+
+        if (Size > Paragraphs) {
+            uint16_t Rest = Size - Paragraphs - 1;
+            if ((_strategy & 3) >= LAST_FIT) {
+                // the top of the block, the rest stays free below it
+                Block = Free + 1 + Rest;
+                _blocks[Free] = Rest;
+                addFree(Free, Rest);
+                writeMCB(Free, OWNER_FREE, Rest, false);
+            } else {
+                uint16_t Next = Free + 1 + Paragraphs;
+                _blocks[Next] = Rest;
+                addFree(Next, Rest);
+                writeMCB(Next, OWNER_FREE, Rest, true);
+            }
+        }
+
+        _blocks[Block] = Paragraphs;
+        writeMCB(Block, Owner, Paragraphs, true);
+        Segment = Block + 1;
+        return true;
+    }
+}
+
+bool MemoryArena::
+release(uint16_t Segment)
+{
+    Blocks::iterator I;
+    if (!lookup(Segment - 1, I))
+        return false;
+
+    uint16_t Block = I->first;
+    uint16_t Size  = I->second;
+    if (isFree(Block))
+        removeFree(Block, Size);
+
+    // one free block with the free neighbours on either side
+    Blocks::iterator Next = std::next(I);
+    if (Next != _blocks.end() && isFree(Next->first)) {
+        removeFree(Next->first, Next->second);
+        Size += 1 + Next->second;
+        _blocks.erase(Next);
+    }
+    if (I != _blocks.begin()) {
+        Blocks::iterator Previous = std::prev(I);
+        if (isFree(Previous->first)) {
+            removeFree(Previous->first, Previous->second);
+            Size += 1 + Previous->second;
+            Block = Previous->first;
+            _blocks.erase(I);
+            I = Previous;
+        }
+    }
+
+    I->second = Size;
+    addFree(Block, Size);
+    writeMCB(Block, OWNER_FREE, Size, false);
+    return true;
+}
+
+bool MemoryArena::
+resize(uint16_t Segment, uint16_t Paragraphs, uint16_t &Largest)
+{
+    Blocks::iterator I;
+    if (!lookup(Segment - 1, I))
+        return false;
+
+    uint16_t Block = I->first;
+    if (isFree(Block)) {
+        errno = EINVAL;
+        return false;
+    }
+
+    // a block grows into free memory right after it, and nowhere else
+    Blocks::iterator Next      = std::next(I);
+    bool             NextFree  = Next != _blocks.end() && isFree(Next->first);
+    uint32_t         Available = I->second;
+    if (NextFree)
+        Available += 1 + Next->second;
+    if (Paragraphs > Available) {
+        Largest = Available;
+        errno   = ENOMEM;
+        return false;
+    }
+
+    if (NextFree) {
+        removeFree(Next->first, Next->second);
+        _blocks.erase(Next);
+    }
+    if (Available > Paragraphs) {
+        uint16_t Rest = Available - Paragraphs - 1;
+        uint16_t Free = Block + 1 + Paragraphs;
+        _blocks[Free] = Rest;
+        addFree(Free, Rest);
+        writeMCB(Free, OWNER_FREE, Rest, true);
+    }
+
+    MCB M;
+    _mem.read(Block, 0, &M, sizeof(M));
+    I->second = Paragraphs;
+    writeMCB(Block, M.Owner, Paragraphs, false);
+    return true;
+}
+
+bool MemoryArena::
+releaseOwner(uint16_t Owner)
+{
+    std::vector <uint16_t> Owned;
+    for (auto const &B : _blocks) {
+        MCB M;
+        _mem.read(B.first, 0, &M, sizeof(M));
+        if (!isFree(B.first) && M.Owner == Owner)
+            Owned.push_back(B.first + 1);
+    }
+
+    bool Result = true;
+    for (uint16_t Segment : Owned)
+        Result = release(Segment) && Result;
+    return Result;
+}
+
+bool MemoryArena::
+setOwner(uint16_t Segment, uint16_t Owner, char const *Name)
+{
+    if (Owner == OWNER_FREE)
+        return release(Segment);
+
+    Blocks::iterator I;
+    if (!lookup(Segment - 1, I))
+        return false;
+    if (isFree(I->first))
+        removeFree(I->first, I->second);
+
+    MCB M;
+    _mem.read(I->first, 0, &M, sizeof(M));
+    M.Owner = Owner;
+    if (Name != nullptr)
+        SetName(M, Name);
+    _mem.write(I->first, 0, &M, sizeof(M));
+    return true;
+}
+
+void MemoryArena::
+clear()
+{
+    for (auto const &F : _free)
+        setLargest(F.second, 0);
+    _free.clear();
+    _blocks.clear();
+}
+
+// the type follows from where the block ends; a Fresh MCB has no name
+void MemoryArena::
+writeMCB(uint16_t Segment, uint16_t Owner, uint16_t Size, bool Fresh)
+{
+    MCB M;
+    if (Fresh)
+        std::memset(&M, 0, sizeof(M));
+    else
+        _mem.read(Segment, 0, &M, sizeof(M));
+
+    M.Type  = (Segment + 1u + Size == END_SEGMENT) ? 'Z' : 'M';
+    M.Owner = Owner;
+    M.Size  = Size;
+    _mem.write(Segment, 0, &M, sizeof(M));
+}
+
+void MemoryArena::
+addFree(uint16_t Segment, uint16_t Size)
+{
+    _free.insert(std::make_pair(Size, Segment));
+    setLargest(Segment, Size + 1);
+}
+
+void MemoryArena::
+removeFree(uint16_t Segment, uint16_t Size)
+{
+    _free.erase(std::make_pair(Size, Segment));
+    setLargest(Segment, 0);
+}
+
+void MemoryArena::
+setLargest(uint16_t Segment, uint16_t Value)
+{
+    size_t i = TREE_LEAVES + Segment;
+    _largest[i] = Value;
+    for (i /= 2; i != 0; i /= 2)
+        _largest[i] = std::max(_largest[2 * i], _largest[2 * i + 1]);
+}
+
+// first and last fit descend to the leftmost or rightmost leaf whose free
+// block is big enough; best fit is the smallest such block, lowest first
+bool MemoryArena::
+findFit(uint16_t Paragraphs, uint16_t &Segment) const
+{
+    uint32_t Need = Paragraphs + 1u;
+
+    if ((_strategy & 3) == BEST_FIT) {
+        auto I = _free.lower_bound(std::make_pair(Paragraphs,
+                    static_cast <uint16_t> (0)));
+        if (I == _free.end())
+            return false;
+        Segment = I->second;
+        return true;
+    }
+
+    if (_largest[1] < Need)
+        return false;
+
+    bool   Last = (_strategy & 3) >= LAST_FIT;
+    size_t i    = 1;
+    while (i < TREE_LEAVES) {
+        i *= 2;
+        if (Last ? _largest[i + 1] >= Need : _largest[i] < Need)
+            i++;
+    }
+    Segment = i - TREE_LEAVES;
+    return true;
+}
+
+// the MCBs of a block and of its neighbours, which a change may merge
+// with, are what the index says they are
+bool MemoryArena::
+consistent(Blocks::const_iterator I) const
+{
+    if (I == _blocks.end())
+        return false;
+
+    Blocks::const_iterator First = (I == _blocks.begin()) ? I : std::prev(I);
+    Blocks::const_iterator Last  = std::next(I);
+    if (Last != _blocks.end())
+        ++Last;
+
+    for (Blocks::const_iterator J = First; J != Last; ++J) {
+        MCB M;
+        _mem.read(J->first, 0, &M, sizeof(M));
+
+        uint8_t Type = (J->first + 1u + J->second == END_SEGMENT) ? 'Z' : 'M';
+        if (M.Type != Type || M.Size != J->second ||
+                (M.Owner == OWNER_FREE) != isFree(J->first))
+            return false;
+    }
+    return true;
+}
+
+bool MemoryArena::
+lookup(uint16_t Segment, Blocks::iterator &I)
+{
+    I = _blocks.find(Segment);
+    if (consistent(I))
+        return true;
+
+    // either the guest has changed the chain, or Segment is no block; only
+    // something that looks like an MCB is worth a walk of the chain
+    MCB M;
+    _mem.read(Segment, 0, &M, sizeof(M));
+    if (I == _blocks.end() && M.Type != 'M' && M.Type != 'Z') {
+        errno = EINVAL;
+        return false;
+    }
+    if (!rebuild())
+        return false;
+
+    I = _blocks.find(Segment);
+    if (I == _blocks.end()) {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,124 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __MemoryArena_h
+#define __MemoryArena_h
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "GuestMemory.h"
+
+//
+// Conventional memory as DOS hands it out: a chain of Memory Control
+// Blocks in guest memory, each a paragraph in front of the block it
+// describes, from FIRST_SEGMENT up to END_SEGMENT. Programs walk the chain
+// and some write to it, so it is the authority; what the host keeps is an
+// index of it.
+//
+// The index holds every block by segment and the free ones twice more: by
+// size, which makes best fit a lower_bound(), and in a tree over segments
+// that keeps the largest free block below each node, which makes first
+// and last fit one descent. Every call is O(log n) in the number of blocks
+// rather than a walk of the chain.
+//
+// Before a block is changed, its MCB and those of its neighbours are
+// compared with the index. If the guest has been at the chain, the index
+// is rebuilt from it; a chain that no longer adds up is reported the way
+// DOS does, as destroyed.
+//
+class MemoryArena {
+public:
+    enum {
+        FIRST_SEGMENT = 0x00FF,     // MCB of the first block
+        END_SEGMENT   = 0xA000,     // top of conventional memory
+        OWNER_FREE    = 0x0000
+    };
+
+    // AH=58h allocation strategy, low bits
+    enum {
+        FIRST_FIT = 0,
+        BEST_FIT  = 1,
+        LAST_FIT  = 2
+    };
+
+#pragma pack(push, 1)
+    struct MCB {
+        uint8_t  Type;              // 'M', or 'Z' for the last block
+        uint16_t Owner;             // PSP segment, 0 if free
+        uint16_t Size;              // paragraphs, not counting the MCB
+        uint8_t  Reserved[3];
+        char     Name[8];           // program name, NUL-padded
+    };
+#pragma pack(pop)
+
+private:
+    enum {
+        TREE_LEAVES = 0x10000       // one per segment
+    };
+
+    typedef std::map <uint16_t, uint16_t> Blocks;
+
+    GuestMemory                                  &_mem;
+    Blocks                                        _blocks;  // MCB -> size
+    std::set <std::pair <uint16_t, uint16_t>>     _free;    // (size, MCB)
+    std::vector <uint16_t>                        _largest; // 1 + size, or 0
+    uint8_t                                       _strategy;
+
+public:
+    explicit MemoryArena(GuestMemory &Memory);
+
+public:
+    // one block over all of conventional memory, given to Owner
+    void format(uint16_t Owner, char const *Name);
+
+    // the index of the chain in guest memory, merging adjacent free blocks
+    // as DOS does; false with errno EFAULT, and an empty index, if the
+    // chain is broken
+    bool rebuild();
+
+    // Segment of a new block of Paragraphs for Owner; false with errno
+    // ENOMEM and Largest the biggest block there is, or EFAULT
+    bool allocate(uint16_t Paragraphs, uint16_t Owner, uint16_t &Segment,
+            uint16_t &Largest);
+
+    // the block at Segment (not its MCB); false with errno EINVAL if there
+    // is no such block, or EFAULT
+    bool release(uint16_t Segment);
+
+    // false with errno ENOMEM and Largest the most the block can grow to,
+    // EINVAL or EFAULT
+    bool resize(uint16_t Segment, uint16_t Paragraphs, uint16_t &Largest);
+
+    // every block of Owner, when it terminates
+    bool releaseOwner(uint16_t Owner);
+
+    // give the block at Segment to Owner, under Name unless nullptr
+    bool setOwner(uint16_t Segment, uint16_t Owner, char const *Name);
+
+    // paragraphs of the largest free block
+    uint16_t largest() const
+        { return (_largest[1] != 0) ? _largest[1] - 1 : 0; }
+
+    uint8_t strategy() const { return _strategy; }
+    void setStrategy(uint8_t Strategy) { _strategy = Strategy; }
+
+private:
+    void clear();
+    void writeMCB(uint16_t Segment, uint16_t Owner, uint16_t Size,
+            bool Fresh);
+    bool isFree(uint16_t Segment) const
+        { return _largest[TREE_LEAVES + Segment] != 0; }
+    void addFree(uint16_t Segment, uint16_t Size);
+    void removeFree(uint16_t Segment, uint16_t Size);
+    void setLargest(uint16_t Segment, uint16_t Value);
+    bool findFit(uint16_t Paragraphs, uint16_t &Segment) const;
+
+    bool consistent(Blocks::const_iterator I) const;
+    bool lookup(uint16_t Segment, Blocks::iterator &I);
+};
+
+#endif  // !__MemoryArena_h
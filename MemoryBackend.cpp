@@ -0,0 +1,224 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "MemoryBackend.h"
+#include "Stats.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <mach/vm_statistics.h>
+#endif
+
+namespace {
+
+// an unnamed shared memory object
+int
+AnonymousObject()
+{
+#ifdef __linux__
+    return ::memfd_create("hvdos", MFD_CLOEXEC);
+#else
+    static unsigned Serial;
+    char Name[64];
+    std::snprintf(Name, sizeof(Name), "/hvdos.%d.%u", ::getpid(), Serial++);
+
+    int FD = ::shm_open(Name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (FD >= 0)
+        ::shm_unlink(Name);
+    return FD;
+#endif
+}
+
+}
+
+MemoryBackend::MemoryBackend() :
+    _kind         (KIND_ANONYMOUS),
+    _base         (nullptr),
+    _size         (0),
+    _mapSize      (0),
+    _pageSize     (::sysconf(_SC_PAGESIZE)),
+    _fd           (-1),
+    _prefaultNanos(0)
+{
+}
+
+// no madvise() to release the pages first: the mapping goes away whole,
+// and with it the memory
+MemoryBackend::~MemoryBackend()
+{
+    if (_base != nullptr)
+        ::munmap(_base, _mapSize);
+    if (_fd >= 0)
+        ::close(_fd);
+    if (!_name.empty())
+        ::shm_unlink(_name.c_str());
+}
+
+bool MemoryBackend::
+parseKind(char const *Text, Options &O)
+{
+    if (std::strcmp(Text, "anonymous") == 0) {
+        O.Type = KIND_ANONYMOUS;
+    } else if (std::strcmp(Text, "huge") == 0) {
+        O.Type = KIND_HUGE;
+    } else if (std::strcmp(Text, "shared") == 0) {
+        O.Type = KIND_SHARED;
+        O.Name.clear();
+    } else if (std::strncmp(Text, "shared:", 7) == 0 && Text[7] != '\0') {
+        O.Type = KIND_SHARED;
+        O.Name = (Text[7] == '/') ? Text + 7 : std::string("/") + (Text + 7);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool MemoryBackend::
+open(Options const &O)
+{
+    size_t Size = (O.Size + _pageSize - 1) & ~(_pageSize - 1);
+    if (Size < MIN_SIZE || Size > MAX_SIZE) {
+        errno = EINVAL;
+        return false;
+    }
+
+    void *Map = MAP_FAILED;
+    _kind    = O.Type;
+    _mapSize = Size;
+
+    switch (O.Type) {
+        case KIND_ANONYMOUS:
+            Map = ::mmap(nullptr, Size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANON, -1, 0);
+            break;
+
+        case KIND_HUGE:
+            if (!mapHuge(Size))
+                return false;
+            Map = _base;
+            break;
+
+        case KIND_SHARED:
+            if (O.Name.empty()) {
+                _fd = AnonymousObject();
+            } else {
+                // another hvdos's memory is not ours to take over
+                _fd = ::shm_open(O.Name.c_str(), O_RDWR | O_CREAT | O_EXCL,
+                        0600);
+                if (_fd >= 0)
+                    _name = O.Name;
+            }
+            if (_fd < 0 || ::ftruncate(_fd, Size) != 0)
+                return false;
+            Map = ::mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    _fd, 0);
+            break;
+
+        case KIND_FILE: {
+            int FD = ::open(O.Path.c_str(), O_RDONLY);
+            if (FD < 0)
+                return false;
+            Map = ::mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    FD, O.Offset);
+            int Error = errno;
+            ::close(FD);
+            errno = Error;
+            break;
+        }
+    }
+    if (Map == MAP_FAILED)
+        return false;
+
+    _base = static_cast <char *> (Map);
+    _size = Size;
+    if (O.Prefault)
+        prefault();
+    return true;
+}
+
+// whole 2 MB pages, aligned to their size
+bool MemoryBackend::
+mapHuge(size_t Size)
+{
+    size_t Rounded = (Size + HUGE_PAGE - 1) & ~static_cast <size_t>
+        (HUGE_PAGE - 1);
+
+#ifdef __APPLE__
+    void *Map = ::mmap(nullptr, Rounded, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANON, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+    if (Map == MAP_FAILED)
+        return false;
+    _base = static_cast <char *> (Map);
+#else
+    // one huge page more than needed, less the unaligned head and tail
+    void *Map = ::mmap(nullptr, Rounded + HUGE_PAGE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (Map == MAP_FAILED)
+        return false;
+
+    char  *Start = static_cast <char *> (Map);
+    char  *Base  = reinterpret_cast <char *> (
+            (reinterpret_cast <uintptr_t> (Start) + HUGE_PAGE - 1) &
+            ~static_cast <uintptr_t> (HUGE_PAGE - 1));
+    size_t Head  = Base - Start;
+    if (Head != 0)
+        ::munmap(Start, Head);
+    ::munmap(Base + Rounded, HUGE_PAGE - Head);
+
+#ifdef MADV_HUGEPAGE
+    ::madvise(Base, Rounded, MADV_HUGEPAGE);
+#endif
+    _base = Base;
+#endif
+
+    _mapSize = Rounded;
+    return true;
+}
+
+// Anonymous and shared memory is written, so that it is committed, not
+// just mapped to the zero page; a file mapping is read, so that it stays
+// shared with the page cache instead of being copied.
+void MemoryBackend::
+prefault()
+{
+    uint64_t Start = Stats::now();
+
+    if (_kind == KIND_FILE) {
+        ::madvise(_base, _size, MADV_WILLNEED);
+        char Sum = 0;
+        for (size_t i = 0; i < _size; i += _pageSize)
+            Sum ^= static_cast <char volatile *> (_base)[i];
+        (void)Sum;
+    } else {
+        for (size_t i = 0; i < _size; i += _pageSize)
+            static_cast <char volatile *> (_base)[i] = 0;
+    }
+
+    _prefaultNanos = Stats::now() - Start;
+}
+
+size_t MemoryBackend::
+residentPages() const
+{
+    std::vector <char> Pages(_size / _pageSize);
+    if (_base == nullptr || ::mincore(_base, _size,
+#ifdef __linux__
+                reinterpret_cast <unsigned char *> (Pages.data())
+#else
+                Pages.data()
+#endif
+                ) != 0)
+        return 0;
+
+    size_t Count = 0;
+    for (char P : Pages)
+        Count += P & 1;
+    return Count;
+}
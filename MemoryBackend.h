@@ -0,0 +1,84 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __MemoryBackend_h
+#define __MemoryBackend_h
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+//
+// Host memory behind guest physical memory, mapped at guest address 0.
+//
+//   anonymous   private anonymous memory, committed a page at a time as the
+//               guest first touches it (the default)
+//   huge        the same in 2 MB pages, for fewer TLB misses and page faults
+//   shared      a shared memory object, which other processes can map while
+//               the guest runs if it is given a name
+//   file        a private copy-on-write mapping of part of a file, such as
+//               the memory of a VMSnapshot
+//
+// The first MB is what real-mode code addresses; anything beyond it is the
+// HMA and extended memory.
+//
+class MemoryBackend {
+public:
+    enum Kind {
+        KIND_ANONYMOUS,
+        KIND_HUGE,
+        KIND_SHARED,
+        KIND_FILE
+    };
+
+    enum {
+        MIN_SIZE  = 1 << 20,
+        MAX_SIZE  = 1 << 30,
+        HUGE_PAGE = 2 << 20
+    };
+
+    struct Options {
+        Kind        Type;
+        size_t      Size;       // rounded up to whole pages
+        bool        Prefault;   // touch every page before the guest runs
+        std::string Name;       // KIND_SHARED: object name, or empty
+        std::string Path;       // KIND_FILE
+        uint64_t    Offset;     // KIND_FILE, page-aligned
+    };
+
+private:
+    Kind        _kind;
+    char       *_base;
+    size_t      _size;
+    size_t      _mapSize;       // of the mapping, which may be larger
+    size_t      _pageSize;
+    int         _fd;            // KIND_SHARED, -1 otherwise
+    std::string _name;          // of a named shared object, unlinked at exit
+    uint64_t    _prefaultNanos;
+
+public:
+    MemoryBackend();
+    ~MemoryBackend();
+
+public:
+    // false with errno set
+    bool open(Options const &O);
+
+    // "anonymous", "huge", "shared" or "shared:name"
+    static bool parseKind(char const *Text, Options &O);
+
+    char *base() const { return _base; }
+    size_t size() const { return _size; }
+    size_t pageSize() const { return _pageSize; }
+    int fd() const { return _fd; }
+    uint64_t prefaultNanos() const { return _prefaultNanos; }
+
+    // host pages of guest memory that are in RAM now
+    size_t residentPages() const;
+
+private:
+    bool mapHuge(size_t Size);
+    void prefault();
+};
+
+#endif  // !__MemoryBackend_h
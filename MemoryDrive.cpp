@@ -0,0 +1,196 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "MemoryDrive.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <unistd.h>
+
+size_t MemoryQuota::
+charge(size_t Bytes)
+{
+    size_t Granted = std::min(Bytes, _limit - std::min(_limit, _used));
+    _used += Granted;
+    return Granted;
+}
+
+MemoryDrive::File::File(MemoryQuota *Q, Clock const *C) :
+    Attributes(0),
+    Quota     (Q),
+    Now       (C)
+{
+    touch();
+}
+
+MemoryDrive::File::~File()
+{
+    Quota->release(Bytes.size());
+}
+
+// last written now, in DOS packed local time
+void MemoryDrive::File::
+touch()
+{
+    struct tm TM;
+
+    if (Now != nullptr && *Now) {
+        time_t Local = (*Now)() / 1000000000;
+        ::gmtime_r(&Local, &TM);
+    } else {
+        time_t Host = ::time(nullptr);
+        ::localtime_r(&Host, &TM);
+    }
+    Time = (TM.tm_hour << 11) | (TM.tm_min << 5) | (TM.tm_sec / 2);
+    Date = (std::max(TM.tm_year - 80, 0) << 9) | ((TM.tm_mon + 1) << 5) |
+        TM.tm_mday;
+}
+
+// false if the quota does not allow growing to Size
+bool MemoryDrive::File::
+resize(size_t Size)
+{
+    if (Size > Bytes.size()) {
+        size_t Extra   = Size - Bytes.size();
+        size_t Granted = Quota->charge(Extra);
+        if (Granted != Extra) {
+            Quota->release(Granted);
+            return false;
+        }
+    } else {
+        Quota->release(Bytes.size() - Size);
+    }
+
+    Bytes.resize(Size);
+    return true;
+}
+
+MemoryDrive::MemoryDrive(MemoryQuota *Quota, Clock const *Now) :
+    _quota     (Quota),
+    _clock     (Now),
+    _generation(0)
+{
+}
+
+MemoryDrive::Node *MemoryDrive::
+find(std::string const &Path)
+{
+    auto I = _nodes.find(Path);
+    return (I != _nodes.end()) ? &I->second : nullptr;
+}
+
+// a new, empty file; an existing one at Path is replaced
+MemoryDrive::Node *MemoryDrive::
+create(std::string const &Path, std::string const &Name)
+{
+    Node &N = _nodes[Path];
+    N.Name = Name;
+    N.Data = std::make_shared <File> (_quota, _clock);
+
+    _whiteouts.erase(Path);
+    _generation++;
+    return &N;
+}
+
+bool MemoryDrive::
+remove(std::string const &Path)
+{
+    if (_nodes.erase(Path) == 0)
+        return false;
+
+    _generation++;
+    return true;
+}
+
+void MemoryDrive::
+whiteout(std::string const &Path)
+{
+    _whiteouts.insert(Path);
+    _generation++;
+}
+
+MemoryFile::MemoryFile(std::shared_ptr <MemoryDrive::File> const &Data,
+        bool Writable) :
+    _data    (Data),
+    _position(0),
+    _writable(Writable),
+    _written (false)
+{
+}
+
+ssize_t MemoryFile::
+read(void *Buffer, size_t Length)
+{
+    std::vector <char> const &Bytes = _data->Bytes;
+
+    if (_position >= static_cast <off_t> (Bytes.size()))
+        return 0;
+
+    size_t Count = std::min(Length, Bytes.size() - _position);
+    std::memcpy(Buffer, &Bytes[_position], Count);
+    _position += Count;
+    return Count;
+}
+
+// a write the quota has no room for is short, which DOS reports as a full
+// disk
+ssize_t MemoryFile::
+write(void const *Buffer, size_t Length)
+{
+    if (!_writable) {
+        errno = EBADF;
+        return -1;
+    }
+
+    std::vector <char> &Bytes = _data->Bytes;
+    size_t End = _position + Length;
+    if (End > Bytes.size() && !_data->resize(End)) {
+        // as much as still fits
+        size_t Room = _data->Quota->limit() - std::min(_data->Quota->limit(),
+                _data->Quota->used());
+        End = std::min(End, Bytes.size() + Room);
+        if (End <= static_cast <size_t> (_position) || !_data->resize(End))
+            return 0;
+        Length = End - _position;
+    }
+
+    std::memcpy(&Bytes[_position], Buffer, Length);
+    _position += Length;
+    _written   = true;
+    return Length;
+}
+
+off_t MemoryFile::
+seek(off_t Offset, int Whence)
+{
+    off_t Base;
+    switch (Whence) {
+        case SEEK_SET: Base = 0; break;
+        case SEEK_CUR: Base = _position; break;
+        case SEEK_END: Base = _data->Bytes.size(); break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    if (Base + Offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _position = Base + Offset;
+    return _position;
+}
+
+int MemoryFile::
+close()
+{
+    if (_written) {
+        _data->touch();
+        _written = false;
+    }
+    return 0;
+}
@@ -0,0 +1,118 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __MemoryDrive_h
+#define __MemoryDrive_h
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "DOSFile.h"
+
+// bytes held by all RAM drives and overlays together
+class MemoryQuota {
+private:
+    size_t _limit;
+    size_t _used;
+
+public:
+    explicit MemoryQuota(size_t Limit) : _limit(Limit), _used(0) {}
+
+public:
+    size_t limit() const { return _limit; }
+    size_t used() const { return _used; }
+    void setLimit(size_t Limit) { _limit = Limit; }
+
+    // grant up to Bytes more, return how many were granted
+    size_t charge(size_t Bytes);
+    void release(size_t Bytes) { _used -= Bytes; }
+};
+
+//
+// Files kept in host memory, by canonical DOS path without the drive
+// ("DIR\\NAME.EXT"). A RAM drive has only its root directory; as the
+// upper layer of an overlay, the directories are those of the host
+// directory below, and names deleted from it are kept as whiteouts.
+//
+class MemoryDrive {
+public:
+    // local time in ns since 1970, as VirtualClock keeps it, for file
+    // dates; the host's time if there is none
+    typedef std::function <int64_t ()> Clock;
+
+    // the contents of a file, shared by its node and its open handles so
+    // that deleting an open file works as on the host
+    struct File {
+        std::vector <char>  Bytes;
+        uint8_t             Attributes;
+        uint16_t            Time;
+        uint16_t            Date;
+        MemoryQuota        *Quota;
+        Clock const        *Now;
+
+        File(MemoryQuota *Q, Clock const *C);
+        ~File();
+
+        void touch();
+        bool resize(size_t Size);
+    };
+
+    struct Node {
+        std::string             Name;   // last component as created
+        std::shared_ptr <File>  Data;
+    };
+
+    typedef std::map <std::string, Node> Nodes;
+
+private:
+    MemoryQuota                *_quota;
+    Clock const                *_clock;
+    Nodes                       _nodes;
+    std::set <std::string>      _whiteouts;
+    uint64_t                    _generation;
+
+public:
+    MemoryDrive(MemoryQuota *Quota, Clock const *Now);
+
+public:
+    Node *find(std::string const &Path);
+    Node *create(std::string const &Path, std::string const &Name);
+    bool remove(std::string const &Path);
+
+    bool isWhiteout(std::string const &Path) const
+        { return _whiteouts.count(Path) != 0; }
+    void whiteout(std::string const &Path);
+
+    // bumped on every change, for FINDFIRST snapshots
+    uint64_t generation() const { return _generation; }
+
+    Nodes const &nodes() const { return _nodes; }
+    std::set <std::string> const &whiteouts() const { return _whiteouts; }
+
+    MemoryQuota *quota() const { return _quota; }
+};
+
+// an open handle on a MemoryDrive file: reads and writes are memcpy()
+class MemoryFile : public DOSFile {
+private:
+    std::shared_ptr <MemoryDrive::File>     _data;
+    off_t                                   _position;
+    bool                                    _writable;
+    bool                                    _written;
+
+public:
+    MemoryFile(std::shared_ptr <MemoryDrive::File> const &Data, bool Writable);
+
+public:
+    ssize_t read(void *Buffer, size_t Length) override;
+    ssize_t write(void const *Buffer, size_t Length) override;
+    off_t seek(off_t Offset, int Whence) override;
+    int close() override;
+};
+
+#endif  // !__MemoryDrive_h
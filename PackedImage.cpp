@@ -0,0 +1,202 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "PackedImage.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static_assert(sizeof(FileSystem::SearchEntry) == 33,
+        "SearchEntry is part of the image format");
+
+namespace {
+
+// Count items of Unit bytes at Offset lie within Size bytes, without
+// overflow for any Offset and Count
+bool
+Fits(uint64_t Offset, uint64_t Count, uint64_t Unit, uint64_t Size)
+{
+    return Offset <= Size && Count <= (Size - Offset) / Unit;
+}
+
+}
+
+PackedImage::PackedImage() :
+    _map    (nullptr),
+    _size   (0),
+    _header (nullptr),
+    _listing(nullptr),
+    _records(nullptr),
+    _buckets(nullptr),
+    _names  (nullptr)
+{
+}
+
+PackedImage::~PackedImage()
+{
+    if (_map != nullptr)
+        ::munmap(const_cast <char *> (_map), _size);
+}
+
+bool PackedImage::
+open(char const *Path)
+{
+    int FD = ::open(Path, O_RDONLY);
+    if (FD < 0)
+        return false;
+
+    struct stat ST;
+    if (::fstat(FD, &ST) != 0) {
+        ::close(FD);
+        return false;
+    }
+    if (ST.st_size < static_cast <off_t> (sizeof(Header))) {
+        ::close(FD);
+        errno = EINVAL;
+        return false;
+    }
+
+    void *Map = ::mmap(nullptr, ST.st_size, PROT_READ, MAP_PRIVATE, FD, 0);
+    ::close(FD);
+    if (Map == MAP_FAILED)
+        return false;
+
+    _map    = static_cast <char const *> (Map);
+    _size   = ST.st_size;
+    _header = reinterpret_cast <Header const *> (_map);
+
+    // every table must lie within the file, and the hash must have room
+    // for every entry and an empty bucket, where find() stops
+    Header const &H = *_header;
+    bool Valid = std::memcmp(H.Magic, "HVPACK01", 8) == 0 &&
+        H.Version == VERSION && H.Size <= _size &&
+        H.RootCount <= H.EntryCount &&
+        H.BucketCount > H.EntryCount &&
+        (H.BucketCount & (H.BucketCount - 1)) == 0 &&
+        Fits(H.ListingOffset, H.EntryCount, sizeof(SearchEntry), H.Size) &&
+        Fits(H.RecordOffset, H.EntryCount, sizeof(Record), H.Size) &&
+        Fits(H.BucketOffset, H.BucketCount, sizeof(uint32_t), H.Size) &&
+        H.NameOffset <= H.Size;
+
+    if (Valid) {
+        _listing = reinterpret_cast <SearchEntry const *>
+            (_map + H.ListingOffset);
+        _records = reinterpret_cast <Record const *> (_map + H.RecordOffset);
+        _buckets = reinterpret_cast <uint32_t const *>
+            (_map + H.BucketOffset);
+        _names   = _map + H.NameOffset;
+    }
+
+    // and every record, so that nothing later needs a bounds check
+    for (uint32_t i = 0; Valid && i < H.EntryCount; i++) {
+        Record const &R = _records[i];
+        Valid = R.PathOffset < H.Size - H.NameOffset &&
+            std::memchr(_names + R.PathOffset, '\0',
+                    H.Size - H.NameOffset - R.PathOffset) != nullptr;
+        if (isDirectory(i))
+            Valid = Valid && static_cast <uint64_t> (R.First) + R.Count <=
+                H.EntryCount;
+        else
+            Valid = Valid && Fits(R.DataOffset, _listing[i].Size, 1, H.Size);
+    }
+    uint32_t Used = 0;
+    for (uint32_t i = 0; Valid && i < H.BucketCount; i++) {
+        Valid = _buckets[i] <= H.EntryCount;
+        Used += _buckets[i] != 0;
+    }
+    Valid = Valid && Used < H.BucketCount;
+
+    if (!Valid) {
+        ::munmap(Map, _size);
+        _map = nullptr;
+        errno = EINVAL;
+        return false;
+    }
+
+    // the index is probed on every open, the data only as programs read it
+    ::madvise(Map, H.NameOffset, MADV_WILLNEED);
+    return true;
+}
+
+int PackedImage::
+find(std::string const &Path) const
+{
+    uint32_t Hash = hash(Path.data(), Path.size());
+    uint32_t Mask = _header->BucketCount - 1;
+
+    for (uint32_t i = Hash & Mask; _buckets[i] != 0; i = (i + 1) & Mask) {
+        uint32_t Index = _buckets[i] - 1;
+        if (_records[Index].Hash == Hash &&
+                Path.compare(_names + _records[Index].PathOffset) == 0)
+            return Index;
+    }
+    return -1;
+}
+
+PackedImage::SearchEntry const *PackedImage::
+list(int Index, size_t &Count) const
+{
+    if (Index < 0) {
+        Count = _header->RootCount;
+        return _listing;
+    }
+
+    Count = _records[Index].Count;
+    return _listing + _records[Index].First;
+}
+
+PackedFile::PackedFile(std::shared_ptr <PackedImage const> const &Image,
+        int Index) :
+    _image   (Image),
+    _data    (Image->data(Index)),
+    _size    (Image->entry(Index).Size),
+    _position(0)
+{
+}
+
+ssize_t PackedFile::
+read(void *Buffer, size_t Length)
+{
+    if (_position >= _size)
+        return 0;
+
+    size_t Count = std::min <off_t> (Length, _size - _position);
+    std::memcpy(Buffer, _data + _position, Count);
+    _position += Count;
+    return Count;
+}
+
+ssize_t PackedFile::
+write(void const *Buffer, size_t Length)
+{
+    errno = EBADF;
+    return -1;
+}
+
+off_t PackedFile::
+seek(off_t Offset, int Whence)
+{
+    off_t Base;
+    switch (Whence) {
+        case SEEK_SET: Base = 0; break;
+        case SEEK_CUR: Base = _position; break;
+        case SEEK_END: Base = _size; break;
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+
+    if (Base + Offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    _position = Base + Offset;
+    return _position;
+}
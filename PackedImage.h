@@ -0,0 +1,122 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __PackedImage_h
+#define __PackedImage_h
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "DOSFile.h"
+#include "FileSystem.h"
+
+//
+// A read-only drive packed into one file by hvpack, mapped MAP_PRIVATE so
+// that every hvdos running from the same image shares its pages.
+//
+//   Header
+//   SearchEntry Listing[EntryCount]    FINDFIRST entries, as FileSystem
+//   Record      Records[EntryCount]    keeps them, one per entry
+//   uint32_t    Buckets[BucketCount]   open-addressed hash of the paths
+//   char        Names[]                NUL-terminated canonical paths
+//   file data, each file at a multiple of ALIGNMENT
+//
+// A directory's entries are contiguous and sorted by template, so a
+// directory listing is a slice of Listing; the root's are the first
+// RootCount. Subdirectories begin with "." and "..", which are not in the
+// hash. Paths are canonical DOS paths below the root ("DIR\\NAME.EXT").
+//
+class PackedImage {
+public:
+    enum {
+        VERSION   = 1,
+        ALIGNMENT = 4096
+    };
+
+    typedef FileSystem::SearchEntry SearchEntry;
+
+#pragma pack(push, 1)
+    struct Header {
+        char     Magic[8];      // "HVPACK01"
+        uint32_t Version;
+        uint32_t EntryCount;
+        uint32_t RootCount;
+        uint32_t BucketCount;   // a power of two
+        uint64_t ListingOffset;
+        uint64_t RecordOffset;
+        uint64_t BucketOffset;
+        uint64_t NameOffset;
+        uint64_t Size;          // of the whole image
+        uint8_t  Reserved[8];
+    };
+
+    struct Record {
+        uint32_t Hash;          // of the path
+        uint32_t PathOffset;    // from NameOffset
+        uint32_t First;         // directory: entries [First, First + Count)
+        uint32_t Count;
+        uint64_t DataOffset;    // file: Listing[i].Size bytes from here
+    };
+#pragma pack(pop)
+
+private:
+    char const         *_map;
+    size_t              _size;
+    Header const       *_header;
+    SearchEntry const  *_listing;
+    Record const       *_records;
+    uint32_t const     *_buckets;
+    char const         *_names;
+
+public:
+    PackedImage();
+    ~PackedImage();
+
+public:
+    // false with errno set if Path is not a valid image
+    bool open(char const *Path);
+
+    // index of the entry for a canonical path, -1 if there is none
+    int find(std::string const &Path) const;
+
+    SearchEntry const &entry(int Index) const { return _listing[Index]; }
+    bool isDirectory(int Index) const
+        { return (_listing[Index].Attributes & FileSystem::ATTR_DIRECTORY) != 0; }
+
+    // the entries of a directory; Index -1 is the root
+    SearchEntry const *list(int Index, size_t &Count) const;
+
+    char const *data(int Index) const
+        { return _map + _records[Index].DataOffset; }
+
+public:
+    // FNV-1a
+    static uint32_t hash(char const *Path, size_t Length)
+    {
+        uint32_t H = 2166136261u;
+        for (size_t i = 0; i < Length; i++)
+            H = (H ^ static_cast <uint8_t> (Path[i])) * 16777619u;
+        return H;
+    }
+};
+
+// an open file of a PackedImage: reads are memcpy() from the mapping
+class PackedFile : public DOSFile {
+private:
+    std::shared_ptr <PackedImage const>  _image;   // keeps _data mapped
+    char const                          *_data;
+    off_t                                _size;
+    off_t                                _position;
+
+public:
+    PackedFile(std::shared_ptr <PackedImage const> const &Image, int Index);
+
+public:
+    ssize_t read(void *Buffer, size_t Length) override;
+    ssize_t write(void const *Buffer, size_t Length) override;
+    off_t seek(off_t Offset, int Whence) override;
+};
+
+#endif  // !__PackedImage_h
@@ -0,0 +1,43 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "ProgramCache.h"
+#include "ProgramImage.h"
+
+#include <sys/stat.h>
+
+std::shared_ptr <ProgramImage> ProgramCache::
+open(std::string const &HostPath)
+{
+    struct stat ST;
+    if (::stat(HostPath.c_str(), &ST) != 0)
+        return nullptr;
+
+    auto I = _images.find(HostPath);
+    if (I != _images.end() && I->second.Device == ST.st_dev &&
+            I->second.Inode == ST.st_ino && I->second.Size == ST.st_size &&
+            I->second.MTime == ST.st_mtime) {
+        _hits++;
+        return I->second.Image;
+    }
+
+    _misses++;
+    auto Image = std::make_shared <ProgramImage> ();
+    if (!Image->open(HostPath.c_str())) {
+        if (I != _images.end())
+            _images.erase(I);
+        return nullptr;
+    }
+
+    // a build that runs more distinct programs than this starts over
+    if (I == _images.end() && _images.size() >= MAX_IMAGES)
+        _images.clear();
+
+    Slot &S  = _images[HostPath];
+    S.Device = ST.st_dev;
+    S.Inode  = ST.st_ino;
+    S.Size   = ST.st_size;
+    S.MTime  = ST.st_mtime;
+    S.Image  = Image;
+    return Image;
+}
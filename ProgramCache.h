@@ -0,0 +1,51 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __ProgramCache_h
+#define __ProgramCache_h
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <sys/types.h>
+
+class ProgramImage;
+
+//
+// Parsed programs by host path. An image is used again for as long as the
+// file keeps its inode, size and modification time, so a program that is
+// run over and over, a compiler once per source file say, is opened,
+// mapped and parsed once.
+//
+class ProgramCache {
+public:
+    enum {
+        MAX_IMAGES = 64
+    };
+
+private:
+    struct Slot {
+        dev_t                            Device;
+        ino_t                            Inode;
+        off_t                            Size;
+        time_t                           MTime;
+        std::shared_ptr <ProgramImage>   Image;
+    };
+
+    std::unordered_map <std::string, Slot>  _images;
+    uint64_t                                _hits;
+    uint64_t                                _misses;
+
+public:
+    ProgramCache() : _hits(0), _misses(0) {}
+
+public:
+    // nullptr with errno set on failure
+    std::shared_ptr <ProgramImage> open(std::string const &HostPath);
+
+    uint64_t hits() const { return _hits; }
+    uint64_t misses() const { return _misses; }
+};
+
+#endif  // !__ProgramCache_h
@@ -0,0 +1,237 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "ProgramImage.h"
+#include "DOSFile.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+ProgramImage::ProgramImage() :
+    _map            (nullptr),
+    _size           (0),
+    _exe            (false),
+    _image          (nullptr),
+    _imageSize      (0),
+    _relocations    (nullptr),
+    _relocationCount(0)
+{
+}
+
+ProgramImage::~ProgramImage()
+{
+    if (_map != nullptr && _data.empty())
+        ::munmap(const_cast <char *> (_map), _size);
+}
+
+bool ProgramImage::
+open(char const *Path)
+{
+    int FD = ::open(Path, O_RDONLY);
+    if (FD < 0)
+        return false;
+
+    struct stat ST;
+    if (::fstat(FD, &ST) != 0) {
+        ::close(FD);
+        return false;
+    }
+    if (!S_ISREG(ST.st_mode) || ST.st_size == 0) {
+        ::close(FD);
+        errno = ENOEXEC;
+        return false;
+    }
+
+    void *Map = ::mmap(nullptr, ST.st_size, PROT_READ, MAP_PRIVATE, FD, 0);
+    ::close(FD);
+    if (Map == MAP_FAILED)
+        return false;
+
+    _map  = static_cast <char const *> (Map);
+    _size = ST.st_size;
+    return parse();
+}
+
+bool ProgramImage::
+read(DOSFile &File)
+{
+    off_t Size = File.seek(0, SEEK_END);
+    if (Size < 0 || File.seek(0, SEEK_SET) != 0)
+        return false;
+    if (Size == 0 || Size > static_cast <off_t> (GuestMemory::ADDRESS_SPACE)) {
+        errno = ENOEXEC;
+        return false;
+    }
+
+    _data.resize(Size);
+    for (off_t Done = 0; Done < Size; ) {
+        ssize_t Count = File.read(&_data[Done], Size - Done);
+        if (Count <= 0) {
+            if (Count == 0)
+                errno = ENOEXEC;
+            return false;
+        }
+        Done += Count;
+    }
+
+    _map  = _data.data();
+    _size = _data.size();
+    return parse();
+}
+
+bool ProgramImage::
+parse()
+{
+    _exe = _size >= sizeof(MZHeader) &&
+        (std::memcmp(_map, "MZ", 2) == 0 || std::memcmp(_map, "ZM", 2) == 0);
+    if (!_exe) {
+        if (_size > COM_LIMIT) {
+            errno = ENOEXEC;
+            return false;
+        }
+        _image     = _map;
+        _imageSize = _size;
+        return true;
+    }
+
+    std::memcpy(&_header, _map, sizeof(_header));
+
+    // the image is what the header says the file holds, less the header
+    size_t FileSize = _header.Pages * static_cast <size_t> (PAGE);
+    if (_header.LastPageBytes != 0)
+        FileSize -= PAGE - (_header.LastPageBytes & (PAGE - 1));
+    size_t HeaderSize = _header.HeaderParagraphs * static_cast <size_t>
+        (PARAGRAPH);
+    size_t TableEnd = _header.RelocationOffset +
+        _header.Relocations * sizeof(Relocation);
+
+    if (FileSize > _size || HeaderSize > FileSize || TableEnd > _size ||
+            FileSize - HeaderSize > GuestMemory::ADDRESS_SPACE) {
+        errno = ENOEXEC;
+        return false;
+    }
+
+    _image           = _map + HeaderSize;
+    _imageSize       = FileSize - HeaderSize;
+    _relocations     = reinterpret_cast <Relocation const *>
+        (_map + _header.RelocationOffset);
+    _relocationCount = _header.Relocations;
+    return true;
+}
+
+bool ProgramImage::
+load(GuestMemory &Memory, uint16_t PSPSegment, uint16_t EndSegment,
+        Entry &E) const
+{
+    uint32_t Start = GuestMemory::linear(PSPSegment, 0);
+    uint32_t End   = static_cast <uint32_t> (EndSegment) * PARAGRAPH;
+    char    *Base  = Memory.base();
+
+    if (!_exe) {
+        // all of a 64 KB segment, with a 0 at the top of the stack that a
+        // RET pops to reach the INT 20h at PSP:0
+        if (End < Start || End - Start < 0x10000) {
+            errno = ENOMEM;
+            return false;
+        }
+
+        std::memcpy(Base + Start + 0x100, _image, _imageSize);
+        std::memset(Base + Start + 0xFFFE, 0, 2);
+        Memory.dirty(Start + 0x100, _imageSize);
+        Memory.dirty(Start + 0xFFFE, 2);
+
+        E.CodeSegment  = PSPSegment;
+        E.CodeOffset   = 0x100;
+        E.StackSegment = PSPSegment;
+        E.StackOffset  = 0xFFFE;
+        return true;
+    }
+
+    uint16_t LoadSegment = PSPSegment + 0x10;
+    uint32_t Load        = Start + 0x100;
+    uint32_t Needed      = _imageSize + _header.MinAlloc *
+        static_cast <uint32_t> (PARAGRAPH);
+    if (End < Load || End - Load < Needed) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    std::memcpy(Base + Load, _image, _imageSize);
+    Memory.dirty(Load, _imageSize);
+    relocate(Memory, Load, End - Load - sizeof(uint16_t), LoadSegment);
+
+    E.CodeSegment  = LoadSegment + _header.CS;
+    E.CodeOffset   = _header.IP;
+    E.StackSegment = LoadSegment + _header.SS;
+    E.StackOffset  = _header.SP;
+    return true;
+}
+
+bool ProgramImage::
+loadOverlay(GuestMemory &Memory, uint16_t Segment, uint16_t Relocation) const
+{
+    uint32_t Load = static_cast <uint32_t> (Segment) * PARAGRAPH;
+    if (Load + _imageSize > GuestMemory::ADDRESS_SPACE) {
+        errno = ENOMEM;
+        return false;
+    }
+
+    std::memcpy(Memory.base() + Load, _image, _imageSize);
+    Memory.dirty(Load, _imageSize);
+    if (_exe) {
+        relocate(Memory, Load, GuestMemory::ADDRESS_SPACE - Load -
+                sizeof(uint16_t), Relocation);
+    }
+    return true;
+}
+
+uint32_t ProgramImage::
+minParagraphs() const
+{
+    if (!_exe)
+        return 0x1000;
+    return 0x10 + (_imageSize + PARAGRAPH - 1) / PARAGRAPH + _header.MinAlloc;
+}
+
+uint32_t ProgramImage::
+maxParagraphs() const
+{
+    if (!_exe)
+        return 0xFFFF;
+    return std::min <uint32_t> (0xFFFF, std::max(minParagraphs(), 0x10 +
+                static_cast <uint32_t> ((_imageSize + PARAGRAPH - 1) /
+                    PARAGRAPH) + _header.MaxAlloc));
+}
+
+// One pass over the table as mapped; the fixups are scattered, so there
+// is nothing to gain from SIMD. The caller marked the image dirty; a fixup
+// past it, in the program's uninitialized memory, is marked here.
+void ProgramImage::
+relocate(GuestMemory &Memory, uint32_t Load, uint32_t Limit,
+        uint16_t Factor) const
+{
+    char *Program = Memory.base() + Load;
+
+    for (size_t i = 0; i < _relocationCount; i++) {
+        Relocation R;
+        std::memcpy(&R, &_relocations[i], sizeof(R));
+
+        uint32_t Offset = static_cast <uint32_t> (R.Segment) * PARAGRAPH +
+            R.Offset;
+        if (Offset > Limit)
+            continue;
+
+        uint16_t Word;
+        std::memcpy(&Word, Program + Offset, sizeof(Word));
+        Word += Factor;
+        std::memcpy(Program + Offset, &Word, sizeof(Word));
+        if (Offset + sizeof(Word) > _imageSize)
+            Memory.dirty(Load + Offset, sizeof(Word));
+    }
+}
@@ -0,0 +1,105 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __ProgramImage_h
+#define __ProgramImage_h
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "GuestMemory.h"
+
+class DOSFile;
+
+//
+// A DOS program file, mapped read-only, or read into memory if it is not
+// a host file. An MZ .EXE is loaded one paragraph above its PSP with its
+// relocations applied; any other file is a .COM image that goes to
+// PSP:0100.
+//
+class ProgramImage {
+public:
+    enum {
+        PARAGRAPH = 16,
+        PAGE      = 512,        // MZ size unit
+        COM_LIMIT = 0xFF00      // bytes of a .COM image
+    };
+
+#pragma pack(push, 1)
+    struct MZHeader {
+        uint16_t Signature;         // "MZ" or "ZM"
+        uint16_t LastPageBytes;     // 0 if the last page is full
+        uint16_t Pages;             // including header and last page
+        uint16_t Relocations;
+        uint16_t HeaderParagraphs;
+        uint16_t MinAlloc;          // paragraphs needed beyond the image
+        uint16_t MaxAlloc;
+        uint16_t SS;                // relative to the load segment
+        uint16_t SP;
+        uint16_t Checksum;
+        uint16_t IP;
+        uint16_t CS;                // relative to the load segment
+        uint16_t RelocationOffset;
+        uint16_t Overlay;
+    };
+
+    // a word at Segment:Offset from the load segment, which is added to it
+    struct Relocation {
+        uint16_t Offset;
+        uint16_t Segment;
+    };
+#pragma pack(pop)
+
+    // initial CS:IP and SS:SP
+    struct Entry {
+        uint16_t CodeSegment;
+        uint16_t CodeOffset;
+        uint16_t StackSegment;
+        uint16_t StackOffset;
+    };
+
+private:
+    char const         *_map;
+    size_t              _size;
+    std::vector <char>  _data;          // read(), instead of a mapping
+    bool                _exe;
+    MZHeader            _header;
+    char const         *_image;
+    size_t              _imageSize;
+    Relocation const   *_relocations;
+    size_t              _relocationCount;
+
+public:
+    ProgramImage();
+    ~ProgramImage();
+
+public:
+    // false with errno set; ENOEXEC if the file is not a valid program
+    bool open(char const *Path);
+    bool read(DOSFile &File);
+
+    bool isEXE() const { return _exe; }
+    size_t imageSize() const { return _imageSize; }
+
+    // paragraphs from the PSP on that the program needs, and that it asks
+    // for at most
+    uint32_t minParagraphs() const;
+    uint32_t maxParagraphs() const;
+
+    // copy the program into memory for a PSP at PSPSegment, with memory
+    // up to EndSegment; false with errno ENOMEM if it does not fit
+    bool load(GuestMemory &Memory, uint16_t PSPSegment, uint16_t EndSegment,
+            Entry &E) const;
+
+    // the image alone at Segment:0, relocated by Relocation (EXEC overlay)
+    bool loadOverlay(GuestMemory &Memory, uint16_t Segment,
+            uint16_t Relocation) const;
+
+private:
+    bool parse();
+    void relocate(GuestMemory &Memory, uint32_t Load, uint32_t Limit,
+            uint16_t Factor) const;
+};
+
+#endif  // !__ProgramImage_h
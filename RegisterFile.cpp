@@ -0,0 +1,124 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "RegisterFile.h"
+#include "interface.h"
+#include "vmcs.h"
+
+namespace {
+
+hv_x86_reg_t const Registers[RegisterFile::SLOT_COUNT] = {
+    HV_X86_RIP, HV_X86_RFLAGS,
+    HV_X86_RAX, HV_X86_RCX, HV_X86_RDX, HV_X86_RBX,
+    HV_X86_RSI, HV_X86_RDI, HV_X86_RSP, HV_X86_RBP,
+    HV_X86_CS, HV_X86_SS, HV_X86_DS, HV_X86_ES, HV_X86_FS, HV_X86_GS
+};
+
+}
+
+RegisterFile::RegisterFile(hv_vcpuid_t vcpu) :
+    _vcpu (vcpu),
+    _valid(0),
+    _dirty(0),
+    _stats()
+{
+}
+
+int RegisterFile::
+slotOf(hv_x86_reg_t reg)
+{
+    switch (reg) {
+        case HV_X86_RIP:    return SLOT_RIP;
+        case HV_X86_RFLAGS: return SLOT_RFLAGS;
+        case HV_X86_RAX:    return SLOT_RAX;
+        case HV_X86_RCX:    return SLOT_RCX;
+        case HV_X86_RDX:    return SLOT_RDX;
+        case HV_X86_RBX:    return SLOT_RBX;
+        case HV_X86_RSI:    return SLOT_RSI;
+        case HV_X86_RDI:    return SLOT_RDI;
+        case HV_X86_RSP:    return SLOT_RSP;
+        case HV_X86_RBP:    return SLOT_RBP;
+        case HV_X86_CS:     return SLOT_CS;
+        case HV_X86_SS:     return SLOT_SS;
+        case HV_X86_DS:     return SLOT_DS;
+        case HV_X86_ES:     return SLOT_ES;
+        case HV_X86_FS:     return SLOT_FS;
+        case HV_X86_GS:     return SLOT_GS;
+        default:            break;
+    }
+    return -1;
+}
+
+hv_x86_reg_t RegisterFile::
+registerAt(int Slot)
+{
+    return Registers[Slot];
+}
+
+// in real mode a segment load also sets the hidden base, which
+// hv_vcpu_write_register does not do for us
+uint32_t RegisterFile::
+segmentBaseField(int slot)
+{
+    switch (slot) {
+        case SLOT_CS: return VMCS_GUEST_CS_BASE;
+        case SLOT_SS: return VMCS_GUEST_SS_BASE;
+        case SLOT_DS: return VMCS_GUEST_DS_BASE;
+        case SLOT_ES: return VMCS_GUEST_ES_BASE;
+        case SLOT_FS: return VMCS_GUEST_FS_BASE;
+        case SLOT_GS: return VMCS_GUEST_GS_BASE;
+        default:      break;
+    }
+    return 0;
+}
+
+uint64_t RegisterFile::
+read(hv_x86_reg_t reg)
+{
+    int Slot = slotOf(reg);
+    if (Slot < 0) {
+        _stats.Reads++;
+        return rreg(_vcpu, reg);
+    }
+
+    if ((_valid & (1u << Slot)) == 0) {
+        _stats.Reads++;
+        _values[Slot] = rreg(_vcpu, reg);
+        _valid |= 1u << Slot;
+    }
+    return _values[Slot];
+}
+
+void RegisterFile::
+write(hv_x86_reg_t reg, uint64_t v)
+{
+    int Slot = slotOf(reg);
+    if (Slot < 0) {
+        _stats.Writes++;
+        wreg(_vcpu, reg, v);
+        return;
+    }
+
+    _values[Slot] = v;
+    _valid |= 1u << Slot;
+    _dirty |= 1u << Slot;
+}
+
+void RegisterFile::
+sync()
+{
+    for (int Slot = 0; _dirty != 0; Slot++) {
+        if ((_dirty & (1u << Slot)) == 0)
+            continue;
+
+        _stats.Writes++;
+        wreg(_vcpu, Registers[Slot], _values[Slot]);
+        if (uint32_t Field = segmentBaseField(Slot)) {
+            wvmcs(_vcpu, Field, (_values[Slot] & 0xffff) << 4);
+        }
+        _dirty &= ~(1u << Slot);
+    }
+
+    _valid = 0;
+    _stats.Resumes++;
+}
@@ -0,0 +1,65 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __RegisterFile_h
+#define __RegisterFile_h
+
+#include <cstdint>
+#include <Hypervisor/hv_vmx.h>
+
+//
+// Per-exit snapshot of the guest registers the DOS kernel works with.
+//
+// Registers are fetched from the vCPU on first use after a VMEXIT and
+// written back by sync() only if they were modified, so a service call
+// costs one hypervisor call per register actually touched instead of one
+// per accessor.
+//
+class RegisterFile {
+public:
+    struct Stats {
+        uint64_t Reads;     // hv_vcpu_read_register calls
+        uint64_t Writes;    // hv_vcpu_write_register calls
+        uint64_t Resumes;   // sync() calls, i.e. guest entries
+    };
+
+    // the registers kept here, by slot
+    enum {
+        SLOT_RIP, SLOT_RFLAGS,
+        SLOT_RAX, SLOT_RCX, SLOT_RDX, SLOT_RBX,
+        SLOT_RSI, SLOT_RDI, SLOT_RSP, SLOT_RBP,
+        SLOT_CS, SLOT_SS, SLOT_DS, SLOT_ES, SLOT_FS, SLOT_GS,
+        SLOT_COUNT
+    };
+
+private:
+    hv_vcpuid_t  _vcpu;
+    uint64_t     _values[SLOT_COUNT];
+    uint32_t     _valid;
+    uint32_t     _dirty;
+    Stats        _stats;
+
+public:
+    explicit RegisterFile(hv_vcpuid_t vcpu);
+
+public:
+    uint64_t read(hv_x86_reg_t reg);
+    void write(hv_x86_reg_t reg, uint64_t v);
+
+    // write back dirty registers and forget the snapshot; must be called
+    // before every hv_vcpu_run
+    void sync();
+
+public:
+    Stats const &stats() const { return _stats; }
+
+    // slots written since the last sync(), as bits, and their registers
+    uint32_t modified() const { return _dirty; }
+    static hv_x86_reg_t registerAt(int Slot);
+
+private:
+    static int slotOf(hv_x86_reg_t reg);
+    static uint32_t segmentBaseField(int slot);
+};
+
+#endif  // !__RegisterFile_h
@@ -0,0 +1,106 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "ResetPoint.h"
+#include "DOSKernel.h"
+#include "vmcs.h"
+
+#include <cstring>
+#include <Hypervisor/hv.h>
+
+namespace {
+
+hv_memory_flags_t const ReadOnly  = HV_MEMORY_READ | HV_MEMORY_EXEC;
+hv_memory_flags_t const ReadWrite = HV_MEMORY_READ | HV_MEMORY_WRITE |
+    HV_MEMORY_EXEC;
+
+}
+
+ResetPoint::ResetPoint(DOSKernel &Kernel, hv_vcpuid_t vcpu) :
+    _kernel(Kernel),
+    _vcpu  (vcpu)
+{
+    std::memset(_dirty, 0, sizeof(_dirty));
+}
+
+ResetPoint::~ResetPoint()
+{
+    if (!_pristine.empty()) {
+        _kernel.memory().track(nullptr);
+        hv_vm_protect(0, GuestMemory::ADDRESS_SPACE, ReadWrite);
+    }
+}
+
+bool ResetPoint::
+capture()
+{
+    _kernel.flushConsole();
+    _kernel.registers().sync();
+    _state.captureVCPU(_vcpu);
+    if (!_kernel.save(_state))
+        return false;
+
+    char const *Memory = _kernel.memory().base();
+    _pristine.assign(Memory, Memory + GuestMemory::ADDRESS_SPACE);
+
+    std::memset(_dirty, 0, sizeof(_dirty));
+    _kernel.memory().track(_dirty);
+    hv_vm_protect(0, GuestMemory::ADDRESS_SPACE, ReadOnly);
+    return true;
+}
+
+// Each run of dirty pages is one copy and one hv_vm_protect() call, so
+// the cost follows the working set of the run, not the size of memory.
+bool ResetPoint::
+reset()
+{
+    uint64_t Start  = Stats::now();
+    char    *Memory = _kernel.memory().base();
+    size_t   Bytes  = 0;
+
+    for (uint32_t Page = 0; Page < GuestMemory::PAGE_COUNT; ) {
+        if ((_dirty[Page / 64] & (1ULL << (Page % 64))) == 0) {
+            // a clean word at a time
+            Page = (_dirty[Page / 64] >> (Page % 64)) == 0 ?
+                (Page / 64 + 1) * 64 : Page + 1;
+            continue;
+        }
+
+        uint32_t First = Page;
+        while (Page < GuestMemory::PAGE_COUNT &&
+                (_dirty[Page / 64] & (1ULL << (Page % 64))) != 0)
+            Page++;
+
+        size_t Offset = First * static_cast <size_t> (GuestMemory::PAGE_SIZE);
+        size_t Length = (Page - First) *
+            static_cast <size_t> (GuestMemory::PAGE_SIZE);
+        std::memcpy(Memory + Offset, &_pristine[Offset], Length);
+        hv_vm_protect(Offset, Length, ReadOnly);
+        Bytes += Length;
+    }
+    std::memset(_dirty, 0, sizeof(_dirty));
+
+    // the register cache goes first, as restoring writes the vCPU directly
+    _kernel.registers().sync();
+    _state.rewind();
+    _state.restoreVCPU(_vcpu);
+    bool Result = _kernel.restore(_state);
+
+    _kernel.stats().Reset.Latency.add(Stats::now() - Start);
+    _kernel.stats().Reset.Bytes += Bytes;
+    return Result;
+}
+
+bool ResetPoint::
+fault(uint64_t Address, uint64_t Qualification)
+{
+    if (_pristine.empty() || Address >= GuestMemory::ADDRESS_SPACE ||
+            (Qualification & EPT_VIOLATION_DATA_WRITE) == 0)
+        return false;
+
+    uint32_t Page = Address / GuestMemory::PAGE_SIZE;
+    _dirty[Page / 64] |= 1ULL << (Page % 64);
+    hv_vm_protect(Page * static_cast <uint64_t> (GuestMemory::PAGE_SIZE),
+            GuestMemory::PAGE_SIZE, ReadWrite);
+    return true;
+}
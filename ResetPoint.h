@@ -0,0 +1,48 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __ResetPoint_h
+#define __ResetPoint_h
+
+#include <cstdint>
+#include <vector>
+#include <Hypervisor/hv_vmx.h>
+
+#include "GuestMemory.h"
+#include "VMSnapshot.h"
+
+class DOSKernel;
+
+//
+// A machine as it was at capture(), to run again from there any number of
+// times. Guest memory is kept as a pristine copy, and reset() copies back
+// only the pages written since.
+//
+// The guest's writes are found through the EPT: every page is mapped
+// read-only, and the first write to one exits with an EPT fault, which
+// fault() records before making the page writable again. The host's own
+// writes are recorded by GuestMemory::dirty().
+//
+class ResetPoint {
+private:
+    DOSKernel          &_kernel;
+    hv_vcpuid_t         _vcpu;
+    VMSnapshot          _state;
+    std::vector <char>  _pristine;
+    uint64_t            _dirty[GuestMemory::PAGE_COUNT / 64];
+
+public:
+    ResetPoint(DOSKernel &Kernel, hv_vcpuid_t vcpu);
+    ~ResetPoint();
+
+public:
+    // false with errno set if the kernel state cannot be saved
+    bool capture();
+    bool reset();
+
+    // an EPT fault at guest physical Address; false if it is not a write
+    // to a tracked page
+    bool fault(uint64_t Address, uint64_t Qualification);
+};
+
+#endif  // !__ResetPoint_h
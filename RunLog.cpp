@@ -0,0 +1,582 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "RunLog.h"
+#include "DOSKernel.h"
+#include "vmcs.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+char const Magic[8] = { 'H', 'V', 'D', 'O', 'S', 'R', 'L', '1' };
+
+// a word this many times over is a run of its own
+size_t const MinimumRepeat = 4;
+
+hv_x86_reg_t const Arguments[RunLog::ARGUMENTS] = {
+    HV_X86_RAX, HV_X86_RBX, HV_X86_RCX, HV_X86_RDX,
+    HV_X86_RSI, HV_X86_RDI, HV_X86_DS, HV_X86_ES
+};
+
+char const *const ArgumentNames[RunLog::ARGUMENTS] = {
+    "AX", "BX", "CX", "DX", "SI", "DI", "DS", "ES"
+};
+
+bool
+WriteAll(int FD, uint8_t const *Bytes, size_t Length)
+{
+    while (Length != 0) {
+        ssize_t Count = ::write(FD, Bytes, Length);
+        if (Count < 0 && errno == EINTR)
+            continue;
+        if (Count <= 0)
+            return false;
+        Bytes  += Count;
+        Length -= Count;
+    }
+    return true;
+}
+
+// times the word at Bytes repeats from there, within Length bytes
+size_t
+Repeats(char const *Bytes, size_t Length)
+{
+    size_t Count = 1;
+    while (2 * (Count + 1) <= Length &&
+            std::memcmp(Bytes, Bytes + 2 * Count, 2) == 0)
+        Count++;
+    return Count;
+}
+
+}
+
+RunLog::RunLog(DOSKernel &Kernel) :
+    _kernel      (Kernel),
+    _mode        (MODE_RECORD),
+    _fd          (-1),
+    _next        (0),
+    _pendingSince(0),
+    _events      (0),
+    _request     (),
+    _exitStatus  (0)
+{
+}
+
+RunLog::~RunLog()
+{
+    if (_fd >= 0)
+        finish();
+}
+
+bool RunLog::
+parse(char const *Text, Options &O)
+{
+    if (std::strncmp(Text, "record:", 7) == 0)
+        O.Type = MODE_RECORD;
+    else if (std::strncmp(Text, "replay:", 7) == 0)
+        O.Type = MODE_REPLAY;
+    else
+        return false;
+
+    O.Path = Text + 7;
+    return !O.Path.empty();
+}
+
+bool RunLog::
+open(Options const &O)
+{
+    _mode = O.Type;
+    _path = O.Path;
+
+    if (_mode == MODE_RECORD) {
+        _fd = ::open(_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+                0644);
+        if (_fd < 0)
+            return false;
+        _bytes.assign(Magic, Magic + sizeof(Magic));
+        return true;
+    }
+
+    // read all of it up front, so that replaying does no I/O of its own
+    int FD = ::open(_path.c_str(), O_RDONLY);
+    if (FD < 0)
+        return false;
+
+    struct stat ST;
+    if (fstat(FD, &ST) != 0) {
+        ::close(FD);
+        return false;
+    }
+
+    _bytes.resize(ST.st_size);
+    size_t Done = 0;
+    while (Done < _bytes.size()) {
+        ssize_t Count = ::read(FD, _bytes.data() + Done,
+                _bytes.size() - Done);
+        if (Count < 0 && errno == EINTR)
+            continue;
+        if (Count <= 0) {
+            if (Count == 0)
+                errno = EINVAL;
+            ::close(FD);
+            return false;
+        }
+        Done += Count;
+    }
+
+    if (_bytes.size() < sizeof(Magic) ||
+            std::memcmp(_bytes.data(), Magic, sizeof(Magic)) != 0) {
+        ::close(FD);
+        errno = EINVAL;
+        return false;
+    }
+
+    _fd   = FD;
+    _next = sizeof(Magic);
+    return true;
+}
+
+bool RunLog::
+start()
+{
+    GuestMemory  &Memory = _kernel.memory();
+    RegisterFile &Regs   = _kernel.registers();
+
+    if (replaying()) {
+        uint64_t Kind;
+        if (!getNumber(Kind) || Kind != KIND_START) {
+            errno = EINVAL;
+            return false;
+        }
+
+        // all of memory, for a machine that was not booted
+        if (!applyEffects()) {
+            errno = EINVAL;
+            return false;
+        }
+        _events++;
+        return true;
+    }
+
+    // every register, and memory as one range; the runs make it small
+    for (int Slot = 0; Slot < RegisterFile::SLOT_COUNT; Slot++)
+        Regs.read(RegisterFile::registerAt(Slot));
+
+    putNumber(KIND_START);
+    _writes.assign(1, GuestMemory::Range { 0, GuestMemory::ADDRESS_SPACE });
+    putEffects((1u << RegisterFile::SLOT_COUNT) - 1);
+    _events++;
+
+    // from here on, what the kernel writes is part of the event
+    _writes.clear();
+    Memory.journal(&_writes);
+    _kernel.console().capture(&_output);
+    return flush();
+}
+
+bool RunLog::
+isEvent(uint64_t Reason)
+{
+    return Reason == EXIT_REASON_VMCALL || Reason == EXIT_REASON_HLT ||
+        Reason == EXIT_REASON_RDTSC;
+}
+
+void RunLog::
+begin(uint64_t Reason)
+{
+    if (isEvent(Reason))
+        _request = request(Reason);
+}
+
+bool RunLog::
+end(uint64_t Reason, int Status)
+{
+    uint32_t Registers = _kernel.registers().modified();
+
+    if (isEvent(Reason)) {
+        putNumber(_request.Kind);
+        putNumber(_request.CS);
+        putNumber(_request.IP);
+        if (_request.Kind == KIND_TRAP) {
+            putNumber(_request.Vector);
+            for (int i = 0; i < ARGUMENTS; i++)
+                putNumber(_request.Arguments[i]);
+        }
+        putNumber(Status);
+        if (Status == DOSKernel::STATUS_STOP)
+            putNumber(_kernel.exitStatus());
+        putEffects(Registers);
+        _events++;
+    } else if (Registers != 0 || !_writes.empty() || !_output.empty()) {
+        putNumber(KIND_TICK);
+        putEffects(Registers);
+        _events++;
+    }
+
+    _writes.clear();
+    _output.clear();
+
+    if (_bytes.size() >= FLUSH_SIZE ||
+            (!_bytes.empty() && Stats::now() - _pendingSince >= FLUSH_NANOS))
+        return flush();
+    return true;
+}
+
+int RunLog::
+replay(uint64_t Reason)
+{
+    Request Asked = request(Reason);
+
+    // the ticks the guest would have seen by now
+    size_t   Position = _next;
+    uint64_t Kind;
+    while (getNumber(Kind) && Kind == KIND_TICK) {
+        if (!applyEffects())
+            return malformed();
+        _events++;
+        Position = _next;
+    }
+    _next = Position;
+
+    Request Recorded;
+    if (_next == _bytes.size()) {
+        std::fprintf(stderr, "%s: event %llu: ", _path.c_str(),
+                static_cast <unsigned long long> (_events));
+        describe(Asked, stderr);
+        std::fprintf(stderr, " after the end of the log\n");
+        return DOSKernel::STATUS_UNSUPPORTED;
+    }
+    if (!getRequest(Recorded))
+        return malformed();
+
+    if (std::memcmp(&Asked, &Recorded, sizeof(Asked)) != 0) {
+        std::fprintf(stderr, "%s: event %llu diverged\n  asked    ",
+                _path.c_str(), static_cast <unsigned long long> (_events));
+        describe(Asked, stderr);
+        std::fprintf(stderr, "\n  recorded ");
+        describe(Recorded, stderr);
+        std::fprintf(stderr, "\n");
+        return DOSKernel::STATUS_UNSUPPORTED;
+    }
+
+    uint64_t Status, ExitStatus = 0;
+    if (!getNumber(Status) || (Status == DOSKernel::STATUS_STOP &&
+                !getNumber(ExitStatus)) || !applyEffects())
+        return malformed();
+
+    _exitStatus = static_cast <int> (ExitStatus);
+    _events++;
+    return static_cast <int> (Status);
+}
+
+void RunLog::
+replayTick()
+{
+    size_t   Position = _next;
+    uint64_t Kind;
+    if (!getNumber(Kind) || Kind != KIND_TICK) {
+        _next = Position;
+        return;
+    }
+
+    if (!applyEffects()) {
+        // the next event reports it
+        _next = Position;
+        return;
+    }
+    _events++;
+}
+
+bool RunLog::
+finish()
+{
+    bool Written = true;
+    if (recording()) {
+        _kernel.memory().journal(nullptr);
+        _kernel.console().capture(nullptr);
+        Written = flush();
+    }
+
+    if (_fd >= 0 && ::close(_fd) != 0)
+        Written = false;
+    _fd = -1;
+    return Written;
+}
+
+// the guest's request at an event exit, which its handling changes
+RunLog::Request RunLog::
+request(uint64_t Reason)
+{
+    RegisterFile &Regs = _kernel.registers();
+    Request       R;
+
+    std::memset(&R, 0, sizeof(R));
+    R.CS = static_cast <uint16_t> (Regs.read(HV_X86_CS));
+    R.IP = static_cast <uint16_t> (Regs.read(HV_X86_RIP));
+
+    switch (Reason) {
+        case EXIT_REASON_HLT:
+            R.Kind = KIND_HALT;
+            return R;
+        case EXIT_REASON_RDTSC:
+            R.Kind = KIND_RDTSC;
+            return R;
+        default:
+            break;
+    }
+
+    // a service call is where it returns to; a VMCALL outside the stubs
+    // is where it is, and fails again
+    R.Kind = KIND_TRAP;
+    if (_kernel.bios().trapVector(R.CS, R.IP, R.Vector)) {
+        uint16_t Frame[2];
+        _kernel.memory().read(static_cast <uint16_t> (Regs.read(HV_X86_SS)),
+                static_cast <uint16_t> (Regs.read(HV_X86_RSP)), Frame,
+                sizeof(Frame));
+        R.IP = Frame[0];
+        R.CS = Frame[1];
+    }
+    for (int i = 0; i < ARGUMENTS; i++)
+        R.Arguments[i] = static_cast <uint16_t> (Regs.read(Arguments[i]));
+    return R;
+}
+
+void RunLog::
+describe(Request const &R, FILE *F) const
+{
+    switch (R.Kind) {
+        case KIND_HALT:
+            std::fprintf(F, "HLT");
+            break;
+        case KIND_RDTSC:
+            std::fprintf(F, "RDTSC");
+            break;
+        default:
+            std::fprintf(F, "INT %02Xh", R.Vector);
+            for (int i = 0; i < ARGUMENTS; i++)
+                std::fprintf(F, " %s=%04X", ArgumentNames[i],
+                        R.Arguments[i]);
+            break;
+    }
+    std::fprintf(F, R.Kind == KIND_TRAP ? " returning to %04X:%04X" :
+            " at %04X:%04X", R.CS, R.IP);
+}
+
+void RunLog::
+putNumber(uint64_t V)
+{
+    if (_bytes.empty())
+        _pendingSince = Stats::now();
+
+    while (V >= 0x80) {
+        _bytes.push_back(static_cast <uint8_t> (V | 0x80));
+        V >>= 7;
+    }
+    _bytes.push_back(static_cast <uint8_t> (V));
+}
+
+// Length bytes as runs, each a number of Count << 1 | Repeat: Count bytes
+// that follow, or the word that follows Count times
+void RunLog::
+putRun(char const *Bytes, size_t Length)
+{
+    size_t Literal = 0;
+    size_t i       = 0;
+
+    while (i < Length) {
+        size_t Count = Repeats(Bytes + i, Length - i);
+        if (i + 1 >= Length || Count < MinimumRepeat) {
+            i++;
+            continue;
+        }
+
+        if (Literal < i) {
+            putNumber((i - Literal) << 1);
+            _bytes.insert(_bytes.end(), Bytes + Literal, Bytes + i);
+        }
+        putNumber(Count << 1 | 1);
+        _bytes.insert(_bytes.end(), Bytes + i, Bytes + i + 2);
+        i      += 2 * Count;
+        Literal = i;
+    }
+
+    if (Literal < Length) {
+        putNumber((Length - Literal) << 1);
+        _bytes.insert(_bytes.end(), Bytes + Literal, Bytes + Length);
+    }
+}
+
+// the registers in the Registers mask of slots, what _writes covers of
+// guest memory as it is now, and _output
+void RunLog::
+putEffects(uint32_t Registers)
+{
+    RegisterFile &Regs = _kernel.registers();
+
+    putNumber(Registers);
+    for (int Slot = 0; Slot < RegisterFile::SLOT_COUNT; Slot++) {
+        if (Registers & (1u << Slot))
+            putNumber(Regs.read(RegisterFile::registerAt(Slot)));
+    }
+
+    // the same bytes are often written more than once in a call
+    std::sort(_writes.begin(), _writes.end(),
+            [] (GuestMemory::Range const &A, GuestMemory::Range const &B)
+                { return A.Linear < B.Linear; });
+    size_t Count = 0;
+    for (size_t i = 0; i < _writes.size(); i++) {
+        GuestMemory::Range const &W = _writes[i];
+        if (Count != 0 && W.Linear <= _writes[Count - 1].Linear +
+                _writes[Count - 1].Length) {
+            GuestMemory::Range &Last = _writes[Count - 1];
+            Last.Length = std::max(Last.Length,
+                    W.Linear + W.Length - Last.Linear);
+        } else {
+            _writes[Count++] = W;
+        }
+    }
+    _writes.resize(Count);
+
+    char const *Base = _kernel.memory().base();
+    putNumber(_writes.size());
+    for (auto const &W : _writes) {
+        putNumber(W.Linear);
+        putNumber(W.Length);
+        putRun(Base + W.Linear, W.Length);
+    }
+
+    putNumber(_output.size());
+    _bytes.insert(_bytes.end(), _output.begin(), _output.end());
+}
+
+bool RunLog::
+flush()
+{
+    if (_bytes.empty())
+        return true;
+
+    bool Written = WriteAll(_fd, _bytes.data(), _bytes.size());
+    _bytes.clear();
+    return Written;
+}
+
+bool RunLog::
+getNumber(uint64_t &V)
+{
+    V = 0;
+    for (int Shift = 0; _next < _bytes.size() && Shift < 64; Shift += 7) {
+        uint8_t B = _bytes[_next++];
+        V |= static_cast <uint64_t> (B & 0x7F) << Shift;
+        if ((B & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool RunLog::
+getRun(char *Bytes, size_t Length)
+{
+    while (Length != 0) {
+        uint64_t Token;
+        if (!getNumber(Token))
+            return false;
+
+        uint64_t Count = Token >> 1;
+        if ((Token & 1) != 0) {
+            if (Count > Length / 2 || _bytes.size() - _next < 2)
+                return false;
+            for (uint64_t i = 0; i < Count; i++)
+                std::memcpy(Bytes + 2 * i, &_bytes[_next], 2);
+            _next  += 2;
+            Count  *= 2;
+        } else {
+            if (Count > Length || _bytes.size() - _next < Count)
+                return false;
+            std::memcpy(Bytes, &_bytes[_next], Count);
+            _next += Count;
+        }
+        Bytes  += Count;
+        Length -= Count;
+    }
+    return true;
+}
+
+bool RunLog::
+getRequest(Request &R)
+{
+    uint64_t Kind, CS, IP, V;
+
+    std::memset(&R, 0, sizeof(R));
+    if (!getNumber(Kind) || !getNumber(CS) || !getNumber(IP))
+        return false;
+    R.Kind = static_cast <uint8_t> (Kind);
+    R.CS   = static_cast <uint16_t> (CS);
+    R.IP   = static_cast <uint16_t> (IP);
+    if (R.Kind != KIND_TRAP)
+        return R.Kind == KIND_HALT || R.Kind == KIND_RDTSC;
+
+    if (!getNumber(V))
+        return false;
+    R.Vector = static_cast <uint8_t> (V);
+    for (int i = 0; i < ARGUMENTS; i++) {
+        if (!getNumber(V))
+            return false;
+        R.Arguments[i] = static_cast <uint16_t> (V);
+    }
+    return true;
+}
+
+// what putEffects() wrote, done to the guest
+bool RunLog::
+applyEffects()
+{
+    RegisterFile &Regs = _kernel.registers();
+    GuestMemory  &Mem  = _kernel.memory();
+    uint64_t      Registers, Ranges, Length;
+
+    if (!getNumber(Registers))
+        return false;
+    for (int Slot = 0; Slot < RegisterFile::SLOT_COUNT; Slot++) {
+        uint64_t V;
+        if ((Registers & (1u << Slot)) == 0)
+            continue;
+        if (!getNumber(V))
+            return false;
+        Regs.write(RegisterFile::registerAt(Slot), V);
+    }
+
+    if (!getNumber(Ranges))
+        return false;
+    for (uint64_t i = 0; i < Ranges; i++) {
+        uint64_t Linear;
+        if (!getNumber(Linear) || !getNumber(Length) ||
+                Linear > GuestMemory::ADDRESS_SPACE ||
+                Length > GuestMemory::ADDRESS_SPACE - Linear ||
+                !getRun(Mem.base() + Linear, Length))
+            return false;
+        Mem.dirty(static_cast <uint32_t> (Linear), Length);
+    }
+
+    if (!getNumber(Length) || _bytes.size() - _next < Length)
+        return false;
+    if (Length != 0) {
+        _kernel.console().writeStream(&_bytes[_next], Length);
+        _next += Length;
+    }
+    return true;
+}
+
+int RunLog::
+malformed()
+{
+    std::fprintf(stderr, "%s: event %llu is malformed\n", _path.c_str(),
+            static_cast <unsigned long long> (_events));
+    return DOSKernel::STATUS_UNSUPPORTED;
+}
@@ -0,0 +1,153 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __RunLog_h
+#define __RunLog_h
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "GuestMemory.h"
+
+class DOSKernel;
+
+//
+// What a run got from the host, in order, so that it can be run again
+// without the host (hvdos -L).
+//
+// The guest learns about the host only at the exits it makes itself: a
+// service call reaching a BIOS trap stub, HLT and RDTSC (which exits while
+// there is a log). Each is an event, and the log has what the kernel did
+// about it: the registers it set, the guest memory it wrote, as reported
+// to GuestMemory::dirty() anyway, and what it wrote to standard output
+// (console output shown on the screen is in guest memory). Keys, file
+// contents, file sizes and dates, directory listings and the time all
+// reach the guest that way. Replaying puts the recorded effects in place
+// of the kernel's, so nothing is read from the host and nothing waited
+// for, provided the guest asks for the same: the same vector with the same
+// AX BX CX DX SI DI DS ES from the same place, or HLT or RDTSC at the same
+// address. The first call that differs is a divergence, reported with its
+// event number, the first event after the start being 1.
+//
+// The only other way in is the BDA tick count, refreshed on host interrupt
+// exits as well. A change to it between events is an event of its own,
+// replayed at the first interrupt exit, or event, once the one before it
+// was; a guest that counts its own reads of it until the tick changes may
+// count differently.
+//
+//   "HVDOSRL1"
+//   start       all of guest memory and the registers, as loaded
+//   event ...   kind, request, status, registers, memory, output
+//
+// Numbers are unsigned LEB128; memory is runs of bytes or repeated words.
+//
+class RunLog {
+public:
+    enum Mode {
+        MODE_RECORD,
+        MODE_REPLAY
+    };
+
+    enum {
+        FLUSH_SIZE  = 64 * 1024,
+        FLUSH_NANOS = 20 * 1000 * 1000,
+        ARGUMENTS   = 8                 // AX BX CX DX SI DI DS ES
+    };
+
+    struct Options {
+        Mode         Type;
+        std::string  Path;
+    };
+
+private:
+    enum Kind {
+        KIND_START,
+        KIND_TRAP,
+        KIND_HALT,
+        KIND_RDTSC,
+        KIND_TICK               // the BDA changed between events
+    };
+
+    // what the guest asked for
+    struct Request {
+        uint8_t     Kind;
+        uint8_t     Vector;                 // KIND_TRAP
+        uint16_t    CS;                     // after the INT, or of HLT/RDTSC
+        uint16_t    IP;
+        uint16_t    Arguments[ARGUMENTS];   // KIND_TRAP
+    };
+
+    DOSKernel                          &_kernel;
+    Mode                                _mode;
+    int                                 _fd;
+    std::string                         _path;
+    std::vector <uint8_t>               _bytes;     // unwritten, or all read
+    size_t                              _next;      // of _bytes, replaying
+    uint64_t                            _pendingSince;
+    uint64_t                            _events;
+    Request                             _request;   // of the exit, recording
+    std::vector <GuestMemory::Range>    _writes;
+    std::string                         _output;
+    int                                 _exitStatus;
+
+public:
+    explicit RunLog(DOSKernel &Kernel);
+    ~RunLog();
+
+public:
+    // "record:path" or "replay:path"
+    static bool parse(char const *Text, Options &O);
+
+    // false with errno set
+    bool open(Options const &O);
+
+    bool recording() const { return _fd >= 0 && _mode == MODE_RECORD; }
+    bool replaying() const { return _fd >= 0 && _mode == MODE_REPLAY; }
+
+    // the machine as loaded: written, or set as it was; false with errno
+    // set (EINVAL for a log that is not one)
+    bool start();
+
+    // the exits that are events
+    static bool isEvent(uint64_t Reason);
+
+    // recording, around the handling of every exit and the tick() after
+    // it; false with errno set if the log cannot be written
+    void begin(uint64_t Reason);
+    bool end(uint64_t Reason, int Status);
+
+    // replaying, in place of handling an event exit: the status it had,
+    // or STATUS_UNSUPPORTED after reporting a divergence
+    int replay(uint64_t Reason);
+
+    // replaying, at any other exit: a recorded tick, if one is next
+    void replayTick();
+
+    // the rest written and the log closed; false with errno set
+    bool finish();
+
+    std::string const &path() const { return _path; }
+    uint64_t events() const { return _events; }
+
+    // AL of the recorded EXIT
+    int exitStatus() const { return _exitStatus; }
+
+private:
+    Request request(uint64_t Reason);
+    void describe(Request const &R, FILE *F) const;
+
+    void putNumber(uint64_t V);
+    void putRun(char const *Bytes, size_t Length);
+    void putEffects(uint32_t Registers);
+    bool flush();
+
+    bool getNumber(uint64_t &V);
+    bool getRun(char *Bytes, size_t Length);
+    bool getRequest(Request &R);
+    bool applyEffects();
+    int malformed();
+};
+
+#endif  // !__RunLog_h
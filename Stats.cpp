@@ -0,0 +1,185 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "Stats.h"
+#include "DOSKernel.h"
+
+#include <cstring>
+
+namespace {
+
+char const *
+ExitReasonName(int Reason)
+{
+    switch (Reason) {
+        case 0:  return "EXCEPTION";
+        case 1:  return "EXT_INTR";
+        case 2:  return "TRIPLE_FAULT";
+        case 7:  return "INTR_WINDOW";
+        case 10: return "CPUID";
+        case 12: return "HLT";
+        case 16: return "RDTSC";
+        case 18: return "VMCALL";
+        case 28: return "CR_ACCESS";
+        case 30: return "INOUT";
+        case 31: return "RDMSR";
+        case 32: return "WRMSR";
+        case 40: return "PAUSE";
+        case 48: return "EPT_FAULT";
+        case 49: return "EPT_MISCONFIG";
+        case 52: return "VMX_PREEMPT";
+        default: break;
+    }
+    return "OTHER";
+}
+
+void
+WriteHistogram(FILE *F, Stats::Histogram const &H)
+{
+    int Last = Stats::HISTOGRAM_BUCKETS - 1;
+    while (Last > 0 && H.Buckets[Last] == 0)
+        Last--;
+
+    std::fprintf(F, "\"count\": %llu, \"total_ns\": %llu, \"max_ns\": %llu, "
+            "\"histogram_log2_ns\": [",
+            static_cast <unsigned long long> (H.Count),
+            static_cast <unsigned long long> (H.TotalNanos),
+            static_cast <unsigned long long> (H.MaxNanos));
+    for (int i = 0; i <= Last; i++) {
+        std::fprintf(F, "%s%llu", i ? ", " : "",
+                static_cast <unsigned long long> (H.Buckets[i]));
+    }
+    std::fprintf(F, "]");
+}
+
+void
+WriteEntries(FILE *F, char const *Key, Stats::Entry const *Entries,
+        DOSKernel::Service const &(DOSKernel::*Lookup)(uint8_t) const,
+        DOSKernel const &Kernel)
+{
+    bool First = true;
+
+    std::fprintf(F, "  \"%s\": [", Key);
+    for (int i = 0; i < 256; i++) {
+        Stats::Entry const &E = Entries[i];
+        uint64_t Hits = (Kernel.*Lookup)(i).Hits;
+        if (E.Latency.Count == 0 && Hits == 0)
+            continue;
+
+        char const *Name = (Kernel.*Lookup)(i).Name;
+        std::fprintf(F, "%s\n    { \"id\": %d, \"name\": \"%s\", "
+                "\"hits\": %llu, \"bytes\": %llu, ",
+                First ? "" : ",", i, Name ? Name : "UNHANDLED",
+                static_cast <unsigned long long> (Hits),
+                static_cast <unsigned long long> (E.Bytes));
+        WriteHistogram(F, E.Latency);
+        std::fprintf(F, " }");
+        First = false;
+    }
+    std::fprintf(F, "\n  ]");
+}
+
+}
+
+void Stats::Histogram::
+add(uint64_t Nanos)
+{
+    int Bucket = 0;
+    for (uint64_t N = Nanos; N != 0 && Bucket < HISTOGRAM_BUCKETS - 1; N >>= 1)
+        Bucket++;
+
+    Count++;
+    TotalNanos += Nanos;
+    if (Nanos > MaxNanos)
+        MaxNanos = Nanos;
+    Buckets[Bucket]++;
+}
+
+Stats::Stats()
+{
+    std::memset(this, 0, sizeof(*this));
+}
+
+void Stats::
+writeJSON(FILE *F, DOSKernel const &Kernel) const
+{
+    RegisterFile::Stats const &RS = Kernel.registers().stats();
+
+    std::fprintf(F, "{\n  \"guest\": { ");
+    WriteHistogram(F, Guest);
+    std::fprintf(F, " },\n");
+
+    // loading cost per megabyte of image, for comparing loaders, and how
+    // often EXEC found the program parsed already
+    std::fprintf(F, "  \"load\": { \"bytes\": %llu, \"ns_per_mb\": %llu, "
+            "\"cache_hits\": %llu, \"cache_misses\": %llu, ",
+            static_cast <unsigned long long> (Load.Bytes),
+            static_cast <unsigned long long> (Load.Bytes ?
+                Load.Latency.TotalNanos * (1 << 20) / Load.Bytes : 0),
+            static_cast <unsigned long long> (Kernel.programs().hits()),
+            static_cast <unsigned long long> (Kernel.programs().misses()));
+    WriteHistogram(F, Load.Latency);
+    std::fprintf(F, " },\n");
+
+    std::fprintf(F, "  \"reset\": { \"bytes\": %llu, ",
+            static_cast <unsigned long long> (Reset.Bytes));
+    WriteHistogram(F, Reset.Latency);
+    std::fprintf(F, " },\n");
+
+    std::fprintf(F, "  \"parked\": { ");
+    WriteHistogram(F, Parked.Latency);
+    std::fprintf(F, " },\n");
+
+    std::fprintf(F, "  \"memory\": { \"bytes\": %llu, \"page_size\": %llu, "
+            "\"resident_pages\": %llu, \"touched_pages\": %llu, "
+            "\"prefault_ns\": %llu },\n",
+            static_cast <unsigned long long> (Memory.Bytes),
+            static_cast <unsigned long long> (Memory.PageSize),
+            static_cast <unsigned long long> (Memory.ResidentPages),
+            static_cast <unsigned long long> (Memory.TouchedPages),
+            static_cast <unsigned long long> (Memory.PrefaultNanos));
+
+    // how long the guest waited, and how far virtual time has come
+    VirtualClock const &C = Kernel.clock();
+    std::fprintf(F, "  \"clock\": { \"mode\": \"%s\", \"waits\": %llu, "
+            "\"idle_ns\": %llu, \"virtual_ns\": %llu },\n",
+            C.mode() == VirtualClock::MODE_VIRTUAL ? "virtual" : "host",
+            static_cast <unsigned long long> (C.waits()),
+            static_cast <unsigned long long> (C.idleNanos()),
+            static_cast <unsigned long long> (C.elapsed()));
+
+    // host calls behind DOS file handles; a read served from a mapping or
+    // the read-ahead buffer makes none
+    DOSFile::Counters const &FC = Kernel.fileSystem().counters();
+    std::fprintf(F, "  \"files\": { \"syscalls\": %llu, \"refills\": %llu, "
+            "\"mapped\": %llu },\n",
+            static_cast <unsigned long long> (FC.Syscalls),
+            static_cast <unsigned long long> (FC.Refills),
+            static_cast <unsigned long long> (FC.Mapped));
+
+    std::fprintf(F, "  \"registers\": { \"reads\": %llu, \"writes\": %llu, "
+            "\"resumes\": %llu },\n",
+            static_cast <unsigned long long> (RS.Reads),
+            static_cast <unsigned long long> (RS.Writes),
+            static_cast <unsigned long long> (RS.Resumes));
+
+    bool First = true;
+    std::fprintf(F, "  \"exit_reasons\": [");
+    for (int i = 0; i < EXIT_REASONS; i++) {
+        if (ExitReasons[i].Latency.Count == 0)
+            continue;
+
+        std::fprintf(F, "%s\n    { \"id\": %d, \"name\": \"%s\", ",
+                First ? "" : ",", i, ExitReasonName(i));
+        WriteHistogram(F, ExitReasons[i].Latency);
+        std::fprintf(F, " }");
+        First = false;
+    }
+    std::fprintf(F, "\n  ],\n");
+
+    WriteEntries(F, "interrupts", Vectors, &DOSKernel::interrupt, Kernel);
+    std::fprintf(F, ",\n");
+    WriteEntries(F, "dos_functions", DOSFunctions, &DOSKernel::dosFunction,
+            Kernel);
+    std::fprintf(F, "\n}\n");
+}
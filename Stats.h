@@ -0,0 +1,77 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __Stats_h
+#define __Stats_h
+
+#include <cstdint>
+#include <cstdio>
+#include <time.h>
+
+class DOSKernel;
+
+//
+// Always-on run accounting: counters and log2-bucketed latency
+// histograms per VMEXIT reason, per interrupt vector and per INT 21h
+// function. Recording is a handful of adds, so it stays enabled; the
+// JSON dump is only produced on request (hvdos -s).
+//
+class Stats {
+public:
+    enum {
+        HISTOGRAM_BUCKETS = 32,     // bucket i: [2^(i-1), 2^i) ns
+        EXIT_REASONS      = 64
+    };
+
+    struct Histogram {
+        uint64_t Count;
+        uint64_t TotalNanos;
+        uint64_t MaxNanos;
+        uint64_t Buckets[HISTOGRAM_BUCKETS];
+
+        void add(uint64_t Nanos);
+    };
+
+    struct Entry {
+        Histogram Latency;
+        uint64_t  Bytes;
+    };
+
+    // guest memory, in host pages
+    struct MemoryUse {
+        uint64_t  Bytes;
+        uint64_t  PageSize;
+        uint64_t  ResidentPages;    // at exit
+        uint64_t  TouchedPages;     // first touched while the guest ran
+        uint64_t  PrefaultNanos;
+    };
+
+public:
+    Histogram Guest;                        // time spent in hv_vcpu_run
+    Entry     ExitReasons[EXIT_REASONS];    // host time per exit, by reason
+    Entry     Vectors[256];                 // handler time, by vector
+    Entry     DOSFunctions[256];            // handler time, by INT 21h AH
+    Entry     Load;                         // program loading, image bytes
+    Entry     Reset;                        // ResetPoint::reset(), page bytes
+    Entry     Parked;                       // input polls parked on the host
+    MemoryUse Memory;
+
+public:
+    Stats();
+
+public:
+    static uint64_t now() {
+        struct timespec TS;
+        clock_gettime(CLOCK_MONOTONIC, &TS);
+        return static_cast <uint64_t> (TS.tv_sec) * 1000000000 + TS.tv_nsec;
+    }
+
+    void addExit(uint64_t Reason, uint64_t Nanos) {
+        ExitReasons[Reason < EXIT_REASONS ? Reason : EXIT_REASONS - 1]
+            .Latency.add(Nanos);
+    }
+
+    void writeJSON(FILE *F, DOSKernel const &Kernel) const;
+};
+
+#endif  // !__Stats_h
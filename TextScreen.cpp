@@ -0,0 +1,612 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "TextScreen.h"
+#include "Stats.h"
+#include "VirtualClock.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+namespace {
+
+enum {
+    BDA_SEGMENT       = 0x0040,
+    BDA_VIDEO_MODE    = 0x49,
+    BDA_VIDEO_COLS    = 0x4A,
+    BDA_PAGE_SIZE     = 0x4C,
+    BDA_PAGE_OFFSET   = 0x4E,
+    BDA_CURSORS       = 0x50,       // column, row for each of 8 pages
+    BDA_CURSOR_SHAPE  = 0x60,       // end line, start line
+    BDA_ACTIVE_PAGE   = 0x62,
+    BDA_CRT_PORT      = 0x63,
+    BDA_CRT_MODE      = 0x65,
+    BDA_VIDEO_ROWS    = 0x84,       // less one
+    BDA_CHAR_HEIGHT   = 0x85,
+
+    CRT_MODE_BLINK    = 0x20,
+    CURSOR_HIDDEN     = 0x2000
+};
+
+uint32_t const FRAME_BUFFER = TextScreen::SEGMENT << 4;
+
+// code page 437 glyphs of 00h-1Fh, 7Fh and 80h-FFh
+uint16_t const LowGlyphs[32] = {
+    0x0020, 0x263A, 0x263B, 0x2665, 0x2666, 0x2663, 0x2660, 0x2022,
+    0x25D8, 0x25CB, 0x25D9, 0x2642, 0x2640, 0x266A, 0x266B, 0x263C,
+    0x25BA, 0x25C4, 0x2195, 0x203C, 0x00B6, 0x00A7, 0x25AC, 0x21A8,
+    0x2191, 0x2193, 0x2192, 0x2190, 0x221F, 0x2194, 0x25B2, 0x25BC
+};
+
+uint16_t const HighGlyphs[128] = {
+    0x00C7, 0x00FC, 0x00E9, 0x00E2, 0x00E4, 0x00E0, 0x00E5, 0x00E7,
+    0x00EA, 0x00EB, 0x00E8, 0x00EF, 0x00EE, 0x00EC, 0x00C4, 0x00C5,
+    0x00C9, 0x00E6, 0x00C6, 0x00F4, 0x00F6, 0x00F2, 0x00FB, 0x00F9,
+    0x00FF, 0x00D6, 0x00DC, 0x00A2, 0x00A3, 0x00A5, 0x20A7, 0x0192,
+    0x00E1, 0x00ED, 0x00F3, 0x00FA, 0x00F1, 0x00D1, 0x00AA, 0x00BA,
+    0x00BF, 0x2310, 0x00AC, 0x00BD, 0x00BC, 0x00A1, 0x00AB, 0x00BB,
+    0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556,
+    0x2555, 0x2563, 0x2551, 0x2557, 0x255D, 0x255C, 0x255B, 0x2510,
+    0x2514, 0x2534, 0x252C, 0x251C, 0x2500, 0x253C, 0x255E, 0x255F,
+    0x255A, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256C, 0x2567,
+    0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256B,
+    0x256A, 0x2518, 0x250C, 0x2588, 0x2584, 0x258C, 0x2590, 0x2580,
+    0x03B1, 0x00DF, 0x0393, 0x03C0, 0x03A3, 0x03C3, 0x00B5, 0x03C4,
+    0x03A6, 0x0398, 0x03A9, 0x03B4, 0x221E, 0x03C6, 0x03B5, 0x2229,
+    0x2261, 0x00B1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00F7, 0x2248,
+    0x00B0, 0x2219, 0x00B7, 0x221A, 0x207F, 0x00B2, 0x25A0, 0x00A0
+};
+
+// CGA colour order to ANSI
+int const AnsiColors[8] = { 0, 4, 2, 6, 1, 5, 3, 7 };
+
+void
+AppendGlyph(std::string &Out, uint8_t C)
+{
+    uint16_t G = C;
+    if (C < 0x20)
+        G = LowGlyphs[C];
+    else if (C == 0x7F)
+        G = 0x2302;
+    else if (C >= 0x80)
+        G = HighGlyphs[C - 0x80];
+
+    if (G < 0x80) {
+        Out += static_cast <char> (G);
+    } else if (G < 0x800) {
+        Out += static_cast <char> (0xC0 | (G >> 6));
+        Out += static_cast <char> (0x80 | (G & 0x3F));
+    } else {
+        Out += static_cast <char> (0xE0 | (G >> 12));
+        Out += static_cast <char> (0x80 | ((G >> 6) & 0x3F));
+        Out += static_cast <char> (0x80 | (G & 0x3F));
+    }
+}
+
+void
+AppendAttribute(std::string &Out, uint8_t Attribute, bool Blink)
+{
+    char SGR[32];
+    int  Foreground = AnsiColors[Attribute & 7];
+    int  Background = AnsiColors[(Attribute >> 4) & 7];
+
+    // with blinking off, the top bit brightens the background instead
+    std::snprintf(SGR, sizeof(SGR), "\033[0;%d;%d%sm",
+            (Attribute & 0x08) ? 90 + Foreground : 30 + Foreground,
+            (!Blink && (Attribute & 0x80)) ? 100 + Background :
+                40 + Background,
+            (Blink && (Attribute & 0x80)) ? ";5" : "");
+    Out += SGR;
+}
+
+void
+AppendMove(std::string &Out, int Row, int Column)
+{
+    char CUP[16];
+
+    std::snprintf(CUP, sizeof(CUP), "\033[%d;%dH", Row + 1, Column + 1);
+    Out += CUP;
+}
+
+bool
+WriteAll(int FD, std::string const &Data)
+{
+    size_t Done = 0;
+
+    while (Done < Data.size()) {
+        ssize_t Count = ::write(FD, Data.data() + Done, Data.size() - Done);
+        if (Count < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        Done += Count;
+    }
+    return true;
+}
+
+}
+
+TextScreen::TextScreen(GuestMemory &Memory, VirtualClock &Clock, int OutFD) :
+    _mem         (Memory),
+    _clock       (Clock),
+    _fd          (OutFD),
+    _shownCursor (-1),
+    _invalid     (true),
+    _lastFrame   (0),
+    _nextSnapshot(-1),
+    _snapshots   (0)
+{
+    _options.Type = OUTPUT_STREAM;
+    _options.Rate = 0;
+}
+
+bool TextScreen::
+parse(char const *Text, Options &O)
+{
+    char const *Rate = std::strrchr(Text, ':');
+    char       *End  = nullptr;
+    unsigned long Value = 0;
+
+    // a trailing number is the rate, unless it is all a snapshot has
+    if (Rate != nullptr && Rate[1] != '\0') {
+        Value = std::strtoul(Rate + 1, &End, 10);
+        if (*End != '\0' || Value == 0)
+            Rate = nullptr;
+    }
+
+    if (std::strcmp(Text, "terminal") == 0 ||
+            (Rate != nullptr && Rate - Text == 8 &&
+             std::strncmp(Text, "terminal", 8) == 0)) {
+        O.Type   = OUTPUT_TERMINAL;
+        O.Rate   = (Rate != nullptr) ? Value : DEFAULT_FPS;
+        O.Prefix.clear();
+        return O.Rate <= 1000;
+    }
+
+    if (std::strncmp(Text, "snapshot:", 9) == 0 && Text[9] != '\0') {
+        O.Type   = OUTPUT_SNAPSHOT;
+        O.Rate   = DEFAULT_MILLIS;
+        O.Prefix = Text + 9;
+        if (Rate != nullptr && Rate > Text + 9) {
+            O.Rate = Value;
+            O.Prefix.assign(Text + 9, Rate);
+        }
+        return true;
+    }
+    return false;
+}
+
+void TextScreen::
+configure(Options const &O)
+{
+    _options = O;
+    _invalid = true;
+}
+
+uint32_t TextScreen::
+cellAddress(uint8_t Page, int Row, int Column) const
+{
+    // the guest may write anything to the BDA, but the cell stays in the
+    // frame buffer
+    uint32_t PageSize = (rows() == 50) ? 0x2000 : 0x1000;
+
+    Row    = std::max(0, std::min(Row, rows() - 1));
+    Column = std::max(0, std::min(Column, COLUMNS - 1));
+    return FRAME_BUFFER + (Page % pages()) * PageSize +
+        (Row * COLUMNS + Column) * 2;
+}
+
+uint16_t TextScreen::
+readBDA16(uint16_t Offset) const
+{
+    uint16_t Value;
+
+    std::memcpy(&Value, _mem.base() + (BDA_SEGMENT << 4) + Offset,
+            sizeof(Value));
+    return Value;
+}
+
+void TextScreen::
+writeBDA16(uint16_t Offset, uint16_t Value)
+{
+    std::memcpy(_mem.base() + (BDA_SEGMENT << 4) + Offset, &Value,
+            sizeof(Value));
+    _mem.dirty(BDA_SEGMENT, Offset, sizeof(Value));
+}
+
+void TextScreen::
+writeBDA8(uint16_t Offset, uint8_t Value)
+{
+    _mem.base()[(BDA_SEGMENT << 4) + Offset] = Value;
+    _mem.dirty(BDA_SEGMENT, Offset, 1);
+}
+
+void TextScreen::
+setMode(uint8_t Mode, bool Clear)
+{
+    writeBDA8(BDA_VIDEO_MODE, (Mode == 0x02 || Mode == 0x07) ? Mode : 0x03);
+    writeBDA16(BDA_VIDEO_COLS, COLUMNS);
+    writeBDA16(BDA_CURSOR_SHAPE, 0x0607);
+    writeBDA16(BDA_CRT_PORT, 0x3D4);
+    writeBDA8(BDA_CRT_MODE, 0x09 | CRT_MODE_BLINK);
+    for (int Page = 0; Page < 8; Page++)
+        writeBDA16(BDA_CURSORS + Page * 2, 0);
+    setRows(25);
+
+    if (Clear) {
+        uint16_t *Cells = reinterpret_cast <uint16_t *> (_mem.base() +
+                FRAME_BUFFER);
+        std::fill(Cells, Cells + 0x4000, static_cast <uint16_t> (BLANK));
+        _mem.dirty(FRAME_BUFFER, 0x8000);
+    }
+}
+
+uint8_t TextScreen::
+mode() const
+{
+    return _mem.base()[(BDA_SEGMENT << 4) + BDA_VIDEO_MODE];
+}
+
+// the 8x8 font makes 50 rows, any other 25
+void TextScreen::
+setRows(int Rows)
+{
+    writeBDA8(BDA_VIDEO_ROWS, Rows - 1);
+    writeBDA16(BDA_CHAR_HEIGHT, Rows == 50 ? 8 : 16);
+    writeBDA16(BDA_PAGE_SIZE, Rows == 50 ? 0x2000 : 0x1000);
+    setPage(0);
+    for (int Page = 0; Page < 8; Page++) {
+        int Row, Column;
+        cursor(Page, Row, Column);
+        setCursor(Page, std::min(Row, Rows - 1), Column);
+    }
+}
+
+int TextScreen::
+rows() const
+{
+    return _mem.base()[(BDA_SEGMENT << 4) + BDA_VIDEO_ROWS] == 49 ? 50 : 25;
+}
+
+int TextScreen::
+pages() const
+{
+    return rows() == 50 ? 4 : 8;
+}
+
+uint8_t TextScreen::
+page() const
+{
+    return _mem.base()[(BDA_SEGMENT << 4) + BDA_ACTIVE_PAGE];
+}
+
+void TextScreen::
+setPage(uint8_t Page)
+{
+    Page %= pages();
+    writeBDA8(BDA_ACTIVE_PAGE, Page);
+    writeBDA16(BDA_PAGE_OFFSET, Page * readBDA16(BDA_PAGE_SIZE));
+}
+
+void TextScreen::
+cursor(uint8_t Page, int &Row, int &Column) const
+{
+    uint16_t Position = readBDA16(BDA_CURSORS + (Page & 7) * 2);
+
+    Row    = Position >> 8;
+    Column = Position & 0xFF;
+}
+
+void TextScreen::
+setCursor(uint8_t Page, int Row, int Column)
+{
+    Row    = std::max(0, std::min(Row, rows() - 1));
+    Column = std::max(0, std::min(Column, COLUMNS - 1));
+    writeBDA16(BDA_CURSORS + (Page & 7) * 2, (Row << 8) | Column);
+}
+
+uint16_t TextScreen::
+cursorShape() const
+{
+    return readBDA16(BDA_CURSOR_SHAPE);
+}
+
+void TextScreen::
+setCursorShape(uint16_t Shape)
+{
+    writeBDA16(BDA_CURSOR_SHAPE, Shape);
+}
+
+void TextScreen::
+setBlink(bool Blink)
+{
+    uint8_t Mode = _mem.base()[(BDA_SEGMENT << 4) + BDA_CRT_MODE];
+
+    writeBDA8(BDA_CRT_MODE, Blink ? (Mode | CRT_MODE_BLINK) :
+            (Mode & ~CRT_MODE_BLINK));
+    _invalid = true;
+}
+
+uint16_t TextScreen::
+cell(uint8_t Page, int Row, int Column) const
+{
+    uint16_t Cell;
+
+    std::memcpy(&Cell, _mem.base() + cellAddress(Page, Row, Column),
+            sizeof(Cell));
+    return Cell;
+}
+
+void TextScreen::
+setCell(uint8_t Page, int Row, int Column, uint16_t Cell)
+{
+    uint32_t Address = cellAddress(Page, Row, Column);
+
+    std::memcpy(_mem.base() + Address, &Cell, sizeof(Cell));
+    _mem.dirty(Address, sizeof(Cell));
+}
+
+void TextScreen::
+scroll(uint8_t Page, int Lines, int Top, int Left, int Bottom, int Right,
+        uint8_t Attribute)
+{
+    Bottom = std::min(Bottom, rows() - 1);
+    Right  = std::min(Right, COLUMNS - 1);
+    if (Top > Bottom || Left > Right)
+        return;
+
+    int Height = Bottom - Top + 1;
+    if (Lines == 0 || std::abs(Lines) >= Height)
+        Lines = Height;
+
+    // a full-width window is one block of memory
+    char    *Base  = _mem.base();
+    size_t   Width = (Right - Left + 1) * 2;
+    size_t   Pitch = COLUMNS * 2;
+    int      Kept  = Height - std::abs(Lines);
+    uint32_t First = cellAddress(Page, Top, Left);
+    if (Kept > 0) {
+        uint32_t To   = First + (Lines > 0 ? 0 : -Lines * Pitch);
+        uint32_t From = First + (Lines > 0 ? Lines * Pitch : 0);
+        if (Width == Pitch) {
+            std::memmove(Base + To, Base + From, Kept * Pitch);
+        } else if (Lines > 0) {
+            for (int i = 0; i < Kept; i++)
+                std::memmove(Base + To + i * Pitch, Base + From + i * Pitch,
+                        Width);
+        } else {
+            for (int i = Kept - 1; i >= 0; i--)
+                std::memmove(Base + To + i * Pitch, Base + From + i * Pitch,
+                        Width);
+        }
+    }
+
+    uint16_t Blank = (Attribute << 8) | ' ';
+    int      Fill  = (Lines > 0) ? Top + Kept : Top;
+    for (int Row = Fill; Row < Fill + Height - Kept; Row++) {
+        uint16_t *Cells = reinterpret_cast <uint16_t *> (Base +
+                cellAddress(Page, Row, Left));
+        std::fill(Cells, Cells + (Right - Left + 1), Blank);
+    }
+    _mem.dirty(First, (Height - 1) * Pitch + Width);
+}
+
+// BIOS teletype: control characters move the cursor, others keep the
+// attribute of the cell they land in, and the page scrolls at the bottom
+void TextScreen::
+teletype(uint8_t Page, uint8_t C)
+{
+    int Row, Column;
+
+    cursor(Page, Row, Column);
+    if (Column >= COLUMNS) {
+        Column = 0;
+        Row++;
+    }
+    if (Row >= rows()) {
+        Row = rows() - 1;
+        scroll(Page, 1, 0, 0, Row, COLUMNS - 1, cell(Page, Row, 0) >> 8);
+    }
+
+    switch (C) {
+        case 0x07:
+            return;
+
+        case 0x08:
+            if (Column > 0)
+                Column--;
+            break;
+
+        case 0x0A:
+            Row++;
+            break;
+
+        case 0x0D:
+            Column = 0;
+            break;
+
+        default:
+            setCell(Page, Row, Column,
+                    (cell(Page, Row, Column) & 0xFF00) | C);
+            if (++Column == COLUMNS) {
+                Column = 0;
+                Row++;
+            }
+            break;
+    }
+
+    if (Row >= rows()) {
+        Row = rows() - 1;
+        scroll(Page, 1, 0, 0, Row, COLUMNS - 1,
+                cell(Page, Row, Column) >> 8);
+    }
+    setCursor(Page, Row, Column);
+}
+
+void TextScreen::
+write(char const *Bytes, size_t Length)
+{
+    uint8_t Page = page();
+
+    for (size_t i = 0; i < Length; i++) {
+        if (Bytes[i] != '\t') {
+            teletype(Page, Bytes[i]);
+            continue;
+        }
+
+        int Row, Column;
+        do {
+            teletype(Page, ' ');
+            cursor(Page, Row, Column);
+        } while (Column % 8 != 0);
+    }
+}
+
+void TextScreen::
+tick(uint64_t Now)
+{
+    if (_options.Type == OUTPUT_TERMINAL) {
+        if (Now - _lastFrame >= 1000000000ULL / _options.Rate) {
+            render();
+            _lastFrame = Now;
+        }
+    } else if (_options.Type == OUTPUT_SNAPSHOT) {
+        int64_t Time = _clock.now();
+        if (_nextSnapshot < 0)
+            _nextSnapshot = Time + _options.Rate * 1000000LL;
+        if (Time >= _nextSnapshot) {
+            saveSnapshot();
+            _nextSnapshot = Time + _options.Rate * 1000000LL;
+        }
+    }
+}
+
+void TextScreen::
+flush()
+{
+    if (_options.Type == OUTPUT_TERMINAL) {
+        render();
+        _lastFrame = Stats::now();
+    }
+}
+
+void TextScreen::
+finish()
+{
+    if (_options.Type == OUTPUT_TERMINAL) {
+        render();
+        _frame = "\033[0m\033[?25h";
+        AppendMove(_frame, rows() - 1, 0);
+        _frame += "\r\n";
+        WriteAll(_fd, _frame);
+    } else if (_options.Type == OUTPUT_SNAPSHOT) {
+        saveSnapshot();
+    }
+}
+
+// the cells that differ from the last frame, in runs, and the cursor, all
+// in one write
+void TextScreen::
+render()
+{
+    int             Rows  = rows();
+    uint8_t         Page  = page();
+    uint16_t const *Cells = reinterpret_cast <uint16_t const *> (
+            _mem.base() + cellAddress(Page, 0, 0));
+    bool Blink = _mem.base()[(BDA_SEGMENT << 4) + BDA_CRT_MODE] &
+        CRT_MODE_BLINK;
+
+    _frame.clear();
+    if (_invalid || _shown.size() != static_cast <size_t> (Rows * COLUMNS)) {
+        _frame += "\033[0m\033[H\033[2J";
+        _shown.assign(Rows * COLUMNS, 0);
+        _shownCursor = -1;
+    }
+
+    int Attribute = -1;
+    int At        = -1;
+    for (int i = 0; i < Rows * COLUMNS; i++) {
+        if (!_invalid && Cells[i] == _shown[i])
+            continue;
+
+        if (At != i)
+            AppendMove(_frame, i / COLUMNS, i % COLUMNS);
+        if ((Cells[i] >> 8) != Attribute) {
+            Attribute = Cells[i] >> 8;
+            AppendAttribute(_frame, Attribute, Blink);
+        }
+        AppendGlyph(_frame, Cells[i] & 0xFF);
+        _shown[i] = Cells[i];
+        At        = (i % COLUMNS == COLUMNS - 1) ? -1 : i + 1;
+    }
+    _invalid = false;
+
+    int Row, Column;
+    cursor(Page, Row, Column);
+    int Cursor = ((cursorShape() & CURSOR_HIDDEN) || Row >= rows() ||
+            Column >= COLUMNS) ? -1 : Row * COLUMNS + Column;
+    if (Cursor != _shownCursor || !_frame.empty()) {
+        if (Cursor >= 0) {
+            AppendMove(_frame, Row, Column);
+            _frame += "\033[?25h";
+        } else {
+            _frame += "\033[?25l";
+        }
+        _shownCursor = Cursor;
+    }
+
+    if (!_frame.empty())
+        WriteAll(_fd, _frame);
+}
+
+void TextScreen::
+saveSnapshot()
+{
+    std::string Text = text();
+    if (_snapshots > 0 && Text == _savedText)
+        return;
+
+    char Path[1024];
+    std::snprintf(Path, sizeof(Path), "%s-%04u.txt", _options.Prefix.c_str(),
+            _snapshots + 1);
+    FILE *F = std::fopen(Path, "w");
+    if (F == nullptr || std::fwrite(Text.data(), 1, Text.size(), F) !=
+            Text.size()) {
+        std::perror(Path);
+        if (F != nullptr)
+            std::fclose(F);
+        return;
+    }
+    std::fclose(F);
+
+    _snapshots++;
+    _savedText.swap(Text);
+}
+
+// the active page as UTF-8 lines, without trailing blanks
+std::string TextScreen::
+text() const
+{
+    std::string Text;
+    uint8_t     Page = page();
+
+    for (int Row = 0; Row < rows(); Row++) {
+        size_t Start = Text.size();
+        size_t End   = Start;
+        for (int Column = 0; Column < COLUMNS; Column++) {
+            uint8_t C = cell(Page, Row, Column) & 0xFF;
+            AppendGlyph(Text, C);
+            if (C != ' ' && C != 0x00 && C != 0xFF)
+                End = Text.size();
+        }
+        Text.resize(End);
+        Text += '\n';
+    }
+    return Text;
+}
@@ -0,0 +1,131 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __TextScreen_h
+#define __TextScreen_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "GuestMemory.h"
+
+class VirtualClock;
+
+//
+// Colour text mode: 80x25, or 80x50 with the 8x8 font, in the guest's own
+// frame buffer at B800:0000, with the mode, page and cursors in the BDA as
+// the BIOS keeps them. INT 10h is served here; all else the guest does to
+// the frame buffer it does directly.
+//
+//   stream     console output goes to standard output as a byte stream,
+//              as does INT 10h teletype (the default); the screen is kept
+//              but not shown
+//   terminal   console output is written to the screen as DOS does, and
+//              the screen is drawn on the terminal: at most Rate times a
+//              second, and before the guest waits for input, only the
+//              cells that changed since the last frame are written
+//   snapshot   console output is written to the screen, and every Rate ms
+//              of guest time the screen's text, if it changed, is saved to
+//              Prefix-NNNN.txt, as it is at exit
+//
+class TextScreen {
+public:
+    enum Output {
+        OUTPUT_STREAM,
+        OUTPUT_TERMINAL,
+        OUTPUT_SNAPSHOT
+    };
+
+    enum {
+        SEGMENT         = 0xB800,
+        COLUMNS         = 80,
+        BLANK           = 0x0720,   // space, light grey on black
+        DEFAULT_FPS     = 30,
+        DEFAULT_MILLIS  = 1000
+    };
+
+    struct Options {
+        Output       Type;
+        unsigned     Rate;          // frames a second, or ms a snapshot
+        std::string  Prefix;        // OUTPUT_SNAPSHOT
+    };
+
+private:
+    GuestMemory            &_mem;
+    VirtualClock           &_clock;
+    int                     _fd;
+    Options                 _options;
+    std::vector <uint16_t>  _shown;         // cells of the last frame
+    int                     _shownCursor;   // its cursor cell, -1 if hidden
+    bool                    _invalid;       // the terminal must be redrawn
+    uint64_t                _lastFrame;     // Stats::now()
+    int64_t                 _nextSnapshot;  // guest time, -1 before any
+    unsigned                _snapshots;
+    std::string             _savedText;
+    std::string             _frame;
+
+public:
+    TextScreen(GuestMemory &Memory, VirtualClock &Clock, int OutFD);
+
+public:
+    // "terminal[:fps]" or "snapshot:prefix[:ms]"
+    static bool parse(char const *Text, Options &O);
+    void configure(Options const &O);
+
+    Output output() const { return _options.Type; }
+
+public:
+    // what INT 10h does; every text mode is 03h but for 02h and 07h
+    void setMode(uint8_t Mode, bool Clear);
+    uint8_t mode() const;
+    void setRows(int Rows);
+    int rows() const;
+    int pages() const;
+
+    uint8_t page() const;
+    void setPage(uint8_t Page);
+    void cursor(uint8_t Page, int &Row, int &Column) const;
+    void setCursor(uint8_t Page, int Row, int Column);
+    uint16_t cursorShape() const;
+    void setCursorShape(uint16_t Shape);
+    void setBlink(bool Blink);
+
+    // character in the low byte, attribute in the high one
+    uint16_t cell(uint8_t Page, int Row, int Column) const;
+    void setCell(uint8_t Page, int Row, int Column, uint16_t Cell);
+
+    // Lines up (or down if negative) in the window, the new lines blank
+    // in Attribute; 0 clears it
+    void scroll(uint8_t Page, int Lines, int Top, int Left, int Bottom,
+            int Right, uint8_t Attribute);
+    void teletype(uint8_t Page, uint8_t C);
+
+    // console output on the active page, with tabs expanded
+    void write(char const *Bytes, size_t Length);
+
+public:
+    // called on every VMEXIT with the current Stats::now()
+    void tick(uint64_t Now);
+
+    // a frame now, if the terminal is behind
+    void flush();
+
+    // the last frame, or snapshot, and the terminal as it was
+    void finish();
+
+    // after a restore, whose screen the terminal does not show
+    void invalidate() { _invalid = true; }
+
+private:
+    uint32_t cellAddress(uint8_t Page, int Row, int Column) const;
+    uint16_t readBDA16(uint16_t Offset) const;
+    void writeBDA16(uint16_t Offset, uint16_t Value);
+    void writeBDA8(uint16_t Offset, uint8_t Value);
+
+    void render();
+    void saveSnapshot();
+    std::string text() const;
+};
+
+#endif  // !__TextScreen_h
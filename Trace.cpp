@@ -0,0 +1,130 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "Trace.h"
+#include "Stats.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static_assert(sizeof(Trace::Header) == 64, "trace header layout");
+static_assert(sizeof(Trace::Record) == 24, "trace record layout");
+
+Trace::Trace() :
+    _header (nullptr),
+    _records(nullptr),
+    _size   (0)
+{
+}
+
+Trace::~Trace()
+{
+    close();
+}
+
+bool Trace::
+open(char const *Path, uint64_t Capacity, uint32_t Mask)
+{
+    close();
+
+    if (Capacity == 0)
+        return false;
+
+    size_t Size = sizeof(Header) + Capacity * sizeof(Record);
+
+    int FD = ::open(Path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (FD < 0) {
+        std::perror(Path);
+        return false;
+    }
+    if (::ftruncate(FD, Size) < 0) {
+        std::perror(Path);
+        ::close(FD);
+        return false;
+    }
+
+    void *Base = ::mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            FD, 0);
+    ::close(FD);
+    if (Base == MAP_FAILED) {
+        std::perror(Path);
+        return false;
+    }
+
+    _header  = static_cast <Header *> (Base);
+    _records = reinterpret_cast <Record *> (_header + 1);
+    _size    = Size;
+
+    std::memcpy(_header->Magic, "HVTRACE1", sizeof(_header->Magic));
+    _header->RecordSize = sizeof(Record);
+    _header->Mask       = Mask;
+    _header->Capacity   = Capacity;
+    _header->Head       = 0;
+
+    return true;
+}
+
+void Trace::
+close()
+{
+    if (_header == nullptr)
+        return;
+
+    ::munmap(_header, _size);
+    _header  = nullptr;
+    _records = nullptr;
+    _size    = 0;
+}
+
+Trace::Record &Trace::
+append(uint32_t Category)
+{
+    Record &R = _records[_header->Head++ % _header->Capacity];
+
+    std::memset(&R, 0, sizeof(R));
+    R.Nanos    = Stats::now();
+    R.Category = Category;
+    return R;
+}
+
+uint32_t Trace::
+parseCategories(char const *List)
+{
+    static struct {
+        char const *Name;
+        uint32_t    Mask;
+    } const Categories[] = {
+        { "exit", CATEGORY_EXIT      },
+        { "int",  CATEGORY_INTERRUPT },
+        { "dos",  CATEGORY_DOS       },
+        { "all",  CATEGORY_ALL       },
+    };
+
+    uint32_t Mask = 0;
+
+    while (*List != '\0') {
+        size_t Length = std::strcspn(List, ",");
+        bool   Found  = false;
+
+        for (auto const &C : Categories) {
+            if (std::strlen(C.Name) == Length &&
+                    std::strncmp(C.Name, List, Length) == 0) {
+                Mask |= C.Mask, Found = true;
+            }
+        }
+        if (!Found) {
+            std::fprintf(stderr, "Unknown trace category: %.*s\n",
+                    static_cast <int> (Length), List);
+        }
+
+        List += Length;
+        if (*List == ',')
+            List++;
+    }
+
+    return Mask;
+}
@@ -0,0 +1,73 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __Trace_h
+#define __Trace_h
+
+#include <cstddef>
+#include <cstdint>
+
+//
+// Binary event trace: a fixed-size ring of compact records in a file
+// mapped MAP_SHARED, so the most recent events survive a crash and can
+// be decoded offline with hvtrace. The category mask lives in the mapped
+// header and can be changed while hvdos is running (hvtrace -m).
+//
+class Trace {
+public:
+    enum {
+        CATEGORY_EXIT      = (1 << 0),  // every VMEXIT
+        CATEGORY_INTERRUPT = (1 << 1),  // interrupt vectors other than 21h
+        CATEGORY_DOS       = (1 << 2),  // INT 21h service calls
+        CATEGORY_ALL       = 0xffffffff
+    };
+
+#pragma pack(push, 1)
+    struct Header {
+        char     Magic[8];      // "HVTRACE1"
+        uint32_t RecordSize;
+        uint32_t Mask;          // enabled categories, may change at runtime
+        uint64_t Capacity;      // number of record slots
+        uint64_t Head;          // total records written; slot is Head % Capacity
+        uint8_t  Reserved[32];
+    };
+
+    struct Record {
+        uint64_t Nanos;         // monotonic timestamp
+        uint8_t  Category;      // one of CATEGORY_*
+        uint8_t  ExitReason;
+        uint8_t  Vector;
+        uint8_t  Function;      // AH on entry
+        uint8_t  Subfunction;   // AL on entry
+        uint8_t  Carry;         // CF on return from the service
+        uint16_t CS;
+        uint16_t IP;
+        uint16_t Handle;        // BX on entry
+        uint16_t Count;         // CX on entry
+        uint16_t Result;        // AX on return
+    };
+#pragma pack(pop)
+
+private:
+    Header  *_header;
+    Record  *_records;
+    size_t   _size;
+
+public:
+    Trace();
+    ~Trace();
+
+public:
+    bool open(char const *Path, uint64_t Capacity, uint32_t Mask);
+    void close();
+
+    bool enabled(uint32_t Category) const
+        { return _header != nullptr && (_header->Mask & Category) != 0; }
+
+    Record &append(uint32_t Category);
+
+public:
+    static uint32_t parseCategories(char const *List);
+};
+
+#endif  // !__Trace_h
@@ -0,0 +1,231 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "VMSnapshot.h"
+#include "interface.h"
+#include "vmcs.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+// what a real-mode guest can change; the rest is set up by hvdos
+hv_x86_reg_t const Registers[] = {
+    HV_X86_RIP, HV_X86_RFLAGS,
+    HV_X86_RAX, HV_X86_RCX, HV_X86_RDX, HV_X86_RBX,
+    HV_X86_RSI, HV_X86_RDI, HV_X86_RSP, HV_X86_RBP,
+    HV_X86_CS, HV_X86_SS, HV_X86_DS, HV_X86_ES, HV_X86_FS, HV_X86_GS
+};
+
+uint32_t const Fields[] = {
+    VMCS_GUEST_CS_BASE, VMCS_GUEST_CS_LIMIT, VMCS_GUEST_CS_ACCESS_RIGHTS,
+    VMCS_GUEST_SS_BASE, VMCS_GUEST_SS_LIMIT, VMCS_GUEST_SS_ACCESS_RIGHTS,
+    VMCS_GUEST_DS_BASE, VMCS_GUEST_DS_LIMIT, VMCS_GUEST_DS_ACCESS_RIGHTS,
+    VMCS_GUEST_ES_BASE, VMCS_GUEST_ES_LIMIT, VMCS_GUEST_ES_ACCESS_RIGHTS,
+    VMCS_GUEST_FS_BASE, VMCS_GUEST_FS_LIMIT, VMCS_GUEST_FS_ACCESS_RIGHTS,
+    VMCS_GUEST_GS_BASE, VMCS_GUEST_GS_LIMIT, VMCS_GUEST_GS_ACCESS_RIGHTS,
+    VMCS_GUEST_IDTR_BASE, VMCS_GUEST_IDTR_LIMIT,
+    VMCS_GUEST_INTERRUPTIBILITY, VMCS_GUEST_ACTIVITY
+};
+
+bool
+WriteAll(int FD, void const *Bytes, size_t Length, off_t Offset)
+{
+    char const *P = static_cast <char const *> (Bytes);
+
+    while (Length != 0) {
+        ssize_t Count = ::pwrite(FD, P, Length, Offset);
+        if (Count < 0 && errno == EINTR)
+            continue;
+        if (Count <= 0)
+            return false;
+        P      += Count;
+        Length -= Count;
+        Offset += Count;
+    }
+    return true;
+}
+
+bool
+ReadAll(int FD, void *Bytes, size_t Length, off_t Offset)
+{
+    char *P = static_cast <char *> (Bytes);
+
+    while (Length != 0) {
+        ssize_t Count = ::pread(FD, P, Length, Offset);
+        if (Count < 0 && errno == EINTR)
+            continue;
+        if (Count <= 0) {
+            if (Count == 0)
+                errno = EINVAL;
+            return false;
+        }
+        P      += Count;
+        Length -= Count;
+        Offset += Count;
+    }
+    return true;
+}
+
+}
+
+VMSnapshot::VMSnapshot() :
+    _position    (0),
+    _memoryOffset(0),
+    _memorySize  (0)
+{
+}
+
+void VMSnapshot::
+captureVCPU(hv_vcpuid_t vcpu)
+{
+    _registers.clear();
+    for (hv_x86_reg_t R : Registers)
+        _registers.push_back(Value { static_cast <uint32_t> (R), rreg(vcpu, R) });
+
+    _fields.clear();
+    for (uint32_t F : Fields)
+        _fields.push_back(Value { F, rvmcs(vcpu, F) });
+}
+
+bool VMSnapshot::
+write(char const *Path, char const *Memory, size_t MemorySize) const
+{
+    Header H = {};
+    std::memcpy(H.Magic, "HVSNAP01", sizeof(H.Magic));
+    H.Version       = VERSION;
+    H.RegisterCount = _registers.size();
+    H.FieldCount    = _fields.size();
+    H.StateSize     = _state.size();
+    H.MemorySize    = MemorySize;
+
+    off_t Registers = sizeof(H);
+    off_t Fields    = Registers + _registers.size() * sizeof(Value);
+    off_t State     = Fields + _fields.size() * sizeof(Value);
+    H.MemoryOffset  = (State + _state.size() + MEMORY_ALIGNMENT - 1) &
+        ~static_cast <uint64_t> (MEMORY_ALIGNMENT - 1);
+
+    // beside the target and renamed over it, as running jobs may have the
+    // old snapshot mapped
+    std::string Temporary = std::string(Path) + ".tmp";
+    int FD = ::open(Temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (FD < 0)
+        return false;
+
+    bool Result = WriteAll(FD, &H, sizeof(H), 0) &&
+        WriteAll(FD, _registers.data(), _registers.size() * sizeof(Value),
+                Registers) &&
+        WriteAll(FD, _fields.data(), _fields.size() * sizeof(Value), Fields) &&
+        WriteAll(FD, _state.data(), _state.size(), State) &&
+        WriteAll(FD, Memory, MemorySize, H.MemoryOffset);
+
+    int Error = errno;
+    if (::close(FD) != 0 && Result) {
+        Result = false;
+        Error  = errno;
+    }
+    if (Result && ::rename(Temporary.c_str(), Path) != 0) {
+        Result = false;
+        Error  = errno;
+    }
+    if (!Result) {
+        ::unlink(Temporary.c_str());
+        errno = Error;
+    }
+    return Result;
+}
+
+bool VMSnapshot::
+read(char const *Path)
+{
+    int FD = ::open(Path, O_RDONLY);
+    if (FD < 0)
+        return false;
+
+    Header H;
+    bool Result = ReadAll(FD, &H, sizeof(H), 0);
+    if (Result && (std::memcmp(H.Magic, "HVSNAP01", sizeof(H.Magic)) != 0 ||
+                H.Version != VERSION ||
+                H.MemoryOffset % MEMORY_ALIGNMENT != 0)) {
+        errno  = EINVAL;
+        Result = false;
+    }
+
+    if (Result) {
+        off_t Fields = sizeof(H) + H.RegisterCount * sizeof(Value);
+        off_t State  = Fields + H.FieldCount * sizeof(Value);
+
+        _registers.resize(H.RegisterCount);
+        _fields.resize(H.FieldCount);
+        _state.resize(H.StateSize);
+        Result =
+            ReadAll(FD, _registers.data(), H.RegisterCount * sizeof(Value),
+                    sizeof(H)) &&
+            ReadAll(FD, _fields.data(), H.FieldCount * sizeof(Value),
+                    Fields) &&
+            ReadAll(FD, _state.data(), H.StateSize, State);
+    }
+
+    int Error = errno;
+    ::close(FD);
+    errno = Error;
+    if (!Result)
+        return false;
+
+    _path         = Path;
+    _position     = 0;
+    _memoryOffset = H.MemoryOffset;
+    _memorySize   = H.MemorySize;
+    return true;
+}
+
+void VMSnapshot::
+restoreVCPU(hv_vcpuid_t vcpu) const
+{
+    for (Value const &V : _registers)
+        wreg(vcpu, static_cast <hv_x86_reg_t> (V.Id), V.Data);
+    for (Value const &V : _fields)
+        wvmcs(vcpu, V.Id, V.Data);
+}
+
+void VMSnapshot::
+put(void const *Bytes, size_t Length)
+{
+    char const *P = static_cast <char const *> (Bytes);
+    _state.insert(_state.end(), P, P + Length);
+}
+
+void VMSnapshot::
+putString(std::string const &String)
+{
+    put(static_cast <uint32_t> (String.size()));
+    put(String.data(), String.size());
+}
+
+bool VMSnapshot::
+get(void *Bytes, size_t Length)
+{
+    if (Length > _state.size() - _position)
+        return false;
+
+    std::memcpy(Bytes, &_state[_position], Length);
+    _position += Length;
+    return true;
+}
+
+bool VMSnapshot::
+getString(std::string &String)
+{
+    uint32_t Length;
+    if (!get(Length) || Length > _state.size() - _position)
+        return false;
+
+    String.assign(&_state[_position], Length);
+    _position += Length;
+    return true;
+}
@@ -0,0 +1,90 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __VMSnapshot_h
+#define __VMSnapshot_h
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <Hypervisor/hv_vmx.h>
+
+//
+// A saved VM in one file: the vCPU's registers and real-mode guest state,
+// a byte stream of host-side kernel state, and guest memory.
+//
+//   Header
+//   Value       Registers[RegisterCount]   hv_x86_reg_t, value
+//   Value       Fields[FieldCount]         VMCS field, value
+//   char        State[StateSize]           written by DOSKernel::save()
+//   guest memory at MemoryOffset, a multiple of MEMORY_ALIGNMENT
+//
+// Restoring maps guest memory from the file MAP_PRIVATE (a MemoryBackend
+// of KIND_FILE), so a run only reads and copies the pages it touches.
+//
+class VMSnapshot {
+public:
+    enum {
+        VERSION          = 4,
+        MEMORY_ALIGNMENT = 4096
+    };
+
+#pragma pack(push, 1)
+    struct Header {
+        char     Magic[8];          // "HVSNAP01"
+        uint32_t Version;
+        uint32_t RegisterCount;
+        uint32_t FieldCount;
+        uint32_t StateSize;
+        uint64_t MemoryOffset;
+        uint64_t MemorySize;
+        uint8_t  Reserved[16];
+    };
+
+    struct Value {
+        uint32_t Id;
+        uint64_t Data;
+    };
+#pragma pack(pop)
+
+private:
+    std::vector <Value>     _registers;
+    std::vector <Value>     _fields;
+    std::vector <char>      _state;
+    size_t                  _position;  // of the next get() in _state
+    std::string             _path;
+    uint64_t                _memoryOffset;
+    uint64_t                _memorySize;
+
+public:
+    VMSnapshot();
+
+public:
+    // save: capture the vCPU and put() the kernel state, then write()
+    void captureVCPU(hv_vcpuid_t vcpu);
+    bool write(char const *Path, char const *Memory, size_t MemorySize) const;
+
+    // restore: read(), map guest memory from path() at memoryOffset(),
+    // then restoreVCPU() and get() the kernel state; false with errno set
+    // on failure
+    bool read(char const *Path);
+    void restoreVCPU(hv_vcpuid_t vcpu) const;
+
+    std::string const &path() const { return _path; }
+    uint64_t memoryOffset() const { return _memoryOffset; }
+    uint64_t memorySize() const { return _memorySize; }
+
+public:
+    void put(void const *Bytes, size_t Length);
+    void putString(std::string const &String);
+    template <typename T> void put(T const &V) { put(&V, sizeof(V)); }
+
+    // false once the state is exhausted; rewind() starts over
+    void rewind() { _position = 0; }
+    bool get(void *Bytes, size_t Length);
+    bool getString(std::string &String);
+    template <typename T> bool get(T &V) { return get(&V, sizeof(V)); }
+};
+
+#endif  // !__VMSnapshot_h
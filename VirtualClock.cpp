@@ -0,0 +1,312 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#include "VirtualClock.h"
+#include "Stats.h"
+#include "VMSnapshot.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <time.h>
+
+namespace {
+
+int64_t const NANOS_PER_SECOND = 1000000000;
+int64_t const NANOS_PER_DAY    = 86400 * NANOS_PER_SECOND;
+int64_t const TICK_NANOS       = 54925439;      // 65536 / 1193182 Hz
+
+// what DOS shows when it has no clock
+int64_t const DEFAULT_START    = 3652 * NANOS_PER_DAY;  // 1980-01-01
+
+int64_t
+RealtimeNanos()
+{
+    struct timespec TS;
+
+    clock_gettime(CLOCK_REALTIME, &TS);
+    return static_cast <int64_t> (TS.tv_sec) * NANOS_PER_SECOND + TS.tv_nsec;
+}
+
+// how far local time is ahead of UTC at Now
+int64_t
+UTCOffset(int64_t Now)
+{
+    time_t    T = Now / NANOS_PER_SECOND;
+    struct tm TM;
+
+    localtime_r(&T, &TM);
+    return static_cast <int64_t> (timegm(&TM) - T) * NANOS_PER_SECOND;
+}
+
+uint64_t
+HostTSC()
+{
+    return __builtin_ia32_rdtsc();
+}
+
+// 1193182 Hz / 65536 = ~18.2 ticks per second, counted in microseconds so
+// that a day's worth stays within 64 bits
+uint32_t
+TicksAt(int64_t NanosOfDay)
+{
+    return (NanosOfDay / 1000) * 1193182 / (65536LL * 1000000);
+}
+
+// the first whole microsecond of Tick, in nanoseconds
+int64_t
+TickStart(uint32_t Tick)
+{
+    return (Tick * 65536LL * 1000000 + 1193181) / 1193182 * 1000;
+}
+
+}
+
+VirtualClock::VirtualClock() :
+    _mode        (MODE_HOST),
+    _start       (DEFAULT_START),
+    _elapsed     (0),
+    _adjust      (0),
+    _utcOffset   (0),
+    _utcChecked  (0),
+    _tscOffset   (-static_cast <int64_t> (HostTSC())),
+    _services    (0),
+    _pollServices(~0ULL),
+    _tscServices (~0ULL),
+    _tscStep     (SERVICE_NANOS),
+    _lastService (Stats::now()),
+    _waits       (0),
+    _idleNanos   (0)
+{
+}
+
+bool VirtualClock::
+parse(char const *Text, Options &O)
+{
+    if (std::strcmp(Text, "host") == 0) {
+        O.Type = MODE_HOST;
+        return true;
+    }
+    if (std::strcmp(Text, "virtual") == 0) {
+        O.Type  = MODE_VIRTUAL;
+        O.Start = DEFAULT_START;
+        return true;
+    }
+    if (std::strncmp(Text, "virtual:", 8) != 0)
+        return false;
+
+    struct tm   TM;
+    int         Length = 0;
+    char const *Date   = Text + 8;
+    std::memset(&TM, 0, sizeof(TM));
+    if (std::sscanf(Date, "%4d-%2d-%2d%n", &TM.tm_year, &TM.tm_mon,
+                &TM.tm_mday, &Length) != 3)
+        return false;
+    Date += Length;
+
+    if (*Date == 'T') {
+        Length = 0;
+        if (std::sscanf(Date, "T%2d:%2d%n", &TM.tm_hour, &TM.tm_min,
+                    &Length) != 2)
+            return false;
+        Date += Length;
+        if (*Date == ':') {
+            Length = 0;
+            if (std::sscanf(Date, ":%2d%n", &TM.tm_sec, &Length) != 1)
+                return false;
+            Date += Length;
+        }
+    }
+
+    // the years a DOS date can hold
+    if (*Date != '\0' || TM.tm_year < 1980 || TM.tm_year > 2099 ||
+            TM.tm_mon < 1 || TM.tm_mon > 12 || TM.tm_mday < 1 ||
+            TM.tm_mday > 31 || TM.tm_hour > 23 || TM.tm_min > 59 ||
+            TM.tm_sec > 59)
+        return false;
+
+    TM.tm_year -= 1900;
+    TM.tm_mon  -= 1;
+    O.Type  = MODE_VIRTUAL;
+    O.Start = static_cast <int64_t> (timegm(&TM)) * NANOS_PER_SECOND;
+    return true;
+}
+
+void VirtualClock::
+configure(Options const &O)
+{
+    _mode = O.Type;
+    if (_mode == MODE_VIRTUAL) {
+        _start   = O.Start;
+        _elapsed = 0;
+    }
+}
+
+int64_t VirtualClock::
+now()
+{
+    if (_mode == MODE_VIRTUAL)
+        return _start + _elapsed + _adjust;
+
+    // the offset changes with daylight saving time, which a look once a
+    // minute is soon enough for
+    int64_t Now = RealtimeNanos();
+    if (_utcChecked == 0 || Now - _utcChecked >= 60 * NANOS_PER_SECOND) {
+        _utcOffset  = UTCOffset(Now);
+        _utcChecked = Now;
+    }
+    return Now + _utcOffset + _adjust;
+}
+
+void VirtualClock::
+set(int64_t Local)
+{
+    _adjust += Local - now();
+}
+
+uint32_t VirtualClock::
+ticks()
+{
+    return TicksAt(now() % NANOS_PER_DAY);
+}
+
+int64_t VirtualClock::
+day()
+{
+    return now() / NANOS_PER_DAY;
+}
+
+void VirtualClock::
+setTicks(uint32_t Ticks)
+{
+    set(day() * NANOS_PER_DAY + TickStart(Ticks));
+}
+
+int64_t VirtualClock::
+lastTick()
+{
+    int64_t Now = now();
+    return Now - Now % NANOS_PER_DAY + TickStart(TicksAt(Now % NANOS_PER_DAY));
+}
+
+void VirtualClock::
+service()
+{
+    _services++;
+    if (_mode == MODE_VIRTUAL) {
+        _elapsed     += SERVICE_NANOS;
+        _lastService  = Stats::now();
+    }
+}
+
+// nothing the guest reads changes before the next tick, which is as true
+// of the host's time as of virtual time
+void VirtualClock::
+pollTicks()
+{
+    if (_services == _pollServices + 1)
+        waitTick();
+    _pollServices = _services;
+}
+
+void VirtualClock::
+wait(int64_t Nanos)
+{
+    if (Nanos <= 0)
+        return;
+
+    _waits++;
+    _idleNanos += Nanos;
+    if (_mode == MODE_VIRTUAL) {
+        _elapsed += Nanos;
+        return;
+    }
+
+    struct timespec TS;
+    TS.tv_sec  = Nanos / NANOS_PER_SECOND;
+    TS.tv_nsec = Nanos % NANOS_PER_SECOND;
+    while (nanosleep(&TS, &TS) != 0 && errno == EINTR)
+        ;
+}
+
+void VirtualClock::
+waitTick()
+{
+    wait(untilTick());
+}
+
+int64_t VirtualClock::
+untilTick()
+{
+    int64_t NanosOfDay = now() % NANOS_PER_DAY;
+    int64_t Next       = std::min(TickStart(TicksAt(NanosOfDay) + 1),
+            NANOS_PER_DAY);
+    return Next - NanosOfDay;
+}
+
+void VirtualClock::
+waited(int64_t Nanos)
+{
+    if (_mode == MODE_VIRTUAL) {
+        waitTick();
+        return;
+    }
+
+    _waits++;
+    _idleNanos += Nanos;
+}
+
+void VirtualClock::
+preempted()
+{
+    if (_mode == MODE_VIRTUAL && Stats::now() - _lastService >= STALL_NANOS)
+        waitTick();
+}
+
+uint64_t VirtualClock::
+readTSC()
+{
+    if (_mode == MODE_HOST)
+        return HostTSC() + _tscOffset;
+
+    // reads in a row are the guest timing a wait; the TSC runs at 1 GHz
+    _tscStep     = (_services == _tscServices) ?
+        std::min(2 * _tscStep, TICK_NANOS) : SERVICE_NANOS;
+    _tscServices = _services;
+    _elapsed    += _tscStep;
+    return _elapsed;
+}
+
+void VirtualClock::
+save(VMSnapshot &Snapshot) const
+{
+    Snapshot.put(static_cast <uint8_t> (_mode));
+    Snapshot.put(_start);
+    Snapshot.put(_elapsed);
+    Snapshot.put(_adjust);
+    Snapshot.put(_services);
+    Snapshot.put(_pollServices);
+    Snapshot.put(_tscServices);
+    Snapshot.put(_tscStep);
+}
+
+// the time of a machine saved in host mode is the host's, which it goes on
+// with; so is a virtual machine's if it is restored in host mode
+bool VirtualClock::
+restore(VMSnapshot &Snapshot)
+{
+    uint8_t Mode;
+    int64_t Start, Elapsed;
+    if (!Snapshot.get(Mode) || !Snapshot.get(Start) ||
+            !Snapshot.get(Elapsed) || !Snapshot.get(_adjust) ||
+            !Snapshot.get(_services) || !Snapshot.get(_pollServices) ||
+            !Snapshot.get(_tscServices) || !Snapshot.get(_tscStep))
+        return false;
+
+    if (Mode == MODE_VIRTUAL && _mode == MODE_VIRTUAL) {
+        _start   = Start;
+        _elapsed = Elapsed;
+    }
+    return true;
+}
@@ -0,0 +1,128 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __VirtualClock_h
+#define __VirtualClock_h
+
+#include <cstdint>
+
+class VMSnapshot;
+
+//
+// The guest's time: the BDA tick count, the DOS and RTC date and time, and
+// the time stamp counter all read it.
+//
+//   host      the host's local time; the TSC is the host's, offset to start
+//             at 0 (the default)
+//   virtual   starts at a given local time and only moves when the guest
+//             does something: a little for every service call, and all at
+//             once when the guest is waiting, so that a delay takes no host
+//             time and a run is the same every time
+//
+// The guest is waiting when it asks to (INT 15h AH=86h), when it halts
+// (until the next tick, as if the timer interrupt had come), and when it
+// reads the tick count or the time twice with no other call in between.
+// RDTSC exits in virtual mode; reads with nothing else in between each
+// move the clock twice as far as the one before, up to a tick.
+//
+// In virtual mode the BIOS has INT 1Ah trap rather than serve it in the
+// ROM. A guest that reads the tick count in the BDA itself, and makes no
+// call at all for STALL_NANOS of host time, gets a tick per host interrupt
+// exit from then on; that is the one way host timing gets into virtual
+// time.
+//
+// Times are nanoseconds since 1970-01-01 00:00 local time, so that the
+// calendar is gmtime() of them whatever the host's time zone is.
+//
+class VirtualClock {
+public:
+    enum Mode {
+        MODE_HOST,
+        MODE_VIRTUAL
+    };
+
+    enum {
+        SERVICE_NANOS = 1000,
+        STALL_NANOS   = 1000000000
+    };
+
+    struct Options {
+        Mode    Type;
+        int64_t Start;          // MODE_VIRTUAL: local time to start at
+    };
+
+private:
+    Mode     _mode;
+    int64_t  _start;
+    int64_t  _elapsed;          // MODE_VIRTUAL: since _start
+    int64_t  _adjust;           // set by the guest, DOS AH=2Bh/2Dh say
+    int64_t  _utcOffset;        // MODE_HOST: of local time, in ns
+    int64_t  _utcChecked;       // MODE_HOST: realtime _utcOffset is as of
+    int64_t  _tscOffset;        // MODE_HOST: guest TSC less the host's
+    uint64_t _services;         // guest service calls
+    uint64_t _pollServices;     // _services at the last tick poll
+    uint64_t _tscServices;      // _services at the last RDTSC
+    int64_t  _tscStep;
+    uint64_t _lastService;      // Stats::now() of the last call
+    uint64_t _waits;
+    uint64_t _idleNanos;        // slept, or skipped in MODE_VIRTUAL
+
+public:
+    VirtualClock();
+
+public:
+    // "host", "virtual" or "virtual:YYYY-MM-DD[THH:MM[:SS]]"
+    static bool parse(char const *Text, Options &O);
+    void configure(Options const &O);
+
+    Mode mode() const { return _mode; }
+
+    int64_t now();
+    void set(int64_t Local);
+
+    // BDA tick count since midnight of now(), and days since 1970
+    uint32_t ticks();
+    int64_t day();
+    void setTicks(uint32_t Ticks);
+
+    // now() at the start of its tick, which is what DOS time is made of
+    int64_t lastTick();
+
+public:
+    // a guest service call, which takes SERVICE_NANOS of virtual time
+    void service();
+
+    // a read of the tick count or time; a second one in a row waits for
+    // the next tick
+    void pollTicks();
+
+    // the guest waits; sleeps in MODE_HOST, skips ahead in MODE_VIRTUAL
+    void wait(int64_t Nanos);
+    void waitTick();
+    int64_t untilTick();
+
+    // the guest waited Nanos of host time on something else, input say;
+    // in MODE_VIRTUAL that is the next tick, however long it was
+    void waited(int64_t Nanos);
+
+    // a host interrupt exit, which is how a guest that makes no calls
+    // gets time in MODE_VIRTUAL
+    void preempted();
+
+    // guest TSC for an RDTSC exit, and the offset of the host's for
+    // hardware that offsets it instead
+    uint64_t readTSC();
+    int64_t tscOffset() const { return _tscOffset; }
+
+    uint64_t waits() const { return _waits; }
+    uint64_t idleNanos() const { return _idleNanos; }
+    int64_t elapsed() const { return _elapsed; }
+
+public:
+    // the guest's adjustment and, in MODE_VIRTUAL, the virtual time, so a
+    // restored machine goes on from the same moment
+    void save(VMSnapshot &Snapshot) const;
+    bool restore(VMSnapshot &Snapshot);
+};
+
+#endif  // !__VirtualClock_h
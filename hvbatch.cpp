@@ -0,0 +1,374 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+//
+// hvbatch - run the hvdos jobs of a manifest on a pool of workers, one
+// hvdos process per job, and report each one as a JSON line
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "hvdos.h"
+
+namespace {
+
+//
+// One line of the manifest: options, then an hvdos command line.
+//
+//   [cd=dir] [in=file] [out=file] [status=n] [hvdos options] program [args]
+//
+// cd is the job's working directory, in its standard input (default
+// /dev/null), out the standard output it must produce and status the exit
+// status it must return. in and out are relative to cd. Fields are
+// separated by blanks; '#' starts a comment line.
+//
+struct Job {
+    size_t                      Line;
+    std::string                 Directory;
+    std::string                 Input;
+    std::string                 Output;
+    int                         Status;     // -1 if not checked
+    std::vector <std::string>   Arguments;
+    std::string                 Program;
+};
+
+struct Result {
+    int                         Status;     // of hvdos, or -1
+    int                         Signal;
+    uint64_t                    Nanos;
+    std::string                 Output;
+    std::string                 Error;
+    bool                        Passed;
+};
+
+std::string HVDOS = "hvdos";
+std::mutex  OutputLock;
+
+// held from creating a child's descriptors until it is forked, so that no
+// other worker's child inherits them before they are close-on-exec
+std::mutex  ForkLock;
+
+// an hvdos option that is followed by its value, as getopt sees it
+bool
+TakesValue(std::string const &Argument)
+{
+    if (Argument.size() != 2 || Argument[1] == ':' || Argument[1] == '\0')
+        return false;
+
+    char const *Option = std::strchr(HVDOS_OPTIONS, Argument[1]);
+    return Option != nullptr && Option[1] == ':';
+}
+
+bool
+ParseManifest(char const *Path, std::vector <Job> &Jobs)
+{
+    std::ifstream In(Path);
+    if (!In)
+        return false;
+
+    std::string Text;
+    for (size_t Line = 1; std::getline(In, Text); Line++) {
+        std::istringstream Fields(Text);
+        std::string        Field;
+        Job                J = { Line, "", "", "", -1, {}, "" };
+
+        while (Fields >> Field) {
+            if (J.Arguments.empty() && Field[0] == '#')
+                break;
+            if (!J.Arguments.empty())
+                J.Arguments.push_back(Field);
+            else if (Field.compare(0, 3, "cd=") == 0)
+                J.Directory = Field.substr(3);
+            else if (Field.compare(0, 3, "in=") == 0)
+                J.Input = Field.substr(3);
+            else if (Field.compare(0, 4, "out=") == 0)
+                J.Output = Field.substr(4);
+            else if (Field.compare(0, 7, "status=") == 0)
+                J.Status = std::atoi(Field.c_str() + 7);
+            else
+                J.Arguments.push_back(Field);
+        }
+        if (J.Arguments.empty())
+            continue;
+
+        // the first argument that is neither an option nor its value
+        for (size_t i = 0; i < J.Arguments.size(); i++) {
+            std::string const &A = J.Arguments[i];
+            if (A[0] != '-') {
+                J.Program = A;
+                break;
+            }
+            if (TakesValue(A))
+                i++;
+        }
+        Jobs.push_back(J);
+    }
+    return true;
+}
+
+// Path as the parent sees it, for a job that runs in Directory
+std::string
+JobPath(Job const &J, std::string const &Path)
+{
+    if (Path.empty() || Path[0] == '/' || J.Directory.empty())
+        return Path;
+    return J.Directory + "/" + Path;
+}
+
+bool
+ReadFile(int FD, std::string &Data)
+{
+    struct stat ST;
+    if (::fstat(FD, &ST) != 0)
+        return false;
+
+    Data.resize(ST.st_size);
+    return ::pread(FD, &Data[0], Data.size(), 0) ==
+        static_cast <ssize_t> (Data.size());
+}
+
+// Program as found on PATH, as execvp would, so that the child can use
+// execv; unchanged if it names a file or is not found
+std::string
+ProgramPath(std::string const &Program)
+{
+    char const *Path = std::getenv("PATH");
+    if (Program.find('/') != std::string::npos || Path == nullptr)
+        return Program;
+
+    std::istringstream Directories(Path);
+    std::string        Directory;
+    while (std::getline(Directories, Directory, ':')) {
+        std::string Candidate = (Directory.empty() ? "." : Directory) + "/" +
+            Program;
+        if (::access(Candidate.c_str(), X_OK) == 0)
+            return Candidate;
+    }
+    return Program;
+}
+
+// an unlinked file for the child to write to; pipes would need a reader
+// per stream while the child runs. Called with ForkLock held.
+int
+CaptureFile()
+{
+    char Path[] = "/tmp/hvbatch.XXXXXX";
+    int  FD     = ::mkstemp(Path);
+    if (FD >= 0) {
+        ::unlink(Path);
+        ::fcntl(FD, F_SETFD, FD_CLOEXEC);
+    }
+    return FD;
+}
+
+void
+Run(Job const &J, Result &R)
+{
+    std::vector <char *> Arguments;
+    Arguments.push_back(const_cast <char *> (HVDOS.c_str()));
+    for (std::string const &A : J.Arguments)
+        Arguments.push_back(const_cast <char *> (A.c_str()));
+    Arguments.push_back(nullptr);
+
+    auto Start = std::chrono::steady_clock::now();
+    std::unique_lock <std::mutex> Lock(ForkLock);
+    int  Out   = CaptureFile();
+    int  Err   = CaptureFile();
+    int  Exec[2];
+
+    // the child only makes async-signal-safe calls (HVDOS was looked up on
+    // PATH before, so it is execv, not execvp), as other workers' threads
+    // are not copied into it; if exec fails it sends errno back through a
+    // pipe that a successful exec closes
+    pid_t Child = -1;
+    if (Out >= 0 && Err >= 0 && ::pipe(Exec) == 0) {
+        ::fcntl(Exec[0], F_SETFD, FD_CLOEXEC);
+        ::fcntl(Exec[1], F_SETFD, FD_CLOEXEC);
+        Child = ::fork();
+        if (Child == 0) {
+            char const *Input = J.Input.empty() ? "/dev/null" :
+                J.Input.c_str();
+            int         In;
+            if ((J.Directory.empty() || ::chdir(J.Directory.c_str()) == 0) &&
+                    (In = ::open(Input, O_RDONLY)) >= 0 &&
+                    ::dup2(In, 0) >= 0 && ::dup2(Out, 1) >= 0 &&
+                    ::dup2(Err, 2) >= 0) {
+                ::close(In);
+                ::execv(Arguments[0], Arguments.data());
+            }
+            int Error = errno;
+            ::write(Exec[1], &Error, sizeof(Error));
+            ::_exit(127);
+        }
+        ::close(Exec[1]);
+    }
+    int Error = errno;
+    Lock.unlock();
+
+    R.Status = -1;
+    R.Signal = 0;
+    if (Child >= 0) {
+        int Status;
+        while (::waitpid(Child, &Status, 0) < 0 && errno == EINTR)
+            ;
+        if (::read(Exec[0], &Error, sizeof(Error)) == sizeof(Error)) {
+            R.Error = std::strerror(Error);
+        } else {
+            if (WIFEXITED(Status))
+                R.Status = WEXITSTATUS(Status);
+            else if (WIFSIGNALED(Status))
+                R.Signal = WTERMSIG(Status);
+            ReadFile(Out, R.Output);
+            ReadFile(Err, R.Error);
+        }
+        ::close(Exec[0]);
+    } else {
+        R.Error = std::strerror(Error);
+    }
+    if (Out >= 0)
+        ::close(Out);
+    if (Err >= 0)
+        ::close(Err);
+
+    R.Nanos = std::chrono::duration_cast <std::chrono::nanoseconds>
+        (std::chrono::steady_clock::now() - Start).count();
+
+    R.Passed = R.Status >= 0 && (J.Status < 0 || R.Status == J.Status);
+    if (R.Passed && !J.Output.empty()) {
+        std::ifstream     Expected(JobPath(J, J.Output), std::ios::binary);
+        std::stringstream Data;
+        Data << Expected.rdbuf();
+        R.Passed = Expected && Data.str() == R.Output;
+    }
+}
+
+void
+WriteString(std::string &Line, std::string const &S)
+{
+    Line += '"';
+    for (unsigned char C : S) {
+        if (C == '"' || C == '\\') {
+            Line += '\\';
+            Line += C;
+        } else if (C == '\n') {
+            Line += "\\n";
+        } else if (C < 0x20 || C >= 0x7F) {
+            // output is bytes, not UTF-8; escaped, the line stays JSON
+            char Escape[8];
+            std::snprintf(Escape, sizeof(Escape), "\\u%04x", C);
+            Line += Escape;
+        } else {
+            Line += C;
+        }
+    }
+    Line += '"';
+}
+
+void
+Report(size_t Index, Job const &J, Result const &R)
+{
+    std::string Line;
+    char        Number[96];
+
+    std::snprintf(Number, sizeof(Number), "{\"job\": %zu, \"line\": %zu, ",
+            Index, J.Line);
+    Line += Number;
+    Line += "\"program\": ";
+    WriteString(Line, J.Program);
+    std::snprintf(Number, sizeof(Number), ", \"status\": %d, \"signal\": %d, "
+            "\"ns\": %llu, ", R.Status, R.Signal,
+            static_cast <unsigned long long> (R.Nanos));
+    Line += Number;
+    Line += "\"stdout\": ";
+    WriteString(Line, R.Output);
+    Line += ", \"stderr\": ";
+    WriteString(Line, R.Error);
+    Line += R.Passed ? ", \"passed\": true}\n" : ", \"passed\": false}\n";
+
+    std::lock_guard <std::mutex> Lock(OutputLock);
+    std::fwrite(Line.data(), 1, Line.size(), stdout);
+    std::fflush(stdout);
+}
+
+void
+Usage()
+{
+    std::fprintf(stderr, "Usage: hvbatch [-j workers] [-x hvdos] manifest\n");
+    std::exit(1);
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned Workers = std::thread::hardware_concurrency();
+    int      ch;
+
+    // by default the hvdos next to hvbatch, if started by path
+    if (std::strchr(argv[0], '/') != nullptr) {
+        HVDOS = argv[0];
+        HVDOS.replace(HVDOS.rfind('/') + 1, std::string::npos, "hvdos");
+    }
+
+    while ((ch = getopt(argc, argv, "j:x:")) != -1) {
+        switch (ch) {
+            case 'j': Workers = std::strtoul(optarg, nullptr, 0); break;
+            case 'x': HVDOS   = optarg; break;
+            default:  Usage();
+        }
+    }
+    if (optind != argc - 1)
+        Usage();
+    if (Workers == 0)
+        Workers = 1;
+    HVDOS = ProgramPath(HVDOS);
+
+    std::vector <Job> Jobs;
+    if (!ParseManifest(argv[optind], Jobs)) {
+        std::perror(argv[optind]);
+        return 1;
+    }
+
+    // each worker takes the next job when it finishes one, so long jobs
+    // never hold up a queue of short ones behind them
+    std::atomic <size_t>    Next(0);
+    std::atomic <size_t>    Failed(0);
+    std::vector <std::thread> Pool;
+    auto Start = std::chrono::steady_clock::now();
+
+    for (unsigned i = 0; i < Workers && i < Jobs.size(); i++) {
+        Pool.emplace_back([&] {
+            for (size_t Index; (Index = Next++) < Jobs.size(); ) {
+                Result R;
+                Run(Jobs[Index], R);
+                Report(Index, Jobs[Index], R);
+                if (!R.Passed)
+                    Failed++;
+            }
+        });
+    }
+    for (std::thread &T : Pool)
+        T.join();
+
+    double Seconds = std::chrono::duration <double>
+        (std::chrono::steady_clock::now() - Start).count();
+    std::fprintf(stderr, "%zu jobs, %zu failed, %u workers, %.1f jobs/s\n",
+            Jobs.size(), Failed.load(), Workers,
+            Seconds > 0 ? Jobs.size() / Seconds : 0.0);
+    return Failed != 0;
+}
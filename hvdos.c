@@ -3,15 +3,26 @@
 //
 // hvdos - a simple DOS emulator based on the OS X 10.10 Hypervisor.framework
 
+#include <ctype.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <Hypervisor/hv.h>
 #include <Hypervisor/hv_vmx.h>
 #include "vmcs.h"
 #include "interface.h"
+#include "hvdos.h"
 #include "DOSKernel.h"
+#include "MemoryBackend.h"
+#include "ResetPoint.h"
+#include "RunLog.h"
+#include "VMSnapshot.h"
 
 //#define DEBUG 1
 
+/* exit status when the guest stopped without terminating */
+#define EXIT_CRASHED 255
+
 /* read GPR */
 uint64_t
 rreg(hv_vcpuid_t vcpu, hv_x86_reg_t reg)
@@ -35,7 +46,7 @@ wreg(hv_vcpuid_t vcpu, hv_x86_reg_t reg, uint64_t v)
 }
 
 /* read VMCS field */
-static uint64_t
+uint64_t
 rvmcs(hv_vcpuid_t vcpu, uint32_t field)
 {
 	uint64_t v;
@@ -48,7 +59,7 @@ rvmcs(hv_vcpuid_t vcpu, uint32_t field)
 }
 
 /* write VMCS field */
-static void
+void
 wvmcs(hv_vcpuid_t vcpu, uint32_t field, uint64_t v)
 {
 	if (hv_vmx_vcpu_write_vmcs(vcpu, field, v)) {
@@ -63,13 +74,443 @@ cap2ctrl(uint64_t cap, uint64_t ctrl)
 	return (ctrl | (cap & 0xffffffff)) & (cap >> 32);
 }
 
+/* write the machine as it is now to path */
+static int
+save_snapshot(const char *path, DOSKernel &kernel, hv_vcpuid_t vcpu,
+	void *mem, size_t size)
+{
+	VMSnapshot snapshot;
+
+	kernel.flushConsole();
+	kernel.registers().sync();
+	snapshot.captureVCPU(vcpu);
+	if (!kernel.save(snapshot) ||
+		!snapshot.write(path, (const char *)mem, size))
+	{
+		perror(path);
+		return 0;
+	}
+	return 1;
+}
+
+/* run the guest until it terminates; nonzero if it stopped otherwise */
+static int
+run(DOSKernel &kernel, hv_vcpuid_t vcpu, void *vm_mem, size_t mem_size,
+	const char *save_path, ResetPoint *reset, RunLog *log)
+{
+	Stats &stats = kernel.stats();
+	int recording = log && log->recording();
+	int replaying = log && log->replaying();
+	int stop = 0;
+	int crashed = 0;
+	do {
+		int status = DOSKernel::STATUS_HANDLED;
+
+		/* write back registers the kernel modified during the last exit */
+		kernel.registers().sync();
+
+		uint64_t t_entry = Stats::now();
+		if (hv_vcpu_run(vcpu)) {
+			abort();
+		}
+		uint64_t t_exit = Stats::now();
+		stats.Guest.add(t_exit - t_entry);
+
+		/* handle VMEXIT */
+		uint64_t exit_reason = rvmcs(vcpu, VMCS_EXIT_REASON);
+
+		if (kernel.trace().enabled(Trace::CATEGORY_EXIT)) {
+			Trace::Record &r = kernel.trace().append(Trace::CATEGORY_EXIT);
+			r.ExitReason = exit_reason;
+			r.CS = kernel.registers().read(HV_X86_CS);
+			r.IP = kernel.registers().read(HV_X86_RIP);
+		}
+
+		if (recording) {
+			log->begin(exit_reason);
+		}
+
+		switch (exit_reason) {
+			case EXIT_REASON_VMCALL:
+				/* INT n reached a BIOS trap stub */
+				status = replaying ? log->replay(exit_reason) : kernel.trap();
+				switch (status) {
+					case DOSKernel::STATUS_UNSUPPORTED:
+						stop = crashed = 1;
+						break;
+					case DOSKernel::STATUS_STOP:
+						stop = 1;
+						break;
+					case DOSKernel::STATUS_NORETURN:
+						// The kernel changed the PC.
+						break;
+					case DOSKernel::STATUS_SNAPSHOT:
+						/* the guest is at the VMCALL, which runs on resume */
+						if (!save_snapshot(save_path, kernel, vcpu, vm_mem,
+							mem_size))
+						{
+							stop = crashed = 1;
+						}
+						break;
+					default:
+						break;
+				}
+				break;
+			case EXIT_REASON_EXCEPTION: {
+				/* CPU exception raised by the guest */
+				uint8_t vector = rvmcs(vcpu, VMCS_EXIT_INTR_INFO) & 0xFF;
+				fprintf(stderr, "exception %u at %04llx:%04llx\n", vector,
+					kernel.registers().read(HV_X86_CS),
+					kernel.registers().read(HV_X86_RIP));
+				stop = crashed = 1;
+				break;
+			}
+			case EXIT_REASON_EXT_INTR:
+				/* VMEXIT due to host interrupt */
+#if DEBUG
+				printf("IRQ\n");
+#endif
+				kernel.clock().preempted();
+				if (replaying) {
+					log->replayTick();
+				}
+				break;
+			case EXIT_REASON_HLT:
+				/* guest executed HLT, which waits for the next tick */
+#if DEBUG
+				printf("HLT\n");
+#endif
+				status = replaying ? log->replay(exit_reason) : kernel.halt();
+				if (status != DOSKernel::STATUS_HANDLED) {
+					stop = crashed = 1;
+				}
+				break;
+			case EXIT_REASON_RDTSC:
+				/* virtual time, or a log: the TSC is the clock's */
+				if (replaying) {
+					status = log->replay(exit_reason);
+					if (status != DOSKernel::STATUS_HANDLED) {
+						stop = crashed = 1;
+					}
+				} else {
+					kernel.readTimeStampCounter();
+				}
+				break;
+			case EXIT_REASON_EPT_FAULT:
+				/* first write to a page since the reset point */
+				if (reset && reset->fault(rvmcs(vcpu,
+					VMCS_GUEST_PHYSICAL_ADDRESS),
+					rvmcs(vcpu, VMCS_EXIT_QUALIFICATION)))
+				{
+					break;
+				}
+				/* nothing is mapped above guest memory */
+				if (rvmcs(vcpu, VMCS_GUEST_PHYSICAL_ADDRESS) >= mem_size) {
+					fprintf(stderr, "access to unmapped guest address %llx\n",
+						rvmcs(vcpu, VMCS_GUEST_PHYSICAL_ADDRESS));
+					stop = crashed = 1;
+					break;
+				}
+				/* disambiguate between EPT cold misses and MMIO */
+				/* ... handle MMIO ... */
+				break;
+	 		/* ... many more exit reasons go here ... */
+			default:
+				printf("unhandled VMEXIT (%llu)\n", exit_reason);
+
+				stop = crashed = 1;
+		}
+
+		/* a replayed guest has the time of day from the log */
+		if (replaying) {
+			kernel.tickDevices();
+		} else {
+			kernel.tick();
+		}
+		if (recording && !log->end(exit_reason, status)) {
+			perror(log->path().c_str());
+			stop = crashed = 1;
+		}
+		stats.addExit(exit_reason, Stats::now() - t_exit);
+	} while (!stop);
+
+	return crashed;
+}
+
+/*
+ * run the program once per line of runs_path, "input output", with its
+ * standard input and output redirected to those files; each run starts
+ * from the machine as it is now, and its exit status goes to stderr
+ */
+static int
+run_each(const char *runs_path, DOSKernel &kernel, hv_vcpuid_t vcpu,
+	void *vm_mem, size_t mem_size, const char *save_path)
+{
+	FILE *runs = fopen(runs_path, "r");
+	if (!runs) {
+		perror(runs_path);
+		return 1;
+	}
+
+	ResetPoint reset(kernel, vcpu);
+	if (!reset.capture()) {
+		perror(runs_path);
+		fclose(runs);
+		return 1;
+	}
+
+	char line[2 * 1024 + 2];
+	char input[1024], output[1024];
+	int first = 1;
+	int crashed = 0;
+	while (fgets(line, sizeof(line), runs)) {
+		if (sscanf(line, "%1023s %1023s", input, output) != 2) {
+			continue;
+		}
+
+		kernel.flushConsole();
+		if (!first && !reset.reset()) {
+			perror(runs_path);
+			crashed = 1;
+			break;
+		}
+		first = 0;
+
+		/* the console uses descriptors 0 and 1, which freopen() keeps */
+		if (!freopen(input, "r", stdin)) {
+			perror(input);
+			crashed = 1;
+			continue;
+		}
+		if (!freopen(output, "w", stdout)) {
+			perror(output);
+			crashed = 1;
+			continue;
+		}
+
+		int status = run(kernel, vcpu, vm_mem, mem_size, save_path, &reset,
+			NULL)
+			? EXIT_CRASHED : kernel.exitStatus();
+		kernel.flushConsole();
+		fflush(stdout);
+		fprintf(stderr, "%s %d\n", output, status);
+		crashed |= status == EXIT_CRASHED;
+	}
+
+	fclose(runs);
+	return crashed;
+}
+
+/* bytes, or with a K or M suffix */
+static int
+parse_size(const char *text, size_t *size)
+{
+	char *end;
+
+	*size = strtoull(text, &end, 0);
+	if (toupper((unsigned char)*end) == 'K') {
+		*size <<= 10;
+		end++;
+	} else if (toupper((unsigned char)*end) == 'M') {
+		*size <<= 20;
+		end++;
+	}
+	return end != text && *end == '\0';
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: hvdos [-s stats.json] [-t trace.bin] [-T categories] "
+		"[-N records]\n"
+		"             [-d X:=dir ...] [-r X: ...] [-o X:=dir ...] "
+		"[-i X:=image ...]\n"
+		"             [-c] [-q size] [-S snapshot[:AH]] [-R snapshot] "
+		"[-E runs]\n"
+		"             [-m size] [-M anonymous|huge|shared[:name]] [-P]\n"
+		"             [-C host|virtual[:YYYY-MM-DD[THH:MM[:SS]]]]\n"
+		"             [-K keyfile | -k keys] "
+		"[-V terminal[:fps]|snapshot:prefix[:ms]]\n"
+		"             [-L record:log|replay:log]\n"
+		"             [program[.com|.exe]] [args...]\n");
+	exit(1);
+}
+
 int
 main(int argc, char **argv)
 {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: hvdos [com file]\n");
-                exit(1);
-    }
+	const char *stats_path = NULL;
+	const char *trace_path = NULL;
+	uint32_t trace_mask = Trace::CATEGORY_ALL;
+	uint64_t trace_records = 1024 * 1024;
+	const char *drives[FileSystem::DRIVE_COUNT] = { NULL };
+	char kinds[FileSystem::DRIVE_COUNT] = { 0 };
+	int commit = 0;
+	size_t quota = 0;
+	MemoryBackend::Options memory_options;
+	memory_options.Type = MemoryBackend::KIND_ANONYMOUS;
+	memory_options.Size = MemoryBackend::MIN_SIZE;
+	memory_options.Prefault = false;
+	memory_options.Offset = 0;
+	VirtualClock::Options clock_options;
+	clock_options.Type = VirtualClock::MODE_HOST;
+	clock_options.Start = 0;
+	const char *save_path = NULL;
+	int save_function = -1;
+	const char *restore_path = NULL;
+	const char *runs_path = NULL;
+	const char *keys_path = NULL;
+	const char *keys = NULL;
+	TextScreen::Options video_options;
+	video_options.Type = TextScreen::OUTPUT_STREAM;
+	video_options.Rate = 0;
+	RunLog::Options log_options;
+	int logging = 0;
+	VMSnapshot snapshot;
+	char *end;
+	int drive;
+	int ch;
+
+	while ((ch = getopt(argc, argv, HVDOS_OPTIONS)) != -1) {
+		switch (ch) {
+			case 's':
+				stats_path = optarg;
+				break;
+			case 't':
+				trace_path = optarg;
+				break;
+			case 'T':
+				trace_mask = Trace::parseCategories(optarg);
+				break;
+			case 'N':
+				trace_records = strtoull(optarg, NULL, 0);
+				break;
+			case 'd':
+			case 'o':
+			case 'i':
+				/* X:=dir or X=dir */
+				drive = toupper((unsigned char)optarg[0]) - 'A';
+				if (drive < 0 || drive >= FileSystem::DRIVE_COUNT ||
+					strchr(optarg, '=') == NULL)
+				{
+					usage();
+				}
+				drives[drive] = strchr(optarg, '=') + 1;
+				kinds[drive] = ch;
+				break;
+			case 'r':
+				/* X: or X */
+				drive = toupper((unsigned char)optarg[0]) - 'A';
+				if (drive < 0 || drive >= FileSystem::DRIVE_COUNT) {
+					usage();
+				}
+				drives[drive] = NULL;
+				kinds[drive] = ch;
+				break;
+			case 'c':
+				commit = 1;
+				break;
+			case 'q':
+				if (!parse_size(optarg, &quota)) {
+					usage();
+				}
+				break;
+			case 'S':
+				/* file, or file:AH to save at that INT 21h function */
+				save_path = optarg;
+				if ((end = strrchr(optarg, ':')) != NULL &&
+					isxdigit((unsigned char)end[1]))
+				{
+					char *colon = end;
+					save_function = strtoul(colon + 1, &end, 16);
+					if (*end != '\0' || save_function > 0xff) {
+						usage();
+					}
+					*colon = '\0';
+				}
+				break;
+			case 'R':
+				restore_path = optarg;
+				break;
+			case 'E':
+				runs_path = optarg;
+				break;
+			case 'm':
+				if (!parse_size(optarg, &memory_options.Size)) {
+					usage();
+				}
+				break;
+			case 'M':
+				if (!MemoryBackend::parseKind(optarg, memory_options)) {
+					usage();
+				}
+				break;
+			case 'P':
+				memory_options.Prefault = true;
+				break;
+			case 'C':
+				if (!VirtualClock::parse(optarg, clock_options)) {
+					usage();
+				}
+				break;
+			case 'K':
+				keys_path = optarg;
+				keys = NULL;
+				break;
+			case 'k':
+				keys = optarg;
+				keys_path = NULL;
+				break;
+			case 'V':
+				if (!TextScreen::parse(optarg, video_options)) {
+					usage();
+				}
+				break;
+			case 'L':
+				if (!RunLog::parse(optarg, log_options)) {
+					usage();
+				}
+				logging = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+	/* the kernel sees the program as argv[1], its arguments after it */
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	/* a restored machine already has its program, a replayed one its log */
+	int replay = logging && log_options.Type == RunLog::MODE_REPLAY;
+	if (argc < 2 && !restore_path && !replay) {
+		usage();
+	}
+	/* a log is of one run from the start */
+	if (logging && (save_path || restore_path || runs_path)) {
+		usage();
+	}
+	if (restore_path && !snapshot.read(restore_path)) {
+		perror(restore_path);
+		exit(1);
+	}
+	/* a reset point puts back the first MB and the kernel, but not RAM
+	 * drives, overlays or memory above 1 MB, so runs would not start alike */
+	if (runs_path) {
+		size_t size = restore_path ? snapshot.memorySize() :
+			memory_options.Size;
+		for (drive = 0; drive < FileSystem::DRIVE_COUNT; drive++) {
+			if (kinds[drive] == 'r' || kinds[drive] == 'o') {
+				break;
+			}
+		}
+		if (drive < FileSystem::DRIVE_COUNT ||
+			size > GuestMemory::ADDRESS_SPACE)
+		{
+			fprintf(stderr, "-E cannot be combined with -r, -o or more "
+				"than 1M of memory\n");
+			exit(1);
+		}
+	}
 
 	/* create a VM instance for the current task */
 	if (hv_vm_create(HV_VM_DEFAULT)) {
@@ -92,14 +533,23 @@ main(int argc, char **argv)
 	}
 
 	/* allocate some guest physical memory */
-#define VM_MEM_SIZE (1 * 1024 * 1024)
-	void *vm_mem;
-	if (!(vm_mem = valloc(VM_MEM_SIZE))) {
-		abort();
+	MemoryBackend memory;
+	if (restore_path) {
+		/* copy-on-write from the snapshot file, at the size it was saved */
+		memory_options.Type = MemoryBackend::KIND_FILE;
+		memory_options.Path = snapshot.path();
+		memory_options.Offset = snapshot.memoryOffset();
+		memory_options.Size = snapshot.memorySize();
+	}
+	if (!memory.open(memory_options)) {
+		perror(restore_path ? restore_path : "guest memory");
+		exit(1);
 	}
+	void *vm_mem = memory.base();
+	size_t mem_size = memory.size();
 	/* map a segment of guest physical memory into the guest physical address
 	 * space of the vm (at address 0) */
-	if (hv_vm_map(vm_mem, 0, VM_MEM_SIZE, HV_MEMORY_READ | HV_MEMORY_WRITE
+	if (hv_vm_map(vm_mem, 0, mem_size, HV_MEMORY_READ | HV_MEMORY_WRITE
 		| HV_MEMORY_EXEC))
 	{
 		abort();
@@ -112,7 +562,9 @@ main(int argc, char **argv)
 	}
 
 	/* vCPU setup */
+#define VMCS_PRI_PROC_BASED_CTLS_TSC_OFFSET    (1 << 3)
 #define VMCS_PRI_PROC_BASED_CTLS_HLT           (1 << 7)
+#define VMCS_PRI_PROC_BASED_CTLS_RDTSC         (1 << 12)
 #define VMCS_PRI_PROC_BASED_CTLS_CR8_LOAD      (1 << 19)
 #define VMCS_PRI_PROC_BASED_CTLS_CR8_STORE     (1 << 20)
 
@@ -121,7 +573,10 @@ main(int argc, char **argv)
     wvmcs(vcpu, VMCS_PRI_PROC_BASED_CTLS, cap2ctrl(vmx_cap_procbased,
                                                    VMCS_PRI_PROC_BASED_CTLS_HLT |
                                                    VMCS_PRI_PROC_BASED_CTLS_CR8_LOAD |
-                                                   VMCS_PRI_PROC_BASED_CTLS_CR8_STORE));
+                                                   VMCS_PRI_PROC_BASED_CTLS_CR8_STORE |
+                                                   (clock_options.Type == VirtualClock::MODE_VIRTUAL || logging
+                                                    ? VMCS_PRI_PROC_BASED_CTLS_RDTSC
+                                                    : VMCS_PRI_PROC_BASED_CTLS_TSC_OFFSET)));
 	wvmcs(vcpu, VMCS_SEC_PROC_BASED_CTLS, cap2ctrl(vmx_cap_procbased2, 0));
 	wvmcs(vcpu, VMCS_ENTRY_CTLS, cap2ctrl(vmx_cap_entry, 0));
 	wvmcs(vcpu, VMCS_EXCEPTION_BITMAP, 0xffffffff);
@@ -173,79 +628,153 @@ main(int argc, char **argv)
 	wvmcs(vcpu, VMCS_GUEST_GDTR_LIMIT, 0);
 	wvmcs(vcpu, VMCS_GUEST_GDTR_BASE, 0);
 
-	wvmcs(vcpu, VMCS_GUEST_IDTR_LIMIT, 0);
+	/* real-mode IVT: interrupts vector into the BIOS stubs (BIOS.h) */
+	wvmcs(vcpu, VMCS_GUEST_IDTR_LIMIT, 0x3ff);
 	wvmcs(vcpu, VMCS_GUEST_IDTR_BASE, 0);
 
 	wvmcs(vcpu, VMCS_GUEST_CR0, 0x20);
 	wvmcs(vcpu, VMCS_GUEST_CR3, 0x0);
 	wvmcs(vcpu, VMCS_GUEST_CR4, 0x2000);
 
-	/* initialize DOS emulation */
-	DOSKernel Kernel((char *)vm_mem, vcpu, argc, argv);
-
-	/* read COM file at 0x100 */
-	FILE *f = fopen(argv[1], "r");
-	fread((char *)vm_mem + 0x100, 1, 64 * 1024, f);
-	fclose(f);
+	/* registers and segment state where the saved machine stopped */
+	if (restore_path) {
+		snapshot.restoreVCPU(vcpu);
+	}
 
-	/* set up GPRs, start at COM file entry point */
-	wreg(vcpu, HV_X86_RIP, 0x100);
-	wreg(vcpu, HV_X86_RFLAGS, 0x2);
-	wreg(vcpu, HV_X86_RSP, 0x0);
+	/* initialize DOS emulation */
+	DOSKernel Kernel((char *)vm_mem, vcpu);
+	Kernel.clock().configure(clock_options);
+	Kernel.screen().configure(video_options);
+	wvmcs(vcpu, VMCS_TSC_OFFSET, Kernel.clock().tscOffset());
+	if (!restore_path && !replay) {
+		Kernel.boot(argc, argv);
+	}
 
-	/* vCPU run loop */
-	int stop = 0;
-	do {
-		if (hv_vcpu_run(vcpu)) {
-			abort();
-		}
-		/* handle VMEXIT */
-		uint64_t exit_reason = rvmcs(vcpu, VMCS_EXIT_REASON);
+	if (trace_path && !Kernel.trace().open(trace_path, trace_records,
+		trace_mask))
+	{
+		exit(1);
+	}
 
-		switch (exit_reason) {
-			case EXIT_REASON_EXCEPTION: {
-				uint8_t interrupt_number = rvmcs(vcpu, VMCS_IDT_VECTORING_INFO) & 0xFF;
-				int Status = Kernel.dispatch(interrupt_number);
-				switch (Status) {
-					case DOSKernel::STATUS_HANDLED:
-						wreg(vcpu, HV_X86_RIP, rreg(vcpu, HV_X86_RIP) + 2);
-						break;
-					case DOSKernel::STATUS_UNSUPPORTED:
-					case DOSKernel::STATUS_STOP:
-						stop = 1;
-						break;
-					case DOSKernel::STATUS_NORETURN:
-						// The kernel changed the PC.
-						break;
-					default:
-						break;
-				}
+	FileSystem &fs = Kernel.fileSystem();
+	if (quota) {
+		fs.setQuota(quota);
+	}
+	for (drive = 0; drive < FileSystem::DRIVE_COUNT; drive++) {
+		int ok = 1;
+		switch (kinds[drive]) {
+			case 'd':
+				ok = fs.mount(drive, drives[drive]);
 				break;
-			}
-			case EXIT_REASON_EXT_INTR:
-				/* VMEXIT due to host interrupt, nothing to do */
-#if DEBUG
-				printf("IRQ\n");
-#endif
+			case 'o':
+				ok = fs.mountOverlay(drive, drives[drive]);
 				break;
-			case EXIT_REASON_HLT:
-				/* guest executed HLT */
-#if DEBUG
-				printf("HLT\n");
-#endif
-				stop = 1;
+			case 'r':
+				ok = fs.mountMemory(drive);
 				break;
-			case EXIT_REASON_EPT_FAULT:
-				/* disambiguate between EPT cold misses and MMIO */
-				/* ... handle MMIO ... */
+			case 'i':
+				ok = fs.mountImage(drive, drives[drive]);
 				break;
-	 		/* ... many more exit reasons go here ... */
-			default:
-				printf("unhandled VMEXIT (%llu)\n", exit_reason);
+		}
+		if (!ok) {
+			perror(drives[drive]);
+			exit(1);
+		}
+	}
 
-				stop = 1;
+	if (restore_path) {
+		/* host-side state, given the drives it was saved with */
+		if (!Kernel.restore(snapshot)) {
+			perror(restore_path);
+			exit(1);
 		}
-	} while (!stop);
+	} else if (replay) {
+		/* the machine, program and all, is in the log */
+	} else if (!Kernel.loadProgram(argv[1])) {
+		/* load the .COM or .EXE above its PSP and set up registers for it */
+		perror(argv[1]);
+		exit(1);
+	}
+
+	/* without a function to stop at, the snapshot is of the loaded program */
+	if (save_path && save_function < 0 &&
+		!save_snapshot(save_path, Kernel, vcpu, vm_mem, mem_size))
+	{
+		exit(1);
+	}
+	if (save_path && save_function >= 0) {
+		Kernel.armSnapshot(save_function);
+	}
+
+	/* scripted keys first, then standard input, a key at a time if a tty */
+	ConsoleInput &input = Kernel.console().input();
+	if (keys_path && !input.loadScript(keys_path)) {
+		perror(keys_path);
+		exit(1);
+	}
+	if (keys && !input.setScript(keys)) {
+		perror(keys);
+		exit(1);
+	}
+	if (!replay) {
+		input.setRaw();
+	}
+
+	/* the machine as it is now is where the log starts */
+	RunLog log(Kernel);
+	if (logging && (!log.open(log_options) || !log.start())) {
+		perror(log_options.Path.c_str());
+		exit(1);
+	}
+
+	/* what the guest commits is what it touches from here on */
+	Stats::MemoryUse &memory_use = Kernel.stats().Memory;
+	memory_use.Bytes = mem_size;
+	memory_use.PageSize = memory.pageSize();
+	memory_use.PrefaultNanos = memory.prefaultNanos();
+	size_t resident = memory.residentPages();
+
+	int crashed = 0;
+	if (!runs_path) {
+		crashed = run(Kernel, vcpu, vm_mem, mem_size, save_path, NULL,
+			logging ? &log : NULL);
+	} else {
+		crashed = run_each(runs_path, Kernel, vcpu, vm_mem, mem_size,
+			save_path);
+	}
+
+	Kernel.flushConsole();
+	Kernel.screen().finish();
+	Kernel.reportUnhandled(stderr);
+	if (logging && !log.finish()) {
+		perror(log_options.Path.c_str());
+	}
+
+	memory_use.ResidentPages = memory.residentPages();
+	memory_use.TouchedPages = memory_use.ResidentPages > resident
+		? memory_use.ResidentPages - resident : 0;
+
+	/* overlay changes are discarded unless asked for */
+	if (commit && !fs.commit()) {
+		perror("commit");
+	}
+
+	if (stats_path) {
+		FILE *sf = fopen(stats_path, "w");
+		if (sf) {
+			Kernel.stats().writeJSON(sf, Kernel);
+			fclose(sf);
+		} else {
+			perror(stats_path);
+		}
+	}
+
+#if DEBUG
+	RegisterFile::Stats const &rs = Kernel.registers().stats();
+	fprintf(stderr, "registers: %llu reads, %llu writes in %llu resumes\n",
+		(unsigned long long)rs.Reads, (unsigned long long)rs.Writes,
+		(unsigned long long)rs.Resumes);
+#endif
 
 	/*
 	 * optional clean-up
@@ -257,7 +786,7 @@ main(int argc, char **argv)
 	}
 
 	/* unmap memory segment at address 0 */
-	if (hv_vm_unmap(0, VM_MEM_SIZE)) {
+	if (hv_vm_unmap(0, mem_size)) {
 		abort();
 	}
 	/* destroy VM instance of this task */
@@ -265,7 +794,7 @@ main(int argc, char **argv)
 		abort();
 	}
 
-	free(vm_mem);
-
-	return 0;
+	/* the return code of AH=4Ch, as a DOS batch file would see it */
+	return crashed ? EXIT_CRASHED : replay ? log.exitStatus()
+		: Kernel.exitStatus();
 }
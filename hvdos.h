@@ -0,0 +1,11 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+
+#ifndef __hvdos_h
+#define __hvdos_h
+
+// the options of hvdos, as getopt takes them; hvbatch finds the program in
+// an hvdos command line by the ones that take a value
+#define HVDOS_OPTIONS "s:t:T:N:d:r:o:i:cq:S:R:E:m:M:PC:K:k:V:L:"
+
+#endif  // !__hvdos_h
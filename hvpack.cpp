@@ -0,0 +1,270 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+//
+// hvpack - pack a host directory into a read-only drive image for hvdos -i
+
+#include "PackedImage.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+typedef PackedImage::SearchEntry SearchEntry;
+
+struct Item {
+    SearchEntry             Entry;
+    PackedImage::Record     Record;
+    std::string             Path;       // empty for "." and ".."
+    std::string             HostPath;
+    dev_t                   Device;
+    ino_t                   Inode;
+};
+
+typedef std::set <std::pair <dev_t, ino_t>> Visited;
+
+// the 8.3 entries of HostDir at the end of Items, sorted by template
+void
+AddDirectory(std::vector <Item> &Items, std::string const &HostDir,
+        std::string const &Dir, bool IsRoot)
+{
+    DIR *DP = ::opendir(HostDir.c_str());
+    if (DP == nullptr) {
+        std::perror(HostDir.c_str());
+        return;
+    }
+
+    size_t Start = Items.size();
+    while (struct dirent *DE = ::readdir(DP)) {
+        bool IsDot = std::strcmp(DE->d_name, ".") == 0 ||
+                     std::strcmp(DE->d_name, "..") == 0;
+        Item I = {};
+
+        if (IsDot) {
+            // a root directory has no "." and ".." in DOS
+            if (IsRoot)
+                continue;
+            FileSystem::makeTemplate(DE->d_name, I.Entry.Template);
+            std::strcpy(I.Entry.Name, DE->d_name);
+        } else if (!FileSystem::shortName(DE->d_name, I.Entry.Template,
+                    I.Entry.Name)) {
+            std::fprintf(stderr, "%s/%s: not an 8.3 name, skipped\n",
+                    HostDir.c_str(), DE->d_name);
+            continue;
+        }
+
+        struct stat ST;
+        I.HostPath = HostDir + "/" + DE->d_name;
+        if (::stat(I.HostPath.c_str(), &ST) != 0) {
+            std::perror(I.HostPath.c_str());
+            continue;
+        }
+        if (!S_ISREG(ST.st_mode) && !S_ISDIR(ST.st_mode))
+            continue;
+        if (S_ISREG(ST.st_mode) && ST.st_size > UINT32_MAX) {
+            std::fprintf(stderr, "%s: too large, skipped\n",
+                    I.HostPath.c_str());
+            continue;
+        }
+
+        I.Entry.Attributes = FileSystem::modeAttributes(ST.st_mode);
+        I.Entry.Size       = S_ISDIR(ST.st_mode) ? 0 : ST.st_size;
+        FileSystem::dosTime(ST.st_mtime, I.Entry.Time, I.Entry.Date);
+        I.Device = ST.st_dev;
+        I.Inode  = ST.st_ino;
+        if (!IsDot)
+            I.Path = Dir.empty() ? I.Entry.Name : Dir + "\\" + I.Entry.Name;
+        Items.push_back(I);
+    }
+    ::closedir(DP);
+
+    std::stable_sort(Items.begin() + Start, Items.end(),
+            [](Item const &A, Item const &B) {
+                return std::memcmp(A.Entry.Template, B.Entry.Template, 11) < 0;
+            });
+
+    // FOO.H and foo.h are the same DOS name
+    Items.erase(std::unique(Items.begin() + Start, Items.end(),
+                [](Item const &A, Item const &B) {
+                    return std::memcmp(A.Entry.Template, B.Entry.Template,
+                            11) == 0;
+                }), Items.end());
+}
+
+bool
+CopyFile(int Out, Item const &I)
+{
+    int In = ::open(I.HostPath.c_str(), O_RDONLY);
+    if (In < 0)
+        return false;
+
+    static char Buffer[64 * 1024];
+    uint64_t    Done = 0;
+    while (Done < I.Entry.Size) {
+        ssize_t Count = ::read(In, Buffer, std::min <uint64_t> (sizeof(Buffer),
+                    I.Entry.Size - Done));
+        if (Count < 0 && errno == EINTR)
+            continue;
+        if (Count <= 0 || ::pwrite(Out, Buffer, Count,
+                    I.Record.DataOffset + Done) != Count) {
+            // a file that shrank while we read it
+            if (Count == 0)
+                errno = EIO;
+            ::close(In);
+            return false;
+        }
+        Done += Count;
+    }
+
+    ::close(In);
+    return true;
+}
+
+inline uint64_t
+Align(uint64_t Offset)
+{
+    return (Offset + PackedImage::ALIGNMENT - 1) &
+        ~static_cast <uint64_t> (PackedImage::ALIGNMENT - 1);
+}
+
+void
+Usage()
+{
+    std::fprintf(stderr, "Usage: hvpack directory image\n");
+    std::exit(1);
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc != 3)
+        Usage();
+
+    // directories breadth first, so each one's entries are contiguous
+    std::vector <Item> Items;
+    Visited            Directories;
+    AddDirectory(Items, argv[1], "", true);
+    uint32_t RootCount = Items.size();
+
+    for (size_t i = 0; i < Items.size(); i++) {
+        if (!(Items[i].Entry.Attributes & FileSystem::ATTR_DIRECTORY) ||
+                Items[i].Path.empty())
+            continue;
+        if (!Directories.insert(std::make_pair(Items[i].Device,
+                        Items[i].Inode)).second) {
+            std::fprintf(stderr, "%s: directory loop, skipped\n",
+                    Items[i].HostPath.c_str());
+            continue;
+        }
+
+        // copies, as adding entries moves Items
+        std::string HostDir(Items[i].HostPath);
+        std::string Dir(Items[i].Path);
+        uint32_t    First = Items.size();
+        AddDirectory(Items, HostDir, Dir, false);
+        Items[i].Record.First = First;
+        Items[i].Record.Count = Items.size() - First;
+    }
+
+    uint32_t Count   = Items.size();
+    uint32_t Buckets = 1;
+    while (Buckets < 2 * Count)
+        Buckets *= 2;
+
+    PackedImage::Header H = {};
+    std::memcpy(H.Magic, "HVPACK01", sizeof(H.Magic));
+    H.Version       = PackedImage::VERSION;
+    H.EntryCount    = Count;
+    H.RootCount     = RootCount;
+    H.BucketCount   = Buckets;
+    H.ListingOffset = sizeof(H);
+    H.RecordOffset  = H.ListingOffset + Count * sizeof(SearchEntry);
+    H.BucketOffset  = H.RecordOffset + Count * sizeof(PackedImage::Record);
+    H.NameOffset    = H.BucketOffset + Buckets * sizeof(uint32_t);
+
+    std::vector <SearchEntry>           Listing;
+    std::vector <PackedImage::Record>   Records;
+    std::vector <uint32_t>              Table(Buckets, 0);
+    std::string                         Names;
+
+    uint64_t Offset = Align(H.NameOffset);
+    for (uint32_t i = 0; i < Count; i++) {
+        Item &I = Items[i];
+
+        I.Record.Hash       = PackedImage::hash(I.Path.data(), I.Path.size());
+        I.Record.PathOffset = Names.size();
+        Names.append(I.Path.c_str(), I.Path.size() + 1);
+
+        if (!(I.Entry.Attributes & FileSystem::ATTR_DIRECTORY)) {
+            I.Record.DataOffset = Offset;
+            Offset = Align(Offset + I.Entry.Size);
+        }
+        if (!I.Path.empty()) {
+            uint32_t Slot = I.Record.Hash & (Buckets - 1);
+            while (Table[Slot] != 0)
+                Slot = (Slot + 1) & (Buckets - 1);
+            Table[Slot] = i + 1;
+        }
+
+        Listing.push_back(I.Entry);
+        Records.push_back(I.Record);
+    }
+    H.Size = std::max(Offset, H.NameOffset + Names.size());
+
+    // written beside the image and renamed over it, so that running jobs
+    // keep the image they mapped
+    std::string Temporary = std::string(argv[2]) + ".tmp";
+    int Out = ::open(Temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (Out < 0) {
+        std::perror(Temporary.c_str());
+        return 1;
+    }
+
+    bool Result =
+        ::pwrite(Out, &H, sizeof(H), 0) == sizeof(H) &&
+        ::pwrite(Out, Listing.data(), Count * sizeof(SearchEntry),
+                H.ListingOffset) ==
+            static_cast <ssize_t> (Count * sizeof(SearchEntry)) &&
+        ::pwrite(Out, Records.data(), Count * sizeof(PackedImage::Record),
+                H.RecordOffset) ==
+            static_cast <ssize_t> (Count * sizeof(PackedImage::Record)) &&
+        ::pwrite(Out, Table.data(), Buckets * sizeof(uint32_t),
+                H.BucketOffset) ==
+            static_cast <ssize_t> (Buckets * sizeof(uint32_t)) &&
+        ::pwrite(Out, Names.data(), Names.size(), H.NameOffset) ==
+            static_cast <ssize_t> (Names.size());
+
+    for (uint32_t i = 0; Result && i < Count; i++) {
+        if (Items[i].Entry.Attributes & FileSystem::ATTR_DIRECTORY)
+            continue;
+        Result = CopyFile(Out, Items[i]);
+        if (!Result)
+            std::perror(Items[i].HostPath.c_str());
+    }
+
+    Result = Result && ::ftruncate(Out, H.Size) == 0;
+    if (::close(Out) != 0 || !Result ||
+            ::rename(Temporary.c_str(), argv[2]) != 0) {
+        std::perror(argv[2]);
+        ::unlink(Temporary.c_str());
+        return 1;
+    }
+
+    std::printf("%s: %u entries, %llu bytes\n", argv[2], Count,
+            static_cast <unsigned long long> (H.Size));
+    return 0;
+}
@@ -0,0 +1,136 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+//
+// hvtrace - decode an hvdos trace file (hvdos -t) to text or CSV, or
+// change the category mask of a trace that is being recorded
+
+#include "Trace.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+char const *
+CategoryName(uint8_t Category)
+{
+    switch (Category) {
+        case Trace::CATEGORY_EXIT:      return "exit";
+        case Trace::CATEGORY_INTERRUPT: return "int";
+        case Trace::CATEGORY_DOS:       return "dos";
+        default:                        break;
+    }
+    return "?";
+}
+
+void
+PrintText(Trace::Record const &R, uint64_t Base)
+{
+    std::printf("%12.3f us %-4s %04X:%04X", (R.Nanos - Base) / 1000.0,
+            CategoryName(R.Category), R.CS, R.IP);
+
+    if (R.Category == Trace::CATEGORY_EXIT) {
+        std::printf(" reason=%u\n", R.ExitReason);
+    } else {
+        std::printf(" INT %02Xh AH=%02X AL=%02X BX=%04X CX=%04X -> "
+                "AX=%04X%s\n", R.Vector, R.Function, R.Subfunction,
+                R.Handle, R.Count, R.Result, R.Carry ? " CF" : "");
+    }
+}
+
+void
+PrintCSV(Trace::Record const &R, uint64_t Base)
+{
+    std::printf("%llu,%s,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u\n",
+            static_cast <unsigned long long> (R.Nanos - Base),
+            CategoryName(R.Category), R.ExitReason, R.Vector, R.CS, R.IP,
+            R.Function, R.Subfunction, R.Handle, R.Count, R.Result,
+            R.Carry);
+}
+
+void
+Usage()
+{
+    std::fprintf(stderr, "Usage: hvtrace [-c] [-l last] trace.bin\n"
+                         "       hvtrace -m categories trace.bin\n");
+    std::exit(1);
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+    bool        CSV  = false;
+    uint64_t    Last = 0;
+    char const *Mask = nullptr;
+    int         ch;
+
+    while ((ch = getopt(argc, argv, "cl:m:")) != -1) {
+        switch (ch) {
+            case 'c': CSV  = true; break;
+            case 'l': Last = std::strtoull(optarg, nullptr, 0); break;
+            case 'm': Mask = optarg; break;
+            default:  Usage();
+        }
+    }
+    if (optind != argc - 1)
+        Usage();
+
+    int FD = ::open(argv[optind], Mask ? O_RDWR : O_RDONLY);
+    struct stat ST;
+    if (FD < 0 || ::fstat(FD, &ST) < 0) {
+        std::perror(argv[optind]);
+        return 1;
+    }
+
+    void *Base = ::mmap(nullptr, ST.st_size,
+            Mask ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, FD, 0);
+    ::close(FD);
+    if (Base == MAP_FAILED) {
+        std::perror(argv[optind]);
+        return 1;
+    }
+
+    auto H = static_cast <Trace::Header *> (Base);
+    if (static_cast <size_t> (ST.st_size) < sizeof(*H) ||
+            std::memcmp(H->Magic, "HVTRACE1", sizeof(H->Magic)) != 0 ||
+            H->RecordSize != sizeof(Trace::Record) ||
+            sizeof(*H) + H->Capacity * sizeof(Trace::Record) >
+                static_cast <size_t> (ST.st_size)) {
+        std::fprintf(stderr, "%s: not an hvdos trace\n", argv[optind]);
+        return 1;
+    }
+
+    if (Mask) {
+        H->Mask = Trace::parseCategories(Mask);
+        return 0;
+    }
+
+    auto     Records = reinterpret_cast <Trace::Record const *> (H + 1);
+    uint64_t Head    = H->Head;
+    uint64_t Count   = Head < H->Capacity ? Head : H->Capacity;
+    if (Last != 0 && Last < Count)
+        Count = Last;
+
+    uint64_t First  = Head - Count;
+    uint64_t Origin = Count ? Records[First % H->Capacity].Nanos : 0;
+
+    if (CSV)
+        std::printf("ns,category,exit_reason,vector,cs,ip,ah,al,bx,cx,ax,cf\n");
+    for (uint64_t i = First; i < Head; i++) {
+        Trace::Record const &R = Records[i % H->Capacity];
+        if (CSV)
+            PrintCSV(R, Origin);
+        else
+            PrintText(R, Origin);
+    }
+
+    return 0;
+}
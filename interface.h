@@ -5,45 +5,55 @@
 
 extern uint64_t rreg(hv_vcpuid_t vcpu, hv_x86_reg_t reg);
 extern void wreg(hv_vcpuid_t vcpu, hv_x86_reg_t reg, uint64_t v);
+extern uint64_t rvmcs(hv_vcpuid_t vcpu, uint32_t field);
+extern void wvmcs(hv_vcpuid_t vcpu, uint32_t field, uint64_t v);
+
+// The accessors below go through the kernel's per-exit RegisterFile
+// (_regs), so repeated use within one service call costs no extra
+// hypervisor calls.
 
 #define readMem8(a) _memory[a]
 #define writeMem8(a, v) do { _memory[a] = v; } while (0)
 
-#define AX ((uint16_t)rreg(_vcpu, HV_X86_RAX))
-#define BX ((uint16_t)rreg(_vcpu, HV_X86_RBX))
-#define CX ((uint16_t)rreg(_vcpu, HV_X86_RCX))
-#define DX ((uint16_t)rreg(_vcpu, HV_X86_RDX))
-
-#define pc ((uint16_t)rreg(_vcpu, HV_X86_RIP))
-#define DS rreg(_vcpu, HV_X86_DS)
-#define ES rreg(_vcpu, HV_X86_ES)
-
-#define FLAGS ((uint16_t)rreg(_vcpu, HV_X86_RFLAGS))
-
-#define AL ((uint16_t)rreg(_vcpu, HV_X86_RAX) & 0xFF)
-#define AH ((uint16_t)rreg(_vcpu, HV_X86_RAX) >> 8)
-#define BL ((uint16_t)rreg(_vcpu, HV_X86_RBX) & 0xFF)
-#define BH ((uint16_t)rreg(_vcpu, HV_X86_RBX) >> 8)
-#define CL ((uint16_t)rreg(_vcpu, HV_X86_RCX) & 0xFF)
-#define CH ((uint16_t)rreg(_vcpu, HV_X86_RCX) >> 8)
-#define DL ((uint16_t)rreg(_vcpu, HV_X86_RDX) & 0xFF)
-#define DH ((uint16_t)rreg(_vcpu, HV_X86_RDX) >> 8)
-
-#define SET_AX(v) wreg(_vcpu, HV_X86_RAX, v)
-#define SET_BX(v) wreg(_vcpu, HV_X86_RBX, v)
-#define SET_CX(v) wreg(_vcpu, HV_X86_RCX, v)
-#define SET_DX(v) wreg(_vcpu, HV_X86_RDX, v)
-
-#define SET_DS(v) wreg(_vcpu, HV_X86_DS, v)
-#define SET_ES(v) wreg(_vcpu, HV_X86_ES, v)
-
-#define SET_AL(v) wreg(_vcpu, HV_X86_RAX, (AX & 0xFF00) | v)
-#define SET_AH(v) wreg(_vcpu, HV_X86_RAX, (AX & 0xFF) | (v << 8))
-#define SET_BL(v) wreg(_vcpu, HV_X86_RBX, (BX & 0xFF00) | v)
-#define SET_BH(v) wreg(_vcpu, HV_X86_RBX, (BX & 0xFF) | (v << 8))
-#define SET_CL(v) wreg(_vcpu, HV_X86_RCX, (CX & 0xFF00) | v)
-#define SET_CH(v) wreg(_vcpu, HV_X86_RCX, (CX & 0xFF) | (v << 8))
-#define SET_DL(v) wreg(_vcpu, HV_X86_RDX, (DX & 0xFF00) | v)
-#define SET_DH(v) wreg(_vcpu, HV_X86_RDX, (DX & 0xFF) | (v << 8))
-
-#define SETC(v) wreg(_vcpu, HV_X86_RFLAGS, (FLAGS & 0xFFFE) | v)
+#define AX ((uint16_t)_regs.read(HV_X86_RAX))
+#define BX ((uint16_t)_regs.read(HV_X86_RBX))
+#define CX ((uint16_t)_regs.read(HV_X86_RCX))
+#define DX ((uint16_t)_regs.read(HV_X86_RDX))
+#define SI ((uint16_t)_regs.read(HV_X86_RSI))
+#define DI ((uint16_t)_regs.read(HV_X86_RDI))
+
+#define pc ((uint16_t)_regs.read(HV_X86_RIP))
+#define SP ((uint16_t)_regs.read(HV_X86_RSP))
+#define DS _regs.read(HV_X86_DS)
+#define ES _regs.read(HV_X86_ES)
+
+#define FLAGS ((uint16_t)_regs.read(HV_X86_RFLAGS))
+
+#define AL ((uint16_t)_regs.read(HV_X86_RAX) & 0xFF)
+#define AH ((uint16_t)_regs.read(HV_X86_RAX) >> 8)
+#define BL ((uint16_t)_regs.read(HV_X86_RBX) & 0xFF)
+#define BH ((uint16_t)_regs.read(HV_X86_RBX) >> 8)
+#define CL ((uint16_t)_regs.read(HV_X86_RCX) & 0xFF)
+#define CH ((uint16_t)_regs.read(HV_X86_RCX) >> 8)
+#define DL ((uint16_t)_regs.read(HV_X86_RDX) & 0xFF)
+#define DH ((uint16_t)_regs.read(HV_X86_RDX) >> 8)
+
+#define SET_AX(v) _regs.write(HV_X86_RAX, v)
+#define SET_BX(v) _regs.write(HV_X86_RBX, v)
+#define SET_CX(v) _regs.write(HV_X86_RCX, v)
+#define SET_DX(v) _regs.write(HV_X86_RDX, v)
+
+#define SET_DS(v) _regs.write(HV_X86_DS, v)
+#define SET_ES(v) _regs.write(HV_X86_ES, v)
+
+#define SET_AL(v) _regs.write(HV_X86_RAX, (AX & 0xFF00) | ((v) & 0xFF))
+#define SET_AH(v) _regs.write(HV_X86_RAX, (AX & 0xFF) | (((v) & 0xFF) << 8))
+#define SET_BL(v) _regs.write(HV_X86_RBX, (BX & 0xFF00) | ((v) & 0xFF))
+#define SET_BH(v) _regs.write(HV_X86_RBX, (BX & 0xFF) | (((v) & 0xFF) << 8))
+#define SET_CL(v) _regs.write(HV_X86_RCX, (CX & 0xFF00) | ((v) & 0xFF))
+#define SET_CH(v) _regs.write(HV_X86_RCX, (CX & 0xFF) | (((v) & 0xFF) << 8))
+#define SET_DL(v) _regs.write(HV_X86_RDX, (DX & 0xFF00) | ((v) & 0xFF))
+#define SET_DH(v) _regs.write(HV_X86_RDX, (DX & 0xFF) | (((v) & 0xFF) << 8))
+
+#define SETC(v) _regs.write(HV_X86_RFLAGS, (FLAGS & 0xFFFE) | ((v) & 1))
+#define SETZ(v) _regs.write(HV_X86_RFLAGS, (FLAGS & 0xFFBF) | (((v) & 1) << 6))
@@ -0,0 +1,194 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+//
+// The common INT 21h paths do no heap allocation: AH=09 print, AH=3F read
+// and AH=40 write, to a file and to the console, once the handle is open.
+// Calls go through DOSKernel::trap() as in hvdos, with an array of
+// registers in place of the vCPU; operator new counts while they run.
+
+#include "DOSKernel.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+uint64_t Registers[HV_X86_REGISTERS_MAX];
+bool     Counting;
+unsigned Allocations;
+int      Failures;
+
+uint16_t const DATA_SEGMENT  = 0x2000;
+uint16_t const STACK_SEGMENT = 0x3000;
+uint16_t const STACK_TOP     = 0xFFFA;     // IP CS FLAGS of the INT
+uint16_t const ROUNDS        = 100;
+
+void
+Check(bool Condition, char const *What)
+{
+    if (!Condition) {
+        std::fprintf(stderr, "FAILED: %s\n", What);
+        Failures++;
+    }
+}
+
+// INT 21h with AX BX CX DX as given, DS at DATA_SEGMENT, then tick() and
+// sync() as in hvdos's run(); AX after the call, or -1 if it set the carry
+long
+Call(DOSKernel &Kernel, uint16_t A, uint16_t B, uint16_t C, uint16_t D)
+{
+    uint16_t Frame[3] = { 0x0100, 0x1000, 0x0202 };
+    Kernel.memory().write(STACK_SEGMENT, STACK_TOP, Frame, sizeof(Frame));
+
+    Registers[HV_X86_CS]     = BIOS::ROM_SEGMENT;
+    Registers[HV_X86_RIP]    = 0x21 * BIOS::TRAP_STRIDE;
+    Registers[HV_X86_SS]     = STACK_SEGMENT;
+    Registers[HV_X86_RSP]    = STACK_TOP;
+    Registers[HV_X86_RFLAGS] = 0x0002;
+    Registers[HV_X86_DS]     = DATA_SEGMENT;
+    Registers[HV_X86_RAX]    = A;
+    Registers[HV_X86_RBX]    = B;
+    Registers[HV_X86_RCX]    = C;
+    Registers[HV_X86_RDX]    = D;
+
+    if (Kernel.trap() != DOSKernel::STATUS_HANDLED)
+        return -1;
+    Kernel.tick();
+    Kernel.registers().sync();
+    return (Registers[HV_X86_RFLAGS] & 1) ? -1 : Registers[HV_X86_RAX];
+}
+
+// the allocations of ROUNDS calls, after one that may set things up
+unsigned
+Allocated(DOSKernel &Kernel, char const *What, uint16_t A, uint16_t B,
+        uint16_t C, uint16_t D)
+{
+    Check(Call(Kernel, A, B, C, D) >= 0, What);
+
+    Allocations = 0;
+    Counting    = true;
+    for (int i = 0; i < ROUNDS; i++)
+        Call(Kernel, A, B, C, D);
+    Counting    = false;
+    return Allocations;
+}
+
+}
+
+void *
+operator new(std::size_t Size)
+{
+    if (Counting)
+        Allocations++;
+    if (void *P = std::malloc(Size ? Size : 1))
+        return P;
+    throw std::bad_alloc();
+}
+
+void
+operator delete(void *P) noexcept
+{
+    std::free(P);
+}
+
+// the vCPU, as interface.h declares it
+uint64_t
+rreg(hv_vcpuid_t vcpu, hv_x86_reg_t reg)
+{
+    return Registers[reg];
+}
+
+void
+wreg(hv_vcpuid_t vcpu, hv_x86_reg_t reg, uint64_t v)
+{
+    Registers[reg] = v;
+}
+
+uint64_t
+rvmcs(hv_vcpuid_t vcpu, uint32_t field)
+{
+    return 0;
+}
+
+void
+wvmcs(hv_vcpuid_t vcpu, uint32_t field, uint64_t v)
+{
+}
+
+int
+main()
+{
+    char Directory[] = "/tmp/hvdos-test.XXXXXX";
+    if (::mkdtemp(Directory) == nullptr) {
+        std::perror(Directory);
+        return 1;
+    }
+
+    std::string Path = std::string(Directory) + "/DATA.TXT";
+    FILE *F = std::fopen(Path.c_str(), "wb");
+    for (int i = 0; F != nullptr && i < 64 * 1024; i++)
+        std::fputc('A' + i % 26, F);
+    if (F == nullptr || std::fclose(F) != 0) {
+        std::perror(Path.c_str());
+        return 1;
+    }
+
+    std::vector <char> Memory(GuestMemory::ADDRESS_SPACE);
+    char const        *Arguments[] = { "hvdos", "TEST.COM", nullptr };
+
+    DOSKernel Kernel(&Memory[0], 0);
+    Kernel.boot(2, const_cast <char **> (Arguments));
+    if (!Kernel.fileSystem().mount(FileSystem::DEFAULT_DRIVE, Directory)) {
+        std::perror(Directory);
+        return 1;
+    }
+
+    // what the console prints goes nowhere while the calls run
+    std::fflush(stdout);
+    int Output = ::dup(1);
+    int Null   = ::open("/dev/null", O_WRONLY);
+    ::dup2(Null, 1);
+
+    Kernel.memory().write(DATA_SEGMENT, 0, "C:\\DATA.TXT", 12);
+    long Reader = Call(Kernel, 0x3D00, 0, 0, 0);
+    long Writer = Call(Kernel, 0x3D02, 0, 0, 0);
+    Check(Reader >= 0 && Writer >= 0, "the file opens");
+
+    Kernel.memory().write(DATA_SEGMENT, 0x0100, "printed by AH=09\r\n$", 19);
+    unsigned Print       = Allocated(Kernel, "AH=09 print", 0x0900, 0, 0,
+            0x0100);
+    unsigned Read        = Allocated(Kernel, "AH=3F read", 0x3F00, Reader,
+            512, 0x0200);
+    unsigned WriteFile   = Allocated(Kernel, "AH=40 write to a file", 0x4000,
+            Writer, 512, 0x0200);
+    unsigned WriteOutput = Allocated(Kernel, "AH=40 write to the console",
+            0x4000, 1, 16, 0x0100);
+    Kernel.flushConsole();
+
+    std::fflush(stdout);
+    ::dup2(Output, 1);
+    ::close(Output);
+    ::close(Null);
+
+    std::printf("allocations in %u calls: AH=09 %u, AH=3F %u, AH=40 file %u, "
+            "AH=40 console %u\n", ROUNDS, Print, Read, WriteFile,
+            WriteOutput);
+    Check(Print == 0, "AH=09 allocates nothing");
+    Check(Read == 0, "AH=3F allocates nothing");
+    Check(WriteFile == 0 && WriteOutput == 0, "AH=40 allocates nothing");
+
+    Call(Kernel, 0x3E00, Reader, 0, 0);
+    Call(Kernel, 0x3E00, Writer, 0, 0);
+    ::unlink(Path.c_str());
+    ::rmdir(Directory);
+
+    std::printf("%s\n", Failures ? "FAILED" : "passed");
+    return Failures != 0;
+}
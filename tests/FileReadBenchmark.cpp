@@ -0,0 +1,162 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+//
+// A DOS program streaming a file in 512-byte AH=3F reads, as the kernel
+// sees it: one trap() per read, with an array of registers in place of the
+// vCPU. The file is read once through a read-write handle, which costs a
+// host read() per call, and once through a read-only one, served from a
+// mapping; the host calls of each are what the "files" counters of
+// hvdos -s report.
+//
+//   filebench [megabytes]
+
+#include "DOSKernel.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+uint64_t Registers[HV_X86_REGISTERS_MAX];
+
+uint16_t const DATA_SEGMENT  = 0x2000;
+uint16_t const STACK_SEGMENT = 0x3000;
+uint16_t const STACK_TOP     = 0xFFFA;     // IP CS FLAGS of the INT
+uint16_t const CHUNK         = 512;
+
+// INT 21h with AX BX CX DX as given, DS at DATA_SEGMENT; AX after the
+// call, or -1 if it set the carry
+long
+Call(DOSKernel &Kernel, uint16_t A, uint16_t B, uint16_t C, uint16_t D)
+{
+    uint16_t Frame[3] = { 0x0100, 0x1000, 0x0202 };
+    Kernel.memory().write(STACK_SEGMENT, STACK_TOP, Frame, sizeof(Frame));
+
+    Registers[HV_X86_CS]     = BIOS::ROM_SEGMENT;
+    Registers[HV_X86_RIP]    = 0x21 * BIOS::TRAP_STRIDE;
+    Registers[HV_X86_SS]     = STACK_SEGMENT;
+    Registers[HV_X86_RSP]    = STACK_TOP;
+    Registers[HV_X86_RFLAGS] = 0x0002;
+    Registers[HV_X86_DS]     = DATA_SEGMENT;
+    Registers[HV_X86_RAX]    = A;
+    Registers[HV_X86_RBX]    = B;
+    Registers[HV_X86_RCX]    = C;
+    Registers[HV_X86_RDX]    = D;
+
+    if (Kernel.trap() != DOSKernel::STATUS_HANDLED)
+        return -1;
+    Kernel.tick();
+    Kernel.registers().sync();
+    return (Registers[HV_X86_RFLAGS] & 1) ? -1 : Registers[HV_X86_RAX];
+}
+
+// C:\DATA.BIN opened with AH=3D in Mode and read to the end
+bool
+Stream(DOSKernel &Kernel, uint8_t Mode, uint64_t Size, char const *Name)
+{
+    DOSFile::Counters Before = Kernel.fileSystem().counters();
+    auto              Start  = std::chrono::steady_clock::now();
+
+    Kernel.memory().write(DATA_SEGMENT, 0, "C:\\DATA.BIN", 12);
+    long Handle = Call(Kernel, 0x3D00 | Mode, 0, 0, 0);
+    if (Handle < 0) {
+        std::fprintf(stderr, "%s: the file does not open\n", Name);
+        return false;
+    }
+
+    uint64_t Total = 0, Reads = 0;
+    for (long Count; (Count = Call(Kernel, 0x3F00, Handle, CHUNK, 0x0100)) > 0;
+            Reads++)
+        Total += Count;
+    Call(Kernel, 0x3E00, Handle, 0, 0);
+
+    double Seconds = std::chrono::duration <double>
+        (std::chrono::steady_clock::now() - Start).count();
+    DOSFile::Counters const &After = Kernel.fileSystem().counters();
+    std::printf("%-10s %llu reads, %llu syscalls, %llu refills, %.0f ns per "
+            "read, %.0f MB/s\n", Name,
+            static_cast <unsigned long long> (Reads),
+            static_cast <unsigned long long> (After.Syscalls - Before.Syscalls),
+            static_cast <unsigned long long> (After.Refills - Before.Refills),
+            Seconds * 1e9 / Reads, Total / Seconds / (1 << 20));
+    return Total == Size;
+}
+
+}
+
+// the vCPU, as interface.h declares it
+uint64_t
+rreg(hv_vcpuid_t vcpu, hv_x86_reg_t reg)
+{
+    return Registers[reg];
+}
+
+void
+wreg(hv_vcpuid_t vcpu, hv_x86_reg_t reg, uint64_t v)
+{
+    Registers[reg] = v;
+}
+
+uint64_t
+rvmcs(hv_vcpuid_t vcpu, uint32_t field)
+{
+    return 0;
+}
+
+void
+wvmcs(hv_vcpuid_t vcpu, uint32_t field, uint64_t v)
+{
+}
+
+int
+main(int argc, char **argv)
+{
+    uint64_t Size = ((argc > 1) ? std::strtoull(argv[1], nullptr, 0) : 50)
+        << 20;
+
+    char Directory[] = "/tmp/hvdos-bench.XXXXXX";
+    if (::mkdtemp(Directory) == nullptr) {
+        std::perror(Directory);
+        return 1;
+    }
+
+    std::string Path = std::string(Directory) + "/DATA.BIN";
+    FILE *F = std::fopen(Path.c_str(), "wb");
+    std::vector <char> Block(1 << 20);
+    for (size_t i = 0; i < Block.size(); i++)
+        Block[i] = static_cast <char> (i * 7);
+    for (uint64_t Written = 0; F != nullptr && Written < Size;
+            Written += Block.size()) {
+        if (std::fwrite(Block.data(), 1, Block.size(), F) != Block.size())
+            break;
+    }
+    if (F == nullptr || std::fclose(F) != 0) {
+        std::perror(Path.c_str());
+        return 1;
+    }
+
+    std::vector <char> Memory(GuestMemory::ADDRESS_SPACE);
+    char const        *Arguments[] = { "hvdos", "BENCH.COM", nullptr };
+
+    DOSKernel Kernel(&Memory[0], 0);
+    Kernel.boot(2, const_cast <char **> (Arguments));
+    if (!Kernel.fileSystem().mount(FileSystem::DEFAULT_DRIVE, Directory)) {
+        std::perror(Directory);
+        return 1;
+    }
+
+    std::printf("%llu MB in %u-byte reads\n",
+            static_cast <unsigned long long> (Size >> 20), CHUNK);
+    bool Complete = Stream(Kernel, 2, Size, "read-write") &&
+        Stream(Kernel, 0, Size, "read-only");
+
+    ::unlink(Path.c_str());
+    ::rmdir(Directory);
+    return Complete ? 0 : 1;
+}
@@ -0,0 +1,23 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+//
+// The part of Hypervisor.framework the kernel's sources name, so that the
+// tests build on any host. There is no vCPU behind it: a test defines
+// rreg(), wreg(), rvmcs() and wvmcs() (interface.h) itself.
+
+#ifndef __hv_vmx_h
+#define __hv_vmx_h
+
+#include <stdint.h>
+
+typedef unsigned hv_vcpuid_t;
+
+typedef enum {
+    HV_X86_RIP, HV_X86_RFLAGS,
+    HV_X86_RAX, HV_X86_RCX, HV_X86_RDX, HV_X86_RBX,
+    HV_X86_RSI, HV_X86_RDI, HV_X86_RSP, HV_X86_RBP,
+    HV_X86_CS, HV_X86_SS, HV_X86_DS, HV_X86_ES, HV_X86_FS, HV_X86_GS,
+    HV_X86_REGISTERS_MAX
+} hv_x86_reg_t;
+
+#endif  // !__hv_vmx_h
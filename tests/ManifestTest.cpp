@@ -0,0 +1,71 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+//
+// hvbatch: the program of a manifest line is found past every hvdos option
+// and its value, for each option hvdos has. hvbatch.cpp is built in here,
+// its main() renamed.
+
+#define main HVBatchMain
+#include "hvbatch.cpp"
+#undef main
+
+namespace {
+
+int Failures;
+
+void
+Check(bool Condition, std::string const &What)
+{
+    if (!Condition) {
+        std::fprintf(stderr, "FAILED: %s\n", What.c_str());
+        Failures++;
+    }
+}
+
+}
+
+int
+main()
+{
+    char Path[] = "/tmp/hvdos-test.XXXXXX";
+    int  FD     = ::mkstemp(Path);
+    if (FD < 0) {
+        std::perror(Path);
+        return 1;
+    }
+
+    // one line per option, its value looking like a program name
+    std::string              Manifest = "# options\n\n";
+    std::vector <std::string> Lines;
+    for (char const *O = HVDOS_OPTIONS; *O != '\0'; O++) {
+        if (*O == ':')
+            continue;
+        std::string Line = std::string("-") + *O;
+        if (O[1] == ':')
+            Line += " VALUE.COM";
+        Line += " PROG.EXE ARG";
+        Lines.push_back(Line);
+    }
+    Lines.push_back("cd=dir in=in.txt status=0 -m 2M -c -E 1M PROG.EXE");
+    Lines.push_back("-m2M -P PROG.EXE -s ARG");
+    for (std::string const &L : Lines)
+        Manifest += L + "\n";
+
+    if (::write(FD, Manifest.data(), Manifest.size()) !=
+            static_cast <ssize_t> (Manifest.size())) {
+        std::perror(Path);
+        return 1;
+    }
+    ::close(FD);
+
+    std::vector <Job> Jobs;
+    Check(ParseManifest(Path, Jobs), "the manifest is read");
+    Check(Jobs.size() == Lines.size(), "one job per line");
+    for (size_t i = 0; i < Jobs.size() && i < Lines.size(); i++)
+        Check(Jobs[i].Program == "PROG.EXE", Lines[i]);
+
+    ::unlink(Path);
+
+    std::printf("%s\n", Failures ? "FAILED" : "passed");
+    return Failures != 0;
+}
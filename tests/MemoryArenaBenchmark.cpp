@@ -0,0 +1,119 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+//
+// MemoryArena under churn: with n blocks allocated, free one at random and
+// allocate another of random size, for each allocation strategy. The
+// arena runs on GuestMemory over a plain buffer; no kernel, no vCPU.
+//
+//   arenabench [blocks] [rounds]
+
+#include "MemoryArena.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+struct Random {
+    uint64_t State;
+
+    uint32_t next()
+    {
+        State ^= State << 13;
+        State ^= State >> 7;
+        State ^= State << 17;
+        return static_cast <uint32_t> (State >> 16);
+    }
+};
+
+struct Result {
+    double   AllocateNanos;     // per call
+    double   ReleaseNanos;
+    uint64_t Failed;            // allocations that found no room
+    bool     Consistent;        // the chain still adds up afterwards
+};
+
+uint16_t const OWNER     = 0x0100;
+uint16_t const MAX_BLOCK = 64;      // paragraphs
+
+Result
+Churn(uint8_t Strategy, size_t Blocks, size_t Rounds)
+{
+    std::vector <char> Buffer(GuestMemory::ADDRESS_SPACE);
+    GuestMemory        Memory(&Buffer[0]);
+    MemoryArena        Arena(Memory);
+    Random             R = { 0x9E3779B97F4A7C15ULL };
+    Result             Out = {};
+
+    Arena.format(MemoryArena::OWNER_FREE, "");
+    Arena.setStrategy(Strategy);
+
+    std::vector <uint16_t> Live;
+    uint16_t               Segment, Largest;
+    while (Live.size() < Blocks &&
+            Arena.allocate(1 + R.next() % MAX_BLOCK, OWNER, Segment, Largest))
+        Live.push_back(Segment);
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::duration Allocating(0), Releasing(0);
+    for (size_t i = 0; i < Rounds && !Live.empty(); i++) {
+        size_t Victim = R.next() % Live.size();
+
+        Clock::time_point Start = Clock::now();
+        Arena.release(Live[Victim]);
+        Clock::time_point Released = Clock::now();
+        bool Allocated = Arena.allocate(1 + R.next() % MAX_BLOCK, OWNER,
+                Segment, Largest);
+        Clock::time_point End = Clock::now();
+
+        Releasing  += Released - Start;
+        Allocating += End - Released;
+        if (Allocated) {
+            Live[Victim] = Segment;
+        } else {
+            Live[Victim] = Live.back();
+            Live.pop_back();
+            Out.Failed++;
+        }
+    }
+
+    Out.AllocateNanos = std::chrono::duration <double, std::nano>
+        (Allocating).count() / Rounds;
+    Out.ReleaseNanos  = std::chrono::duration <double, std::nano>
+        (Releasing).count() / Rounds;
+    Out.Consistent    = Arena.rebuild();
+    return Out;
+}
+
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t Blocks = (argc > 1) ? std::strtoul(argv[1], nullptr, 0) : 1000;
+    size_t Rounds = (argc > 2) ? std::strtoul(argv[2], nullptr, 0) : 1000000;
+
+    struct {
+        uint8_t     Strategy;
+        char const *Name;
+    } const Strategies[] = {
+        { MemoryArena::FIRST_FIT, "first fit" },
+        { MemoryArena::BEST_FIT,  "best fit" },
+        { MemoryArena::LAST_FIT,  "last fit" }
+    };
+
+    std::printf("%zu blocks of 1-%u paragraphs, %zu rounds of release and "
+            "allocate\n", Blocks, MAX_BLOCK, Rounds);
+    bool Consistent = true;
+    for (auto const &S : Strategies) {
+        Result R = Churn(S.Strategy, Blocks, Rounds);
+        std::printf("%-10s  allocate %7.1f ns  release %7.1f ns  "
+                "%llu without room%s\n", S.Name, R.AllocateNanos,
+                R.ReleaseNanos, static_cast <unsigned long long> (R.Failed),
+                R.Consistent ? "" : "  CHAIN BROKEN");
+        Consistent = Consistent && R.Consistent;
+    }
+    return Consistent ? 0 : 1;
+}
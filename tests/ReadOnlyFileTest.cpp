@@ -0,0 +1,93 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+//
+// ReadOnlyFile: a mapped file truncated by another process while it is
+// open reads as the shorter file, rather than faulting on the pages that
+// are gone.
+
+#include "DOSFile.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+int Failures;
+
+void
+Check(bool Condition, char const *What)
+{
+    if (!Condition) {
+        std::fprintf(stderr, "FAILED: %s\n", What);
+        Failures++;
+    }
+}
+
+char
+Expected(off_t Offset)
+{
+    return static_cast <char> ('A' + Offset % 26);
+}
+
+}
+
+int
+main()
+{
+    char Directory[] = "/tmp/hvdos-test.XXXXXX";
+    if (::mkdtemp(Directory) == nullptr) {
+        std::perror(Directory);
+        return 1;
+    }
+
+    std::string Path = std::string(Directory) + "/DATA.BIN";
+    std::vector <char> Contents(1 << 20);
+    for (size_t i = 0; i < Contents.size(); i++)
+        Contents[i] = Expected(i);
+    FILE *F = std::fopen(Path.c_str(), "wb");
+    if (F == nullptr || std::fwrite(Contents.data(), 1, Contents.size(), F) !=
+            Contents.size() || std::fclose(F) != 0) {
+        std::perror(Path.c_str());
+        return 1;
+    }
+
+    DOSFile::Counters C = {};
+    int FD = ::open(Path.c_str(), O_RDONLY);
+    if (FD < 0) {
+        std::perror(Path.c_str());
+        return 1;
+    }
+    ReadOnlyFile File(FD, &C);
+    Check(C.Mapped == 1, "the file is mapped");
+
+    char Buffer[512];
+    Check(File.read(Buffer, sizeof(Buffer)) == sizeof(Buffer) &&
+            std::memcmp(Buffer, Contents.data(), sizeof(Buffer)) == 0,
+            "a read before the truncation");
+
+    // well inside the size the file had, on a page that is gone
+    Check(::truncate(Path.c_str(), 1000) == 0, "the truncation");
+    Check(File.seek(600000, SEEK_SET) == 600000, "a seek past the new end");
+    Check(File.read(Buffer, sizeof(Buffer)) == 0,
+            "a read past the new end is the end of the file");
+
+    // what is left reads as it was
+    Check(File.seek(512, SEEK_SET) == 512, "a seek back");
+    Check(File.read(Buffer, sizeof(Buffer)) == 488 &&
+            std::memcmp(Buffer, Contents.data() + 512, 488) == 0,
+            "the rest of the file");
+    Check(File.read(Buffer, sizeof(Buffer)) == 0, "then the end of the file");
+    Check(File.close() == 0, "the file closes");
+
+    ::unlink(Path.c_str());
+    ::rmdir(Directory);
+
+    std::printf("%s\n", Failures ? "FAILED" : "passed");
+    return Failures != 0;
+}
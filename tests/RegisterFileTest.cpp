@@ -0,0 +1,242 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+//
+// RegisterFile: an exit costs one hypervisor call per register the kernel
+// uses, and one per register it changed, written back at sync(). INT 21h
+// calls go through DOSKernel::trap() as in hvdos, with an array of
+// registers in place of the vCPU.
+
+#include "DOSKernel.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+uint64_t Registers[HV_X86_REGISTERS_MAX];
+unsigned Reads[HV_X86_REGISTERS_MAX];
+unsigned Writes[HV_X86_REGISTERS_MAX];
+unsigned FieldWrites;
+int      Failures;
+
+char const *const Names[HV_X86_REGISTERS_MAX] = {
+    "RIP", "RFLAGS", "RAX", "RCX", "RDX", "RBX", "RSI", "RDI", "RSP", "RBP",
+    "CS", "SS", "DS", "ES", "FS", "GS"
+};
+
+uint16_t const DATA_SEGMENT  = 0x2000;
+uint16_t const STACK_SEGMENT = 0x3000;
+uint16_t const STACK_TOP     = 0xFFFA;     // IP CS FLAGS of the INT
+uint16_t const CALLER_FLAGS  = 0x0203;     // IF, and a carry left over
+uint16_t const ROM_FLAGS     = 0x00C6;     // what the ROM's compares left
+
+void
+Check(bool Condition, char const *What)
+{
+    if (!Condition) {
+        std::fprintf(stderr, "FAILED: %s\n", What);
+        Failures++;
+    }
+}
+
+// the hypervisor calls of one exit
+struct Exit {
+    int      Status;
+    unsigned Reads;
+    unsigned Writes;
+    unsigned MostReads;     // of any one register
+};
+
+// INT 21h as it reaches the kernel: a VMCALL in its trap stub with the
+// interrupt frame on the stack, then tick() and sync() before the guest
+// would run again, as in hvdos's run()
+Exit
+Trap(DOSKernel &Kernel, char *Memory)
+{
+    uint16_t Frame[3] = { 0x0100, 0x1000, CALLER_FLAGS };
+    std::memcpy(Memory + (STACK_SEGMENT << 4) + STACK_TOP, Frame,
+            sizeof(Frame));
+
+    Registers[HV_X86_CS]     = BIOS::ROM_SEGMENT;
+    Registers[HV_X86_RIP]    = 0x21 * BIOS::TRAP_STRIDE;
+    Registers[HV_X86_SS]     = STACK_SEGMENT;
+    Registers[HV_X86_RSP]    = STACK_TOP;
+    Registers[HV_X86_RFLAGS] = ROM_FLAGS;
+    Registers[HV_X86_DS]     = DATA_SEGMENT;
+
+    std::memset(Reads, 0, sizeof(Reads));
+    std::memset(Writes, 0, sizeof(Writes));
+    FieldWrites = 0;
+
+    Exit E = { Kernel.trap(), 0, 0, 0 };
+    Kernel.tick();
+    Kernel.registers().sync();
+
+    for (int R = 0; R < HV_X86_REGISTERS_MAX; R++) {
+        E.Reads    += Reads[R];
+        E.Writes   += Writes[R];
+        E.MostReads = std::max(E.MostReads, Reads[R]);
+    }
+    return E;
+}
+
+// FLAGS as the IRET of the trap stub restores them
+uint16_t
+ReturnedFlags(char const *Memory)
+{
+    uint16_t Flags;
+    std::memcpy(&Flags, Memory + (STACK_SEGMENT << 4) + STACK_TOP + 4,
+            sizeof(Flags));
+    return Flags;
+}
+
+void
+Report(char const *Call, Exit const &E)
+{
+    std::printf("%-24s %u reads, %u writes:", Call, E.Reads, E.Writes);
+    for (int R = 0; R < HV_X86_REGISTERS_MAX; R++) {
+        if (Writes[R] != 0)
+            std::printf(" %s", Names[R]);
+    }
+    std::printf("\n");
+}
+
+// what every handled INT 21h call must cost: no register fetched twice,
+// and only AX, FLAGS (the carry) and IP (past the VMCALL) written back
+void
+CheckExit(Exit const &E)
+{
+    Check(E.Status == DOSKernel::STATUS_HANDLED, "the call is handled");
+    Check(E.MostReads == 1, "no register is read twice in an exit");
+    Check(E.Reads <= 10, "at most CS IP AX BX CX DX DS SS SP FLAGS read");
+    Check(Writes[HV_X86_RAX] == 1 && Writes[HV_X86_RFLAGS] == 1 &&
+            Writes[HV_X86_RIP] == 1 && E.Writes == 3,
+            "AX, FLAGS and IP written once each, nothing else");
+    Check(FieldWrites == 0, "no segment base written");
+}
+
+}
+
+// the vCPU, as interface.h declares it
+uint64_t
+rreg(hv_vcpuid_t vcpu, hv_x86_reg_t reg)
+{
+    Reads[reg]++;
+    return Registers[reg];
+}
+
+void
+wreg(hv_vcpuid_t vcpu, hv_x86_reg_t reg, uint64_t v)
+{
+    Writes[reg]++;
+    Registers[reg] = v;
+}
+
+uint64_t
+rvmcs(hv_vcpuid_t vcpu, uint32_t field)
+{
+    return 0;
+}
+
+void
+wvmcs(hv_vcpuid_t vcpu, uint32_t field, uint64_t v)
+{
+    FieldWrites++;
+}
+
+int
+main()
+{
+    char Directory[] = "/tmp/hvdos-test.XXXXXX";
+    if (::mkdtemp(Directory) == nullptr) {
+        std::perror(Directory);
+        return 1;
+    }
+
+    std::string Contents;
+    for (int i = 0; i < 1000; i++)
+        Contents += static_cast <char> ('A' + i % 26);
+    std::string Path = std::string(Directory) + "/DATA.TXT";
+    FILE *F = std::fopen(Path.c_str(), "wb");
+    if (F == nullptr || std::fwrite(Contents.data(), 1, Contents.size(), F) !=
+            Contents.size() || std::fclose(F) != 0) {
+        std::perror(Path.c_str());
+        return 1;
+    }
+
+    std::vector <char> Memory(GuestMemory::ADDRESS_SPACE);
+    char              *Base = &Memory[0];
+    char const        *Arguments[] = { "hvdos", "TEST.COM", nullptr };
+
+    DOSKernel Kernel(Base, 0);
+    Kernel.boot(2, const_cast <char **> (Arguments));
+    if (!Kernel.fileSystem().mount(FileSystem::DEFAULT_DRIVE, Directory)) {
+        std::perror(Directory);
+        return 1;
+    }
+
+    // AH=3D, open C:\DATA.TXT for reading
+    std::strcpy(Base + (DATA_SEGMENT << 4), "C:\\DATA.TXT");
+    Registers[HV_X86_RAX] = 0x3D00;
+    Registers[HV_X86_RDX] = 0;
+    Exit E = Trap(Kernel, Base);
+    Report("AH=3D open", E);
+    CheckExit(E);
+    Check((Registers[HV_X86_RFLAGS] & 1) == 0, "the file opens");
+    Check(ReturnedFlags(Base) == (CALLER_FLAGS & ~1), "the open returns NC");
+    uint16_t Handle = Registers[HV_X86_RAX];
+
+    // AH=3F, 512 bytes at a time until the end of the file
+    size_t Offset = 0;
+    for (size_t Expected : { 512, 488, 0 }) {
+        Registers[HV_X86_RAX] = 0x3F00;
+        Registers[HV_X86_RBX] = Handle;
+        Registers[HV_X86_RCX] = 512;
+        Registers[HV_X86_RDX] = 0x0100;
+        E = Trap(Kernel, Base);
+        Report("AH=3F read 512 bytes", E);
+        CheckExit(E);
+        Check((Registers[HV_X86_RFLAGS] & 1) == 0 &&
+                Registers[HV_X86_RAX] == Expected, "the read count");
+        Check(ReturnedFlags(Base) == (CALLER_FLAGS & ~1),
+                "the read returns NC and the caller's other flags");
+        Check(std::memcmp(Base + (DATA_SEGMENT << 4) + 0x100,
+                    Contents.data() + Offset, Expected) == 0, "the data read");
+        Offset += Expected;
+    }
+
+    // AH=3F on a handle that is not open fails the same way
+    Registers[HV_X86_RAX] = 0x3F00;
+    Registers[HV_X86_RBX] = 19;
+    E = Trap(Kernel, Base);
+    Report("AH=3F bad handle", E);
+    CheckExit(E);
+    Check((Registers[HV_X86_RFLAGS] & 1) != 0 && Registers[HV_X86_RAX] == 6,
+            "error 6, invalid handle");
+    Check(ReturnedFlags(Base) == (CALLER_FLAGS | 1), "the error returns CY");
+
+    // AH=09 sets no flags: the caller gets its own back, not the ROM's
+    std::strcpy(Base + (DATA_SEGMENT << 4) + 0x0100, "$");
+    Registers[HV_X86_RAX] = 0x0900;
+    Registers[HV_X86_RDX] = 0x0100;
+    E = Trap(Kernel, Base);
+    Report("AH=09 print nothing", E);
+    Check(E.Status == DOSKernel::STATUS_HANDLED && Writes[HV_X86_RFLAGS] == 0,
+            "AH=09 leaves FLAGS alone");
+    Check(ReturnedFlags(Base) == CALLER_FLAGS, "the caller's flags");
+
+    RegisterFile::Stats const &S = Kernel.registers().stats();
+    Check(S.Resumes == 6, "one sync() per exit");
+
+    ::unlink(Path.c_str());
+    ::rmdir(Directory);
+
+    std::printf("%s\n", Failures ? "FAILED" : "passed");
+    return Failures != 0;
+}
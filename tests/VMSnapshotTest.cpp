@@ -0,0 +1,268 @@
+// Copyright (c) 2009-present, the hvdos developers. All Rights Reserved.
+// Read LICENSE.txt for licensing information.
+//
+// VMSnapshot: a machine saved as hvdos -S does and restored as -R does is
+// the same machine. The vCPU is an array of registers and a map of VMCS
+// fields.
+
+#include "DOSKernel.h"
+#include "MemoryBackend.h"
+#include "VMSnapshot.h"
+#include "vmcs.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+uint64_t                     Registers[HV_X86_REGISTERS_MAX];
+std::map <uint32_t, uint64_t> Fields;
+int                          Failures;
+
+uint16_t const DATA_SEGMENT  = 0x2000;
+uint16_t const STACK_SEGMENT = 0x3000;
+uint16_t const STACK_TOP     = 0xFFFA;     // IP CS FLAGS of the INT
+
+void
+Check(bool Condition, char const *What)
+{
+    if (!Condition) {
+        std::fprintf(stderr, "FAILED: %s\n", What);
+        Failures++;
+    }
+}
+
+// INT 21h with AX BX CX DX and ES as given, DS at DATA_SEGMENT; AX after
+// the call, the carry in Carry
+uint16_t
+Call(DOSKernel &Kernel, uint16_t A, uint16_t B, uint16_t C, uint16_t D,
+        uint16_t E, bool &Carry)
+{
+    uint16_t Frame[3] = { 0x0100, 0x1000, 0x0202 };
+    Kernel.memory().write(STACK_SEGMENT, STACK_TOP, Frame, sizeof(Frame));
+
+    Registers[HV_X86_CS]     = BIOS::ROM_SEGMENT;
+    Registers[HV_X86_RIP]    = 0x21 * BIOS::TRAP_STRIDE;
+    Registers[HV_X86_SS]     = STACK_SEGMENT;
+    Registers[HV_X86_RSP]    = STACK_TOP;
+    Registers[HV_X86_RFLAGS] = 0x0002;
+    Registers[HV_X86_DS]     = DATA_SEGMENT;
+    Registers[HV_X86_ES]     = E;
+    Registers[HV_X86_RAX]    = A;
+    Registers[HV_X86_RBX]    = B;
+    Registers[HV_X86_RCX]    = C;
+    Registers[HV_X86_RDX]    = D;
+
+    Check(Kernel.trap() == DOSKernel::STATUS_HANDLED, "the call is handled");
+    Kernel.registers().sync();
+    Carry = (Registers[HV_X86_RFLAGS] & 1) != 0;
+    return Registers[HV_X86_RAX];
+}
+
+uint16_t
+Call(DOSKernel &Kernel, uint16_t A, uint16_t B = 0, uint16_t C = 0,
+        uint16_t D = 0, uint16_t E = 0)
+{
+    bool Carry;
+    uint16_t Result = Call(Kernel, A, B, C, D, E, Carry);
+    Check(!Carry, "the call succeeds");
+    return Result;
+}
+
+// what a restored machine must agree on with the saved one
+struct Observed {
+    uint16_t Drive;
+    char     Directory[64];
+    char     DTA[43];       // after AH=4E
+    uint16_t Block;         // AH=48 after the snapshot
+};
+
+Observed
+Observe(DOSKernel &Kernel)
+{
+    Observed O = {};
+
+    O.Drive = Call(Kernel, 0x1900) & 0xFF;
+    Registers[HV_X86_RSI] = 0x0200;
+    Call(Kernel, 0x4700);
+    Kernel.memory().read(DATA_SEGMENT, 0x0200, O.Directory,
+            sizeof(O.Directory));
+    Kernel.memory().write(DATA_SEGMENT, 0x0300, "*.*", 4);
+    Call(Kernel, 0x4E00, 0, 0x0010, 0x0300);
+    Kernel.memory().read(DATA_SEGMENT, 0x0080, O.DTA, sizeof(O.DTA));
+    O.Block = Call(Kernel, 0x4800, 0x0010);
+    return O;
+}
+
+}
+
+// the vCPU, as interface.h declares it
+uint64_t
+rreg(hv_vcpuid_t vcpu, hv_x86_reg_t reg)
+{
+    return Registers[reg];
+}
+
+void
+wreg(hv_vcpuid_t vcpu, hv_x86_reg_t reg, uint64_t v)
+{
+    Registers[reg] = v;
+}
+
+uint64_t
+rvmcs(hv_vcpuid_t vcpu, uint32_t field)
+{
+    return Fields[field];
+}
+
+void
+wvmcs(hv_vcpuid_t vcpu, uint32_t field, uint64_t v)
+{
+    Fields[field] = v;
+}
+
+int
+main()
+{
+    char Directory[] = "/tmp/hvdos-test.XXXXXX";
+    if (::mkdtemp(Directory) == nullptr) {
+        std::perror(Directory);
+        return 1;
+    }
+    std::string Path    = std::string(Directory) + "/machine.snap";
+    std::string Again   = std::string(Directory) + "/again.snap";
+    std::string SubPath = std::string(Directory) + "/SUB";
+
+    MemoryBackend::Options M = {};
+    M.Type = MemoryBackend::KIND_ANONYMOUS;
+    M.Size = MemoryBackend::MIN_SIZE;
+
+    MemoryBackend Saved;
+    if (!Saved.open(M)) {
+        std::perror("memory");
+        return 1;
+    }
+
+    // a machine with state in every part of a snapshot: the DTA, a current
+    // directory, an MCB chain with a block allocated, registers and fields
+    char const *Arguments[] = { "hvdos", "TEST.COM", nullptr };
+    DOSKernel   Kernel(Saved.base(), 0);
+    Kernel.boot(2, const_cast <char **> (Arguments));
+    if (!Kernel.fileSystem().mount(FileSystem::DEFAULT_DRIVE, Directory)) {
+        std::perror(Directory);
+        return 1;
+    }
+
+    ::mkdir(SubPath.c_str(), 0755);
+    Kernel.memory().write(DATA_SEGMENT, 0, "SUB", 4);
+    Call(Kernel, 0x3B00);
+    Call(Kernel, 0x1A00, 0, 0, 0x0080);
+    Call(Kernel, 0x4A00, 0x1000, 0, 0, DOSKernel::PROGRAM_SEGMENT);
+    Call(Kernel, 0x4800, 0x0100);
+    Kernel.memory().write(DATA_SEGMENT, 0x0400, "guest data", 11);
+
+    Kernel.registers().sync();
+    for (int R = 0; R < HV_X86_REGISTERS_MAX; R++)
+        Registers[R] = 0x1111 * (R + 1);
+    Fields[VMCS_GUEST_CS_BASE]  = 0x12340;
+    Fields[VMCS_GUEST_ACTIVITY] = 1;
+
+    VMSnapshot Snapshot;
+    Kernel.flushConsole();
+    Snapshot.captureVCPU(0);
+    Check(Kernel.save(Snapshot), "the kernel saves");
+    Check(Snapshot.write(Path.c_str(), Saved.base(), Saved.size()),
+            "the snapshot is written");
+
+    uint64_t                      SavedRegisters[HV_X86_REGISTERS_MAX];
+    std::map <uint32_t, uint64_t> SavedFields = Fields;
+    std::memcpy(SavedRegisters, Registers, sizeof(Registers));
+
+    // reopened into a vCPU and memory of its own, file-backed MAP_PRIVATE
+    std::memset(Registers, 0, sizeof(Registers));
+    Fields.clear();
+
+    VMSnapshot Restored;
+    Check(Restored.read(Path.c_str()), "the snapshot is read");
+    M.Type   = MemoryBackend::KIND_FILE;
+    M.Path   = Restored.path();
+    M.Offset = Restored.memoryOffset();
+    M.Size   = Restored.memorySize();
+
+    MemoryBackend Mapped;
+    if (!Mapped.open(M)) {
+        std::perror(Path.c_str());
+        return 1;
+    }
+    Restored.restoreVCPU(0);
+
+    DOSKernel Copy(Mapped.base(), 0);
+    Check(Copy.fileSystem().mount(FileSystem::DEFAULT_DRIVE, Directory),
+            "the drive mounts");
+    Check(Copy.restore(Restored), "the kernel restores");
+
+    Check(std::memcmp(Registers, SavedRegisters, sizeof(Registers)) == 0,
+            "the registers");
+    for (auto const &F : SavedFields)
+        Check(Fields[F.first] == F.second, "the VMCS fields");
+    Check(Mapped.size() == Saved.size() &&
+            std::memcmp(Mapped.base(), Saved.base(), Saved.size()) == 0,
+            "guest memory");
+
+    // the restored machine saves to the same file
+    VMSnapshot Second;
+    Second.captureVCPU(0);
+    Check(Copy.save(Second), "the restored kernel saves");
+    Check(Second.write(Again.c_str(), Mapped.base(), Mapped.size()),
+            "the second snapshot is written");
+
+    std::string First, Next;
+    for (auto const &P : { std::make_pair(&Path, &First),
+                std::make_pair(&Again, &Next) }) {
+        FILE *F = std::fopen(P.first->c_str(), "rb");
+        char  Buffer[65536];
+        for (size_t Count; F && (Count = std::fread(Buffer, 1, sizeof(Buffer),
+                        F)) > 0; )
+            P.second->append(Buffer, Count);
+        if (F)
+            std::fclose(F);
+    }
+    Check(!First.empty() && First == Next, "a second save is identical");
+
+    // and both machines go on the same way
+    Observed A = Observe(Kernel);
+    Observed B = Observe(Copy);
+    Check(A.Drive == B.Drive && A.Drive == FileSystem::DEFAULT_DRIVE,
+            "the current drive");
+    Check(std::strcmp(A.Directory, B.Directory) == 0 &&
+            std::strcmp(B.Directory, "SUB") == 0, "the current directory");
+    Check(std::memcmp(A.DTA, B.DTA, sizeof(A.DTA)) == 0 && B.DTA[0x1E] != 0,
+            "the DTA");
+    Check(A.Block == B.Block, "the MCB chain");
+
+    // MAP_PRIVATE: the file keeps the memory it was saved with
+    char Text[11];
+    Copy.memory().write(DATA_SEGMENT, 0x0400, "host write", 11);
+    Restored.read(Path.c_str());
+    FILE *F = std::fopen(Path.c_str(), "rb");
+    Check(F != nullptr && std::fseek(F, Restored.memoryOffset() +
+                (DATA_SEGMENT << 4) + 0x0400, SEEK_SET) == 0 &&
+            std::fread(Text, 1, sizeof(Text), F) == sizeof(Text) &&
+            std::strcmp(Text, "guest data") == 0, "the file is unchanged");
+    if (F)
+        std::fclose(F);
+
+    ::unlink(Path.c_str());
+    ::unlink(Again.c_str());
+    ::rmdir(SubPath.c_str());
+    ::rmdir(Directory);
+
+    std::printf("%s\n", Failures ? "FAILED" : "passed");
+    return Failures != 0;
+}